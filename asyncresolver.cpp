@@ -0,0 +1,325 @@
+#include <algorithm>
+#include <string.h>
+#include <strings.h>
+#include <netdb.h>
+#include "asyncresolver.h"
+
+
+/*
+ * The resolvers shared by the clients on each loop.
+ */
+static map<struct ev_loop *, AsyncResolver *> sharedResolvers;
+static mutex sharedResolversLock;
+
+
+/****************************
+* ResolvedAddress (public)  *
+****************************/
+
+bool ResolvedAddress::operator==(const ResolvedAddress & other) const
+{
+	return family == other.family && socktype == other.socktype &&
+		protocol == other.protocol && addrlen == other.addrlen &&
+		memcmp(&addr, &other.addr, addrlen) == 0;
+}
+
+
+/*********************
+* Resolver (public)  *
+*********************/
+
+Resolver::~Resolver()
+{
+}
+
+/*
+ * getaddrinfo, keeping every address it returns, of
+ * either family.
+ */
+int Resolver::resolve(const string & host, const string & service,
+	vector<ResolvedAddress> & addresses, double *ttl)
+{
+	struct addrinfo *info = NULL;
+	struct addrinfo hints;
+	bzero(&hints, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = 0;
+
+	int err = getaddrinfo(host.c_str(), service.c_str(), &hints, &info);
+	if(err != 0)
+	{
+		return err;
+	}
+
+	for(struct addrinfo *ai = info; ai != NULL; ai = ai->ai_next)
+	{
+		ResolvedAddress address;
+		bzero(&address, sizeof(address));
+		address.family = ai->ai_family;
+		address.socktype = ai->ai_socktype;
+		address.protocol = ai->ai_protocol;
+		address.addrlen = ai->ai_addrlen;
+		memcpy(&address.addr, ai->ai_addr, ai->ai_addrlen);
+		addresses.push_back(address);
+	}
+	freeaddrinfo(info);
+	return 0;
+}
+
+
+/**************************
+* AsyncResolver (public)  *
+**************************/
+
+AsyncResolver::AsyncResolver(struct ev_loop *loop, Resolver *resolver, double ttl)
+{
+	this->loop = loop;
+	this->resolver = resolver != NULL ? resolver : &systemResolver;
+	this->ttl = ttl;
+	pending = 0;
+	refs = 0;
+	running = NULL;
+	stopping = false;
+
+	// The watcher only keeps the loop alive while a
+	// lookup is pending.
+	ev_async_init(&async, asyncCbWrapper);
+	async.data = (void *) this;
+	ev_async_start(loop, &async);
+	ev_unref(loop);
+}
+
+/*
+ * Stops the resolver thread, waiting for the lookup it
+ * is in, if any.
+ */
+AsyncResolver::~AsyncResolver()
+{
+	if(worker.joinable())
+	{
+		{
+			unique_lock<mutex> guard(lock);
+			stopping = true;
+		}
+		wake.notify_one();
+		worker.join();
+	}
+
+	for(size_t i = 0; i < jobs.size(); ++i)
+	{
+		delete jobs[i];
+	}
+	for(size_t i = 0; i < results.size(); ++i)
+	{
+		delete results[i];
+	}
+	if(pending > 0)
+	{
+		ev_unref(loop);
+	}
+
+	ev_ref(loop);
+	ev_async_stop(loop, &async);
+}
+
+AsyncResolver *AsyncResolver::acquire(struct ev_loop *loop)
+{
+	unique_lock<mutex> guard(sharedResolversLock);
+	AsyncResolver *& resolver = sharedResolvers[loop];
+	if(resolver == NULL)
+	{
+		resolver = new AsyncResolver(loop);
+	}
+	resolver->refs++;
+	return resolver;
+}
+
+void AsyncResolver::release(AsyncResolver *resolver)
+{
+	unique_lock<mutex> guard(sharedResolversLock);
+	if(--resolver->refs == 0)
+	{
+		sharedResolvers.erase(resolver->loop);
+		delete resolver;
+	}
+}
+
+void AsyncResolver::resolve(const string & host, const string & service,
+	ResolveCallback cb, void *owner)
+{
+	string key = host + ":" + service;
+	map<string, CacheEntry>::iterator iter = cache.find(key);
+	if(iter != cache.end() && ev_now(loop) < iter->second.expires)
+	{
+		cb(0, iter->second.addresses, iter->second.expires - ev_now(loop), owner);
+		return;
+	}
+
+	// Numeric addresses need no lookup.
+	struct addrinfo *info = NULL;
+	struct addrinfo hints;
+	bzero(&hints, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICHOST;
+	if(getaddrinfo(host.c_str(), service.c_str(), &hints, &info) == 0)
+	{
+		freeaddrinfo(info);
+		vector<ResolvedAddress> addresses;
+		int err = systemResolver.resolve(host, service, addresses, NULL);
+		cb(err, addresses, 0, owner);
+		return;
+	}
+
+	Job *job = new Job();
+	job->host = host;
+	job->service = service;
+	job->cb = cb;
+	job->owner = owner;
+	job->cancelled = false;
+	job->error = 0;
+	job->ttl = ttl;
+
+	if(pending++ == 0)
+	{
+		ev_ref(loop);
+	}
+	{
+		unique_lock<mutex> guard(lock);
+		jobs.push_back(job);
+		if(!worker.joinable())
+		{
+			worker = thread(&AsyncResolver::run, this);
+		}
+	}
+	wake.notify_one();
+}
+
+void AsyncResolver::cancel(void *owner)
+{
+	unique_lock<mutex> guard(lock);
+	for(deque<Job *> *queue : { &jobs, &results })
+	{
+		for(size_t i = 0; i < queue->size(); )
+		{
+			Job *job = (*queue)[i];
+			if(job->owner == owner)
+			{
+				queue->erase(queue->begin() + i);
+				delete job;
+				finish(NULL);
+			}
+			else
+			{
+				++i;
+			}
+		}
+	}
+	if(running != NULL && running->owner == owner && !running->cancelled)
+	{
+		running->cancelled = true;
+		finish(NULL);
+	}
+}
+
+void AsyncResolver::flush()
+{
+	cache.clear();
+}
+
+
+/***************************
+* AsyncResolver (private)  *
+***************************/
+
+/*
+ * Resolver thread: runs queued lookups one at a time
+ * and hands the results to the loop.
+ */
+void AsyncResolver::run()
+{
+	unique_lock<mutex> guard(lock);
+	while(true)
+	{
+		while(jobs.empty() && !stopping)
+		{
+			wake.wait(guard);
+		}
+		if(stopping)
+		{
+			return;
+		}
+
+		Job *job = jobs.front();
+		jobs.pop_front();
+		running = job;
+
+		guard.unlock();
+		job->error = resolver->resolve(job->host, job->service, job->addresses, &job->ttl);
+		guard.lock();
+
+		running = NULL;
+		if(job->cancelled)
+		{
+			delete job;
+			continue;
+		}
+		results.push_back(job);
+		ev_async_send(loop, &async);
+	}
+}
+
+/*
+ * Loop thread: caches and delivers finished lookups.
+ * Takes them one at a time, since a callback may cancel
+ * the lookups of another owner.
+ */
+void AsyncResolver::asyncCb(struct ev_loop *loop, struct ev_async *watcher, int revents)
+{
+	while(true)
+	{
+		Job *job;
+		{
+			unique_lock<mutex> guard(lock);
+			if(results.empty())
+			{
+				return;
+			}
+			job = results.front();
+			results.pop_front();
+		}
+
+		if(job->error == 0 && job->ttl > 0)
+		{
+			CacheEntry & entry = cache[job->host + ":" + job->service];
+			entry.addresses = job->addresses;
+			entry.expires = ev_now(loop) + job->ttl;
+		}
+		finish(job);
+	}
+}
+
+void AsyncResolver::asyncCbWrapper(struct ev_loop *loop, struct ev_async *watcher, int revents)
+{
+	AsyncResolver *resolver = (AsyncResolver *) watcher->data;
+	resolver->asyncCb(loop, watcher, revents);
+}
+
+/*
+ * A lookup is over: delivers it, unless it was
+ * cancelled (job is NULL), and lets the loop go once
+ * none are pending.
+ */
+void AsyncResolver::finish(Job *job)
+{
+	if(--pending == 0)
+	{
+		ev_unref(loop);
+	}
+	if(job != NULL)
+	{
+		job->cb(job->error, job->addresses, job->ttl, job->owner);
+		delete job;
+	}
+}
@@ -0,0 +1,182 @@
+/***************************************************************
+* ASYNCRESOLVER
+* -------------
+* Host name resolution off the event loop. Lookups run on
+* a resolver thread, through a pluggable Resolver (the
+* system's getaddrinfo by default), and their results are
+* passed back to the loop thread through an ev_async, so
+* a slow DNS server never stalls the loop.
+*
+* Results are cached for their TTL. Numeric addresses are
+* resolved at once, without the thread.
+*
+* Apart from the Resolver, which runs on the resolver
+* thread, only to be used from the loop's thread.
+*
+* Clients not given a resolver share one per loop, with
+* one thread and one cache, through acquire and release.
+*
+*/
+
+#ifndef ASYNCRESOLVER_H_
+#define ASYNCRESOLVER_H_
+
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <sys/socket.h>
+#include <ev.h>
+
+using namespace std;
+
+/*
+ * How long resolved addresses are used before being
+ * looked up again, when the Resolver doesn't say.
+ */
+#define DEFAULT_DNS_TTL (60.0)
+
+/*
+ * One address a host name resolved to, ready for
+ * socket() and connect().
+ */
+class ResolvedAddress
+{
+	public:
+		int family;
+		int socktype;
+		int protocol;
+		socklen_t addrlen;
+		struct sockaddr_storage addr;
+
+		bool operator==(const ResolvedAddress & other) const;
+};
+
+/*
+ * Looks up a host name, blocking. Called on the resolver
+ * thread, so implementations must not touch the loop.
+ * The default uses getaddrinfo; subclasses can stand in
+ * for DNS, e.g. in tests.
+ */
+class Resolver
+{
+	public:
+		virtual ~Resolver();
+
+		/*
+		 * Fills addresses for host and service (a port
+		 * number), and may set ttl to how long they can be
+		 * used. Returns 0, or a getaddrinfo error code.
+		 */
+		virtual int resolve(const string & host, const string & service,
+			vector<ResolvedAddress> & addresses, double *ttl);
+};
+
+/*
+ * Called on the loop thread with the outcome of
+ * AsyncResolver::resolve: 0 or a getaddrinfo error
+ * code, the addresses, and the seconds they are good for
+ * (0 if they never change, as for numeric addresses).
+ */
+typedef void (*ResolveCallback)(int error, const vector<ResolvedAddress> & addresses,
+	double ttl, void *owner);
+
+class AsyncResolver
+{
+	public:
+		/*
+		 * resolver is not owned, and NULL means the
+		 * system's. ttl is used when the resolver gives
+		 * none.
+		 */
+		AsyncResolver(struct ev_loop *loop, Resolver *resolver = NULL,
+			double ttl = DEFAULT_DNS_TTL);
+		~AsyncResolver();
+
+		/*
+		 * Returns the loop's shared resolver, which uses the
+		 * system's Resolver, making it on first use. Each
+		 * acquire must be matched by a release, and the last
+		 * release deletes it. Safe from any thread.
+		 */
+		static AsyncResolver *acquire(struct ev_loop *loop);
+		static void release(AsyncResolver *resolver);
+
+		/*
+		 * Resolves host and service, and calls cb with
+		 * owner. Cached and numeric results are passed to
+		 * cb before this returns; others from the loop
+		 * later. While a lookup is pending the loop is kept
+		 * alive.
+		 */
+		void resolve(const string & host, const string & service,
+			ResolveCallback cb, void *owner);
+
+		/*
+		 * Drops the pending lookups made for owner; their
+		 * callbacks will not be called.
+		 */
+		void cancel(void *owner);
+
+		/*
+		 * Forgets cached results, so the next lookups go
+		 * to the resolver.
+		 */
+		void flush();
+
+	private:
+		class Job
+		{
+			public:
+				string host;
+				string service;
+				ResolveCallback cb;
+				void *owner;
+				bool cancelled;
+				int error;
+				vector<ResolvedAddress> addresses;
+				double ttl;
+		};
+
+		class CacheEntry
+		{
+			public:
+				vector<ResolvedAddress> addresses;
+				double expires;
+		};
+
+		struct ev_loop *loop;
+		Resolver *resolver;
+		Resolver systemResolver;
+		double ttl;
+		map<string, CacheEntry> cache;
+		struct ev_async async;
+		int pending;
+
+		/*
+		 * Holders of a shared resolver, under the shared
+		 * resolvers' lock.
+		 */
+		int refs;
+
+		/*
+		 * Shared with the resolver thread, under lock.
+		 */
+		thread worker;
+		mutex lock;
+		condition_variable wake;
+		deque<Job *> jobs;
+		deque<Job *> results;
+		Job *running;
+		bool stopping;
+
+		void run();
+		void asyncCb(struct ev_loop *loop, struct ev_async *watcher, int revents);
+		static void asyncCbWrapper(struct ev_loop *loop, struct ev_async *watcher, int revents);
+		void finish(Job *job);
+};
+
+#endif /* ASYNCRESOLVER_H_ */
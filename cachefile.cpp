@@ -0,0 +1,560 @@
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include "cachefile.h"
+#include "responsecache.h"
+
+/*
+ * File layout: a CacheFileHeader, then records back to
+ * back, each a CacheRecord followed by its header spans,
+ * key, etag, lastModified, header block, Vary names and
+ * values (each joined by newlines) and body, padded to 8
+ * bytes. A record whose magic is missing, or whose
+ * checksum doesn't match, ends the file.
+ *
+ * The checksum covers everything after it, so a record
+ * can be marked dead in place without rewriting it.
+ */
+#define CACHE_FILE_MAGIC ("EVHCACHE")
+#define CACHE_FILE_VERSION (1)
+#define CACHE_RECORD_MAGIC (0x52434845)
+#define CACHE_RECORD_DEAD (1)
+
+struct CacheFileHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t numWellKnown;
+	uint32_t recordSize;
+	uint32_t spanSize;
+	char reserved[40];
+};
+
+struct CacheRecord
+{
+	uint32_t magic;
+	uint32_t flags;
+	uint32_t checksum;
+	uint32_t size;
+	double expires;
+	double lifetime;
+	int16_t code;
+	int16_t wellKnown[NUM_WELL_KNOWN_HEADERS];
+	uint32_t spanCount;
+	uint32_t keyLen;
+	uint32_t etagLen;
+	uint32_t lastModifiedLen;
+	uint32_t headerBlockLen;
+	uint32_t varyNamesLen;
+	uint32_t varyValuesLen;
+	uint32_t bodyLen;
+};
+
+#define CACHE_CHECKSUM_START (offsetof(CacheRecord, size))
+#define CACHE_SPAN_SIZE (sizeof(uint32_t) * 4)
+
+
+/**********
+* Helpers *
+**********/
+
+static size_t align8(size_t size)
+{
+	return (size + 7) & ~(size_t) 7;
+}
+
+/*
+ * FNV-1a, used to detect torn or stale records.
+ */
+static uint32_t checksum(const char *data, size_t len)
+{
+	uint32_t hash = 2166136261u;
+	for(size_t i = 0; i < len; ++i)
+	{
+		hash ^= (unsigned char) data[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/*
+ * Bytes a record's fields occupy, before padding.
+ */
+static uint64_t payloadSize(const CacheRecord *record)
+{
+	return sizeof(CacheRecord) + (uint64_t) record->spanCount * CACHE_SPAN_SIZE +
+		(uint64_t) record->keyLen + record->etagLen + record->lastModifiedLen +
+		record->headerBlockLen + record->varyNamesLen + record->varyValuesLen +
+		record->bodyLen;
+}
+
+static std::string_view recordKey(const CacheRecord *record)
+{
+	const char *p = (const char *) (record + 1) + record->spanCount * CACHE_SPAN_SIZE;
+	return std::string_view(p, record->keyLen);
+}
+
+/*
+ * Reads the next field of a record and advances p
+ * past it.
+ */
+static std::string_view nextField(const char **p, uint32_t len)
+{
+	std::string_view field(*p, len);
+	*p += len;
+	return field;
+}
+
+static char *putField(char *p, std::string_view field)
+{
+	memcpy(p, field.data(), field.size());
+	return p + field.size();
+}
+
+/*
+ * Splits a newline-joined list into exactly count
+ * strings.
+ */
+static void splitLines(std::string_view joined, size_t count, vector<string> *out)
+{
+	out->clear();
+	size_t pos = 0;
+	for(size_t i = 0; i < count; ++i)
+	{
+		size_t end = joined.find('\n', pos);
+		if(end == std::string_view::npos)
+		{
+			end = joined.size();
+		}
+		out->push_back(string(joined.substr(pos, end - pos)));
+		pos = end + 1;
+	}
+}
+
+static string joinLines(const vector<string> & lines)
+{
+	string joined;
+	for(size_t i = 0; i < lines.size(); ++i)
+	{
+		if(i > 0)
+		{
+			joined += '\n';
+		}
+		joined += lines[i];
+	}
+	return joined;
+}
+
+
+/*********************
+* CacheFile (public) *
+*********************/
+
+CacheFile::CacheFile()
+{
+	fd = -1;
+	base = NULL;
+	capacity = 0;
+	writeOffset = 0;
+	liveBytes = 0;
+	ticks = 0;
+}
+
+CacheFile::~CacheFile()
+{
+	close();
+}
+
+int CacheFile::open(const string & path, size_t capacity)
+{
+	close();
+
+	fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+	if(fd < 0)
+	{
+		perror("cache file open error");
+		return -1;
+	}
+
+	// A second process would index and compact the same
+	// records without seeing the first one's changes.
+	if(flock(fd, LOCK_EX | LOCK_NB) < 0)
+	{
+		perror("cache file lock error");
+		close();
+		return -1;
+	}
+
+	struct stat st;
+	if(fstat(fd, &st) < 0)
+	{
+		perror("cache file stat error");
+		close();
+		return -1;
+	}
+
+	// Never shrink an existing file: its records would
+	// be lost.
+	capacity = max(capacity, (size_t) st.st_size);
+	capacity = max(capacity, sizeof(CacheFileHeader) + sizeof(CacheRecord));
+	if((size_t) st.st_size < capacity && ftruncate(fd, capacity) < 0)
+	{
+		perror("cache file truncate error");
+		close();
+		return -1;
+	}
+
+	void *mapping = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(mapping == MAP_FAILED)
+	{
+		perror("cache file mmap error");
+		close();
+		return -1;
+	}
+	base = (char *) mapping;
+	this->capacity = capacity;
+
+	const CacheFileHeader *header = (const CacheFileHeader *) base;
+	if(memcmp(header->magic, CACHE_FILE_MAGIC, sizeof(header->magic)) != 0 ||
+		header->version != CACHE_FILE_VERSION ||
+		header->numWellKnown != NUM_WELL_KNOWN_HEADERS ||
+		header->recordSize != sizeof(CacheRecord) ||
+		header->spanSize != CACHE_SPAN_SIZE)
+	{
+		reset();
+	}
+	scan();
+	return 0;
+}
+
+bool CacheFile::load(std::string_view key, CacheEntry *entry)
+{
+	RecordIndex::iterator iter = index.find(key);
+	if(iter == index.end())
+	{
+		return false;
+	}
+	iter->second.lastUsed = ++ticks;
+
+	const CacheRecord *record = (const CacheRecord *) (base + iter->second.offset);
+	const char *p = (const char *) (record + 1);
+
+	entry->headerSpans.resize(record->spanCount);
+	memcpy(entry->headerSpans.data(), p, record->spanCount * CACHE_SPAN_SIZE);
+	p += record->spanCount * CACHE_SPAN_SIZE;
+
+	entry->key.assign(nextField(&p, record->keyLen));
+	entry->etag.assign(nextField(&p, record->etagLen));
+	entry->lastModified.assign(nextField(&p, record->lastModifiedLen));
+	entry->headerBlock.assign(nextField(&p, record->headerBlockLen));
+	std::string_view varyNames = nextField(&p, record->varyNamesLen);
+	std::string_view varyValues = nextField(&p, record->varyValuesLen);
+	size_t varyCount = 0;
+	if(varyNames.size() > 0)
+	{
+		varyCount = count(varyNames.begin(), varyNames.end(), '\n') + 1;
+	}
+	splitLines(varyNames, varyCount, &entry->varyNames);
+	splitLines(varyValues, varyCount, &entry->varyValues);
+	entry->body.assign(nextField(&p, record->bodyLen));
+
+	entry->code = record->code;
+	entry->expires = record->expires;
+	entry->lifetime = record->lifetime;
+	for(int i = 0; i < NUM_WELL_KNOWN_HEADERS; ++i)
+	{
+		entry->wellKnown[i] = record->wellKnown[i];
+	}
+	return true;
+}
+
+/*
+ * Writes the fields first and the record's magic last,
+ * so a record cut short by a crash is not mistaken for
+ * a complete one.
+ */
+bool CacheFile::store(const CacheEntry & entry, double now)
+{
+	if(base == NULL)
+	{
+		return false;
+	}
+
+	RecordIndex::iterator iter = index.find(entry.key);
+	if(iter != index.end())
+	{
+		kill(iter);
+	}
+
+	string varyNames = joinLines(entry.varyNames);
+	string varyValues = joinLines(entry.varyValues);
+	size_t spanBytes = entry.headerSpans.size() * CACHE_SPAN_SIZE;
+	size_t size = align8(sizeof(CacheRecord) + spanBytes + entry.key.size() +
+		entry.etag.size() + entry.lastModified.size() + entry.headerBlock.size() +
+		varyNames.size() + varyValues.size() + entry.body.size());
+	if(size > capacity - sizeof(CacheFileHeader))
+	{
+		return false;
+	}
+	if(writeOffset + size > capacity)
+	{
+		makeRoom(size, now);
+		compact();
+		if(writeOffset + size > capacity)
+		{
+			return false;
+		}
+	}
+
+	CacheRecord *record = (CacheRecord *) (base + writeOffset);
+	char *p = (char *) (record + 1);
+	memcpy(p, entry.headerSpans.data(), spanBytes);
+	p += spanBytes;
+	p = putField(p, entry.key);
+	p = putField(p, entry.etag);
+	p = putField(p, entry.lastModified);
+	p = putField(p, entry.headerBlock);
+	p = putField(p, varyNames);
+	p = putField(p, varyValues);
+	p = putField(p, entry.body);
+	memset(p, 0, (char *) record + size - p);
+
+	record->size = size;
+	record->expires = entry.expires;
+	record->lifetime = entry.lifetime;
+	record->code = entry.code;
+	for(int i = 0; i < NUM_WELL_KNOWN_HEADERS; ++i)
+	{
+		record->wellKnown[i] = entry.wellKnown[i];
+	}
+	record->spanCount = entry.headerSpans.size();
+	record->keyLen = entry.key.size();
+	record->etagLen = entry.etag.size();
+	record->lastModifiedLen = entry.lastModified.size();
+	record->headerBlockLen = entry.headerBlock.size();
+	record->varyNamesLen = varyNames.size();
+	record->varyValuesLen = varyValues.size();
+	record->bodyLen = entry.body.size();
+	record->checksum = checksum((char *) record + CACHE_CHECKSUM_START,
+		size - CACHE_CHECKSUM_START);
+	record->flags = 0;
+	record->magic = CACHE_RECORD_MAGIC;
+
+	RecordSlot slot = { writeOffset, ++ticks };
+	index.insert(RecordIndex::value_type(entry.key, slot));
+	liveBytes += size;
+	writeOffset += size;
+	if(writeOffset + sizeof(uint32_t) <= capacity)
+	{
+		*(uint32_t *) (base + writeOffset) = 0;
+	}
+	return true;
+}
+
+void CacheFile::erase(std::string_view key)
+{
+	RecordIndex::iterator iter = index.find(key);
+	if(iter != index.end())
+	{
+		kill(iter);
+	}
+}
+
+void CacheFile::invalidate(std::string_view prefix)
+{
+	RecordIndex::iterator iter = index.lower_bound(prefix);
+	while(iter != index.end() && iter->first.compare(0, prefix.size(), prefix) == 0)
+	{
+		RecordIndex::iterator next = iter;
+		++next;
+		kill(iter);
+		iter = next;
+	}
+}
+
+size_t CacheFile::entries() const
+{
+	return index.size();
+}
+
+size_t CacheFile::bytes() const
+{
+	return liveBytes;
+}
+
+
+/**********************
+* CacheFile (private) *
+**********************/
+
+void CacheFile::close()
+{
+	if(base != NULL)
+	{
+		munmap(base, capacity);
+		base = NULL;
+	}
+	if(fd >= 0)
+	{
+		::close(fd);
+		fd = -1;
+	}
+	index.clear();
+	capacity = 0;
+	writeOffset = 0;
+	liveBytes = 0;
+	ticks = 0;
+}
+
+/*
+ * Writes a fresh header, leaving the file empty.
+ */
+void CacheFile::reset()
+{
+	CacheFileHeader *header = (CacheFileHeader *) base;
+	memset(header, 0, sizeof(CacheFileHeader));
+	memcpy(header->magic, CACHE_FILE_MAGIC, sizeof(header->magic));
+	header->version = CACHE_FILE_VERSION;
+	header->numWellKnown = NUM_WELL_KNOWN_HEADERS;
+	header->recordSize = sizeof(CacheRecord);
+	header->spanSize = CACHE_SPAN_SIZE;
+	*(uint32_t *) (base + sizeof(CacheFileHeader)) = 0;
+}
+
+/*
+ * Rebuilds the index from the records in the file. If
+ * a key appears more than once, the last record wins and
+ * earlier ones are marked dead. Records count as used in
+ * file order, so the oldest are evicted first.
+ */
+void CacheFile::scan()
+{
+	size_t offset = sizeof(CacheFileHeader);
+	while(offset + sizeof(CacheRecord) <= capacity)
+	{
+		CacheRecord *record = (CacheRecord *) (base + offset);
+		if(record->magic != CACHE_RECORD_MAGIC ||
+			record->size < sizeof(CacheRecord) || record->size % 8 != 0 ||
+			record->size > capacity - offset ||
+			payloadSize(record) > record->size ||
+			record->checksum != checksum((char *) record + CACHE_CHECKSUM_START,
+				record->size - CACHE_CHECKSUM_START))
+		{
+			break;
+		}
+
+		if(!(record->flags & CACHE_RECORD_DEAD))
+		{
+			std::string_view key = recordKey(record);
+			RecordIndex::iterator iter = index.find(key);
+			if(iter != index.end())
+			{
+				kill(iter);
+			}
+			RecordSlot slot = { offset, ++ticks };
+			index.insert(RecordIndex::value_type(string(key), slot));
+			liveBytes += record->size;
+		}
+		offset += record->size;
+	}
+
+	writeOffset = offset;
+	if(writeOffset + sizeof(uint32_t) <= capacity)
+	{
+		*(uint32_t *) (base + writeOffset) = 0;
+	}
+}
+
+/*
+ * Evicts records until size more bytes fit after
+ * compaction: first every record expired as of now, then
+ * the least recently used. Without this, a file full of
+ * live records would refuse every later store.
+ */
+void CacheFile::makeRoom(size_t size, double now)
+{
+	size_t room = capacity - sizeof(CacheFileHeader);
+	RecordIndex::iterator iter = index.begin();
+	while(iter != index.end())
+	{
+		RecordIndex::iterator next = iter;
+		++next;
+		const CacheRecord *record = (const CacheRecord *) (base + iter->second.offset);
+		if(record->expires <= now)
+		{
+			kill(iter);
+		}
+		iter = next;
+	}
+	if(liveBytes + size <= room)
+	{
+		return;
+	}
+
+	vector<RecordIndex::iterator> byUse;
+	byUse.reserve(index.size());
+	for(iter = index.begin(); iter != index.end(); ++iter)
+	{
+		byUse.push_back(iter);
+	}
+	sort(byUse.begin(), byUse.end(),
+		[](RecordIndex::iterator a, RecordIndex::iterator b)
+		{
+			return a->second.lastUsed < b->second.lastUsed;
+		});
+	for(size_t i = 0; i < byUse.size() && liveBytes + size > room; ++i)
+	{
+		kill(byUse[i]);
+	}
+}
+
+/*
+ * Slides live records down over dead ones, in file
+ * order, and moves the write offset to the end of the
+ * last one.
+ */
+void CacheFile::compact()
+{
+	size_t read = sizeof(CacheFileHeader);
+	size_t write = read;
+	while(read < writeOffset)
+	{
+		CacheRecord *record = (CacheRecord *) (base + read);
+		size_t size = record->size;
+		if(!(record->flags & CACHE_RECORD_DEAD))
+		{
+			RecordIndex::iterator iter = index.find(recordKey(record));
+			if(write != read)
+			{
+				memmove(base + write, base + read, size);
+				iter->second.offset = write;
+			}
+			write += size;
+		}
+		read += size;
+	}
+
+	writeOffset = write;
+	if(writeOffset + sizeof(uint32_t) <= capacity)
+	{
+		*(uint32_t *) (base + writeOffset) = 0;
+	}
+}
+
+/*
+ * Marks a record dead and drops it from the index.
+ */
+void CacheFile::kill(RecordIndex::iterator iter)
+{
+	CacheRecord *record = (CacheRecord *) (base + iter->second.offset);
+	record->flags |= CACHE_RECORD_DEAD;
+	liveBytes -= record->size;
+	index.erase(iter);
+}
@@ -0,0 +1,110 @@
+/***************************************************************
+* CACHEFILE
+* ---------
+* Persistent tier for ResponseCache: an append-structured
+* file, memory-mapped in full, holding one record per
+* stored response. An in-memory index from cache key to
+* record offset is rebuilt by scanning the file when it is
+* opened, so a restarted process starts with the responses
+* its predecessor stored, under the same freshness rules.
+*
+* Records are never modified except to mark them dead
+* (replaced, invalidated or evicted). When the file fills
+* up, expired records and then least recently used ones
+* are evicted until the new record fits, and live records
+* are slid down over dead ones.
+*
+* Reads copy a record's fields out of the mapping into a
+* CacheEntry; nothing is read through a buffer.
+*
+* Currently not thread-safe. A file can only be opened by
+* one process at a time: open takes an exclusive lock on
+* it, and fails if another process holds it.
+*
+*/
+
+#ifndef CACHEFILE_H_
+#define CACHEFILE_H_
+
+#include <map>
+#include <string>
+#include <string_view>
+#include <functional>
+#include <stdint.h>
+
+using namespace std;
+
+class CacheEntry;
+
+/*
+ * Where a record lives, and when it was last stored or
+ * loaded (in CacheFile's own ticks), for LRU eviction.
+ */
+class RecordSlot
+{
+	public:
+		size_t offset;
+		uint64_t lastUsed;
+};
+
+class CacheFile
+{
+	public:
+		CacheFile();
+		~CacheFile();
+
+		/*
+		 * Opens (creating if needed) and maps the file at
+		 * path, sized to at least capacity bytes, and indexes
+		 * its records. A file written by an incompatible
+		 * version is reinitialized. Returns 0 on success, -1
+		 * on failure, including when another process has the
+		 * file open.
+		 */
+		int open(const string & path, size_t capacity);
+
+		/*
+		 * Copies the record for key, if any, into entry and
+		 * marks it most recently used.
+		 */
+		bool load(std::string_view key, CacheEntry *entry);
+
+		/*
+		 * Appends a record for entry, replacing any previous
+		 * one for its key. If the file is full, records
+		 * expired as of now, then least recently used ones,
+		 * are evicted to make room. Returns false only if the
+		 * record is larger than the file.
+		 */
+		bool store(const CacheEntry & entry, double now);
+
+		/*
+		 * Removes the record for key, or every record whose
+		 * key starts with prefix.
+		 */
+		void erase(std::string_view key);
+		void invalidate(std::string_view prefix);
+
+		size_t entries() const;
+		size_t bytes() const;
+
+	private:
+		typedef map<string, RecordSlot, std::less<> > RecordIndex;
+
+		int fd;
+		char *base;
+		size_t capacity;
+		size_t writeOffset;
+		size_t liveBytes;
+		uint64_t ticks;
+		RecordIndex index;
+
+		void close();
+		void reset();
+		void scan();
+		void makeRoom(size_t size, double now);
+		void compact();
+		void kill(RecordIndex::iterator iter);
+};
+
+#endif /* CACHEFILE_H_ */
@@ -1,13 +1,19 @@
 #include <algorithm>
+#include <charconv>
+#include <math.h>
 #include <netdb.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <string.h>
 #include <strings.h>
+#include <time.h>
+#include <unistd.h>
 #include "evhttpclient.h"
+#include "responsecache.h"
 
 /******************************
 * Forward decs for callbacks. *
@@ -15,6 +21,10 @@
 static void writeCbWrapper(struct ev_loop *loop, struct ev_io *watcher, int revents);
 static void readCbWrapper(struct ev_loop *loop, struct ev_io *watcher, int revents);
 static void timeoutCbWrapper(struct ev_loop *loop, struct ev_timer *timer, int revents);
+static void hedgeCbWrapper(struct ev_loop *loop, struct ev_timer *timer, int revents);
+static void retryCbWrapper(struct ev_loop *loop, struct ev_timer *timer, int revents);
+static void raceCbWrapper(struct ev_loop *loop, struct ev_io *watcher, int revents);
+static void raceTimerCbWrapper(struct ev_loop *loop, struct ev_timer *timer, int revents);
 static int messageBeginCb(http_parser *parser);
 static int headerFieldCb(http_parser *parser, const char *at, size_t len);
 static int headerValueCb(http_parser *parser, const char *at, size_t len);
@@ -23,6 +33,143 @@ static int bodyCb(http_parser *parser, const char *at, size_t len);
 static int messageCompleteCb(http_parser *parser);
 
 
+/*
+ * Pool autoscaling tuning. Rate and latency estimates rise
+ * immediately and decay with weight AUTOSCALE_DECAY per
+ * interval. Idle surplus is closed only once the pool has
+ * exceeded its target by AUTOSCALE_HYSTERESIS for
+ * AUTOSCALE_SHRINK_TICKS consecutive intervals.
+ */
+#define AUTOSCALE_DECAY (0.3)
+#define AUTOSCALE_HYSTERESIS (0.25)
+#define AUTOSCALE_SHRINK_TICKS (3)
+
+/*
+ * Response arenas are sized from the bytes recent
+ * responses actually used: the estimate rises at once
+ * and decays with weight ARENA_DECAY per response. A
+ * Content-Length larger than ARENA_MAX_RESERVE is not
+ * trusted for reserving the body up front.
+ */
+#define ARENA_DECAY (0.05)
+#define ARENA_MIN_CHUNK_SIZE (256)
+#define ARENA_MAX_RESERVE (16 * 1024 * 1024)
+
+/*
+ * Pooled connections are retired this many seconds
+ * before the idle timeout the server advertised in
+ * its Keep-Alive header, or halfway through it if that
+ * is sooner, so a short timeout still allows reuse.
+ */
+#define KEEP_ALIVE_MARGIN (1.0)
+
+/*
+ * Hedging. The latency percentile is taken over the last
+ * HEDGE_LATENCY_SAMPLES requests, recomputed every
+ * HEDGE_RECOMPUTE_INTERVAL of them, and only used once
+ * HEDGE_MIN_SAMPLES are in. Unused hedge allowance
+ * accumulates up to HEDGE_MAX_TOKENS.
+ */
+#define HEDGE_LATENCY_SAMPLES (1024)
+#define HEDGE_RECOMPUTE_INTERVAL (64)
+#define HEDGE_MIN_SAMPLES (32)
+#define HEDGE_MAX_TOKENS (10.0)
+
+/*
+ * Weight of each new latency in the moving average
+ * reported by getLatencyEwma.
+ */
+#define LATENCY_EWMA_WEIGHT (0.2)
+
+/*
+ * Seconds before looking a host name up again after
+ * the lookup failed.
+ */
+#define RESOLVE_RETRY_INTERVAL (5.0)
+
+/*
+ * Response headers the cache needs, kept regardless of
+ * the header capture mode while a cache is enabled.
+ */
+#define CACHE_INTERNAL_HEADERS ((1u << HEADER_ETAG) | (1u << HEADER_LAST_MODIFIED) | \
+	(1u << HEADER_CACHE_CONTROL) | (1u << HEADER_EXPIRES) | (1u << HEADER_DATE) | \
+	(1u << HEADER_AGE) | (1u << HEADER_VARY))
+
+
+/*
+ * Canonical names of the well-known headers, indexed
+ * by HttpHeaderId, and the perfect hash classifyHeader
+ * uses to find them. The hash table is built at compile
+ * time; adding a name that collides fails the build.
+ */
+static constexpr const char *wellKnownHeaderNames[NUM_WELL_KNOWN_HEADERS] =
+{
+	"Content-Length",
+	"Content-Type",
+	"Content-Encoding",
+	"Transfer-Encoding",
+	"Connection",
+	"Keep-Alive",
+	"ETag",
+	"Last-Modified",
+	"Cache-Control",
+	"Expires",
+	"Date",
+	"Age",
+	"Vary",
+	"Retry-After",
+	"Location"
+};
+
+#define HEADER_HASH_SIZE (32)
+
+static constexpr size_t constLength(const char *s)
+{
+	size_t len = 0;
+	while(s[len] != 0)
+	{
+		len++;
+	}
+	return len;
+}
+
+static constexpr unsigned headerHash(const char *name, size_t len)
+{
+	return (3 * (len + (name[0] | 0x20)) + (name[len - 1] | 0x20))
+		& (HEADER_HASH_SIZE - 1);
+}
+
+struct HeaderHashTable
+{
+	signed char slots[HEADER_HASH_SIZE];
+	bool perfect;
+};
+
+static constexpr HeaderHashTable buildHeaderHashTable()
+{
+	HeaderHashTable table = {};
+	table.perfect = true;
+	for(int i = 0; i < HEADER_HASH_SIZE; ++i)
+	{
+		table.slots[i] = -1;
+	}
+	for(int id = 0; id < NUM_WELL_KNOWN_HEADERS; ++id)
+	{
+		const char *name = wellKnownHeaderNames[id];
+		unsigned h = headerHash(name, constLength(name));
+		if(table.slots[h] >= 0)
+		{
+			table.perfect = false;
+		}
+		table.slots[h] = id;
+	}
+	return table;
+}
+
+static constexpr HeaderHashTable headerHashTable = buildHeaderHashTable();
+static_assert(headerHashTable.perfect, "well-known header names collide in headerHash");
+
+
 /*********************
 * Class declarations *
 *********************/
@@ -34,17 +181,64 @@ static int messageCompleteCb(http_parser *parser);
 class RequestInfo
 {
 	public:
+		/*
+		 * What the response cache does with the response:
+		 * nothing, store it, store it or (on 304) answer from
+		 * the stale entry, or invalidate GETs of the path.
+		 */
+		enum CacheState { CACHE_BYPASS, CACHE_STORE, CACHE_REVALIDATE, CACHE_INVALIDATE };
+
 		ResponseInfo *response;
 		HttpConn *conn;
 		EvHttpClient *client;
-		EvHttpClientCallback cb;
+		RequestCallback cb;
 		string requestString;
 		struct timeval start;
 		struct ev_timer timer;
+		struct ev_timer hedgeTimer;
+		struct ev_timer retryTimer;
+		int attempts;
+		bool probe;
+		bool unresolved;
+		bool untimed;
 		void *data;
+		CacheState cacheState;
+		string cacheKey;
+		bool cacheHit;
+
+		/*
+		 * Coalescing. A leader is the request actually sent
+		 * for coalesceKey; identical GETs made meanwhile wait
+		 * on it in a doubly linked list headed by waiters.
+		 */
+		string coalesceKey;
+		bool coalesceLeader;
+		RequestInfo *leader;
+		RequestInfo *waiters;
+		RequestInfo *prevWaiter;
+		RequestInfo *nextWaiter;
+
+		/*
+		 * All requests not yet completed are linked, so they
+		 * can be found by cancelRequests.
+		 */
+		bool active;
+		bool cancelled;
+		RequestInfo *prevActive;
+		RequestInfo *nextActive;
+
+		/*
+		 * Hedging. A hedge is a duplicate of a request sent
+		 * on another connection; each points to the other.
+		 */
+		RequestInfo *hedge;
+		RequestInfo *hedgeOf;
 		
 		RequestInfo(EvHttpClient *client);
+		void reset();
 		void timeoutCb(struct ev_loop *loop, struct ev_timer *timer, int revents);
+		void hedgeCb(struct ev_loop *loop, struct ev_timer *timer, int revents);
+		void retryCb(struct ev_loop *loop, struct ev_timer *timer, int revents);
 };
 
 /*
@@ -63,9 +257,8 @@ class HttpConn
 		
 		http_parser parser;
 		HeaderState headerState;
-		string headerField;
-		string headerValue;
-		string body;
+		bool headerOpen;
+		bool skipHeader;
 		
 		struct ev_io writeWatcher;
 		struct ev_io readWatcher;
@@ -74,13 +267,35 @@ class HttpConn
 		bool messageComplete;
 		bool responseSent;
 		bool isNew;
+		ev_tstamp idleDeadline;
+		ResolvedAddress address;
+
+		/*
+		 * Connection racing (see EvHttpClient::createConn).
+		 * While connecting, fd is the oldest attempt still
+		 * pending and raceFd, if set, a later one.
+		 */
+		bool connecting;
+		int family;
+		size_t start;
+		size_t attempts;
+		int raceFd;
+		ResolvedAddress raceAddress;
+		struct ev_io raceWatcher;
+		struct ev_timer raceTimer;
 
 		HttpConn(EvHttpClient *client);
 		void resetState();
+		bool isAlive();
 		void writeCb(struct ev_loop *loop, struct ev_io *watcher, int revents);
 		void readCb(struct ev_loop *loop, struct ev_io *watcher, int revents);
+		void raceCb(struct ev_loop *loop, struct ev_io *watcher, int revents);
+		void raceTimerCb(struct ev_loop *loop, struct ev_timer *timer, int revents);
 		int messageBeginCb(http_parser *parser);
+		void endHeaderName();
 		void flushHeaders();
+		bool keepAlive(http_parser *parser);
+		RequestInfo *detachForResend(bool reuse);
 		int headerFieldCb(http_parser *parser, const char *at, size_t len);
 		int headerValueCb(http_parser *parser, const char *at, size_t len);
 		int headersCompleteCb(http_parser *parser);
@@ -95,6 +310,232 @@ class HttpConn
 * Helper functions *
 *******************/
 
+HttpHeaderId classifyHeader(std::string_view name)
+{
+	if(name.empty())
+	{
+		return HEADER_UNKNOWN;
+	}
+
+	int id = headerHashTable.slots[headerHash(name.data(), name.size())];
+	if(id < 0)
+	{
+		return HEADER_UNKNOWN;
+	}
+
+	const char *candidate = wellKnownHeaderNames[id];
+	if(constLength(candidate) != name.size() ||
+		strncasecmp(candidate, name.data(), name.size()) != 0)
+	{
+		return HEADER_UNKNOWN;
+	}
+	return (HttpHeaderId) id;
+}
+
+/*
+ * Outcome of a non-blocking connect: 1 if the socket
+ * is connected, 0 if still pending, -1 if it failed.
+ */
+static int connectState(int fd)
+{
+	int err = 0;
+	socklen_t len = sizeof(err);
+	if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+	{
+		return -1;
+	}
+
+	struct sockaddr_storage peer;
+	len = sizeof(peer);
+	if(getpeername(fd, (struct sockaddr *) &peer, &len) == 0)
+	{
+		return 1;
+	}
+	return errno == ENOTCONN ? 0 : -1;
+}
+
+/*
+ * Case-insensitive check for a header name in a
+ * range of (name, value) pairs.
+ */
+template <class HeaderIter>
+static bool hasHeaderNamed(HeaderIter begin, HeaderIter end,
+	std::string_view name)
+{
+	for(HeaderIter iter = begin; iter != end; ++iter)
+	{
+		if(iter->first.size() == name.size() &&
+			strncasecmp(iter->first.data(), name.data(), name.size()) == 0)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool hasHeaderNamed(const map<string, string> & headers,
+	std::string_view name)
+{
+	return hasHeaderNamed(headers.begin(), headers.end(), name);
+}
+
+static bool hasHeaderNamed(const vector<string> & names, std::string_view name)
+{
+	for(size_t i = 0; i < names.size(); ++i)
+	{
+		if(names[i].size() == name.size() &&
+			strncasecmp(names[i].data(), name.data(), name.size()) == 0)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Canonical spellings of the standard methods, so
+ * that the common case needs no upper-casing.
+ */
+static constexpr std::string_view knownMethods[] =
+{
+	"GET", "POST", "PUT", "DELETE", "HEAD", "OPTIONS", "PATCH", "TRACE", "CONNECT"
+};
+
+/*
+ * Returns the canonical spelling of a standard method
+ * given in any case, or an empty view.
+ */
+static std::string_view canonicalMethod(std::string_view method)
+{
+	for(size_t i = 0; i < sizeof(knownMethods) / sizeof(knownMethods[0]); ++i)
+	{
+		if(knownMethods[i].size() == method.size() &&
+			strncasecmp(knownMethods[i].data(), method.data(), method.size()) == 0)
+		{
+			return knownMethods[i];
+		}
+	}
+	return std::string_view();
+}
+
+/*
+ * Copies s to p and returns the end of the copy.
+ * Used by the request serializers, which size their
+ * output exactly before writing it.
+ */
+static inline char *put(char *p, std::string_view s)
+{
+	memcpy(p, s.data(), s.size());
+	return p + s.size();
+}
+
+/*
+ * Writes "Content-Length: <length>\r\n" into buffer,
+ * which must hold CONTENT_LENGTH_LINE_MAX bytes, and
+ * returns the number of bytes written.
+ */
+#define CONTENT_LENGTH_LINE_MAX (48)
+
+static size_t contentLengthLine(char *buffer, size_t length)
+{
+	memcpy(buffer, "Content-Length: ", 16);
+	char *end = to_chars(buffer + 16, buffer + CONTENT_LENGTH_LINE_MAX - 2, length).ptr;
+	memcpy(end, "\r\n", 2);
+	return end + 2 - buffer;
+}
+
+/*
+ * Whether a serialized request uses one of methods.
+ */
+static bool methodIn(std::string_view request, const vector<string> & methods)
+{
+	for(size_t i = 0; i < methods.size(); ++i)
+	{
+		size_t len = methods[i].size();
+		if(request.size() > len && request[len] == ' ' &&
+			strncasecmp(request.data(), methods[i].data(), len) == 0)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Case-insensitive check for a token in a comma
+ * separated header value, e.g. "close" in
+ * "Connection: Upgrade, close".
+ */
+static bool headerHasToken(std::string_view value, std::string_view token)
+{
+	size_t pos = 0;
+	while(pos < value.size())
+	{
+		size_t end = value.find(',', pos);
+		if(end == std::string_view::npos)
+		{
+			end = value.size();
+		}
+
+		size_t first = pos;
+		size_t last = end;
+		while(first < last && (value[first] == ' ' || value[first] == '\t'))
+		{
+			first++;
+		}
+		while(last > first && (value[last - 1] == ' ' || value[last - 1] == '\t'))
+		{
+			last--;
+		}
+		if(last - first == token.size() &&
+			strncasecmp(value.data() + first, token.data(), token.size()) == 0)
+		{
+			return true;
+		}
+
+		pos = end + 1;
+	}
+	return false;
+}
+
+/*
+ * Finds a name=value parameter in a comma separated
+ * header value, e.g. "timeout" in "Keep-Alive:
+ * timeout=5, max=100", matching the name without regard
+ * to case. Returns the value, or an empty view.
+ */
+static std::string_view headerParam(std::string_view value, std::string_view name)
+{
+	size_t pos = 0;
+	while(pos < value.size())
+	{
+		size_t end = value.find(',', pos);
+		if(end == std::string_view::npos)
+		{
+			end = value.size();
+		}
+
+		size_t first = pos;
+		size_t last = end;
+		while(first < last && (value[first] == ' ' || value[first] == '\t'))
+		{
+			first++;
+		}
+		while(last > first && (value[last - 1] == ' ' || value[last - 1] == '\t'))
+		{
+			last--;
+		}
+		if(last - first > name.size() && value[first + name.size()] == '=' &&
+			strncasecmp(value.data() + first, name.data(), name.size()) == 0)
+		{
+			return value.substr(first + name.size() + 1, last - first - name.size() - 1);
+		}
+
+		pos = end + 1;
+	}
+	return std::string_view();
+}
+
 /*
  * Calculate the difference between
  * two struct timevals in microseconds.
@@ -127,7 +568,8 @@ static long difftime(struct timeval *end, struct timeval *start)
  * Constructor. Initialize parser, connection pool, etc.
  */
 EvHttpClient::EvHttpClient(struct ev_loop *loop, const string & urlstring,
-	double timeout, void *data, int init_num_conns, int block_size)
+	double timeout, void *data, int init_num_conns, int block_size,
+	AsyncResolver *resolver)
 {
 	// Initialize loop, timeout, and url //TODO connect and request timeouts
 	this->loop = loop;
@@ -136,38 +578,117 @@ EvHttpClient::EvHttpClient(struct ev_loop *loop, const string & urlstring,
 	this->data = data;
 	this->init_num_conns = init_num_conns;
 	this->block_size = block_size;
+
+	// Initialize pool statistics and autoscaling
+	arenaEstimate = DEFAULT_ARENA_CHUNK_SIZE;
+	headerCapture = CAPTURE_ALL_HEADERS;
+	captureMask = 0;
+	internalHeaders = (1u << HEADER_CONNECTION) | (1u << HEADER_KEEP_ALIVE);
+	cache = NULL;
+	ev_timer_init(&cacheTimer, cacheCbWrapper, 0., 0.);
+	cacheTimer.data = (void *) this;
+	coalesce = false;
+	activeRequests = NULL;
+	hedge = false;
+	hedgeDelay = 0;
+	hedgePercentile = 0;
+	hedgeMaxRate = DEFAULT_HEDGE_MAX_RATE;
+	hedgeTokens = HEDGE_MAX_TOKENS;
+	latencyNext = 0;
+	latencyCount = 0;
+	hedgeReport.enabled = false;
+	hedgeReport.delay = 0;
+	hedgeReport.sent = 0;
+	hedgeReport.won = 0;
+	hedgeReport.suppressed = 0;
+	retryTokens = retryPolicy.budgetBurst;
+	retryReport.retries = 0;
+	retryReport.exhausted = 0;
+	retryReport.overBudget = 0;
+	retryRandom.seed(time(NULL) ^ getpid());
+	latencyEwma = 0;
+	breaker = false;
+	breakerReport.enabled = false;
+	breakerReport.state = BREAKER_CLOSED;
+	breakerReport.since = 0;
+	breakerReport.transitions = 0;
+	breakerReport.requests = 0;
+	breakerReport.failures = 0;
+	breakerReport.rejected = 0;
+	breakerOpenUntil = 0;
+	breakerProbes = 0;
+	for(int i = 0; i < BREAKER_BUCKETS; ++i)
+	{
+		breakerEpochs[i] = -1;
+		breakerRequests[i] = 0;
+		breakerFailures[i] = 0;
+	}
+	numConns = 0;
+	numOutstanding = 0;
+	evicted = 0;
+	autoscale = false;
+	minConns = DEFAULT_AUTOSCALE_MIN_CONNS;
+	maxConns = DEFAULT_AUTOSCALE_MAX_CONNS;
+	headroom = DEFAULT_AUTOSCALE_HEADROOM;
+	autoscaleInterval = DEFAULT_AUTOSCALE_INTERVAL;
+	ev_timer_init(&autoscaleTimer, autoscaleCbWrapper, 0., 0.);
+	autoscaleTimer.data = (void *) this;
+	windowRequests = 0;
+	windowCompleted = 0;
+	windowLatency = 0;
+	windowPeakOutstanding = 0;
+	rateEstimate = -1;
+	latencyEstimate = -1;
+	surplusTicks = 0;
+	poolReport.autoscale = false;
+	poolReport.target = init_num_conns;
+	poolReport.rate = 0;
+	poolReport.latency = 0;
+	poolReport.concurrency = 0;
+	poolReport.reason = "autoscaling disabled; pool size fixed at init_num_conns";
 	
-	// Initialize addr
-	char *host = strdup(url.host().c_str());
-	stringstream ss;
-	ss << url.port();
-	char *service = strdup(ss.str().c_str());
-	struct addrinfo *info = NULL;
-	struct addrinfo hints;
-	bzero(&hints, sizeof(hints));
-	hints.ai_family = AF_INET;
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_protocol = 0;
-
-	int err = getaddrinfo(host, service, &hints, &info);
-	if(err < 0)
-	{
-		cout << "Error: couldn't resolve host name " << this << endl;
-		free(host);
-		free(service);
-		return;
+	// Precompute the default path and the Host header
+	defaultPath = url.path();
+	if(url.query().size() > 0)
+	{
+		defaultPath += "?" + url.query();
+	}
+	stringstream host_ss;
+	if(url.host().find(':') != string::npos)
+	{
+		host_ss << "Host: [" << url.host() << "]";
+	}
+	else
+	{
+		host_ss << "Host: " << url.host();
+	}
+	if(url.port() != 80 && url.port() != 443)
+	{
+		host_ss << ":" << url.port();
 	}
+	host_ss << "\r\n";
+	hostHeader = host_ss.str();
+	defaultHost = false;
 
-	family = info->ai_family;
-	socktype = info->ai_socktype;
-	protocol = info->ai_protocol;
-	addrlen = info->ai_addrlen;
-	memcpy(&addr, info->ai_addr, addrlen);
+	// Initialize address resolution
+	sharedResolver = resolver == NULL;
+	this->resolver = sharedResolver ? AsyncResolver::acquire(loop) : resolver;
+	nextAddress = 0;
+	preferredFamily = AF_INET6;
+	resolving = false;
+	ev_timer_init(&resolveTimer, resolveTimerCbWrapper, 0., 0.);
+	resolveTimer.data = (void *) this;
+
+	// Initialize the submission queue. Like the autoscale
+	// timer, its watcher doesn't keep the loop alive unless
+	// asked to (see setSubmitKeepAlive).
+	submissions = NULL;
+	ev_async_init(&submitWatcher, submitCbWrapper);
+	submitWatcher.data = (void *) this;
+	ev_async_start(loop, &submitWatcher);
+	ev_unref(loop);
+	submitKeepAlive = false;
 
-	free(host);
-	free(service);
-	freeaddrinfo(info);
-	
 	// Initialize parser settings
 	parser_settings.on_message_begin = messageBeginCb;
 	parser_settings.on_url = NULL;
@@ -177,8 +698,9 @@ EvHttpClient::EvHttpClient(struct ev_loop *loop, const string & urlstring,
 	parser_settings.on_body = bodyCb;
 	parser_settings.on_message_complete = messageCompleteCb;
 	
-	// Initialize connection pool
-	initConnPool();
+	// The connection pool is filled once the host name
+	// is resolved.
+	startResolve();
 }
 
 /*
@@ -186,12 +708,61 @@ EvHttpClient::EvHttpClient(struct ev_loop *loop, const string & urlstring,
  */
 EvHttpClient::~EvHttpClient()
 {
+	setAutoscale(false);
+
+	if(!submitKeepAlive)
+	{
+		ev_ref(loop);
+	}
+	ev_async_stop(loop, &submitWatcher);
+	Submission *submission = submissions.exchange(NULL);
+	while(submission != NULL)
+	{
+		Submission *next = submission->next;
+		submission->cb(NULL, submission->data, data);
+		delete submission;
+		submission = next;
+	}
+
+	resolver->cancel(this);
+	if(ev_is_active(&resolveTimer))
+	{
+		ev_ref(loop);
+		ev_timer_stop(loop, &resolveTimer);
+	}
+	failOutstanding();
+	if(sharedResolver)
+	{
+		AsyncResolver::release(resolver);
+	}
+
+	ev_timer_stop(loop, &cacheTimer);
+	while(!cacheHits.empty())
+	{
+		freeRequest(cacheHits.front());
+		cacheHits.pop();
+	}
+	delete cache;
+
 	while(!connections.empty())
 	{
 		HttpConn *conn = connections.front();
 		connections.pop();
 		destroyConnAndRequest(conn);
 	}
+
+	for(size_t i = 0; i < freeRequests.size(); ++i)
+	{
+		delete freeRequests[i];
+	}
+	for(size_t i = 0; i < freeResponses.size(); ++i)
+	{
+		delete freeResponses[i];
+	}
+	for(size_t i = 0; i < freeConns.size(); ++i)
+	{
+		delete freeConns[i];
+	}
 }
 
 /*
@@ -204,445 +775,3107 @@ void EvHttpClient::setTimeout(double seconds)
 }
 
 /*
- * Callback that does nothing for situations where the
- * user does not specify a callback (for fire-and-forget
- * situations).
+ * Replaces the headers sent with every request.
  */
-static void noOpCb(ResponseInfo *response, void *requestData,
-	void *clientData)
+void EvHttpClient::setDefaultHeaders(const map<string, string> & headers)
 {
-	// Do nothing.
+	defaultHeaders = headers;
+	defaultHeaderNames.clear();
+	defaultHeaderLines.clear();
+	for(map<string, string>::const_iterator iter = headers.begin();
+		iter != headers.end(); ++iter)
+	{
+		defaultHeaderNames.push_back(iter->first);
+		defaultHeaderLines.push_back(iter->first + ": " + iter->second + "\r\n");
+	}
+	defaultHost = hasHeaderNamed(headers, "Host");
 }
 
 /*
- * Makes a request given a string. Starts event loop
- * structures.
+ * Turns pool autoscaling on or off. The autoscale timer
+ * does not keep the event loop alive on its own.
  */
-int EvHttpClient::makeRequest(EvHttpClientCallback cb,
-	const string requestString, void *data)
+void EvHttpClient::setAutoscale(bool enabled, int min_conns,
+	int max_conns, double headroom, double interval)
 {
-	HttpConn *conn = getConn();
-	if(conn == NULL)
-	{
-		return -1;
-	}
-	
-	RequestInfo *request = new RequestInfo(this);
-	request->response = new ResponseInfo();
-	request->conn = conn;
-	if(cb == NULL)
-	{
-		request->cb = noOpCb;
-	}
-	else
+	if(autoscale)
 	{
-		request->cb = cb;
+		ev_ref(loop);
+		ev_timer_stop(loop, &autoscaleTimer);
 	}
-	request->cb = cb;
-	request->requestString = requestString;
-	gettimeofday(&request->start, NULL);
-	ev_timer_init(&request->timer, timeoutCbWrapper, timeout, 0.);
-	request->timer.data = (void *) request;
-	request->data = data;
-	
-	conn->request = request;
-	ev_io_start(loop, &conn->writeWatcher);
-	
-	if(timeout > 0)
+
+	autoscale = enabled;
+	poolReport.autoscale = enabled;
+	if(!enabled)
 	{
-		ev_timer_start(loop, &request->timer);
+		return;
 	}
 
-	return 0;
-}
+	minConns = max(min_conns, 0);
+	maxConns = max(max_conns, minConns);
+	this->headroom = headroom;
+	autoscaleInterval = interval;
+	windowRequests = 0;
+	windowCompleted = 0;
+	windowLatency = 0;
+	windowPeakOutstanding = numOutstanding;
+	surplusTicks = 0;
 
-/*
- * Makes a request given a method, set of headers, and
- * optional body.
- */
-int EvHttpClient::makeRequest(EvHttpClientCallback cb,
-	const string & path, const string & method,
-	const map<string, string> & headers,
-	const string & body, void *data)
-{
-	string request = buildRequest(path, method, headers, body);
-	return makeRequest(cb, request, data);
+	ev_timer_set(&autoscaleTimer, interval, interval);
+	ev_timer_start(loop, &autoscaleTimer);
+	ev_unref(loop);
 }
 
 /*
- * Makes GET.
+ * Returns the most recent sizing decision along with
+ * current pool occupancy.
  */
-int EvHttpClient::makeGet(EvHttpClientCallback cb, const string & path,
-	const map<string, string> & headers, void *data)
+PoolReport EvHttpClient::getPoolReport()
 {
-	return makeRequest(cb, path, "GET", headers, "", data);
+	PoolReport report = poolReport;
+	report.idle = connections.size();
+	report.outstanding = numOutstanding;
+	report.total = numConns;
+	report.evicted = evicted;
+	return report;
 }
 
 /*
- * Makes POST.
+ * Sets which response headers are stored. Well-known
+ * names go into a bitmask; others are matched by a
+ * case-insensitive compare.
  */
-int EvHttpClient::makePost(EvHttpClientCallback cb, const string & path,
-	const map<string, string> & headers, const string & body,
-	void *data)
+void EvHttpClient::setHeaderCapture(HeaderCapture mode,
+	const vector<string> & names)
 {
-	return makeRequest(cb, path, "POST", headers, body, data);
-}
+	headerCapture = mode;
+	captureMask = 0;
+	captureNames.clear();
+	if(mode != CAPTURE_SELECTED_HEADERS)
+	{
+		return;
+	}
+
+	for(size_t i = 0; i < names.size(); ++i)
+	{
+		HttpHeaderId id = classifyHeader(names[i]);
+		if(id != HEADER_UNKNOWN)
+		{
+			captureMask |= 1u << id;
+		}
+		else
+		{
+			captureNames.push_back(names[i]);
+		}
+	}
+}
+
+/*
+ * Creates, resizes or removes the response cache.
+ * Requests already in flight finish without it.
+ */
+void EvHttpClient::setCache(size_t max_bytes, const vector<string> & key_headers)
+{
+	cacheKeyHeaders = key_headers;
+	if(max_bytes == 0)
+	{
+		delete cache;
+		cache = NULL;
+		internalHeaders &= ~CACHE_INTERNAL_HEADERS;
+		return;
+	}
+
+	if(cache == NULL)
+	{
+		cache = new ResponseCache(max_bytes);
+	}
+	else
+	{
+		cache->setMaxBytes(max_bytes);
+	}
+	internalHeaders |= CACHE_INTERNAL_HEADERS;
+}
+
+int EvHttpClient::setCacheFile(const string & path, size_t max_bytes)
+{
+	if(cache == NULL)
+	{
+		return -1;
+	}
+	return cache->openFile(path, max_bytes);
+}
+
+CacheStats EvHttpClient::getCacheStats()
+{
+	if(cache == NULL)
+	{
+		return CacheStats();
+	}
+	return cache->stats();
+}
+
+/*
+ * Turns coalescing of identical GETs on or off. GETs
+ * already coalesced complete as before.
+ */
+void EvHttpClient::setCoalescing(bool enabled)
+{
+	coalesce = enabled;
+}
+
+/*
+ * Turns hedging on or off. Hedges already sent are
+ * unaffected.
+ */
+void EvHttpClient::setHedging(bool enabled, double delay, double percentile,
+	double max_rate)
+{
+	hedge = enabled;
+	hedgeDelay = delay;
+	hedgePercentile = percentile;
+	hedgeMaxRate = max_rate;
+	hedgeReport.enabled = enabled;
+	hedgeReport.delay = delay;
+	latencyNext = 0;
+	latencyCount = 0;
+	latencySamples.clear();
+}
+
+HedgeReport EvHttpClient::getHedgeReport()
+{
+	return hedgeReport;
+}
+
+/*
+ * Takes effect for retries decided from now on. The
+ * budget restarts at the new burst size.
+ */
+void EvHttpClient::setRetryPolicy(const RetryPolicy & policy)
+{
+	retryPolicy = policy;
+	retryTokens = policy.budgetBurst;
+}
+
+const RetryPolicy & EvHttpClient::getRetryPolicy()
+{
+	return retryPolicy;
+}
+
+RetryReport EvHttpClient::getRetryReport()
+{
+	return retryReport;
+}
+
+int EvHttpClient::getOutstanding()
+{
+	return numOutstanding;
+}
+
+double EvHttpClient::getLatencyEwma()
+{
+	return latencyEwma;
+}
+
+void EvHttpClient::setCircuitBreaker(bool enabled, const BreakerPolicy & policy)
+{
+	breaker = enabled;
+	breakerPolicy = policy;
+	breakerReport.enabled = enabled;
+	breakerReport.state = BREAKER_CLOSED;
+	breakerReport.since = ev_now(loop);
+	breakerReport.requests = 0;
+	breakerReport.failures = 0;
+	for(int i = 0; i < BREAKER_BUCKETS; ++i)
+	{
+		breakerEpochs[i] = -1;
+	}
+}
+
+/*
+ * An open breaker reports half-open once its open time
+ * is up, though it only changes when next consulted.
+ */
+BreakerState EvHttpClient::getBreakerState()
+{
+	if(breakerReport.state == BREAKER_OPEN && ev_now(loop) >= breakerOpenUntil)
+	{
+		return BREAKER_HALF_OPEN;
+	}
+	return breakerReport.state;
+}
+
+BreakerReport EvHttpClient::getBreakerReport()
+{
+	breakerCount();
+	BreakerReport report = breakerReport;
+	report.state = getBreakerState();
+	return report;
+}
+
+/*
+ * Finds pending requests by their data pointer and
+ * cancels each without calling its callback.
+ */
+int EvHttpClient::cancelRequests(void *data)
+{
+	int cancelled = 0;
+	RequestInfo *request = activeRequests;
+	while(request != NULL)
+	{
+		RequestInfo *next = request->nextActive;
+		if(request->data == data && !request->cancelled)
+		{
+			cancelRequest(request);
+			cancelled++;
+		}
+		request = next;
+	}
+	return cancelled;
+}
+
+void EvHttpClient::keepResponse(ResponseInfo *response)
+{
+	response->holds++;
+}
+
+void EvHttpClient::releaseResponse(ResponseInfo *response)
+{
+	if(--response->holds == 0 && response->released)
+	{
+		response->released = false;
+		freeResponse(response);
+	}
+}
+
+/*
+ * Callback that does nothing for situations where the
+ * user does not specify a callback (for fire-and-forget
+ * situations).
+ */
+static void noOpCb(ResponseInfo *response, void *requestData,
+	void *clientData)
+{
+	// Do nothing.
+}
+
+/*
+ * Makes a request given a string. Starts event loop
+ * structures.
+ */
+int EvHttpClient::makeRequest(EvHttpClientCallback cb,
+	const string & requestString, void *data)
+{
+	return makeRequest(cb, std::string_view(requestString), data);
+}
+
+/*
+ * Makes a request given a string, taking ownership
+ * of it.
+ */
+int EvHttpClient::makeRequest(EvHttpClientCallback cb,
+	string && requestString, void *data)
+{
+	RequestInfo *request = newRequest();
+	request->requestString = std::move(requestString);
+	return startRequest(request, cb, data);
+}
+
+/*
+ * Makes a request given a borrowed string. Copies it
+ * into the request's pooled buffer.
+ */
+int EvHttpClient::makeRequest(EvHttpClientCallback cb,
+	std::string_view requestString, void *data)
+{
+	RequestInfo *request = newRequest();
+	request->requestString.assign(requestString);
+	return startRequest(request, cb, data);
+}
+
+int EvHttpClient::makeRequest(EvHttpClientCallback cb,
+	const char *requestString, void *data)
+{
+	return makeRequest(cb, std::string_view(requestString), data);
+}
+
+/*
+ * Makes a request from a template.
+ */
+int EvHttpClient::makeRequest(EvHttpClientCallback cb,
+	const RequestTemplate & tmpl, std::string_view pathSuffix,
+	const std::string_view *slotValues, std::string_view body, void *data)
+{
+	RequestInfo *request = newRequest();
+	buildRequest(request->requestString, tmpl, pathSuffix, slotValues, body);
+	return startRequest(request, cb, data);
+}
+
+int EvHttpClient::makeRequest(EvHttpClientCallback cb,
+	const RequestTemplate & tmpl, std::string_view pathSuffix,
+	std::initializer_list<std::string_view> slotValues,
+	std::string_view body, void *data)
+{
+	if(slotValues.size() != tmpl.numSlots())
+	{
+		return -1;
+	}
+	return makeRequest(cb, tmpl, pathSuffix, slotValues.begin(), body, data);
+}
+
+/*
+ * Makes a request given a method, set of headers, and
+ * optional body.
+ */
+int EvHttpClient::makeRequest(EvHttpClientCallback cb,
+	const string & path, const string & method,
+	const map<string, string> & headers,
+	const string & body, void *data)
+{
+	RequestInfo *request = newRequest();
+	serializeRequest(request->requestString, path, method,
+		headers.begin(), headers.end(), body);
+	return startRequest(request, cb, data);
+}
+
+/*
+ * Makes a request given an array of borrowed headers.
+ */
+int EvHttpClient::makeRequest(EvHttpClientCallback cb,
+	std::string_view path, std::string_view method,
+	const HeaderPair *headers, size_t numHeaders,
+	std::string_view body, void *data)
+{
+	RequestInfo *request = newRequest();
+	serializeRequest(request->requestString, path, method,
+		headers, headers + numHeaders, body);
+	return startRequest(request, cb, data);
+}
+
+/*
+ * Makes a request with a callable callback, given a
+ * borrowed string.
+ */
+int EvHttpClient::makeRequest(RequestCallback && cb, std::string_view requestString)
+{
+	RequestInfo *request = newRequest();
+	request->requestString.assign(requestString);
+	request->cb = std::move(cb);
+	return startRequest(request);
+}
+
+/*
+ * Makes a request with a callable callback, given an
+ * array of borrowed headers.
+ */
+int EvHttpClient::makeRequest(RequestCallback && cb, std::string_view path,
+	std::string_view method, const HeaderPair *headers, size_t numHeaders,
+	std::string_view body)
+{
+	return makeCallableRequest(std::move(cb), path, method, headers, numHeaders,
+		body, NULL, true);
+}
+
+/*
+ * Makes GET.
+ */
+int EvHttpClient::makeGet(EvHttpClientCallback cb, const string & path,
+	const map<string, string> & headers, void *data)
+{
+	return makeRequest(cb, path, "GET", headers, "", data);
+}
+
+/*
+ * Makes POST.
+ */
+int EvHttpClient::makePost(EvHttpClientCallback cb, const string & path,
+	const map<string, string> & headers, const string & body,
+	void *data)
+{
+	return makeRequest(cb, path, "POST", headers, body, data);
+}
+
+/*
+ * Makes PUT.
+ */
+int EvHttpClient::makePut(EvHttpClientCallback cb, const string & path,
+	const map<string, string> & headers, const string & body,
+	void *data)
+{
+	return makeRequest(cb, path, "PUT", headers, body, data);
+}
+
+/*
+ * Makes DELETE.
+ */
+int EvHttpClient::makeDelete(EvHttpClientCallback cb, const string & path,
+	const map<string, string> & headers, const string & body,
+	void *data)
+{
+	return makeRequest(cb, path, "DELETE", headers, body, data);
+}
+
+/*
+ * Submits a serialized request from any thread.
+ */
+int EvHttpClient::submitRequest(EvHttpClientCallback cb,
+	string && requestString, void *data)
+{
+	Submission *submission = new Submission();
+	submission->cb = cb != NULL ? cb : noOpCb;
+	submission->requestString = std::move(requestString);
+	submission->data = data;
+	submit(submission);
+	return 0;
+}
+
+/*
+ * Submits a request from any thread, serializing it
+ * there.
+ */
+int EvHttpClient::submitRequest(EvHttpClientCallback cb,
+	std::string_view path, std::string_view method,
+	std::initializer_list<HeaderPair> headers,
+	std::string_view body, void *data)
+{
+	Submission *submission = new Submission();
+	submission->cb = cb != NULL ? cb : noOpCb;
+	serializeRequest(submission->requestString, path, method,
+		headers.begin(), headers.end(), body);
+	submission->data = data;
+	submit(submission);
+	return 0;
+}
+
+int EvHttpClient::submitGet(EvHttpClientCallback cb, std::string_view path,
+	std::initializer_list<HeaderPair> headers, void *data)
+{
+	return submitRequest(cb, path, "GET", headers, "", data);
+}
+
+void EvHttpClient::setSubmitKeepAlive(bool enabled)
+{
+	if(enabled == submitKeepAlive)
+	{
+		return;
+	}
+	if(enabled)
+	{
+		ev_ref(loop);
+	}
+	else
+	{
+		ev_unref(loop);
+	}
+	submitKeepAlive = enabled;
+}
+
+/*
+ * Pushes a submission onto the queue. Only the push
+ * that finds the queue empty wakes the loop thread;
+ * later ones are picked up by the same drain.
+ */
+void EvHttpClient::submit(Submission *submission)
+{
+	Submission *head = submissions.load(std::memory_order_relaxed);
+	do
+	{
+		submission->next = head;
+	}
+	while(!submissions.compare_exchange_weak(head, submission,
+		std::memory_order_release, std::memory_order_relaxed));
+
+	if(head == NULL)
+	{
+		ev_async_send(loop, &submitWatcher);
+	}
+}
+
+/*
+ * Takes everything queued in one exchange and starts
+ * it, oldest first.
+ */
+void EvHttpClient::drainSubmissions()
+{
+	Submission *submission = submissions.exchange(NULL, std::memory_order_acquire);
+	Submission *oldest = NULL;
+	while(submission != NULL)
+	{
+		Submission *next = submission->next;
+		submission->next = oldest;
+		oldest = submission;
+		submission = next;
+	}
+
+	while(oldest != NULL)
+	{
+		Submission *next = oldest->next;
+		if(makeRequest(oldest->cb, std::move(oldest->requestString), oldest->data) != 0)
+		{
+			oldest->cb(NULL, oldest->data, data);
+		}
+		delete oldest;
+		oldest = next;
+	}
+}
+
+void EvHttpClient::submitCbWrapper(struct ev_loop *loop, struct ev_async *watcher,
+	int revents)
+{
+	EvHttpClient *client = (EvHttpClient *) watcher->data;
+	client->drainSubmissions();
+}
+
+/*
+ * Builds a request string out of the method, headers,
+ * and body.
+ */
+void EvHttpClient::buildRequest(string & out, std::string_view path,
+	std::string_view method, const map<string, string> & headers,
+	std::string_view body)
+{
+	serializeRequest(out, path, method, headers.begin(), headers.end(), body);
+}
+
+void EvHttpClient::buildRequest(string & out, std::string_view path,
+	std::string_view method, const HeaderPair *headers, size_t numHeaders,
+	std::string_view body)
+{
+	serializeRequest(out, path, method, headers, headers + numHeaders, body);
+}
+
+/*
+ * Request serializer shared by the map and HeaderPair
+ * request functions. Computes the exact size first,
+ * then writes everything into out with no intermediate
+ * strings, so a reused out allocates nothing.
+ */
+template <class HeaderIter>
+void EvHttpClient::serializeRequest(string & out, std::string_view path,
+	std::string_view method, HeaderIter begin, HeaderIter end,
+	std::string_view body)
+{
+	std::string_view knownMethod = canonicalMethod(method);
+	if(path.size() == 0)
+	{
+		path = defaultPath;
+	}
+
+	bool hasHost = hasHeaderNamed(begin, end, "Host") || defaultHost;
+	char contentLength[CONTENT_LENGTH_LINE_MAX];
+	size_t contentLengthLen = 0;
+	if(body.size() > 0 && !hasHeaderNamed(begin, end, "Content-Length"))
+	{
+		contentLengthLen = contentLengthLine(contentLength, body.size());
+	}
+
+	// Size pass
+	size_t size = method.size() + 1 + path.size() + 11;
+	for(HeaderIter iter = begin; iter != end; ++iter)
+	{
+		size += iter->first.size() + iter->second.size() + 4;
+	}
+	for(size_t i = 0; i < defaultHeaderLines.size(); ++i)
+	{
+		if(!hasHeaderNamed(begin, end, defaultHeaderNames[i]))
+		{
+			size += defaultHeaderLines[i].size();
+		}
+	}
+	if(!hasHost)
+	{
+		size += hostHeader.size();
+	}
+	size += contentLengthLen + 2 + body.size();
+
+	// Write pass
+	out.resize(size);
+	char *p = &out[0];
+	if(knownMethod.size() > 0)
+	{
+		p = put(p, knownMethod);
+	}
+	else
+	{
+		for(size_t i = 0; i < method.size(); ++i)
+		{
+			*p++ = toupper(method[i]);
+		}
+	}
+	*p++ = ' ';
+	p = put(p, path);
+	p = put(p, " HTTP/1.1\r\n");
+
+	for(HeaderIter iter = begin; iter != end; ++iter)
+	{
+		p = put(p, iter->first);
+		p = put(p, ": ");
+		p = put(p, iter->second);
+		p = put(p, "\r\n");
+	}
+	for(size_t i = 0; i < defaultHeaderLines.size(); ++i)
+	{
+		if(!hasHeaderNamed(begin, end, defaultHeaderNames[i]))
+		{
+			p = put(p, defaultHeaderLines[i]);
+		}
+	}
+	if(!hasHost)
+	{
+		p = put(p, hostHeader);
+	}
+	p = put(p, std::string_view(contentLength, contentLengthLen));
+	p = put(p, "\r\n");
+	put(p, body);
+}
+
+/*
+ * Builds a request from a template. Sizes the request
+ * string exactly, then copies in the precompiled parts
+ * and the per-request values.
+ */
+void EvHttpClient::buildRequest(string & out, const RequestTemplate & tmpl,
+	std::string_view pathSuffix, const std::string_view *slotValues,
+	std::string_view body)
+{
+	char contentLength[CONTENT_LENGTH_LINE_MAX];
+	size_t contentLengthLen = 0;
+	if(body.size() > 0 && !tmpl.fixedContentLength)
+	{
+		contentLengthLen = contentLengthLine(contentLength, body.size());
+	}
+
+	size_t size = tmpl.requestLine.size() + pathSuffix.size() +
+		tmpl.headerBlock.size() + tmpl.defaultBlock.size() + contentLengthLen + 2 +
+		body.size();
+	for(size_t i = 0; i < tmpl.slotPrefixes.size(); ++i)
+	{
+		size += tmpl.slotPrefixes[i].size() + slotValues[i].size() + 2;
+	}
+
+	out.resize(size);
+	char *p = &out[0];
+	p = put(p, tmpl.requestLine);
+	p = put(p, pathSuffix);
+	p = put(p, tmpl.headerBlock);
+	for(size_t i = 0; i < tmpl.slotPrefixes.size(); ++i)
+	{
+		p = put(p, tmpl.slotPrefixes[i]);
+		p = put(p, slotValues[i]);
+		p = put(p, "\r\n");
+	}
+	p = put(p, tmpl.defaultBlock);
+	p = put(p, std::string_view(contentLength, contentLengthLen));
+	p = put(p, "\r\n");
+	put(p, body);
+}
+
+
+/*************************
+* EvHttpClient (private) *
+**************************/
+
+/*
+ * Sends a request whose requestString has been filled
+ * in. Frees the request on failure.
+ */
+int EvHttpClient::startRequest(RequestInfo *request, EvHttpClientCallback cb,
+	void *data)
+{
+	if(cb == NULL)
+	{
+		request->cb = noOpCb;
+	}
+	else
+	{
+		request->cb = cb;
+	}
+	request->data = data;
+	return startRequest(request);
+}
+
+/*
+ * Makes a request with a callable callback. data is the
+ * request's data pointer, by which it can be cancelled
+ * (RequestGroup passes itself). Unless timed, the
+ * request has no timeout, e.g. because a group's
+ * deadline stands in.
+ */
+int EvHttpClient::makeCallableRequest(RequestCallback && cb, std::string_view path,
+	std::string_view method, const HeaderPair *headers, size_t numHeaders,
+	std::string_view body, void *data, bool timed)
+{
+	RequestInfo *request = newRequest();
+	serializeRequest(request->requestString, path, method,
+		headers, headers + numHeaders, body);
+	request->cb = std::move(cb);
+	request->data = data;
+	request->untimed = !timed;
+	return startRequest(request);
+}
+
+/*
+ * Sends a request whose requestString, callback and
+ * data pointer have been filled in. Frees the request
+ * on failure.
+ */
+int EvHttpClient::startRequest(RequestInfo *request)
+{
+	gettimeofday(&request->start, NULL);
+	ev_timer_init(&request->timer, timeoutCbWrapper, timeout, 0.);
+	request->timer.data = (void *) request;
+	linkActive(request);
+
+	if(coalesce && coalesceRequest(request))
+	{
+		return 0;
+	}
+
+	if(cache != NULL && cacheRequest(request))
+	{
+		return 0;
+	}
+
+	if(breaker && !breakerAllows(request))
+	{
+		freeRequest(request);
+		return EVHTTPCLIENT_BREAKER_OPEN;
+	}
+
+	// Until the host name is resolved, the request
+	// waits without a connection.
+	HttpConn *conn = NULL;
+	if(addresses.size() > 0)
+	{
+		conn = getConn();
+		if(conn == NULL)
+		{
+			breakerRecord(request, true);
+			freeRequest(request);
+			return -1;
+		}
+	}
+	else if(!resolving)
+	{
+		freeRequest(request);
+		return -1;
+	}
+	
+	request->conn = conn;
+	if(request->coalesceKey.size() > 0)
+	{
+		inflight.insert(InflightMap::value_type(request->coalesceKey, request));
+		request->coalesceLeader = true;
+	}
+	
+	if(conn != NULL)
+	{
+		conn->request = request;
+		ev_io_start(loop, &conn->writeWatcher);
+	}
+	else
+	{
+		request->unresolved = true;
+		unresolvedRequests.push_back(request);
+	}
+	requestStarted();
+	
+	if(timeout > 0 && !request->untimed)
+	{
+		ev_timer_start(loop, &request->timer);
+	}
+
+	retryTokens = min(retryTokens + retryPolicy.budgetRatio, retryPolicy.budgetBurst);
+
+	if(hedge && methodIn(request->requestString, retryPolicy.idempotentMethods))
+	{
+		hedgeTokens = min(hedgeTokens + hedgeMaxRate, HEDGE_MAX_TOKENS);
+		if(timeout <= 0 || hedgeReport.delay < timeout)
+		{
+			ev_timer_set(&request->hedgeTimer, hedgeReport.delay, 0.);
+			ev_timer_start(loop, &request->hedgeTimer);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Sends a request again, on a new or pooled connection.
+ */
+void EvHttpClient::retryRequest(RequestInfo *request)
+{
+	if(request->conn != NULL)
+	{
+		destroyConn(request->conn);
+		request->conn = NULL;
+	}
+
+	request->conn = getConn();
+	if(request->conn == NULL)
+	{
+		finalizeError(request);
+		return;
+	}
+	
+	request->conn->request = request;
+	ev_io_start(loop, &request->conn->writeWatcher);
+}
+
+/*
+ * Looks the host name up (again).
+ */
+void EvHttpClient::startResolve()
+{
+	stringstream service;
+	service << url.port();
+	resolving = true;
+	resolver->resolve(url.host(), service.str(), resolveCbWrapper, this);
+}
+
+/*
+ * Takes the addresses from a lookup. Connections to
+ * addresses that are gone are closed now if idle, or
+ * when their requests finish (see returnConn). If the
+ * lookup failed, the addresses from the last one are
+ * kept; if there are none, the waiting requests fail.
+ */
+void EvHttpClient::resolveCb(int error, const vector<ResolvedAddress> & addresses,
+	double ttl)
+{
+	resolving = false;
+	if(error != 0 || addresses.empty())
+	{
+		cout << "Error: couldn't resolve host name " << url.host() << ": "
+			<< (error != 0 ? gai_strerror(error) : "no addresses") << endl;
+		while(this->addresses.empty() && !unresolvedRequests.empty())
+		{
+			RequestInfo *request = unresolvedRequests.back();
+			unresolvedRequests.pop_back();
+			request->unresolved = false;
+			finalizeError(request);
+		}
+		ttl = RESOLVE_RETRY_INTERVAL;
+	}
+	else
+	{
+		bool first = this->addresses.empty();
+		this->addresses = addresses;
+		nextAddress = 0;
+
+		size_t idle = connections.size();
+		for(size_t i = 0; i < idle; ++i)
+		{
+			HttpConn *conn = connections.front();
+			connections.pop();
+			if(addressCurrent(conn))
+			{
+				connections.push(conn);
+			}
+			else
+			{
+				destroyConn(conn);
+			}
+		}
+
+		if(first)
+		{
+			initConnPool();
+		}
+		vector<RequestInfo *> waiting;
+		waiting.swap(unresolvedRequests);
+		for(size_t i = 0; i < waiting.size(); ++i)
+		{
+			waiting[i]->unresolved = false;
+			retryRequest(waiting[i]);
+		}
+	}
+
+	// Look up again when the addresses expire. Like the
+	// autoscale timer, this doesn't keep the loop alive.
+	if(ttl > 0)
+	{
+		if(ev_is_active(&resolveTimer))
+		{
+			ev_ref(loop);
+			ev_timer_stop(loop, &resolveTimer);
+		}
+		ev_timer_set(&resolveTimer, ttl, 0.);
+		ev_timer_start(loop, &resolveTimer);
+		ev_unref(loop);
+	}
+}
+
+void EvHttpClient::resolveCbWrapper(int error, const vector<ResolvedAddress> & addresses,
+	double ttl, void *owner)
+{
+	EvHttpClient *client = (EvHttpClient *) owner;
+	client->resolveCb(error, addresses, ttl);
+}
+
+void EvHttpClient::resolveTimerCbWrapper(struct ev_loop *loop, struct ev_timer *timer,
+	int revents)
+{
+	EvHttpClient *client = (EvHttpClient *) timer->data;
+	ev_ref(loop);
+	client->startResolve();
+}
+
+/*
+ * Whether the connection's address is still among
+ * those the host name resolves to.
+ */
+bool EvHttpClient::addressCurrent(HttpConn *conn)
+{
+	return find(addresses.begin(), addresses.end(), conn->address) != addresses.end();
+}
+
+/*
+ * Called when a request's connection failed, and has
+ * been destroyed. closed is set if it was a pooled
+ * connection, most likely closed by the server while
+ * idle. Retries the request if the policy allows,
+ * otherwise fails it.
+ */
+void EvHttpClient::connectionFailed(RequestInfo *request, bool closed)
+{
+	bool retryable = closed ? retryPolicy.retryClosedConnections :
+		retryPolicy.retryConnectFailures;
+	double delay = closed ? 0 : retryBackoff(request);
+
+	if(retryable && retryAllowed(request, delay))
+	{
+		scheduleRetry(request, delay);
+	}
+	else
+	{
+		finalizeError(request);
+	}
+}
+
+/*
+ * Whether the request may be sent again after delay
+ * seconds: its method is idempotent, it has attempts
+ * left, the retry would start before its timeout, and
+ * the budget allows. Hedges are never retried; the
+ * original carries on.
+ */
+bool EvHttpClient::retryAllowed(RequestInfo *request, double delay)
+{
+	if(request->hedgeOf != NULL ||
+		!methodIn(request->requestString, retryPolicy.idempotentMethods))
+	{
+		return false;
+	}
+	if(request->attempts >= retryPolicy.maxAttempts ||
+		(ev_is_active(&request->timer) && delay >= ev_timer_remaining(loop, &request->timer)))
+	{
+		retryReport.exhausted++;
+		return false;
+	}
+	if(retryTokens < 1)
+	{
+		retryReport.overBudget++;
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Exponential backoff with full jitter for the
+ * request's next retry.
+ */
+double EvHttpClient::retryBackoff(RequestInfo *request)
+{
+	double cap = retryPolicy.baseBackoff;
+	for(int i = 1; i < request->attempts && cap < retryPolicy.maxBackoff; ++i)
+	{
+		cap *= 2;
+	}
+	cap = min(cap, retryPolicy.maxBackoff);
+
+	std::uniform_real_distribution<double> jitter(0, cap);
+	return jitter(retryRandom);
+}
+
+/*
+ * Seconds asked for by the response's Retry-After
+ * header (delay-seconds or an HTTP date), or -1.
+ */
+double EvHttpClient::retryAfter(RequestInfo *request)
+{
+	std::string_view value = request->response->getHeader(HEADER_RETRY_AFTER);
+	if(value.size() == 0)
+	{
+		return -1;
+	}
+
+	long seconds = 0;
+	std::from_chars_result result = std::from_chars(value.data(),
+		value.data() + value.size(), seconds);
+	if(result.ec == std::errc() && result.ptr == value.data() + value.size())
+	{
+		return seconds >= 0 ? seconds : -1;
+	}
+
+	double date = ResponseCache::parseHttpDate(value);
+	if(date < 0)
+	{
+		return -1;
+	}
+	return max(date - ev_now(loop), 0.);
+}
+
+/*
+ * Whether a complete response's status calls for the
+ * request to be retried, and if so, sets delay.
+ */
+bool EvHttpClient::retryStatus(RequestInfo *request, double *delay)
+{
+	const vector<short> & statuses = retryPolicy.retryStatuses;
+	if(find(statuses.begin(), statuses.end(), request->response->code) == statuses.end())
+	{
+		return false;
+	}
+
+	*delay = retryBackoff(request);
+	if(retryPolicy.useRetryAfter)
+	{
+		*delay = max(*delay, retryAfter(request));
+	}
+	return retryAllowed(request, *delay);
+}
+
+/*
+ * Sends the request again after delay seconds (at once
+ * if 0), with a fresh response. The request must not
+ * have a connection. Its timeout keeps running.
+ */
+void EvHttpClient::scheduleRetry(RequestInfo *request, double delay)
+{
+	request->attempts++;
+	retryTokens -= 1;
+	retryReport.retries++;
+
+	freeResponse(request->response);
+	request->response = newResponse();
+
+	if(delay <= 0)
+	{
+		retryRequest(request);
+		return;
+	}
+
+	ev_timer_stop(loop, &request->hedgeTimer);
+	ev_timer_set(&request->retryTimer, delay, 0.);
+	ev_timer_start(loop, &request->retryTimer);
+}
+
+void EvHttpClient::retryCb(struct ev_loop *loop, struct ev_timer *timer, int revents)
+{
+	RequestInfo *request = (RequestInfo *) timer->data;
+	retryRequest(request);
+}
+
+/*
+ * Whether the breaker lets a request through to the
+ * server. While half-open, the requests let through are
+ * marked as probes.
+ */
+bool EvHttpClient::breakerAllows(RequestInfo *request)
+{
+	if(breakerReport.state == BREAKER_OPEN && ev_now(loop) >= breakerOpenUntil)
+	{
+		breakerTransition(BREAKER_HALF_OPEN);
+	}
+
+	if(breakerReport.state == BREAKER_CLOSED)
+	{
+		return true;
+	}
+	if(breakerReport.state == BREAKER_HALF_OPEN && breakerProbes < breakerPolicy.probes)
+	{
+		breakerProbes++;
+		request->probe = true;
+		return true;
+	}
+	breakerReport.rejected++;
+	return false;
+}
+
+/*
+ * Counts the outcome of a request that went to the
+ * server, and trips or resets the breaker as needed.
+ * Hedges and requests answered from the cache don't
+ * count, nor do requests from before the breaker opened
+ * that finish while it is open.
+ */
+void EvHttpClient::breakerRecord(RequestInfo *request, bool failed)
+{
+	if(!breaker || request->hedgeOf != NULL || request->cacheHit)
+	{
+		return;
+	}
+
+	if(request->probe)
+	{
+		request->probe = false;
+		breakerProbes--;
+		if(breakerReport.state == BREAKER_HALF_OPEN)
+		{
+			breakerTransition(failed ? BREAKER_OPEN : BREAKER_CLOSED);
+		}
+		return;
+	}
+	if(breakerReport.state != BREAKER_CLOSED)
+	{
+		return;
+	}
+
+	double width = breakerPolicy.window / BREAKER_BUCKETS;
+	long epoch = (long) (ev_now(loop) / width);
+	int bucket = epoch % BREAKER_BUCKETS;
+	if(breakerEpochs[bucket] != epoch)
+	{
+		breakerEpochs[bucket] = epoch;
+		breakerRequests[bucket] = 0;
+		breakerFailures[bucket] = 0;
+	}
+	breakerRequests[bucket]++;
+	if(failed)
+	{
+		breakerFailures[bucket]++;
+	}
+	else
+	{
+		return;
+	}
+
+	breakerCount();
+	if(breakerReport.requests >= breakerPolicy.minRequests &&
+		breakerReport.failures >= breakerPolicy.failureRatio * breakerReport.requests)
+	{
+		breakerTransition(BREAKER_OPEN);
+	}
+}
+
+/*
+ * Totals the buckets still inside the window.
+ */
+void EvHttpClient::breakerCount()
+{
+	double width = breakerPolicy.window / BREAKER_BUCKETS;
+	long epoch = (long) (ev_now(loop) / width);
+	breakerReport.requests = 0;
+	breakerReport.failures = 0;
+	for(int i = 0; i < BREAKER_BUCKETS; ++i)
+	{
+		if(breakerEpochs[i] > epoch - BREAKER_BUCKETS)
+		{
+			breakerReport.requests += breakerRequests[i];
+			breakerReport.failures += breakerFailures[i];
+		}
+	}
+}
+
+void EvHttpClient::breakerTransition(BreakerState state)
+{
+	breakerReport.state = state;
+	breakerReport.since = ev_now(loop);
+	breakerReport.transitions++;
+
+	if(state == BREAKER_OPEN)
+	{
+		breakerOpenUntil = ev_now(loop) + breakerPolicy.openTime;
+	}
+	else if(state == BREAKER_CLOSED)
+	{
+		// Start the window afresh, so the failures that
+		// opened the breaker don't trip it again.
+		for(int i = 0; i < BREAKER_BUCKETS; ++i)
+		{
+			breakerEpochs[i] = -1;
+		}
+	}
+}
+
+/*
+ * The address for a connection's attempt'th connect.
+ * Addresses of the family preferred when the connection
+ * was created alternate with those of the other family
+ * (RFC 8305, section 4), each family's taken in turn
+ * from the connection's start so that connections spread
+ * over the addresses. NULL once every address is tried.
+ */
+const ResolvedAddress *EvHttpClient::candidate(HttpConn *conn, size_t attempt)
+{
+	size_t total = addresses.size();
+	if(attempt >= total)
+	{
+		return NULL;
+	}
+
+	size_t preferred = 0;
+	for(size_t i = 0; i < total; ++i)
+	{
+		if(addresses[i].family == conn->family)
+		{
+			preferred++;
+		}
+	}
+	size_t other = total - preferred;
+	size_t both = min(preferred, other);
+
+	bool inPreferred;
+	size_t index;
+	if(attempt < 2 * both)
+	{
+		inPreferred = attempt % 2 == 0;
+		index = attempt / 2;
+	}
+	else
+	{
+		inPreferred = preferred > other;
+		index = attempt - both;
+	}
+	index = (index + conn->start) % (inPreferred ? preferred : other);
+
+	for(size_t i = 0; i < total; ++i)
+	{
+		if((addresses[i].family == conn->family) == inPreferred && index-- == 0)
+		{
+			return &addresses[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Starts a non-blocking connect to the connection's
+ * next address, skipping any that fail at once (e.g. a
+ * family the host has no route for). Returns the socket
+ * and sets address, or returns -1 if none are left.
+ */
+int EvHttpClient::connectNext(HttpConn *conn, ResolvedAddress *address)
+{
+	const ResolvedAddress *next;
+	while((next = candidate(conn, conn->attempts)) != NULL)
+	{
+		conn->attempts++;
+
+		int fd = socket(next->family, next->socktype, next->protocol);
+		if(fd < 0)
+		{
+			continue;
+		}
+
+		int flags = fcntl(fd, F_GETFL, 0);
+		fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+
+		if(connect(fd, (struct sockaddr *) &next->addr, next->addrlen) < 0 &&
+			errno != EINPROGRESS)
+		{
+			int err = errno;
+			close(fd);
+			errno = err;
+			continue;
+		}
+
+		*address = *next;
+		return fd;
+	}
+	return -1;
+}
+
+/*
+ * Replaces the connection's socket, keeping its
+ * watchers as they were.
+ */
+void EvHttpClient::moveConn(HttpConn *conn, int fd, const ResolvedAddress & address)
+{
+	bool writing = ev_is_active(&conn->writeWatcher);
+	bool reading = ev_is_active(&conn->readWatcher);
+	ev_io_stop(loop, &conn->writeWatcher);
+	ev_io_stop(loop, &conn->readWatcher);
+
+	close(conn->fd);
+	conn->fd = fd;
+	conn->address = address;
+
+	ev_io_set(&conn->writeWatcher, fd, EV_WRITE);
+	ev_io_set(&conn->readWatcher, fd, EV_READ);
+	if(writing)
+	{
+		ev_io_start(loop, &conn->writeWatcher);
+	}
+	if(reading)
+	{
+		ev_io_start(loop, &conn->readWatcher);
+	}
+}
+
+/*
+ * Called when the connection's current attempt failed.
+ * Carries on with the racing attempt, if any, or else
+ * the next address. Returns false if none are left.
+ */
+bool EvHttpClient::nextAttempt(HttpConn *conn)
+{
+	ev_timer_stop(loop, &conn->raceTimer);
+	if(conn->raceFd >= 0)
+	{
+		ev_io_stop(loop, &conn->raceWatcher);
+		int fd = conn->raceFd;
+		conn->raceFd = -1;
+		moveConn(conn, fd, conn->raceAddress);
+	}
+	else
+	{
+		ResolvedAddress address;
+		int fd = connectNext(conn, &address);
+		if(fd < 0)
+		{
+			conn->connecting = false;
+			return false;
+		}
+		moveConn(conn, fd, address);
+	}
+
+	if(candidate(conn, conn->attempts) != NULL)
+	{
+		ev_timer_set(&conn->raceTimer, HAPPY_EYEBALLS_DELAY, 0.);
+		ev_timer_start(loop, &conn->raceTimer);
+	}
+	return true;
+}
+
+/*
+ * Called when the connection's current attempt failed
+ * and its error has been read, so the socket can't
+ * report it again. If it was the last one, fails the
+ * connection's request; an idle pooled connection is
+ * left for getConn to find dead.
+ */
+void EvHttpClient::attemptFailed(HttpConn *conn)
+{
+	if(nextAttempt(conn) || conn->request == NULL)
+	{
+		return;
+	}
+
+	RequestInfo *request = conn->request;
+	cout << "Error: couldn't connect to " << url.host() << ":" << url.port() << endl;
+	destroyConn(conn);
+	request->conn = NULL;
+	connectionFailed(request, false);
+}
+
+/*
+ * Starts a connect to the next address alongside the
+ * current one.
+ */
+void EvHttpClient::startRace(HttpConn *conn)
+{
+	int fd = connectNext(conn, &conn->raceAddress);
+	if(fd < 0)
+	{
+		return;
+	}
+	conn->raceFd = fd;
+	ev_io_set(&conn->raceWatcher, fd, EV_WRITE);
+	ev_io_start(loop, &conn->raceWatcher);
+}
+
+/*
+ * Ends the race once the connection's socket has
+ * connected, and remembers its family for the next
+ * connections.
+ */
+void EvHttpClient::connected(HttpConn *conn)
+{
+	if(conn->raceFd >= 0)
+	{
+		ev_io_stop(loop, &conn->raceWatcher);
+		close(conn->raceFd);
+		conn->raceFd = -1;
+	}
+	ev_timer_stop(loop, &conn->raceTimer);
+	conn->connecting = false;
+	preferredFamily = conn->address.family;
+}
+
+/*
+ * The racing attempt finished connecting: if it
+ * succeeded it replaces the current one, otherwise the
+ * next address takes its place.
+ */
+void EvHttpClient::raceCb(HttpConn *conn)
+{
+	int state = connectState(conn->raceFd);
+	if(state == 0)
+	{
+		return;
+	}
+
+	ev_io_stop(loop, &conn->raceWatcher);
+	int fd = conn->raceFd;
+	conn->raceFd = -1;
+	if(state > 0)
+	{
+		moveConn(conn, fd, conn->raceAddress);
+		connected(conn);
+	}
+	else
+	{
+		close(fd);
+		startRace(conn);
+	}
+}
+
+/*
+ * The current attempt has had HAPPY_EYEBALLS_DELAY to
+ * connect. This also covers pooled connections, whose
+ * write watcher only runs once they have a request.
+ */
+void EvHttpClient::raceTimerCb(HttpConn *conn)
+{
+	int state = connectState(conn->fd);
+	if(state > 0)
+	{
+		connected(conn);
+	}
+	else if(state < 0)
+	{
+		attemptFailed(conn);
+	}
+	else if(conn->raceFd < 0)
+	{
+		startRace(conn);
+	}
+}
+
+/*
+ * Connects to the remote server. Returns the
+ * new connection, or NULL on error.
+ *
+ * If the host has several addresses and this one
+ * doesn't connect within HAPPY_EYEBALLS_DELAY, the next
+ * is tried alongside it, and the first to connect is
+ * kept. At most two connects are pending at a time.
+ */
+HttpConn *EvHttpClient::createConn()
+{
+	if(addresses.empty())
+	{
+		return NULL;
+	}
+	HttpConn *conn = newConn();
+	conn->family = preferredFamily;
+	conn->start = nextAddress++;
+	conn->attempts = 0;
+	conn->raceFd = -1;
+
+	if( (conn->fd = connectNext(conn, &conn->address)) < 0)
+	{
+		perror("connect() failed");
+		freeConn(conn);
+		return NULL;
+	}
+
+	ev_io_init(&conn->writeWatcher, writeCbWrapper, conn->fd, EV_WRITE);
+	ev_io_init(&conn->readWatcher, readCbWrapper, conn->fd, EV_READ);
+	conn->writeWatcher.data = (void *) conn;
+	conn->readWatcher.data = (void *) conn;
+
+	// Race the other addresses if this one is slow.
+	conn->connecting = candidate(conn, conn->attempts) != NULL;
+	if(conn->connecting)
+	{
+		ev_timer_set(&conn->raceTimer, HAPPY_EYEBALLS_DELAY, 0.);
+		ev_timer_start(loop, &conn->raceTimer);
+	}
+	
+	conn->request = NULL;
+	numConns++;
+	
+	return conn;
+}
+
+/*
+ * Disconnects a connection object and returns it
+ * to the freelist.
+ *
+ * IS NOT responsible for the connection's RequestInfo.
+ * This must be freed prior to calling destroyConn.
+ */
+void EvHttpClient::destroyConn(HttpConn *conn)
+{
+	shutdown(conn->fd, 2);
+	close(conn->fd);
+	if(conn->raceFd >= 0)
+	{
+		close(conn->raceFd);
+		conn->raceFd = -1;
+	}
+	conn->connecting = false;
+	
+	ev_io_stop(loop, &conn->writeWatcher);
+	ev_io_stop(loop, &conn->readWatcher);
+	ev_io_stop(loop, &conn->raceWatcher);
+	ev_timer_stop(loop, &conn->raceTimer);
+	http_parser_pause(&conn->parser, 1);
+
+	numConns--;
+	freeConn(conn);
+}
+
+/*
+ * Disconnects and frees connection object.
+ *
+ * ALSO invokes finalizeTimeout on request if
+ * a request is attached.
+ */
+void EvHttpClient::destroyConnAndRequest(HttpConn *conn)
+{
+	if (conn->request != NULL)
+		finalizeTimeout(conn->request);
+	
+	destroyConn(conn);
+}
+
+/*
+ * Fails every request still outstanding, for the
+ * destructor. Waiters are failed on their own, since
+ * they hold no connection. Cache hits stay queued, to be
+ * freed with the rest.
+ */
+void EvHttpClient::failOutstanding()
+{
+	while(activeRequests != NULL)
+	{
+		RequestInfo *request = activeRequests;
+		if(request->cacheHit)
+		{
+			unlinkActive(request);
+			if(!request->cancelled)
+			{
+				request->cb(NULL, request->data, data);
+			}
+		}
+		else if(request->leader != NULL)
+		{
+			unlinkWaiter(request);
+			finalizeWaiter(request, NULL);
+		}
+		else
+		{
+			if(request->conn != NULL)
+			{
+				destroyConn(request->conn);
+				request->conn = NULL;
+			}
+			finalizeError(request);
+		}
+	}
+}
+
+/*
+ * Retrieves a connection from the connection pool,
+ * or creates a new one if the pool is empty.
+ *
+ * Pooled connections the peer has closed or reset
+ * while idle are discarded here rather than being
+ * discovered after the request has been written.
+ */
+HttpConn *EvHttpClient::getConn()
+{
+	while(!connections.empty())
+	{
+		HttpConn *conn = connections.front();
+		connections.pop();
+		if(conn->isAlive() && addressCurrent(conn) &&
+			(conn->idleDeadline == 0 || ev_now(loop) < conn->idleDeadline))
+		{
+			conn->resetState();
+			return conn;
+		}
+
+		evicted++;
+		destroyConn(conn);
+	}
+
+	return createConn();
+}
+
+/*
+ * Returns a connection to the connection pool.
+ *
+ * IS NOT responsible for the connection's RequestInfo.
+ */
+void EvHttpClient::returnConn(HttpConn *conn)
+{
+	if(!addressCurrent(conn))
+	{
+		destroyConn(conn);
+		return;
+	}
+
+	ev_io_stop(loop, &conn->writeWatcher);
+	ev_io_stop(loop, &conn->readWatcher);
+	http_parser_pause(&conn->parser, 1);
+
+	connections.push(conn);
+}
+
+/*
+ * Calls user callback on timeout.
+ */
+void EvHttpClient::finalizeTimeout(RequestInfo *request)
+{
+	ev_timer_stop(loop, &request->timer);
+	breakerRecord(request, true);
+	unregisterLeader(request);
+	dropHedge(request);
+	ResponseInfo *response = request->response;
+	
+	response->timeout = true;
+	response->code = 0;
+	response->latency = 0;
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	long diff = difftime(&tv, &request->start);
+	request->response->latency = diff / 1000000.;
+	requestFinished(response->latency);
+	unlinkActive(request);
+	if(!request->cancelled)
+	{
+		request->cb(response, request->data, request->client->data);
+	}
+	completeWaiters(request, response);
+	freeRequest(request);
+}
+
+/*
+ * Calls user callback on error.
+ */
+void EvHttpClient::finalizeError(RequestInfo *request)
+{
+	ev_timer_stop(loop, &request->timer);
+	breakerRecord(request, true);
+	unregisterLeader(request);
+	dropHedge(request);
+	if(request->hedgeOf != NULL)
+	{
+		// A failed hedge leaves the original to carry on.
+		request->hedgeOf->hedge = NULL;
+		request->hedgeOf = NULL;
+	}
+	requestFinished(-1);
+	unlinkActive(request);
+	if(!request->cancelled)
+	{
+		request->cb(NULL, request->data, request->client->data);
+	}
+	completeWaiters(request, NULL);
+	freeRequest(request);
+}
+
+/*
+ * Completes a request that waited on a leader, with
+ * the leader's response (or its own, on timeout).
+ */
+void EvHttpClient::finalizeWaiter(RequestInfo *request, ResponseInfo *response)
+{
+	ev_timer_stop(loop, &request->timer);
+	if(response != NULL && response->timeout)
+	{
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		long diff = difftime(&tv, &request->start);
+		response->code = 0;
+		response->latency = diff / 1000000.;
+	}
+	unlinkActive(request);
+	if(!request->cancelled)
+	{
+		request->cb(response, request->data, data);
+	}
+	freeRequest(request);
+}
+
+/*
+ * Internal callback for when a socket becomes writable.
+ */
+void EvHttpClient::writeCb(struct ev_loop *loop, struct ev_io *watcher, int revents)
+{
+	if(EV_ERROR & revents)
+	{
+		perror("EvHttpClient got invalid write event");
+		return;
+	}
+
+	HttpConn *conn = (HttpConn *) watcher->data;
+	RequestInfo *request = conn->request;
+
+	// While racing connects, the first writable event
+	// says how this attempt went.
+	if(conn->connecting)
+	{
+		int state = connectState(conn->fd);
+		if(state <= 0)
+		{
+			if(state < 0)
+			{
+				attemptFailed(conn);
+			}
+			return;
+		}
+		connected(conn);
+	}
+	
+	const char *toWrite = request->requestString.data() + conn->requestBytesSent;
+	size_t toWriteLen = request->requestString.size() - conn->requestBytesSent;
+	
+	int sent = send(watcher->fd, toWrite, toWriteLen, 0); //MSG_NOSIGNAL);
+	
+	if(sent < 0)
+	{
+		bool closed = !conn->isNew;
+		if(!closed)
+		{
+			cout << "Write error" << endl;
+		}
+		destroyConn(conn);
+		request->conn = NULL;
+		connectionFailed(request, closed);
+		return;
+	}
+	
+	conn->requestBytesSent += sent;
+	if(conn->requestBytesSent == request->requestString.size())
+	{
+		ev_io_stop(loop, watcher);
+		ev_io_start(loop, &conn->readWatcher);
+	}
+}
+
+/*
+ * Internal callback for when a socket becomes readable.
+ */
+void EvHttpClient::readCb(struct ev_loop *loop, struct ev_io *watcher, int revents)
+{
+	if(EV_ERROR & revents)
+	{
+		perror("EvHttpClient got invalid read event");
+		return;
+	}
+	
+	char buffer[block_size];
+	bzero(buffer, sizeof(buffer));
+	HttpConn *conn = (HttpConn *) watcher->data;
+	RequestInfo *request = conn->request;
+	
+	int received = recv(watcher->fd, buffer, sizeof(buffer), 0);
+	if(received <= 0)
+	{
+		bool closed = !conn->isNew;
+		if(!closed)
+		{
+			cout << "Read error " << received << endl;
+		}
+		destroyConn(conn);
+		request->conn = NULL;
+		connectionFailed(request, closed);
+		return;
+	}
+	
+	buffer[received] = 0;
+	http_parser_execute(&conn->parser, &parser_settings,
+		buffer, received);
+}
+
+/*
+ * Internal callback for when timer expires.
+ */
+void EvHttpClient::timeoutCb(struct ev_loop *loop, struct ev_timer *timer, int revents)
+{
+	RequestInfo *request = (RequestInfo *) timer->data;
+
+	if(request->leader != NULL)
+	{
+		unlinkWaiter(request);
+		request->response->timeout = true;
+		finalizeWaiter(request, request->response);
+		return;
+	}
+
+	// The connection carries on for the requests waiting
+	// on this one.
+	if(request->waiters != NULL)
+	{
+		promoteWaiter(request);
+	}
+
+	HttpConn *conn = request->conn;
+
+	//ev_timer_stop(loop, timer); //handled in finalizeTimeout
+	if(conn != NULL)
+	{
+		destroyConn(conn);
+		request->conn = NULL;
+	}
+	
+	finalizeTimeout(request);
+}
+
+/*
+ * Periodic autoscaling callback. Estimates the number of
+ * concurrent requests from the observed rate and latency
+ * (Little's law), adds headroom, and resizes the pool.
+ */
+void EvHttpClient::autoscaleCb(struct ev_loop *loop, struct ev_timer *timer, int revents)
+{
+	double rate = windowRequests / autoscaleInterval;
+	double latency = latencyEstimate;
+	if(windowCompleted > 0)
+	{
+		latency = windowLatency / windowCompleted;
+	}
+	if(latency < 0)
+	{
+		latency = 0;
+	}
+
+	// Grow ahead of demand: estimates jump up immediately
+	// but only decay gradually.
+	if(rate >= rateEstimate)
+	{
+		rateEstimate = rate;
+	}
+	else
+	{
+		rateEstimate += AUTOSCALE_DECAY * (rate - rateEstimate);
+	}
+	if(latency >= latencyEstimate)
+	{
+		latencyEstimate = latency;
+	}
+	else
+	{
+		latencyEstimate += AUTOSCALE_DECAY * (latency - latencyEstimate);
+	}
+
+	double concurrency = rateEstimate * latencyEstimate;
+	int target = (int) ceil(concurrency * headroom);
+
+	stringstream reason;
+	reason << "rate " << rateEstimate << "/s * latency " << latencyEstimate
+		<< "s = " << concurrency << " concurrent, * headroom " << headroom
+		<< " = " << target;
+	if(windowPeakOutstanding > target)
+	{
+		target = windowPeakOutstanding;
+		reason << "; raised to observed peak of " << windowPeakOutstanding
+			<< " outstanding";
+	}
+	if(target < minConns)
+	{
+		target = minConns;
+		reason << "; raised to min_conns";
+	}
+	else if(target > maxConns)
+	{
+		target = maxConns;
+		reason << "; capped at max_conns";
+	}
+
+	if(numConns < target)
+	{
+		surplusTicks = 0;
+		reason << "; growing from " << numConns;
+		resizePool(target);
+	}
+	else if(numConns > target * (1 + AUTOSCALE_HYSTERESIS) && !connections.empty())
+	{
+		if(++surplusTicks >= AUTOSCALE_SHRINK_TICKS)
+		{
+			surplusTicks = 0;
+			reason << "; shrinking idle surplus from " << numConns;
+			resizePool(target);
+		}
+		else
+		{
+			reason << "; surplus of " << numConns - target
+				<< " held (" << surplusTicks << "/" << AUTOSCALE_SHRINK_TICKS << ")";
+		}
+	}
+	else
+	{
+		surplusTicks = 0;
+		reason << "; holding at " << numConns;
+	}
+
+	poolReport.target = target;
+	poolReport.rate = rateEstimate;
+	poolReport.latency = latencyEstimate;
+	poolReport.concurrency = concurrency;
+	poolReport.reason = reason.str();
+
+	windowRequests = 0;
+	windowCompleted = 0;
+	windowLatency = 0;
+	windowPeakOutstanding = numOutstanding;
+}
+
+/*
+ * Delivers responses answered from the cache. Hits
+ * queued by these callbacks wait for the next loop
+ * iteration.
+ */
+void EvHttpClient::cacheCb(struct ev_loop *loop, struct ev_timer *timer, int revents)
+{
+	size_t count = cacheHits.size();
+	for(size_t i = 0; i < count; ++i)
+	{
+		RequestInfo *request = cacheHits.front();
+		cacheHits.pop();
+
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		long diff = difftime(&tv, &request->start);
+		request->response->latency = diff / 1000000.;
+		unlinkActive(request);
+		if(!request->cancelled)
+		{
+			request->cb(request->response, request->data, data);
+		}
+		freeRequest(request);
+	}
+}
+
+/*
+ * Consults the cache before a request is sent. A fresh
+ * entry is copied into the request's response, which is
+ * queued for delivery, and true is returned. A stale one
+ * with validators turns the request into a conditional
+ * GET. Otherwise notes what to do with the response.
+ */
+bool EvHttpClient::cacheRequest(RequestInfo *request)
+{
+	std::string_view raw = request->requestString;
+	size_t lineEnd = raw.find("\r\n");
+	size_t methodEnd = raw.find(' ');
+	size_t pathEnd = raw.rfind(' ', lineEnd);
+	if(lineEnd == std::string_view::npos || methodEnd >= pathEnd)
+	{
+		return false;
+	}
+
+	std::string_view method = raw.substr(0, methodEnd);
+	request->cacheKey.assign("GET ");
+	request->cacheKey.append(raw.substr(methodEnd + 1, pathEnd - methodEnd - 1));
+	request->cacheKey.push_back('\n');
+
+	if(method.size() == 4 && strncasecmp(method.data(), "HEAD", 4) == 0)
+	{
+		return false;
+	}
+	if(method.size() != 3 || strncasecmp(method.data(), "GET", 3) != 0)
+	{
+		request->cacheState = RequestInfo::CACHE_INVALIDATE;
+		return false;
+	}
+
+	std::string_view cacheControl = ResponseCache::requestHeader(raw, "Cache-Control");
+	if(headerHasToken(cacheControl, "no-store") ||
+		ResponseCache::requestHeader(raw, "If-None-Match").size() > 0 ||
+		ResponseCache::requestHeader(raw, "If-Modified-Since").size() > 0 ||
+		ResponseCache::requestHeader(raw, "Range").size() > 0)
+	{
+		return false;
+	}
+
+	for(size_t i = 0; i < cacheKeyHeaders.size(); ++i)
+	{
+		request->cacheKey.append(ResponseCache::requestHeader(raw, cacheKeyHeaders[i]));
+		request->cacheKey.push_back('\n');
+	}
+
+	request->cacheState = RequestInfo::CACHE_STORE;
+	if(headerHasToken(cacheControl, "no-cache"))
+	{
+		return false;
+	}
+
+	const CacheEntry *entry = NULL;
+	CacheLookup result = cache->lookup(request->cacheKey, raw, ev_now(loop), &entry);
+	if(result == CACHE_HIT)
+	{
+		cache->fill(entry, request->response);
+		request->cacheHit = true;
+		cacheHits.push(request);
+		if(!ev_is_active(&cacheTimer))
+		{
+			ev_timer_set(&cacheTimer, 0., 0.);
+			ev_timer_start(loop, &cacheTimer);
+		}
+		return true;
+	}
+
+	if(result == CACHE_STALE)
+	{
+		string & requestString = request->requestString;
+		size_t headersEnd = requestString.find("\r\n\r\n");
+		if(headersEnd != string::npos)
+		{
+			string conditional;
+			if(entry->etag.size() > 0)
+			{
+				conditional += "If-None-Match: " + entry->etag + "\r\n";
+			}
+			if(entry->lastModified.size() > 0)
+			{
+				conditional += "If-Modified-Since: " + entry->lastModified + "\r\n";
+			}
+			requestString.insert(headersEnd + 2, conditional);
+			request->cacheState = RequestInfo::CACHE_REVALIDATE;
+		}
+	}
+	return false;
+}
+
+/*
+ * Updates the cache from a response before it is
+ * passed to the callback. A 304 to a revalidation is
+ * replaced by the stored response. Returns false if
+ * there is none any more (it was evicted, or the cache
+ * disabled, while the request was out, or the 304 made
+ * it uncacheable): the 304 has no body to give the
+ * caller, so the request must be sent again (see
+ * resendUnconditional).
+ */
+bool EvHttpClient::cacheResponse(RequestInfo *request)
+{
+	ResponseInfo *response = request->response;
+	if(request->cacheState == RequestInfo::CACHE_REVALIDATE && response->code == 304)
+	{
+		const CacheEntry *entry = NULL;
+		if(cache != NULL)
+		{
+			entry = cache->refresh(request->cacheKey, response, ev_now(loop));
+		}
+		if(entry == NULL)
+		{
+			return false;
+		}
+		cache->fill(entry, response);
+		return true;
+	}
+
+	if(cache == NULL || request->cacheState == RequestInfo::CACHE_BYPASS)
+	{
+		return true;
+	}
+
+	if(request->cacheState == RequestInfo::CACHE_INVALIDATE)
+	{
+		if(response->code < 400)
+		{
+			cache->invalidate(request->cacheKey);
+		}
+		return true;
+	}
+
+	cache->store(request->cacheKey, request->requestString, response, ev_now(loop));
+	return true;
+}
+
+/*
+ * Sends a revalidation again without the conditional
+ * headers cacheRequest added, so the server answers
+ * with the full response, which is then stored as a new
+ * entry. The request must not have a connection. It is
+ * not a retry, so takes no retry budget.
+ */
+void EvHttpClient::resendUnconditional(RequestInfo *request)
+{
+	// cacheRequest doesn't revalidate requests carrying
+	// these headers already, so any present are its own.
+	string & requestString = request->requestString;
+	const char *conditionals[] = { "\r\nIf-None-Match: ", "\r\nIf-Modified-Since: " };
+	for(size_t i = 0; i < sizeof(conditionals) / sizeof(conditionals[0]); ++i)
+	{
+		size_t start = requestString.find(conditionals[i]);
+		if(start != string::npos)
+		{
+			size_t end = requestString.find("\r\n", start + 2);
+			requestString.erase(start, end - start);
+		}
+	}
+	request->cacheState = RequestInfo::CACHE_STORE;
+
+	freeResponse(request->response);
+	request->response = newResponse();
+	retryRequest(request);
+}
+
+/*
+ * Attaches a GET to an identical one already in
+ * flight, if any, and returns true. Otherwise notes the
+ * request's key so it can lead later ones.
+ */
+bool EvHttpClient::coalesceRequest(RequestInfo *request)
+{
+	const string & raw = request->requestString;
+	if(raw.size() < 4 || strncasecmp(raw.data(), "GET ", 4) != 0)
+	{
+		return false;
+	}
+
+	InflightMap::iterator iter = inflight.find(raw);
+	if(iter == inflight.end())
+	{
+		request->coalesceKey.assign(raw);
+		return false;
+	}
+
+	RequestInfo *leader = iter->second;
+	request->leader = leader;
+	request->nextWaiter = leader->waiters;
+	if(leader->waiters != NULL)
+	{
+		leader->waiters->prevWaiter = request;
+	}
+	leader->waiters = request;
+
+	if(timeout > 0 && !request->untimed)
+	{
+		ev_timer_start(loop, &request->timer);
+	}
+	return true;
+}
+
+void EvHttpClient::unlinkWaiter(RequestInfo *request)
+{
+	if(request->prevWaiter != NULL)
+	{
+		request->prevWaiter->nextWaiter = request->nextWaiter;
+	}
+	else
+	{
+		request->leader->waiters = request->nextWaiter;
+	}
+	if(request->nextWaiter != NULL)
+	{
+		request->nextWaiter->prevWaiter = request->prevWaiter;
+	}
+	request->leader = NULL;
+	request->prevWaiter = NULL;
+	request->nextWaiter = NULL;
+}
+
+/*
+ * Makes a leader's first waiter the leader in its
+ * place, handing over the connection, the response
+ * being parsed, and the remaining waiters. The old
+ * leader is left with an empty response and no
+ * connection, ready to be finalized.
+ */
+void EvHttpClient::promoteWaiter(RequestInfo *request)
+{
+	RequestInfo *next = request->waiters;
+	unlinkWaiter(next);
+
+	next->waiters = request->waiters;
+	request->waiters = NULL;
+	for(RequestInfo *waiter = next->waiters; waiter != NULL; waiter = waiter->nextWaiter)
+	{
+		waiter->leader = next;
+	}
+
+	swap(next->response, request->response);
+	next->requestString.swap(request->requestString);
+	next->cacheState = request->cacheState;
+	next->cacheKey.swap(request->cacheKey);
+	next->conn = request->conn;
+	request->conn = NULL;
+	if(next->conn != NULL)
+	{
+		next->conn->request = next;
+	}
+	ev_timer_stop(loop, &request->hedgeTimer);
+	next->hedge = request->hedge;
+	request->hedge = NULL;
+	if(next->hedge != NULL)
+	{
+		next->hedge->hedgeOf = next;
+	}
+	next->attempts = request->attempts;
+	if(request->unresolved)
+	{
+		*find(unresolvedRequests.begin(), unresolvedRequests.end(), request) = next;
+		request->unresolved = false;
+		next->unresolved = true;
+	}
+	if(ev_is_active(&request->retryTimer))
+	{
+		ev_timer_set(&next->retryTimer, ev_timer_remaining(loop, &request->retryTimer), 0.);
+		ev_timer_start(loop, &next->retryTimer);
+		ev_timer_stop(loop, &request->retryTimer);
+	}
+
+	next->coalesceKey.swap(request->coalesceKey);
+	if(request->coalesceLeader)
+	{
+		inflight[next->coalesceKey] = next;
+		next->coalesceLeader = true;
+		request->coalesceLeader = false;
+	}
+
+	// The old leader's finalization counts the request
+	// as finished; it isn't.
+	numOutstanding++;
+}
+
+/*
+ * Stops a leader from collecting new waiters.
+ */
+void EvHttpClient::unregisterLeader(RequestInfo *request)
+{
+	if(request->coalesceLeader)
+	{
+		inflight.erase(request->coalesceKey);
+		request->coalesceLeader = false;
+	}
+}
+
+/*
+ * Passes a leader's outcome to its waiters. They all
+ * receive the same response object.
+ */
+void EvHttpClient::completeWaiters(RequestInfo *request, ResponseInfo *response)
+{
+	while(request->waiters != NULL)
+	{
+		RequestInfo *waiter = request->waiters;
+		unlinkWaiter(waiter);
+		finalizeWaiter(waiter, response);
+	}
+}
+
+/*
+ * Cancels a pending request. A waiter is simply
+ * detached. A leader with waiters hands its connection
+ * to the first of them. A request answered from the
+ * cache is dropped when its delivery comes up. Anything
+ * else loses its connection.
+ */
+void EvHttpClient::cancelRequest(RequestInfo *request)
+{
+	request->cancelled = true;
+	if(request->cacheHit)
+	{
+		return;
+	}
+
+	ev_timer_stop(loop, &request->timer);
+	if(request->leader != NULL)
+	{
+		unlinkWaiter(request);
+		freeRequest(request);
+		return;
+	}
+
+	if(request->waiters != NULL)
+	{
+		promoteWaiter(request);
+	}
+	unregisterLeader(request);
+	dropHedge(request);
+	if(request->conn != NULL)
+	{
+		destroyConn(request->conn);
+		request->conn = NULL;
+	}
+	requestFinished(-1);
+	freeRequest(request);
+}
+
+/*
+ * Hedge timer: the request has had no response yet, so
+ * send a duplicate on another connection, if the hedge
+ * allowance permits.
+ */
+void EvHttpClient::hedgeCb(struct ev_loop *loop, struct ev_timer *timer, int revents)
+{
+	RequestInfo *request = (RequestInfo *) timer->data;
+	if(request->conn == NULL || request->hedge != NULL)
+	{
+		return;
+	}
+	if(hedgeTokens < 1)
+	{
+		hedgeReport.suppressed++;
+		return;
+	}
+
+	HttpConn *conn = getConn();
+	if(conn == NULL)
+	{
+		return;
+	}
+	hedgeTokens -= 1;
+	hedgeReport.sent++;
+
+	RequestInfo *duplicate = newRequest();
+	duplicate->requestString = request->requestString;
+	duplicate->cb = noOpCb;
+	duplicate->hedgeOf = request;
+	request->hedge = duplicate;
+	gettimeofday(&duplicate->start, NULL);
+	ev_timer_init(&duplicate->timer, timeoutCbWrapper, 0., 0.);
+	duplicate->timer.data = (void *) duplicate;
+
+	duplicate->conn = conn;
+	conn->request = duplicate;
+	ev_io_start(loop, &conn->writeWatcher);
+	requestStarted();
+}
+
+/*
+ * A hedge's response completed first. Moves it, and the
+ * hedge's connection, to the original request, whose
+ * own connection is closed. Returns the original.
+ */
+RequestInfo *EvHttpClient::hedgeWon(RequestInfo *hedge)
+{
+	RequestInfo *request = hedge->hedgeOf;
+	HttpConn *conn = hedge->conn;
+
+	swap(request->response, hedge->response);
+	if(request->conn != NULL)
+	{
+		destroyConn(request->conn);
+	}
+	request->conn = conn;
+	conn->request = request;
+	request->hedge = NULL;
+	hedge->hedgeOf = NULL;
+	hedge->conn = NULL;
+
+	hedgeReport.won++;
+	requestFinished(-1);
+	freeRequest(hedge);
+	return request;
+}
+
+/*
+ * Cancels a request's hedge timer and its hedge, if
+ * one was sent, closing the hedge's connection.
+ */
+void EvHttpClient::dropHedge(RequestInfo *request)
+{
+	ev_timer_stop(loop, &request->hedgeTimer);
+	RequestInfo *duplicate = request->hedge;
+	if(duplicate == NULL)
+	{
+		return;
+	}
+
+	request->hedge = NULL;
+	duplicate->hedgeOf = NULL;
+	if(duplicate->conn != NULL)
+	{
+		destroyConn(duplicate->conn);
+		duplicate->conn = NULL;
+	}
+	requestFinished(-1);
+	freeRequest(duplicate);
+}
+
+/*
+ * Keeps a ring of recent latencies and, every so often,
+ * sets the hedge delay to the chosen percentile of them.
+ */
+void EvHttpClient::recordLatency(double latency)
+{
+	if(latencySamples.size() < HEDGE_LATENCY_SAMPLES)
+	{
+		latencySamples.push_back(latency);
+	}
+	else
+	{
+		latencySamples[latencyNext] = latency;
+		latencyNext = (latencyNext + 1) % HEDGE_LATENCY_SAMPLES;
+	}
+
+	if(++latencyCount % HEDGE_RECOMPUTE_INTERVAL != 0 ||
+		latencySamples.size() < HEDGE_MIN_SAMPLES)
+	{
+		return;
+	}
+
+	latencyScratch.assign(latencySamples.begin(), latencySamples.end());
+	size_t rank = (size_t) (hedgePercentile * (latencyScratch.size() - 1));
+	nth_element(latencyScratch.begin(), latencyScratch.begin() + rank,
+		latencyScratch.end());
+	hedgeReport.delay = latencyScratch[rank];
+}
+
+void EvHttpClient::linkActive(RequestInfo *request)
+{
+	request->active = true;
+	request->prevActive = NULL;
+	request->nextActive = activeRequests;
+	if(activeRequests != NULL)
+	{
+		activeRequests->prevActive = request;
+	}
+	activeRequests = request;
+}
+
+/*
+ * Called as a request completes, before its callback
+ * runs, so that it can no longer be cancelled.
+ */
+void EvHttpClient::unlinkActive(RequestInfo *request)
+{
+	if(!request->active)
+	{
+		return;
+	}
+
+	if(request->prevActive != NULL)
+	{
+		request->prevActive->nextActive = request->nextActive;
+	}
+	else
+	{
+		activeRequests = request->nextActive;
+	}
+	if(request->nextActive != NULL)
+	{
+		request->nextActive->prevActive = request->prevActive;
+	}
+	request->active = false;
+}
 
 /*
- * Makes PUT.
+ * Bookkeeping for autoscaling when a request is
+ * dispatched.
  */
-int EvHttpClient::makePut(EvHttpClientCallback cb, const string & path,
-	const map<string, string> & headers, const string & body,
-	void *data)
+void EvHttpClient::requestStarted()
 {
-	return makeRequest(cb, path, "PUT", headers, body, data);
+	numOutstanding++;
+	windowRequests++;
+	if(numOutstanding > windowPeakOutstanding)
+	{
+		windowPeakOutstanding = numOutstanding;
+	}
 }
 
 /*
- * Makes DELETE.
+ * Bookkeeping for autoscaling when a request is
+ * finalized. A negative latency means none was
+ * measured (the request failed).
  */
-int EvHttpClient::makeDelete(EvHttpClientCallback cb, const string & path,
-	const map<string, string> & headers, const string & body,
-	void *data)
+void EvHttpClient::requestFinished(double latency)
 {
-	return makeRequest(cb, path, "DELETE", headers, body, data);
+	numOutstanding--;
+	if(latency >= 0)
+	{
+		windowCompleted++;
+		windowLatency += latency;
+		if(latencyEwma == 0)
+		{
+			latencyEwma = latency;
+		}
+		else
+		{
+			latencyEwma += LATENCY_EWMA_WEIGHT * (latency - latencyEwma);
+		}
+		if(hedge && hedgePercentile > 0 && hedgePercentile < 1)
+		{
+			recordLatency(latency);
+		}
+	}
 }
 
-
-/*************************
-* EvHttpClient (private) *
-**************************/
-
 /*
- * Retries a request given a request object.
+ * Opens idle connections or closes idle ones until
+ * the pool holds target connections in total. Never
+ * touches connections that are in use.
  */
-void EvHttpClient::retryRequest(RequestInfo *request)
+void EvHttpClient::resizePool(int target)
 {
-	if(request->conn != NULL)
+	while(numConns < target)
 	{
-		destroyConn(request->conn);
-		request->conn = NULL;
+		HttpConn *newConn = createConn();
+		if(newConn == NULL)
+		{
+			break;
+		}
+		connections.push(newConn);
 	}
 
-	request->conn = getConn();
-	if(request->conn == NULL)
+	while(numConns > target && !connections.empty())
 	{
-		finalizeError(request);
-		return;
+		HttpConn *conn = connections.front();
+		connections.pop();
+		destroyConn(conn);
 	}
-	
-	request->conn->request = request;
-	ev_io_start(loop, &request->conn->writeWatcher);
 }
 
 /*
- * Connects to the remote server. Returns the
- * new connection, or NULL on error.
+ * Whether a response header should be stored, per
+ * setHeaderCapture.
  */
-HttpConn *EvHttpClient::createConn()
+bool EvHttpClient::captureHeader(HttpHeaderId id, std::string_view name)
 {
-	HttpConn *conn = new HttpConn(this);
-	
-	if( (conn->fd = socket(family, socktype, 
-		protocol)) < 0)
-	{   
-		perror("socket error");
-		delete conn;
-		return NULL;
+	if(headerCapture == CAPTURE_ALL_HEADERS)
+	{
+		return true;
+	}
+
+	if(id != HEADER_UNKNOWN)
+	{
+		return ((captureMask | internalHeaders) & (1u << id)) != 0;
 	}
-	
-	int flags = fcntl(conn->fd, F_GETFL, 0);
-	fcntl(conn->fd, F_SETFL, flags | O_NONBLOCK);   
 
-	if( (connect(conn->fd, &addr, addrlen)) < 0)
+	for(size_t i = 0; i < captureNames.size(); ++i)
 	{
-		if(errno != EINPROGRESS)
+		if(captureNames[i].size() == name.size() &&
+			strncasecmp(captureNames[i].data(), name.data(), name.size()) == 0)
 		{
-			perror("connect() failed");
-			delete conn;
-			return NULL;
+			return true;
 		}
 	}
-
-	ev_io_init(&conn->writeWatcher, writeCbWrapper, conn->fd, EV_WRITE);
-	ev_io_init(&conn->readWatcher, readCbWrapper, conn->fd, EV_READ);
-	conn->writeWatcher.data = (void *) conn;
-	conn->readWatcher.data = (void *) conn;
-	
-	conn->request = NULL;
-	
-	return conn;
+	return false;
 }
 
 /*
- * Disconnects and frees a connection object.
- *
- * IS NOT responsible for the connection's RequestInfo.
- * This must be freed prior to calling destroyConn.
+ * Object freelists. RequestInfo, ResponseInfo and HttpConn
+ * objects are recycled rather than deleted, and are reset
+ * in place so that their strings keep their capacity. Once
+ * the freelists have grown to the client's peak concurrency,
+ * issuing a request allocates nothing for these objects.
  */
-void EvHttpClient::destroyConn(HttpConn *conn)
+RequestInfo *EvHttpClient::newRequest()
 {
-	shutdown(conn->fd, 2);
-	close(conn->fd);
-	
-	ev_io_stop(loop, &conn->writeWatcher);
-	ev_io_stop(loop, &conn->readWatcher);
-	http_parser_pause(&conn->parser, 1);
+	RequestInfo *request;
+	if(freeRequests.empty())
+	{
+		request = new RequestInfo(this);
+	}
+	else
+	{
+		request = freeRequests.back();
+		freeRequests.pop_back();
+	}
 
-	delete conn;
+	request->response = newResponse();
+	return request;
 }
 
 /*
- * Disconnects and frees connection object.
- *
- * ALSO invokes finalizeTimeout on request if
- * a request is attached.
+ * Also frees the request's response, if any.
  */
-void EvHttpClient::destroyConnAndRequest(HttpConn *conn)
+void EvHttpClient::freeRequest(RequestInfo *request)
 {
-	if (conn->request != NULL)
-		finalizeTimeout(conn->request);
-	
-	destroyConn(conn);
+	unlinkActive(request);
+	ev_timer_stop(loop, &request->hedgeTimer);
+	ev_timer_stop(loop, &request->retryTimer);
+	if(request->probe)
+	{
+		breakerProbes--;
+	}
+	if(request->unresolved)
+	{
+		unresolvedRequests.erase(find(unresolvedRequests.begin(),
+			unresolvedRequests.end(), request));
+	}
+	if(request->response != NULL)
+	{
+		freeResponse(request->response);
+	}
+	request->reset();
+	freeRequests.push_back(request);
+}
+
+ResponseInfo *EvHttpClient::newResponse()
+{
+	if(freeResponses.empty())
+	{
+		return new ResponseInfo();
+	}
+
+	ResponseInfo *response = freeResponses.back();
+	freeResponses.pop_back();
+	return response;
 }
 
 /*
- * Retrieves a connection from the connection pool,
- * or creates a new one if the pool is empty.
+ * Releases the response's arena in one step, and
+ * sizes its next chunk from recent responses.
  */
-HttpConn *EvHttpClient::getConn()
+void EvHttpClient::freeResponse(ResponseInfo *response)
 {
-	HttpConn *conn;
-	
-	if(connections.empty())
+	// Held responses are recycled by the last release.
+	if(response->holds > 0)
 	{
-		conn = createConn();
-		if(conn == NULL)
-		{
-			return NULL;
-		}
+		response->released = true;
+		return;
+	}
+
+	size_t used = response->arena.bytesUsed();
+	if(used >= arenaEstimate)
+	{
+		arenaEstimate = used;
 	}
 	else
 	{
-		conn = connections.front();
-		connections.pop();
-		conn->resetState();
+		arenaEstimate -= (size_t) ((arenaEstimate - used) * ARENA_DECAY);
 	}
-	
+
+	size_t chunkSize = ARENA_MIN_CHUNK_SIZE;
+	while(chunkSize < arenaEstimate)
+	{
+		chunkSize <<= 1;
+	}
+
+	response->reset(chunkSize);
+	freeResponses.push_back(response);
+}
+
+/*
+ * Returns a connection object in its initial state,
+ * without a socket.
+ */
+HttpConn *EvHttpClient::newConn()
+{
+	if(freeConns.empty())
+	{
+		return new HttpConn(this);
+	}
+
+	HttpConn *conn = freeConns.back();
+	freeConns.pop_back();
+	conn->resetState();
+	conn->isNew = true;
 	return conn;
 }
 
 /*
- * Returns a connection to the connection pool.
- *
- * IS NOT responsible for the connection's RequestInfo.
+ * The connection's socket must already be closed and
+ * its watchers stopped. Its request, if any, belongs to
+ * the caller, so it is detached here rather than freed
+ * when the connection is reused.
  */
-void EvHttpClient::returnConn(HttpConn *conn)
+void EvHttpClient::freeConn(HttpConn *conn)
 {
-	ev_io_stop(loop, &conn->writeWatcher);
-	ev_io_stop(loop, &conn->readWatcher);
-	http_parser_pause(&conn->parser, 1);
+	conn->request = NULL;
+	freeConns.push_back(conn);
+}
 
-	connections.push(conn);
+/*
+ * Populates connection pool.
+ */
+void EvHttpClient::initConnPool()
+{
+	for(int i = 0; i < init_num_conns; ++i)
+	{
+		HttpConn *newConn = createConn();
+		if(newConn == NULL)
+		{
+			break;
+		}
+		connections.push(newConn);
+	}
+}
+
+/*************************
+* ResponseArena (public) *
+*************************/
+
+ResponseArena::ResponseArena(size_t chunkSize)
+{
+	this->chunkSize = chunkSize;
+	chunk = (char *) ::operator new(chunkSize);
+	chunkUsed = 0;
+	overflowUsed = 0;
+}
+
+ResponseArena::~ResponseArena()
+{
+	reset(0);
+	::operator delete(chunk);
+}
+
+void ResponseArena::reset(size_t nextChunkSize)
+{
+	for(size_t i = 0; i < overflow.size(); ++i)
+	{
+		::operator delete(overflow[i]);
+	}
+	overflow.clear();
+	overflowUsed = 0;
+	chunkUsed = 0;
+
+	if(nextChunkSize > 0 &&
+		(nextChunkSize > chunkSize * 2 || nextChunkSize * 2 < chunkSize))
+	{
+		::operator delete(chunk);
+		chunkSize = nextChunkSize;
+		chunk = (char *) ::operator new(chunkSize);
+	}
+}
+
+size_t ResponseArena::bytesUsed() const
+{
+	return chunkUsed + overflowUsed;
+}
+
+
+/**************************
+* ResponseArena (private) *
+**************************/
+
+void *ResponseArena::do_allocate(size_t bytes, size_t alignment)
+{
+	size_t offset = (chunkUsed + alignment - 1) & ~(alignment - 1);
+	if(offset + bytes <= chunkSize)
+	{
+		chunkUsed = offset + bytes;
+		return chunk + offset;
+	}
+
+	void *block = ::operator new(bytes);
+	overflow.push_back(block);
+	overflowUsed += bytes;
+	return block;
+}
+
+void ResponseArena::do_deallocate(void *p, size_t bytes, size_t alignment)
+{
+	// Released in bulk by reset.
+}
+
+bool ResponseArena::do_is_equal(const std::pmr::memory_resource & other) const noexcept
+{
+	return this == &other;
 }
 
+
+/***************************
+* RequestTemplate (public) *
+***************************/
+
 /*
- * Calls user callback on timeout.
+ * Serializes the fixed parts of the request. Headers
+ * are emitted in the same order buildRequest uses for
+ * the given headers: the template's fixed headers, then
+ * (per request) the slot headers, then the client's
+ * defaults and Host, which are kept apart for that.
  */
-void EvHttpClient::finalizeTimeout(RequestInfo *request)
+RequestTemplate::RequestTemplate(EvHttpClient *client, const string & method,
+	const string & pathPrefix, const map<string, string> & headers,
+	const vector<string> & slotHeaders)
 {
-	ev_timer_stop(loop, &request->timer);
-	ResponseInfo *response = request->response;
-	
-	response->timeout = true;
-	response->code = 0;
-	response->latency = 0;
-	struct timeval tv;
-	gettimeofday(&tv, NULL);
-	long diff = difftime(&tv, &request->start);
-	request->response->latency = diff / 1000000.;
-	request->cb(response, request->data, request->client->data);
-	delete response;
-	delete request;
+	requestLine = method;
+	transform(requestLine.begin(), requestLine.end(), requestLine.begin(), ::toupper);
+	requestLine += " ";
+	requestLine += pathPrefix.size() > 0 ? pathPrefix : client->defaultPath;
+
+	headerBlock = " HTTP/1.1\r\n";
+	for(map<string, string>::const_iterator iter = headers.begin();
+		iter != headers.end(); ++iter)
+	{
+		headerBlock += iter->first + ": " + iter->second + "\r\n";
+	}
+
+	for(map<string, string>::const_iterator iter = client->defaultHeaders.begin();
+		iter != client->defaultHeaders.end(); ++iter)
+	{
+		if(!hasHeaderNamed(headers, iter->first) &&
+			!hasHeaderNamed(slotHeaders, iter->first))
+		{
+			defaultBlock += iter->first + ": " + iter->second + "\r\n";
+		}
+	}
+
+	if(!hasHeaderNamed(headers, "Host") && !hasHeaderNamed(slotHeaders, "Host") &&
+		!hasHeaderNamed(client->defaultHeaders, "Host"))
+	{
+		defaultBlock += client->hostHeader;
+	}
+
+	for(size_t i = 0; i < slotHeaders.size(); ++i)
+	{
+		slotPrefixes.push_back(slotHeaders[i] + ": ");
+	}
+
+	fixedContentLength = hasHeaderNamed(headers, "Content-Length") ||
+		hasHeaderNamed(slotHeaders, "Content-Length");
+}
+
+size_t RequestTemplate::numSlots() const
+{
+	return slotPrefixes.size();
 }
 
+
+/************************
+* ResponseInfo (public) *
+************************/
+
 /*
- * Calls user callback on error.
+ * Constructor binds headers and body to
+ * the response's arena.
  */
-void EvHttpClient::finalizeError(RequestInfo *request)
+ResponseInfo::ResponseInfo()
+	: response(&arena), headerBlock(&arena), headerSpans(&arena),
+	compatHeaders(&arena)
 {
-	ev_timer_stop(loop, &request->timer);
-	request->cb(NULL, request->data, request->client->data);
-	delete request->response;
-	delete request;
+	timeout = false;
+	code = 0;
+	latency = 0;
+	compatBuilt = false;
+	for(int i = 0; i < NUM_WELL_KNOWN_HEADERS; ++i)
+	{
+		wellKnown[i] = -1;
+	}
+	holds = 0;
+	released = false;
 }
 
 /*
- * Internal callback for when a socket becomes writable.
+ * Resetter used when the response is returned to
+ * the client's freelist. Drops the containers' hold
+ * on arena memory before releasing the arena.
  */
-void EvHttpClient::writeCb(struct ev_loop *loop, struct ev_io *watcher, int revents)
+void ResponseInfo::reset(size_t nextChunkSize)
 {
-	if(EV_ERROR & revents)
+	timeout = false;
+	code = 0;
+	latency = 0;
+	std::pmr::string(&arena).swap(response);
+	std::pmr::string(&arena).swap(headerBlock);
+	std::pmr::vector<HeaderSpan>(&arena).swap(headerSpans);
+	compatHeaders.clear();
+	compatBuilt = false;
+	for(int i = 0; i < NUM_WELL_KNOWN_HEADERS; ++i)
 	{
-		perror("EvHttpClient got invalid write event");
-		return;
+		wellKnown[i] = -1;
+	}
+	arena.reset(nextChunkSize);
+}
+
+size_t ResponseInfo::headerCount() const
+{
+	return headerSpans.size();
+}
+
+std::string_view ResponseInfo::headerName(size_t i) const
+{
+	const HeaderSpan & span = headerSpans[i];
+	return std::string_view(headerBlock.data() + span.name, span.nameLen);
+}
+
+std::string_view ResponseInfo::headerValue(size_t i) const
+{
+	const HeaderSpan & span = headerSpans[i];
+	return std::string_view(headerBlock.data() + span.value, span.valueLen);
+}
+
+std::string_view ResponseInfo::getHeader(std::string_view name) const
+{
+	int i = findHeader(name);
+	if(i < 0)
+	{
+		return std::string_view();
+	}
+	return headerValue(i);
+}
+
+bool ResponseInfo::hasHeader(std::string_view name) const
+{
+	return findHeader(name) >= 0;
+}
+
+std::string_view ResponseInfo::getHeader(HttpHeaderId id) const
+{
+	if(id >= NUM_WELL_KNOWN_HEADERS || wellKnown[id] < 0)
+	{
+		return std::string_view();
 	}
+	return headerValue(wellKnown[id]);
+}
+
+bool ResponseInfo::hasHeader(HttpHeaderId id) const
+{
+	return id < NUM_WELL_KNOWN_HEADERS && wellKnown[id] >= 0;
+}
 
-	HttpConn *conn = (HttpConn *) watcher->data;
-	RequestInfo *request = conn->request;
-	
-	string toWrite = request->requestString.substr(conn->requestBytesSent);
-	char *toWriteC = strdup(toWrite.c_str());
-	
-	int sent = send(watcher->fd, toWriteC, strlen(toWriteC), 0); //MSG_NOSIGNAL);
-	free(toWriteC);
-	
-	if(sent < 0)
+const ResponseInfo::HeaderMap & ResponseInfo::headerMap()
+{
+	if(!compatBuilt)
 	{
-		if(conn->isNew)
-		{
-			cout << "Write error" << endl;
-			destroyConn(conn);
-			request->conn = NULL;
-			finalizeError(request);
-		}
-		else
+		for(size_t i = 0; i < headerSpans.size(); ++i)
 		{
-			destroyConn(conn);
-			request->conn = NULL;
-			retryRequest(request);
+			std::pmr::string name(headerName(i), &arena);
+			compatHeaders[std::move(name)].assign(headerValue(i));
 		}
-		return;
-	}
-	
-	conn->requestBytesSent += sent;
-	if(conn->requestBytesSent == request->requestString.size())
-	{
-		ev_io_stop(loop, watcher);
-		ev_io_start(loop, &conn->readWatcher);
+		compatBuilt = true;
 	}
+	return compatHeaders;
 }
 
+
+/*************************
+* ResponseInfo (private) *
+*************************/
+
 /*
- * Internal callback for when a socket becomes readable.
+ * Well-known names resolve through their slot. Others
+ * use a linear, case-insensitive scan; spans whose length
+ * differs are skipped without touching the block.
  */
-void EvHttpClient::readCb(struct ev_loop *loop, struct ev_io *watcher, int revents)
+int ResponseInfo::findHeader(std::string_view name) const
 {
-	if(EV_ERROR & revents)
+	HttpHeaderId id = classifyHeader(name);
+	if(id != HEADER_UNKNOWN)
 	{
-		perror("EvHttpClient got invalid read event");
-		return;
+		return wellKnown[id];
 	}
-	
-	char buffer[block_size];
-	bzero(buffer, sizeof(buffer));
-	HttpConn *conn = (HttpConn *) watcher->data;
-	RequestInfo *request = conn->request;
-	
-	int received = recv(watcher->fd, buffer, sizeof(buffer), 0);
-	if(received <= 0)
+
+	const char *block = headerBlock.data();
+	for(size_t i = 0; i < headerSpans.size(); ++i)
 	{
-		if(conn->isNew)
-		{
-			cout << "Read error " << received << endl;
-			destroyConn(conn);
-			request->conn = NULL;
-			finalizeError(request);
-		}
-		else
+		const HeaderSpan & span = headerSpans[i];
+		if(span.nameLen == name.size() &&
+			strncasecmp(block + span.name, name.data(), name.size()) == 0)
 		{
-			destroyConn(conn);
-			request->conn = NULL;
-			retryRequest(request);
+			return i;
 		}
-		return;
 	}
-	
-	buffer[received] = 0;
-	http_parser_execute(&conn->parser, &parser_settings,
-		buffer, received);
+	return -1;
 }
 
-/*
- * Internal callback for when timer expires.
- */
-void EvHttpClient::timeoutCb(struct ev_loop *loop, struct ev_timer *timer, int revents)
+
+/***********************
+* RetryPolicy (public) *
+***********************/
+
+RetryPolicy::RetryPolicy()
 {
-	RequestInfo *request = (RequestInfo *) timer->data;
-	HttpConn *conn = request->conn;
+	maxAttempts = DEFAULT_RETRY_MAX_ATTEMPTS;
+	retryClosedConnections = true;
+	retryConnectFailures = false;
+	retryStatuses.push_back(503);
+	useRetryAfter = true;
+	idempotentMethods.push_back("GET");
+	idempotentMethods.push_back("HEAD");
+	idempotentMethods.push_back("OPTIONS");
+	idempotentMethods.push_back("PUT");
+	idempotentMethods.push_back("DELETE");
+	idempotentMethods.push_back("TRACE");
+	baseBackoff = DEFAULT_RETRY_BASE_BACKOFF;
+	maxBackoff = DEFAULT_RETRY_MAX_BACKOFF;
+	budgetRatio = DEFAULT_RETRY_BUDGET_RATIO;
+	budgetBurst = DEFAULT_RETRY_BUDGET_BURST;
+}
 
-	//ev_timer_stop(loop, timer); //handled in finalizeTimeout
-	if(conn != NULL)
+
+/*************************
+* BreakerPolicy (public) *
+*************************/
+
+BreakerPolicy::BreakerPolicy()
+{
+	window = DEFAULT_BREAKER_WINDOW;
+	minRequests = DEFAULT_BREAKER_MIN_REQUESTS;
+	failureRatio = DEFAULT_BREAKER_FAILURE_RATIO;
+	countServerErrors = false;
+	openTime = DEFAULT_BREAKER_OPEN_TIME;
+	probes = DEFAULT_BREAKER_PROBES;
+}
+
+
+/***************************
+* RequestCallback (public) *
+***************************/
+
+RequestCallback::RequestCallback()
+{
+	ops = NULL;
+	fn = NULL;
+}
+
+RequestCallback::RequestCallback(EvHttpClientCallback cb)
+{
+	ops = NULL;
+	fn = cb;
+}
+
+RequestCallback::RequestCallback(RequestCallback && other)
+{
+	ops = other.ops;
+	fn = other.fn;
+	if(ops != NULL)
 	{
-		destroyConn(conn);
-		request->conn = NULL;
+		ops->relocate(other.storage, storage);
+		other.ops = NULL;
 	}
-	
-	finalizeTimeout(request);
 }
 
-/*
- * Populates connection pool.
- */
-void EvHttpClient::initConnPool()
+RequestCallback::~RequestCallback()
 {
-	for(int i = 0; i < init_num_conns; ++i)
+	reset();
+}
+
+RequestCallback & RequestCallback::operator=(RequestCallback && other)
+{
+	if(this != &other)
 	{
-		HttpConn *newConn = createConn();
-		if(newConn == NULL)
+		reset();
+		ops = other.ops;
+		fn = other.fn;
+		if(ops != NULL)
 		{
-			break;
+			ops->relocate(other.storage, storage);
+			other.ops = NULL;
 		}
-		connections.push(newConn);
 	}
+	return *this;
 }
 
-/*
- * Builds a request string out of the method,
- * headers, and body.
- */
-string EvHttpClient::buildRequest(const string & path, 
-	const string & method, const map<string, string> & headers, 
-	const string & body)
+RequestCallback & RequestCallback::operator=(EvHttpClientCallback cb)
 {
-	stringstream request;
-	string realMethod(method);
-	transform(realMethod.begin(), realMethod.end(), realMethod.begin(), ::toupper);
-	string realPath;
-	if(path.size() == 0)
-	{
-		realPath = url.path() + "?" + url.query();
-	}
-	else
-	{
-		realPath = path;
-	}
-	request << realMethod << " " << realPath << " HTTP/1.1\r\n";
-	
-	for(map<string, string>::const_iterator iter = headers.begin(); iter != headers.end(); ++iter)
+	reset();
+	fn = cb;
+	return *this;
+}
+
+void RequestCallback::operator()(ResponseInfo *response, void *requestData,
+	void *clientData)
+{
+	if(ops != NULL)
 	{
-		request << iter->first << ": " << iter->second << "\r\n";
+		ops->call(storage, response);
 	}
-	
-	if(headers.find("Host") == headers.end())
+	else if(fn != NULL)
 	{
-		request << "Host: " << url.host();
-		short port = url.port();
-		if(port != 80 && port != 443)
-		{
-			request << ":" << port;
-		}
-		request << "\r\n";
+		fn(response, requestData, clientData);
 	}
-	
-	if(body.size() > 0 && headers.find("Content-Length") == headers.end())
+}
+
+void RequestCallback::reset()
+{
+	if(ops != NULL)
 	{
-		request << "Content-Length: " << body.size() << "\r\n";
+		ops->destroy(storage);
+		ops = NULL;
 	}
-	
-	request << "\r\n" << body;
-
-  return request.str();
+	fn = NULL;
 }
 
 
@@ -657,6 +3890,44 @@ string EvHttpClient::buildRequest(const string & path,
 RequestInfo::RequestInfo(EvHttpClient *client)
 {
 	this->client = client;
+	ev_timer_init(&hedgeTimer, hedgeCbWrapper, 0., 0.);
+	hedgeTimer.data = (void *) this;
+	ev_timer_init(&retryTimer, retryCbWrapper, 0., 0.);
+	retryTimer.data = (void *) this;
+	reset();
+}
+
+/*
+ * Resetter used when the request is returned to
+ * the client's freelist. Keeps requestString's
+ * capacity.
+ */
+void RequestInfo::reset()
+{
+	response = NULL;
+	conn = NULL;
+	cb.reset();
+	requestString.clear();
+	data = NULL;
+	cacheState = CACHE_BYPASS;
+	cacheKey.clear();
+	cacheHit = false;
+	coalesceKey.clear();
+	coalesceLeader = false;
+	leader = NULL;
+	waiters = NULL;
+	prevWaiter = NULL;
+	nextWaiter = NULL;
+	active = false;
+	cancelled = false;
+	prevActive = NULL;
+	nextActive = NULL;
+	hedge = NULL;
+	hedgeOf = NULL;
+	attempts = 1;
+	probe = false;
+	unresolved = false;
+	untimed = false;
 }
 
 /*
@@ -667,6 +3938,22 @@ void RequestInfo::timeoutCb(struct ev_loop *loop, struct ev_timer *timer, int re
 	client->timeoutCb(loop, timer, revents);
 }
 
+/*
+ * Hedge callback defers to client.
+ */
+void RequestInfo::hedgeCb(struct ev_loop *loop, struct ev_timer *timer, int revents)
+{
+	client->hedgeCb(loop, timer, revents);
+}
+
+/*
+ * Retry callback defers to client.
+ */
+void RequestInfo::retryCb(struct ev_loop *loop, struct ev_timer *timer, int revents)
+{
+	client->retryCb(loop, timer, revents);
+}
+
 
 /*********************
 * HttpConn (public)  *
@@ -685,18 +3972,24 @@ HttpConn::HttpConn(EvHttpClient *client)
 	
 	requestBytesSent = 0;
 
-	headerField = "";
-	headerValue = "";
-	body = "";
-
 	http_parser_init(&parser, HTTP_RESPONSE);
 	parser.data = (void *) this;
 	headerState = HEADER_STATE_FIELD;
+	headerOpen = false;
+	skipHeader = false;
 
 	messageBegun = false;
 	messageComplete = false;
 	responseSent = false;
 	isNew = true;
+	idleDeadline = 0;
+
+	connecting = false;
+	raceFd = -1;
+	ev_io_init(&raceWatcher, raceCbWrapper, -1, EV_WRITE);
+	raceWatcher.data = (void *) this;
+	ev_timer_init(&raceTimer, raceTimerCbWrapper, 0., 0.);
+	raceTimer.data = (void *) this;
 }
 
 /*
@@ -707,9 +4000,8 @@ void HttpConn::resetState()
 {
 	if(request != NULL)
 	{
-		delete request->response;
+		client->freeRequest(request);
 	}
-	delete request;
 	request = NULL;
 
 	requestBytesSent = 0;
@@ -718,15 +4010,34 @@ void HttpConn::resetState()
 	parser.data = (void *) this;
 	
 	headerState = HEADER_STATE_FIELD;
-	
-	headerField = "";
-	headerValue = "";
-	body = "";
+	headerOpen = false;
+	skipHeader = false;
 	
 	messageBegun = false;
 	messageComplete = false;
 	responseSent = false;
 	isNew = false;
+	idleDeadline = 0;
+}
+
+/*
+ * Cheap readiness check for an idle connection. Peeks
+ * at the socket without blocking: pending EOF, a reset,
+ * a failed connect, or unsolicited data (e.g. a 408 sent
+ * before the server closed) all mean the connection
+ * can't be reused. A connection with nothing to read
+ * (including one still connecting) is alive.
+ */
+bool HttpConn::isAlive()
+{
+	char c;
+	int received = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+	if(received < 0)
+	{
+		return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+	}
+
+	return false;
 }
 
 /*
@@ -737,6 +4048,19 @@ void HttpConn::writeCb(struct ev_loop *loop, struct ev_io *watcher, int revents)
 	client->writeCb(loop, watcher, revents);
 }
 
+/*
+ * Racing callbacks defer to client's callbacks.
+ */
+void HttpConn::raceCb(struct ev_loop *loop, struct ev_io *watcher, int revents)
+{
+	client->raceCb(this);
+}
+
+void HttpConn::raceTimerCb(struct ev_loop *loop, struct ev_timer *timer, int revents)
+{
+	client->raceTimerCb(this);
+}
+
 /*
  * Read callback defers to client's callback.
  */
@@ -766,19 +4090,48 @@ int HttpConn::messageBeginCb(http_parser *parser)
 	return 0;
 }
 
+/*
+ * Header names and values are appended straight from
+ * the parser's buffer to the response's header block;
+ * the current header is the last span.
+ *
+ * Called once the current header's name is complete.
+ * Headers the client isn't capturing are dropped here,
+ * and their values are then skipped without copying.
+ * Records well-known headers in their slots (the first
+ * occurrence wins).
+ */
+void HttpConn::endHeaderName()
+{
+	ResponseInfo *response = request->response;
+	size_t i = response->headerSpans.size() - 1;
+	std::string_view name = response->headerName(i);
+	HttpHeaderId id = classifyHeader(name);
+	if(!client->captureHeader(id, name))
+	{
+		response->headerBlock.resize(response->headerSpans[i].name);
+		response->headerSpans.pop_back();
+		skipHeader = true;
+		return;
+	}
+
+	if(id != HEADER_UNKNOWN && response->wellKnown[id] < 0)
+	{
+		response->wellKnown[id] = i;
+	}
+}
+
 void HttpConn::flushHeaders()
 {
-	request->response->headers[headerField] = headerValue;
-	headerField = "";
-	headerValue = "";
+	if(headerOpen && headerState == HEADER_STATE_FIELD)
+	{
+		endHeaderName();
+	}
+	headerOpen = false;
 }
 
 int HttpConn::headerFieldCb(http_parser *parser, const char *at, size_t len)
 {
-	char buffer[len + 1];
-	strncpy(buffer, at, len);
-	buffer[len] = 0;
-	
 	if(headerState == HEADER_STATE_DONE)
 	{
 		cout << "Header field received when headers were done." << endl;
@@ -790,71 +4143,206 @@ int HttpConn::headerFieldCb(http_parser *parser, const char *at, size_t len)
 		flushHeaders();
 		headerState = HEADER_STATE_FIELD;
 	}
+
+	ResponseInfo *response = request->response;
+	if(!headerOpen)
+	{
+		skipHeader = false;
+		ResponseInfo::HeaderSpan span;
+		span.name = response->headerBlock.size();
+		span.nameLen = 0;
+		span.value = span.name;
+		span.valueLen = 0;
+		response->headerSpans.push_back(span);
+		headerOpen = true;
+	}
 	
-	headerField += buffer;
+	response->headerBlock.append(at, len);
+	response->headerSpans.back().nameLen += len;
 	return 0;
 }
 
 int HttpConn::headerValueCb(http_parser *parser, const char *at, size_t len)
 {
-	char buffer[len + 1];
-	strncpy(buffer, at, len);
-	buffer[len] = 0;
-	
 	if(headerState == HEADER_STATE_DONE)
 	{
 		cout << "Header value received when headers were done." << endl;
 		return 1;
 	}
+
+	ResponseInfo *response = request->response;
+	if(!headerOpen)
+	{
+		cout << "Header value received without a header field." << endl;
+		return 1;
+	}
+
+	if(headerState == HEADER_STATE_FIELD)
+	{
+		endHeaderName();
+		if(!skipHeader)
+		{
+			response->headerSpans.back().value = response->headerBlock.size();
+		}
+	}
 	
 	headerState = HEADER_STATE_VALUE;
-	headerValue += buffer;
+	if(skipHeader)
+	{
+		return 0;
+	}
+
+	response->headerBlock.append(at, len);
+	response->headerSpans.back().valueLen += len;
 	return 0;
 }
 
 int HttpConn::headersCompleteCb(http_parser *parser)
 {
-	headerState = HEADER_STATE_DONE;
 	flushHeaders();
+	headerState = HEADER_STATE_DONE;
+
+	if(parser->content_length != ULLONG_MAX &&
+		parser->content_length <= ARENA_MAX_RESERVE)
+	{
+		request->response->response.reserve(parser->content_length);
+	}
 	return 0;
 }
 
 int HttpConn::bodyCb(http_parser *parser, const char *at, size_t len)
 {
-	char buffer[len + 1];
-	strncpy(buffer, at, len);
-	buffer[len] = 0;
-	body += buffer;
+	request->response->response.append(at, len);
 	return 0;
 }
 
 int HttpConn::messageCompleteCb(http_parser *parser)
 {
+	if(request->hedgeOf != NULL)
+	{
+		request = client->hedgeWon(request);
+	}
+
+	request->response->code = parser->status_code;
+	double delay;
+	if(client->retryStatus(request, &delay))
+	{
+		client->scheduleRetry(detachForResend(keepAlive(parser)), delay);
+		return 0;
+	}
+
+	// Before the cache replaces a 304's headers with the
+	// stored response's.
+	bool reuse = keepAlive(parser);
+	if(!client->cacheResponse(request))
+	{
+		client->resendUnconditional(detachForResend(reuse));
+		return 0;
+	}
+
 	ev_timer_stop(client->loop, &request->timer);
 
 	messageComplete = true;
-	request->response->response = body;
 
 	request->response->timeout = false;
-	request->response->code = parser->status_code;
 
 	struct timeval tv;
 	gettimeofday(&tv, NULL);
 	long diff = difftime(&tv, &request->start);
 	request->response->latency = diff / 1000000.;
+	client->requestFinished(request->response->latency);
+
+	client->breakerRecord(request, client->breakerPolicy.countServerErrors &&
+		request->response->code >= 500);
 
-	request->cb(request->response, request->data, request->client->data);
+	client->unregisterLeader(request);
+	client->dropHedge(request);
+	client->unlinkActive(request);
+
+	if(!request->cancelled)
+	{
+		request->cb(request->response, request->data, request->client->data);
+	}
+	client->completeWaiters(request, request->response);
 	responseSent = true;
 	
-	delete request->response;
-	delete request;
+	client->freeRequest(request);
 	request = NULL;
 	
-	client->returnConn(this);
+	if(reuse)
+	{
+		client->returnConn(this);
+	}
+	else
+	{
+		client->destroyConn(this);
+	}
 	
 	return 0;
 }
 
+/*
+ * Whether the connection can be reused after this
+ * response, judging by the Connection header (HTTP/1.1
+ * defaults to keep-alive, HTTP/1.0 to close). Also
+ * notes any idle timeout advertised in Keep-Alive, so
+ * the pool can retire the connection before the server
+ * does.
+ */
+bool HttpConn::keepAlive(http_parser *parser)
+{
+	ResponseInfo *response = request->response;
+	std::string_view connection = response->getHeader(HEADER_CONNECTION);
+
+	bool reuse;
+	if(parser->http_major > 1 || (parser->http_major == 1 && parser->http_minor >= 1))
+	{
+		reuse = !headerHasToken(connection, "close");
+	}
+	else
+	{
+		reuse = headerHasToken(connection, "keep-alive");
+	}
+
+	idleDeadline = 0;
+	std::string_view timeout = headerParam(response->getHeader(HEADER_KEEP_ALIVE),
+		"timeout");
+	if(reuse && !timeout.empty())
+	{
+		int seconds = 0;
+		std::from_chars(timeout.data(), timeout.data() + timeout.size(), seconds);
+		if(seconds > 0)
+		{
+			idleDeadline = ev_now(client->loop) + seconds -
+				min(KEEP_ALIVE_MARGIN, seconds / 2.);
+		}
+	}
+
+	return reuse;
+}
+
+/*
+ * Gives up the connection after a complete response
+ * that won't be passed on, returning it to the pool if
+ * reuse is set, and returns its request to be sent
+ * again.
+ */
+RequestInfo *HttpConn::detachForResend(bool reuse)
+{
+	RequestInfo *resent = request;
+	resent->conn = NULL;
+	request = NULL;
+	if(reuse)
+	{
+		client->returnConn(this);
+	}
+	else
+	{
+		client->destroyConn(this);
+	}
+	return resent;
+}
+
 
 /*************
 * Callbacks  *
@@ -871,12 +4359,48 @@ static void readCbWrapper(struct ev_loop *loop, struct ev_io *watcher, int reven
 	conn->readCb(loop, watcher, revents);
 }
 
+static void raceCbWrapper(struct ev_loop *loop, struct ev_io *watcher, int revents)
+{
+	HttpConn *conn = (HttpConn *) watcher->data;
+	conn->raceCb(loop, watcher, revents);
+}
+
+static void raceTimerCbWrapper(struct ev_loop *loop, struct ev_timer *timer, int revents)
+{
+	HttpConn *conn = (HttpConn *) timer->data;
+	conn->raceTimerCb(loop, timer, revents);
+}
+
 static void timeoutCbWrapper(struct ev_loop *loop, struct ev_timer *timer, int revents)
 {
 	RequestInfo *request = (RequestInfo *) timer->data;
 	request->timeoutCb(loop, timer, revents);
 }
 
+static void hedgeCbWrapper(struct ev_loop *loop, struct ev_timer *timer, int revents)
+{
+	RequestInfo *request = (RequestInfo *) timer->data;
+	request->hedgeCb(loop, timer, revents);
+}
+
+static void retryCbWrapper(struct ev_loop *loop, struct ev_timer *timer, int revents)
+{
+	RequestInfo *request = (RequestInfo *) timer->data;
+	request->retryCb(loop, timer, revents);
+}
+
+void EvHttpClient::autoscaleCbWrapper(struct ev_loop *loop, struct ev_timer *timer, int revents)
+{
+	EvHttpClient *client = (EvHttpClient *) timer->data;
+	client->autoscaleCb(loop, timer, revents);
+}
+
+void EvHttpClient::cacheCbWrapper(struct ev_loop *loop, struct ev_timer *timer, int revents)
+{
+	EvHttpClient *client = (EvHttpClient *) timer->data;
+	client->cacheCb(loop, timer, revents);
+}
+
 static int messageBeginCb(http_parser *parser)
 {
 	HttpConn *conn = (HttpConn *) parser->data;
@@ -3,7 +3,8 @@
 * ------------
 * Http client which uses the libev event loop.
 *
-* Currently not thread-safe.
+* Not thread-safe, except for the submit functions,
+* which may be called from any thread.
 *
 */
 
@@ -11,8 +12,19 @@
 #define EVHTTPCLIENT_H_
 
 #include <queue>
+#include <vector>
 #include <map>
 #include <string>
+#include <string_view>
+#include <utility>
+#include <initializer_list>
+#include <functional>
+#include <type_traits>
+#include <new>
+#include <cstddef>
+#include <memory_resource>
+#include <random>
+#include <atomic>
 #include <iostream>
 #include <sstream>
 #include <arpa/inet.h>
@@ -20,15 +32,135 @@
 #include <ev.h>
 #include "url.h"
 #include "http_parser.h"
+#include "asyncresolver.h"
 
 #define DEFAULT_BLOCK_SIZE (1024)
 #define DEFAULT_INIT_NUM_CONNS (100)
 
+#define DEFAULT_ARENA_CHUNK_SIZE (4096)
+
+#define CALLBACK_INLINE_SIZE (48)
+
+#define DEFAULT_AUTOSCALE_MIN_CONNS (1)
+#define DEFAULT_AUTOSCALE_MAX_CONNS (1000)
+#define DEFAULT_AUTOSCALE_HEADROOM (1.5)
+#define DEFAULT_AUTOSCALE_INTERVAL (1.0)
+
+#define DEFAULT_HEDGE_MAX_RATE (0.05)
+
+#define DEFAULT_RETRY_MAX_ATTEMPTS (3)
+#define DEFAULT_RETRY_BASE_BACKOFF (0.05)
+#define DEFAULT_RETRY_MAX_BACKOFF (1.0)
+#define DEFAULT_RETRY_BUDGET_RATIO (0.1)
+#define DEFAULT_RETRY_BUDGET_BURST (10.0)
+
+#define DEFAULT_BREAKER_WINDOW (10.0)
+#define DEFAULT_BREAKER_MIN_REQUESTS (20)
+#define DEFAULT_BREAKER_FAILURE_RATIO (0.5)
+#define DEFAULT_BREAKER_OPEN_TIME (5.0)
+#define DEFAULT_BREAKER_PROBES (1)
+#define BREAKER_BUCKETS (10)
+
+#define HAPPY_EYEBALLS_DELAY (0.25)
+
+/*
+ * Returned by the request functions instead of -1 when
+ * the circuit breaker is open (see setCircuitBreaker).
+ */
+#define EVHTTPCLIENT_BREAKER_OPEN (-2)
+
 using namespace std;
 
 /* Forward decs */
 class HttpConn;
 class RequestInfo;
+class EvHttpClient;
+class ResponseCache;
+class CacheEntry;
+
+/*
+ * Response headers the client recognizes while parsing.
+ * Their values can be read in O(1) via
+ * ResponseInfo::getHeader(HttpHeaderId), and the client
+ * uses them for its own decisions (e.g. keep-alive).
+ */
+enum HttpHeaderId
+{
+	HEADER_CONTENT_LENGTH,
+	HEADER_CONTENT_TYPE,
+	HEADER_CONTENT_ENCODING,
+	HEADER_TRANSFER_ENCODING,
+	HEADER_CONNECTION,
+	HEADER_KEEP_ALIVE,
+	HEADER_ETAG,
+	HEADER_LAST_MODIFIED,
+	HEADER_CACHE_CONTROL,
+	HEADER_EXPIRES,
+	HEADER_DATE,
+	HEADER_AGE,
+	HEADER_VARY,
+	HEADER_RETRY_AFTER,
+	HEADER_LOCATION,
+	NUM_WELL_KNOWN_HEADERS,
+	HEADER_UNKNOWN = NUM_WELL_KNOWN_HEADERS
+};
+
+/*
+ * Which response headers an EvHttpClient stores.
+ * See EvHttpClient::setHeaderCapture.
+ */
+enum HeaderCapture
+{
+	CAPTURE_ALL_HEADERS,
+	CAPTURE_SELECTED_HEADERS,
+	CAPTURE_NO_HEADERS
+};
+
+/*
+ * Maps a header name (any case) to its HttpHeaderId,
+ * or HEADER_UNKNOWN. Uses a perfect hash on the name's
+ * length and first and last characters, followed by
+ * a single comparison.
+ */
+HttpHeaderId classifyHeader(std::string_view name);
+
+/*
+ * Bump allocator backing all storage of a single
+ * response. Allocations are carved out of one chunk;
+ * anything that doesn't fit gets its own overflow
+ * block. Deallocation is a no-op: everything is
+ * released at once by reset, which also resizes the
+ * chunk for the next response.
+ */
+class ResponseArena : public std::pmr::memory_resource
+{
+	public:
+		ResponseArena(size_t chunkSize = DEFAULT_ARENA_CHUNK_SIZE);
+		~ResponseArena();
+
+		/*
+		 * Releases every allocation. The chunk is resized
+		 * to nextChunkSize if it is off by more than a factor
+		 * of two; otherwise it is kept as is.
+		 */
+		void reset(size_t nextChunkSize);
+
+		/*
+		 * Number of bytes handed out since the last reset.
+		 */
+		size_t bytesUsed() const;
+
+	private:
+		char *chunk;
+		size_t chunkSize;
+		size_t chunkUsed;
+		vector<void *> overflow;
+		size_t overflowUsed;
+
+		void *do_allocate(size_t bytes, size_t alignment);
+		void do_deallocate(void *p, size_t bytes, size_t alignment);
+		bool do_is_equal(const std::pmr::memory_resource & other) const noexcept;
+};
 
 /*
  * Information about an HTTP response. Passed back to
@@ -36,15 +168,259 @@ class RequestInfo;
  * true, this means the request timed out, and the other
  * fields of this class are more or less meaningless
  * EXCEPT latency.
+ *
+ * Headers and body live in the response's arena and
+ * are only valid until the callback returns.
+ *
+ * Headers are stored flat, in the order received, as
+ * (name, value) spans over a single header block.
+ * Lookups by name are case-insensitive. Repeated
+ * headers are all kept; getHeader returns the first.
  */
 class ResponseInfo
 {
+	friend class HttpConn;
+	friend class EvHttpClient;
+	friend class ResponseCache;
+	friend class CacheEntry;
+
 	public:
+		typedef std::pmr::map<std::pmr::string, std::pmr::string> HeaderMap;
+
+		ResponseArena arena;
+
 		bool timeout;
 		short code;
 		double latency;
-		map<string, string> headers;
-		string response;
+		std::pmr::string response;
+
+		ResponseInfo();
+		void reset(size_t nextChunkSize = DEFAULT_ARENA_CHUNK_SIZE);
+
+		/*
+		 * Header access. headerName and headerValue take an
+		 * index below headerCount. getHeader returns an empty
+		 * view if the header is absent; use hasHeader to tell
+		 * an absent header from an empty one.
+		 */
+		size_t headerCount() const;
+		std::string_view headerName(size_t i) const;
+		std::string_view headerValue(size_t i) const;
+		std::string_view getHeader(std::string_view name) const;
+		bool hasHeader(std::string_view name) const;
+
+		/*
+		 * O(1) access to well-known headers, which are
+		 * classified as they are parsed.
+		 */
+		std::string_view getHeader(HttpHeaderId id) const;
+		bool hasHeader(HttpHeaderId id) const;
+
+		/*
+		 * Compatibility view of the headers as a map. Built
+		 * (in the arena) on first use only. If a header is
+		 * repeated, the map holds the last value.
+		 */
+		const HeaderMap & headerMap();
+
+	private:
+		struct HeaderSpan
+		{
+			uint32_t name;
+			uint32_t nameLen;
+			uint32_t value;
+			uint32_t valueLen;
+		};
+
+		std::pmr::string headerBlock;
+		std::pmr::vector<HeaderSpan> headerSpans;
+		HeaderMap compatHeaders;
+		bool compatBuilt;
+		short wellKnown[NUM_WELL_KNOWN_HEADERS];
+		int holds;
+		bool released;
+
+		int findHeader(std::string_view name) const;
+};
+
+/*
+ * Snapshot of a client's connection pool sizing, as
+ * returned by EvHttpClient::getPoolReport.
+ *
+ * rate is the observed request rate (requests/second),
+ * latency the observed mean latency (seconds), and
+ * concurrency their product (Little's law). target is
+ * the pool size the client is steering towards, and
+ * reason says why it was chosen. evicted counts pooled
+ * connections found dead before reuse.
+ */
+class PoolReport
+{
+	public:
+		bool autoscale;
+		int target;
+		int idle;
+		int outstanding;
+		int total;
+		long evicted;
+		double rate;
+		double latency;
+		double concurrency;
+		string reason;
+};
+
+/*
+ * State of a client's request hedging, as returned by
+ * EvHttpClient::getHedgeReport.
+ *
+ * delay is the current hedge delay (seconds), taken from
+ * the latency percentile once enough samples are in.
+ * sent counts hedges sent, won those whose response
+ * arrived first, and suppressed those withheld because
+ * the hedge rate cap was reached.
+ */
+class HedgeReport
+{
+	public:
+		bool enabled;
+		double delay;
+		long sent;
+		long won;
+		long suppressed;
+};
+
+/*
+ * When a client sends a failed request again; see
+ * EvHttpClient::setRetryPolicy. The defaults retry
+ * idempotent requests on pooled connections that the
+ * server had closed, and on 503 Service Unavailable.
+ *
+ * maxAttempts counts the first attempt, so 1 disables
+ * retries. Retries after a closed pooled connection go
+ * out at once; others wait a random time between 0 and
+ * baseBackoff * 2^(retry - 1), capped at maxBackoff, or
+ * as long as Retry-After asks if useRetryAfter is set.
+ * A retry that would end after the request's timeout is
+ * not made.
+ *
+ * Retries are also capped at budgetRatio times the
+ * number of requests, plus a burst of budgetBurst.
+ *
+ * idempotentMethods are those safe to send twice. Only
+ * their requests are retried, or hedged (see
+ * EvHttpClient::setHedging).
+ */
+class RetryPolicy
+{
+	public:
+		RetryPolicy();
+
+		int maxAttempts;
+		bool retryClosedConnections;
+		bool retryConnectFailures;
+		vector<short> retryStatuses;
+		bool useRetryAfter;
+		vector<string> idempotentMethods;
+		double baseBackoff;
+		double maxBackoff;
+		double budgetRatio;
+		double budgetBurst;
+};
+
+/*
+ * Retry counters, as returned by
+ * EvHttpClient::getRetryReport. exhausted counts
+ * requests that failed after maxAttempts or whose next
+ * retry would have passed their timeout, and overBudget
+ * those refused a retry by the budget.
+ */
+class RetryReport
+{
+	public:
+		long retries;
+		long exhausted;
+		long overBudget;
+};
+
+/*
+ * When a client's circuit breaker trips; see
+ * EvHttpClient::setCircuitBreaker.
+ *
+ * The breaker opens when, over the last window seconds,
+ * at least minRequests requests finished and at least
+ * failureRatio of them failed (connection errors and
+ * timeouts, and 5xx responses if countServerErrors is
+ * set). After openTime seconds it lets up to probes
+ * requests through; if they succeed it closes, and if
+ * any fails it opens again.
+ */
+class BreakerPolicy
+{
+	public:
+		BreakerPolicy();
+
+		double window;
+		long minRequests;
+		double failureRatio;
+		bool countServerErrors;
+		double openTime;
+		int probes;
+};
+
+enum BreakerState
+{
+	BREAKER_CLOSED,
+	BREAKER_OPEN,
+	BREAKER_HALF_OPEN
+};
+
+/*
+ * State of a client's circuit breaker, as returned by
+ * EvHttpClient::getBreakerReport. since is the (ev_now)
+ * time of the last transition, and transitions counts
+ * them. requests and failures cover the current window.
+ * rejected counts requests refused while open.
+ */
+class BreakerReport
+{
+	public:
+		bool enabled;
+		BreakerState state;
+		double since;
+		long transitions;
+		long requests;
+		long failures;
+		long rejected;
+};
+
+/*
+ * Counters for a client's response cache, as returned
+ * by EvHttpClient::getCacheStats.
+ *
+ * hits were answered from the cache without contacting
+ * the server, and revalidated were answered from it after
+ * the server replied 304 Not Modified. misses include
+ * those revalidations. bytes is the memory the cache
+ * accounts for, out of maxBytes.
+ *
+ * With a cache file, fileHits counts entries loaded from
+ * it into memory, and fileEntries and fileBytes what it
+ * currently holds.
+ */
+class CacheStats
+{
+	public:
+		long hits;
+		long misses;
+		long revalidated;
+		long stores;
+		long evictions;
+		size_t entries;
+		size_t bytes;
+		size_t maxBytes;
+		long fileHits;
+		size_t fileEntries;
+		size_t fileBytes;
 };
 
 /*
@@ -62,6 +438,194 @@ class ResponseInfo
  */
 typedef void (*EvHttpClientCallback) (ResponseInfo *, void *, void *);
 
+/*
+ * A borrowed request header (name, value). The strings
+ * only need to live until the request function returns.
+ */
+typedef std::pair<std::string_view, std::string_view> HeaderPair;
+
+/*
+ * Constrains the string arguments (path, method, body)
+ * of request functions taking a braced header list to
+ * types convertible to string_view. Deducing their exact
+ * types keeps a call such as
+ *
+ * client.makeGet(cb, path, {{"Accept", "text/plain"}}, data);
+ *
+ * with a std::string path from being ambiguous with the
+ * map-based form, which takes const string &.
+ */
+template <class... Strings>
+using EnableIfStringArgs = std::enable_if_t<
+	(std::is_convertible_v<const Strings &, std::string_view> && ...)>;
+
+/*
+ * True for callables that can be used as request
+ * callbacks: those invocable with a ResponseInfo *.
+ */
+template <class F>
+inline constexpr bool IsResponseHandler = std::is_invocable_v<F &, ResponseInfo *>;
+
+template <class F>
+using EnableIfResponseHandler = std::enable_if_t<IsResponseHandler<F>>;
+
+/*
+ * The callback of a request: either an
+ * EvHttpClientCallback, or any callable taking a
+ * ResponseInfo * (NULL on error), such as a lambda with
+ * captures. A callable of up to CALLBACK_INLINE_SIZE
+ * bytes is stored inline, so a request made with one
+ * allocates nothing; a larger one is moved to the heap.
+ *
+ * Move-only. Calling an empty RequestCallback does
+ * nothing.
+ */
+class RequestCallback
+{
+	public:
+		RequestCallback();
+		RequestCallback(EvHttpClientCallback cb);
+		RequestCallback(RequestCallback && other);
+		RequestCallback(const RequestCallback &) = delete;
+		~RequestCallback();
+
+		template <class F, class = EnableIfResponseHandler<F>>
+		RequestCallback(F && f);
+
+		RequestCallback & operator=(RequestCallback && other);
+		RequestCallback & operator=(EvHttpClientCallback cb);
+
+		/*
+		 * Calls the callback. The data pointers are only
+		 * passed on to an EvHttpClientCallback.
+		 */
+		void operator()(ResponseInfo *response, void *requestData, void *clientData);
+
+		/*
+		 * Destroys the stored callable, if any.
+		 */
+		void reset();
+
+	private:
+		/*
+		 * What the type of the stored callable provides:
+		 * calling it, moving it to other storage (leaving
+		 * the original destroyed), and destroying it.
+		 */
+		class Ops
+		{
+			public:
+				void (*call)(void *storage, ResponseInfo *response);
+				void (*relocate)(void *from, void *to);
+				void (*destroy)(void *storage);
+		};
+
+		template <class F>
+		static constexpr bool storedInline = sizeof(F) <= CALLBACK_INLINE_SIZE &&
+			alignof(F) <= alignof(std::max_align_t) &&
+			std::is_nothrow_move_constructible_v<F>;
+
+		template <class F>
+		static const Ops inlineOps;
+
+		template <class F>
+		static const Ops heapOps;
+
+		const Ops *ops;
+		EvHttpClientCallback fn;
+		alignas(std::max_align_t) unsigned char storage[CALLBACK_INLINE_SIZE];
+};
+
+template <class F, class>
+RequestCallback::RequestCallback(F && f)
+{
+	typedef std::decay_t<F> Callable;
+	fn = NULL;
+	if constexpr (storedInline<Callable>)
+	{
+		new (storage) Callable(std::forward<F>(f));
+		ops = &inlineOps<Callable>;
+	}
+	else
+	{
+		*(Callable **) storage = new Callable(std::forward<F>(f));
+		ops = &heapOps<Callable>;
+	}
+}
+
+template <class F>
+const RequestCallback::Ops RequestCallback::inlineOps =
+{
+	[](void *storage, ResponseInfo *response)
+	{
+		(*(F *) storage)(response);
+	},
+	[](void *from, void *to)
+	{
+		new (to) F(std::move(*(F *) from));
+		((F *) from)->~F();
+	},
+	[](void *storage)
+	{
+		((F *) storage)->~F();
+	}
+};
+
+template <class F>
+const RequestCallback::Ops RequestCallback::heapOps =
+{
+	[](void *storage, ResponseInfo *response)
+	{
+		(**(F **) storage)(response);
+	},
+	[](void *from, void *to)
+	{
+		*(F **) to = *(F **) from;
+	},
+	[](void *storage)
+	{
+		delete *(F **) storage;
+	}
+};
+
+
+/*
+ * A precompiled request for an EvHttpClient. The
+ * request line up to the path suffix, and the header
+ * lines (fixed headers, the client's default headers
+ * and Host), are serialized once when the template is
+ * created. Each request made from it only copies in
+ * the path suffix, the values of the slot headers and
+ * the body.
+ *
+ * If pathPrefix is empty, the client's default path is
+ * used. slotHeaders names headers whose values are
+ * supplied per request, in this order. A request made
+ * from a template is byte for byte the one the other
+ * request functions make given the fixed headers (in
+ * map order) followed by the slot headers.
+ *
+ * Changing the client's default headers afterwards does
+ * not affect existing templates.
+ */
+class RequestTemplate
+{
+	friend class EvHttpClient;
+
+	public:
+		RequestTemplate(EvHttpClient *client, const string & method,
+			const string & pathPrefix, const map<string, string> & headers,
+			const vector<string> & slotHeaders = vector<string>());
+
+		size_t numSlots() const;
+
+	private:
+		string requestLine;
+		string headerBlock;
+		string defaultBlock;
+		vector<string> slotPrefixes;
+		bool fixedContentLength;
+};
 
 /*
  * An HTTP client. Uses a pool of HttpConn objects
@@ -71,6 +635,8 @@ class EvHttpClient
 {
 	friend class HttpConn;
 	friend class RequestInfo;
+	friend class RequestTemplate;
+	friend class RequestGroup;
 
 	public:
 		/*
@@ -107,10 +673,40 @@ class EvHttpClient
 		 *
 		 * The block_size parameter specifies how many bytes
 		 * this client tries to receive on each call to recv.
+		 *
+		 * The host name is resolved in the background by
+		 * resolver, which several clients may share; if it is
+		 * NULL the client uses the one shared by all such
+		 * clients on its loop (see AsyncResolver::acquire).
+		 * Requests made before the name is resolved wait for
+		 * it (within their timeout). The name is looked up
+		 * again when its TTL runs out: new connections use
+		 * the new addresses, and connections to addresses
+		 * that have gone are closed once their requests
+		 * finish.
+		 *
+		 * Names may resolve to IPv6 and IPv4 addresses (and
+		 * the URL may give an IPv6 literal in brackets, as in
+		 * http://[::1]:8080/). New connections race the two
+		 * families as in RFC 8305 ("Happy Eyeballs"): the
+		 * family that last won is tried first, and an address
+		 * of the other family is tried too if the first has
+		 * not connected within HAPPY_EYEBALLS_DELAY. So an
+		 * unreachable family costs that delay, not a timeout.
 		 */
 		EvHttpClient(struct ev_loop *loop, const string & url,
 			double timeout, void *data, int init_num_conns = DEFAULT_INIT_NUM_CONNS,
-			int block_size = DEFAULT_BLOCK_SIZE);
+			int block_size = DEFAULT_BLOCK_SIZE, AsyncResolver *resolver = NULL);
+
+		/*
+		 * Requests still outstanding when the client is
+		 * destroyed fail: each gets its callback with a NULL
+		 * response, as for any failed request, unless it was
+		 * cancelled. That includes requests in flight, those
+		 * waiting for the host name, cache hits not yet
+		 * delivered and submissions still queued. These
+		 * callbacks must not use the client.
+		 */
 		~EvHttpClient();
 
 		/*
@@ -123,6 +719,187 @@ class EvHttpClient
 		 * infinite timeout will be used.
 		 */
 		void setTimeout(double seconds);
+
+		/*
+		 * Set headers sent with every request, unless the
+		 * request sets a header of the same name itself.
+		 */
+		void setDefaultHeaders(const map<string, string> & headers);
+
+		/*
+		 * Enable or disable pool autoscaling.
+		 *
+		 * When enabled, the client measures its request rate
+		 * and latency every interval seconds and sizes the pool
+		 * to rate * latency (the expected number of concurrent
+		 * requests) times headroom, clamped to
+		 * [min_conns, max_conns]. The pool grows as soon as
+		 * demand rises, but idle surplus is only closed after
+		 * it has persisted for several intervals, so short lulls
+		 * do not cause connection churn.
+		 *
+		 * The init_num_conns constructor parameter still sets
+		 * the initial pool size.
+		 */
+		void setAutoscale(bool enabled,
+			int min_conns = DEFAULT_AUTOSCALE_MIN_CONNS,
+			int max_conns = DEFAULT_AUTOSCALE_MAX_CONNS,
+			double headroom = DEFAULT_AUTOSCALE_HEADROOM,
+			double interval = DEFAULT_AUTOSCALE_INTERVAL);
+
+		/*
+		 * Returns the current pool size target and the
+		 * measurements it was derived from.
+		 */
+		PoolReport getPoolReport();
+
+		/*
+		 * Choose which response headers are stored in
+		 * ResponseInfo. By default all are. With
+		 * CAPTURE_SELECTED_HEADERS only the named headers
+		 * (any case) are kept; with CAPTURE_NO_HEADERS none
+		 * are. Values of headers that aren't kept are
+		 * skipped by the parser without being copied.
+		 *
+		 * Headers the client relies on itself (Connection and
+		 * Keep-Alive, plus the caching headers while a cache
+		 * is enabled) are always kept.
+		 */
+		void setHeaderCapture(HeaderCapture mode,
+			const vector<string> & names = vector<string>());
+
+		/*
+		 * Enable an in-memory LRU cache of GET responses
+		 * holding at most max_bytes; 0 disables it and drops
+		 * its contents.
+		 *
+		 * Responses are keyed on path and the values of the
+		 * request headers named in key_headers, and are kept
+		 * as HTTP caching allows (Cache-Control max-age,
+		 * no-store and no-cache, Expires, Vary). A request
+		 * with a fresh entry never touches a connection: its
+		 * callback runs on the next loop iteration, with the
+		 * stored status, headers and body. Stale entries are
+		 * revalidated with If-None-Match/If-Modified-Since,
+		 * and a 304 reply is delivered as the stored response.
+		 *
+		 * Other methods invalidate cached GETs of the same
+		 * path when they succeed. Requests carrying their own
+		 * conditional headers, Range, or Cache-Control:
+		 * no-store bypass the cache.
+		 */
+		void setCache(size_t max_bytes,
+			const vector<string> & key_headers = vector<string>());
+
+		/*
+		 * Enable or disable coalescing of identical GETs.
+		 *
+		 * While a GET is in flight, further GETs with the same
+		 * request string (path, headers and all) don't get a
+		 * connection of their own: they wait for the first,
+		 * and every callback receives the very same
+		 * ResponseInfo, including the first request's latency.
+		 * Each waiter keeps its own timeout; if the first
+		 * request times out or is cancelled, the connection
+		 * carries on for the others.
+		 */
+		void setCoalescing(bool enabled);
+
+		/*
+		 * Enable or disable hedging of idempotent requests,
+		 * those whose method is in the retry policy's
+		 * idempotentMethods (by default GET, HEAD, OPTIONS,
+		 * PUT, DELETE and TRACE).
+		 *
+		 * If a request has had no response after delay
+		 * seconds, a duplicate is sent on another connection.
+		 * Whichever response completes first is passed to the
+		 * callback; the other request is cancelled and its
+		 * connection closed. If percentile is between 0 and 1,
+		 * the delay instead tracks that percentile of recent
+		 * latencies (delay is used until there are enough).
+		 *
+		 * Hedges are limited to max_rate times the number of
+		 * requests (plus a small burst), so that a slow
+		 * backend doesn't get twice the load.
+		 */
+		void setHedging(bool enabled, double delay, double percentile = 0,
+			double max_rate = DEFAULT_HEDGE_MAX_RATE);
+
+		HedgeReport getHedgeReport();
+
+		/*
+		 * Replace the retry policy (see RetryPolicy).
+		 */
+		void setRetryPolicy(const RetryPolicy & policy);
+
+		const RetryPolicy & getRetryPolicy();
+		RetryReport getRetryReport();
+
+		/*
+		 * Enable or disable the circuit breaker (see
+		 * BreakerPolicy). While it is open, requests that
+		 * would need the server fail at once with
+		 * EVHTTPCLIENT_BREAKER_OPEN, without using a
+		 * connection; cache hits and coalesced requests are
+		 * still served. Enabling resets it to closed.
+		 */
+		void setCircuitBreaker(bool enabled,
+			const BreakerPolicy & policy = BreakerPolicy());
+
+		BreakerState getBreakerState();
+		BreakerReport getBreakerReport();
+
+		/*
+		 * Load figures, as used by MultiEvHttpClient to
+		 * pick an endpoint: the number of requests
+		 * outstanding, and a moving average of their
+		 * latency (timeouts count as the time waited).
+		 */
+		int getOutstanding();
+		double getLatencyEwma();
+
+		/*
+		 * Cancel every pending request made with the given
+		 * data pointer. Their callbacks will not be called.
+		 * Returns the number of requests cancelled.
+		 */
+		int cancelRequests(void *data);
+
+		/*
+		 * A response is normally recycled when its callback
+		 * returns. keepResponse, called during the callback,
+		 * keeps it until a matching releaseResponse, which
+		 * must be called on the loop thread before the client
+		 * is destroyed.
+		 */
+		void keepResponse(ResponseInfo *response);
+		void releaseResponse(ResponseInfo *response);
+
+		/*
+		 * Back the cache with a memory-mapped file at path,
+		 * of up to max_bytes (an existing larger file keeps
+		 * its size). Responses are written to it as they are
+		 * stored, and a client opening the same file later
+		 * (e.g. after a restart) serves them under the same
+		 * freshness rules. An entry read from the file is
+		 * copied into memory, and from there into each
+		 * response, like any other. When the file is full,
+		 * expired entries and then least recently used ones
+		 * are dropped from it. setCache must have been called
+		 * first.
+		 *
+		 * Only one process can use a file at a time. Returns
+		 * 0 on success, -1 on failure (including when another
+		 * process has the file open).
+		 */
+		int setCacheFile(const string & path, size_t max_bytes);
+
+		/*
+		 * Returns the cache's counters. All zero if no
+		 * cache is enabled.
+		 */
+		CacheStats getCacheStats();
 	
 		/*
 		 * Request functions
@@ -142,11 +919,13 @@ class EvHttpClient
 		 * specified (if the path is of length 0), the path indicated by the 
 		 * url given to the EvHttpClient constructor will be used.
 		 *
-		 * Each return 0 on success, -1 on failure.
+		 * Each return 0 on success, -1 on failure, or
+		 * EVHTTPCLIENT_BREAKER_OPEN if the circuit breaker
+		 * refused the request.
 		 *
 		 */
 		int makeRequest(EvHttpClientCallback cb,
-			const string requestString, void *data);
+			const string & requestString, void *data);
 		int makeRequest(EvHttpClientCallback cb, const string & path, 
 			const string & method, const map<string, string> & headers, 
 			const string & body, void *data);
@@ -162,43 +941,454 @@ class EvHttpClient
 			const map<string, string> & headers,
 			const string & body, void *data);
 
+		/*
+		 * Copy-avoiding variants of the above. A request string
+		 * passed as string&& is moved into the request; one passed
+		 * as string_view (or const char *) is copied once into a
+		 * pooled buffer. Headers can be given as an array of
+		 * HeaderPair or a braced list, e.g.
+		 *
+		 * client.makeGet(cb, "/x", {{"Accept", "text/plain"}}, data);
+		 *
+		 * so no map has to be built. The map-based functions are
+		 * thin wrappers over the same serializer.
+		 *
+		 * The braced-list forms are templates on their string
+		 * arguments (see EnableIfStringArgs), so they also take
+		 * std::string paths and bodies.
+		 */
+		int makeRequest(EvHttpClientCallback cb,
+			string && requestString, void *data);
+		int makeRequest(EvHttpClientCallback cb,
+			std::string_view requestString, void *data);
+		int makeRequest(EvHttpClientCallback cb,
+			const char *requestString, void *data);
+		int makeRequest(EvHttpClientCallback cb, std::string_view path,
+			std::string_view method, const HeaderPair *headers, size_t numHeaders,
+			std::string_view body, void *data);
+		template <class Path, class Method, class Body,
+			class = EnableIfStringArgs<Path, Method, Body>>
+		int makeRequest(EvHttpClientCallback cb, const Path & path,
+			const Method & method, std::initializer_list<HeaderPair> headers,
+			const Body & body, void *data);
+		template <class Path, class = EnableIfStringArgs<Path>>
+		int makeGet(EvHttpClientCallback cb, const Path & path,
+			std::initializer_list<HeaderPair> headers, void *data);
+		template <class Path, class Body, class = EnableIfStringArgs<Path, Body>>
+		int makePost(EvHttpClientCallback cb, const Path & path,
+			std::initializer_list<HeaderPair> headers,
+			const Body & body, void *data);
+		template <class Path, class Body, class = EnableIfStringArgs<Path, Body>>
+		int makePut(EvHttpClientCallback cb, const Path & path,
+			std::initializer_list<HeaderPair> headers,
+			const Body & body, void *data);
+		template <class Path, class Body, class = EnableIfStringArgs<Path, Body>>
+		int makeDelete(EvHttpClientCallback cb, const Path & path,
+			std::initializer_list<HeaderPair> headers,
+			const Body & body, void *data);
+
+		/*
+		 * Make a request from a RequestTemplate. pathSuffix is
+		 * appended to the template's path prefix, and
+		 * slotValues must hold one value per slot header,
+		 * in the template's order.
+		 */
+		int makeRequest(EvHttpClientCallback cb, const RequestTemplate & tmpl,
+			std::string_view pathSuffix, const std::string_view *slotValues,
+			std::string_view body, void *data);
+		int makeRequest(EvHttpClientCallback cb, const RequestTemplate & tmpl,
+			std::string_view pathSuffix,
+			std::initializer_list<std::string_view> slotValues,
+			std::string_view body, void *data);
+
+		/*
+		 * Request functions taking a RequestCallback: any
+		 * callable taking a ResponseInfo *, e.g.
+		 *
+		 * client.makeGet([this, id](ResponseInfo *response)
+		 *     { done(id, response); }, "/x");
+		 *
+		 * The captures take the place of the data pointer.
+		 * Otherwise as above.
+		 */
+		int makeRequest(RequestCallback && cb, std::string_view requestString);
+		int makeRequest(RequestCallback && cb, std::string_view path,
+			std::string_view method, const HeaderPair *headers, size_t numHeaders,
+			std::string_view body);
+		template <class F, class = EnableIfResponseHandler<F>>
+		int makeRequest(F && cb, std::string_view requestString);
+		template <class F, class = EnableIfResponseHandler<F>>
+		int makeRequest(F && cb, std::string_view path, std::string_view method,
+			std::initializer_list<HeaderPair> headers, std::string_view body);
+		template <class F, class = EnableIfResponseHandler<F>>
+		int makeGet(F && cb, std::string_view path,
+			std::initializer_list<HeaderPair> headers = {});
+		template <class F, class = EnableIfResponseHandler<F>>
+		int makePost(F && cb, std::string_view path,
+			std::initializer_list<HeaderPair> headers, std::string_view body);
+		template <class F, class = EnableIfResponseHandler<F>>
+		int makePut(F && cb, std::string_view path,
+			std::initializer_list<HeaderPair> headers, std::string_view body);
+		template <class F, class = EnableIfResponseHandler<F>>
+		int makeDelete(F && cb, std::string_view path,
+			std::initializer_list<HeaderPair> headers, std::string_view body);
+
+		/*
+		 * Serializes a request into out, replacing its contents,
+		 * exactly as the request functions above would send it.
+		 * Reusing out across calls avoids allocating.
+		 */
+		void buildRequest(string & out, std::string_view path,
+			std::string_view method, const map<string, string> & headers,
+			std::string_view body);
+		void buildRequest(string & out, std::string_view path,
+			std::string_view method, const HeaderPair *headers, size_t numHeaders,
+			std::string_view body);
+		void buildRequest(string & out, const RequestTemplate & tmpl,
+			std::string_view pathSuffix, const std::string_view *slotValues,
+			std::string_view body);
+
+		/*
+		 * Thread-safe request functions, which may be called
+		 * from any thread while the loop runs. The request is
+		 * serialized on the calling thread and queued (without
+		 * locks) for the loop thread, which is woken once for
+		 * however many requests arrive before it drains the
+		 * queue, and starts them there as the request functions
+		 * above would.
+		 *
+		 * Callbacks run on the loop thread; copy what is needed
+		 * from the ResponseInfo there, since it is freed once
+		 * the callback returns. A request the loop thread can't
+		 * start gets its callback with a NULL response.
+		 *
+		 * By default the queue does not keep the loop alive,
+		 * like the client's other background watchers, so an
+		 * idle loop returns from ev_loop and queued requests
+		 * wait until it runs again. A loop thread that should
+		 * wait for submissions calls setSubmitKeepAlive(true)
+		 * first. Default headers must not be changed while
+		 * other threads submit.
+		 *
+		 * Each returns 0.
+		 */
+		int submitRequest(EvHttpClientCallback cb, string && requestString,
+			void *data);
+		int submitRequest(EvHttpClientCallback cb, std::string_view path,
+			std::string_view method, std::initializer_list<HeaderPair> headers,
+			std::string_view body, void *data);
+		int submitGet(EvHttpClientCallback cb, std::string_view path,
+			std::initializer_list<HeaderPair> headers, void *data);
+
+		/*
+		 * Whether the submission queue keeps the loop
+		 * running while it has nothing else to do, so that
+		 * ev_loop waits for submitted requests instead of
+		 * returning. Off by default. Call on the loop thread.
+		 */
+		void setSubmitKeepAlive(bool enabled);
+
 	private:
+		/*
+		 * A request queued by a submit function. Queued
+		 * requests form a singly linked stack, newest first.
+		 */
+		struct Submission
+		{
+			Submission *next;
+			EvHttpClientCallback cb;
+			string requestString;
+			void *data;
+		};
+
 		struct ev_loop *loop;
 
 		http_parser_settings parser_settings;
 
 		queue<HttpConn *> connections;
 
+		vector<RequestInfo *> freeRequests;
+		vector<ResponseInfo *> freeResponses;
+		vector<HttpConn *> freeConns;
+		size_t arenaEstimate;
+
+		HeaderCapture headerCapture;
+		unsigned captureMask;
+		unsigned internalHeaders;
+		vector<string> captureNames;
+
+		ResponseCache *cache;
+		vector<string> cacheKeyHeaders;
+		queue<RequestInfo *> cacheHits;
+		struct ev_timer cacheTimer;
+
+		typedef map<string, RequestInfo *, std::less<> > InflightMap;
+		bool coalesce;
+		InflightMap inflight;
+		RequestInfo *activeRequests;
+
+		bool hedge;
+		double hedgeDelay;
+		double hedgePercentile;
+		double hedgeMaxRate;
+		double hedgeTokens;
+		vector<double> latencySamples;
+		vector<double> latencyScratch;
+		size_t latencyNext;
+		long latencyCount;
+		HedgeReport hedgeReport;
+
+		RetryPolicy retryPolicy;
+		RetryReport retryReport;
+		double retryTokens;
+		std::minstd_rand retryRandom;
+
+		double latencyEwma;
+
+		/*
+		 * Circuit breaker. The window is kept as
+		 * BREAKER_BUCKETS buckets of outcomes, each for one
+		 * slice of time (bucketEpochs says which).
+		 */
+		bool breaker;
+		BreakerPolicy breakerPolicy;
+		BreakerReport breakerReport;
+		double breakerOpenUntil;
+		int breakerProbes;
+		long breakerEpochs[BREAKER_BUCKETS];
+		long breakerRequests[BREAKER_BUCKETS];
+		long breakerFailures[BREAKER_BUCKETS];
+
 		double timeout;
 
 		int init_num_conns;
 		int block_size;
 
+		int numConns;
+		int numOutstanding;
+		long evicted;
+
+		bool autoscale;
+		int minConns;
+		int maxConns;
+		double headroom;
+		double autoscaleInterval;
+		struct ev_timer autoscaleTimer;
+		long windowRequests;
+		long windowCompleted;
+		double windowLatency;
+		int windowPeakOutstanding;
+		double rateEstimate;
+		double latencyEstimate;
+		int surplusTicks;
+		PoolReport poolReport;
+
 		Url url;
-		int family;
-		int socktype;
-		int protocol;
-		size_t addrlen;
-		struct sockaddr addr;
+		string defaultPath;
+		string hostHeader;
+		map<string, string> defaultHeaders;
+		vector<string> defaultHeaderNames;
+		vector<string> defaultHeaderLines;
+		bool defaultHost;
+
+		/*
+		 * Addresses the host name resolved to, used in
+		 * turn for new connections, and the requests
+		 * waiting for the first resolution.
+		 */
+		AsyncResolver *resolver;
+		bool sharedResolver;
+		vector<ResolvedAddress> addresses;
+		size_t nextAddress;
+		int preferredFamily;
+		bool resolving;
+		struct ev_timer resolveTimer;
+		vector<RequestInfo *> unresolvedRequests;
+
+		std::atomic<Submission *> submissions;
+		struct ev_async submitWatcher;
+		bool submitKeepAlive;
 
 		void *data;
 
+		int startRequest(RequestInfo *request, EvHttpClientCallback cb, void *data);
+		int startRequest(RequestInfo *request);
+		int makeCallableRequest(RequestCallback && cb, std::string_view path,
+			std::string_view method, const HeaderPair *headers, size_t numHeaders,
+			std::string_view body, void *data, bool timed);
 		void retryRequest(RequestInfo *request);
+		void submit(Submission *submission);
+		void drainSubmissions();
+		static void submitCbWrapper(struct ev_loop *loop, struct ev_async *watcher,
+			int revents);
+		void startResolve();
+		void resolveCb(int error, const vector<ResolvedAddress> & addresses, double ttl);
+		static void resolveCbWrapper(int error, const vector<ResolvedAddress> & addresses,
+			double ttl, void *owner);
+		static void resolveTimerCbWrapper(struct ev_loop *loop, struct ev_timer *timer,
+			int revents);
+		bool addressCurrent(HttpConn *conn);
+		void connectionFailed(RequestInfo *request, bool closed);
+		bool retryAllowed(RequestInfo *request, double delay);
+		double retryBackoff(RequestInfo *request);
+		double retryAfter(RequestInfo *request);
+		bool retryStatus(RequestInfo *request, double *delay);
+		void scheduleRetry(RequestInfo *request, double delay);
+		void retryCb(struct ev_loop *loop, struct ev_timer *timer, int revents);
+		bool breakerAllows(RequestInfo *request);
+		void breakerRecord(RequestInfo *request, bool failed);
+		void breakerCount();
+		void breakerTransition(BreakerState state);
+		const ResolvedAddress *candidate(HttpConn *conn, size_t attempt);
+		int connectNext(HttpConn *conn, ResolvedAddress *address);
+		void moveConn(HttpConn *conn, int fd, const ResolvedAddress & address);
+		bool nextAttempt(HttpConn *conn);
+		void attemptFailed(HttpConn *conn);
+		void startRace(HttpConn *conn);
+		void connected(HttpConn *conn);
+		void raceCb(HttpConn *conn);
+		void raceTimerCb(HttpConn *conn);
 		HttpConn *createConn();
 		void destroyConn(HttpConn *conn);
 		void destroyConnAndRequest(HttpConn *conn);
+		void failOutstanding();
 		HttpConn *getConn();
 		void returnConn(HttpConn *conn);
 		void finalizeTimeout(RequestInfo *request);
 		void finalizeError(RequestInfo *request);
+		void finalizeWaiter(RequestInfo *request, ResponseInfo *response);
+		bool coalesceRequest(RequestInfo *request);
+		void unlinkWaiter(RequestInfo *request);
+		void promoteWaiter(RequestInfo *request);
+		void unregisterLeader(RequestInfo *request);
+		void completeWaiters(RequestInfo *request, ResponseInfo *response);
+		void cancelRequest(RequestInfo *request);
+		void hedgeCb(struct ev_loop *loop, struct ev_timer *timer, int revents);
+		RequestInfo *hedgeWon(RequestInfo *hedge);
+		void dropHedge(RequestInfo *request);
+		void recordLatency(double latency);
+		void linkActive(RequestInfo *request);
+		void unlinkActive(RequestInfo *request);
 		void writeCb(struct ev_loop *loop, struct ev_io *watcher, int revents);
 		void readCb(struct ev_loop *loop, struct ev_io *watcher, int revents);
 		void timeoutCb(struct ev_loop *loop, struct ev_timer *timer, int revents);
+		void autoscaleCb(struct ev_loop *loop, struct ev_timer *timer, int revents);
+		static void autoscaleCbWrapper(struct ev_loop *loop, struct ev_timer *timer, int revents);
+		void cacheCb(struct ev_loop *loop, struct ev_timer *timer, int revents);
+		static void cacheCbWrapper(struct ev_loop *loop, struct ev_timer *timer, int revents);
+		bool cacheRequest(RequestInfo *request);
+		bool cacheResponse(RequestInfo *request);
+		void resendUnconditional(RequestInfo *request);
+		void requestStarted();
+		void requestFinished(double latency);
+		void resizePool(int target);
+		bool captureHeader(HttpHeaderId id, std::string_view name);
+		RequestInfo *newRequest();
+		void freeRequest(RequestInfo *request);
+		ResponseInfo *newResponse();
+		void freeResponse(ResponseInfo *response);
+		HttpConn *newConn();
+		void freeConn(HttpConn *conn);
 		void initConnPool();
-		string buildRequest(const string & path, const string & method,
-			const map<string, string> & headers, const string & body);
+		template <class HeaderIter>
+		void serializeRequest(string & out, std::string_view path,
+			std::string_view method, HeaderIter begin, HeaderIter end,
+			std::string_view body);
 
 };
 
+/*
+ * Braced-list request functions. All go through the
+ * HeaderPair array form.
+ */
+template <class Path, class Method, class Body, class>
+int EvHttpClient::makeRequest(EvHttpClientCallback cb, const Path & path,
+	const Method & method, std::initializer_list<HeaderPair> headers,
+	const Body & body, void *data)
+{
+	return makeRequest(cb, std::string_view(path), std::string_view(method),
+		headers.begin(), headers.size(), std::string_view(body), data);
+}
+
+template <class Path, class>
+int EvHttpClient::makeGet(EvHttpClientCallback cb, const Path & path,
+	std::initializer_list<HeaderPair> headers, void *data)
+{
+	return makeRequest(cb, std::string_view(path), "GET", headers.begin(),
+		headers.size(), "", data);
+}
+
+template <class Path, class Body, class>
+int EvHttpClient::makePost(EvHttpClientCallback cb, const Path & path,
+	std::initializer_list<HeaderPair> headers, const Body & body, void *data)
+{
+	return makeRequest(cb, std::string_view(path), "POST", headers.begin(),
+		headers.size(), std::string_view(body), data);
+}
+
+template <class Path, class Body, class>
+int EvHttpClient::makePut(EvHttpClientCallback cb, const Path & path,
+	std::initializer_list<HeaderPair> headers, const Body & body, void *data)
+{
+	return makeRequest(cb, std::string_view(path), "PUT", headers.begin(),
+		headers.size(), std::string_view(body), data);
+}
+
+template <class Path, class Body, class>
+int EvHttpClient::makeDelete(EvHttpClientCallback cb, const Path & path,
+	std::initializer_list<HeaderPair> headers, const Body & body, void *data)
+{
+	return makeRequest(cb, std::string_view(path), "DELETE", headers.begin(),
+		headers.size(), std::string_view(body), data);
+}
+
+/*
+ * Callable request functions. The callable is wrapped
+ * where it is passed, so it is moved (not copied) into
+ * the request.
+ */
+template <class F, class>
+int EvHttpClient::makeRequest(F && cb, std::string_view requestString)
+{
+	return makeRequest(RequestCallback(std::forward<F>(cb)), requestString);
+}
+
+template <class F, class>
+int EvHttpClient::makeRequest(F && cb, std::string_view path,
+	std::string_view method, std::initializer_list<HeaderPair> headers,
+	std::string_view body)
+{
+	return makeRequest(RequestCallback(std::forward<F>(cb)), path, method,
+		headers.begin(), headers.size(), body);
+}
+
+template <class F, class>
+int EvHttpClient::makeGet(F && cb, std::string_view path,
+	std::initializer_list<HeaderPair> headers)
+{
+	return makeRequest(std::forward<F>(cb), path, "GET", headers, "");
+}
+
+template <class F, class>
+int EvHttpClient::makePost(F && cb, std::string_view path,
+	std::initializer_list<HeaderPair> headers, std::string_view body)
+{
+	return makeRequest(std::forward<F>(cb), path, "POST", headers, body);
+}
+
+template <class F, class>
+int EvHttpClient::makePut(F && cb, std::string_view path,
+	std::initializer_list<HeaderPair> headers, std::string_view body)
+{
+	return makeRequest(std::forward<F>(cb), path, "PUT", headers, body);
+}
+
+template <class F, class>
+int EvHttpClient::makeDelete(F && cb, std::string_view path,
+	std::initializer_list<HeaderPair> headers, std::string_view body)
+{
+	return makeRequest(std::forward<F>(cb), path, "DELETE", headers, body);
+}
+
 #endif /* EVHTTPCLIENT_H_ */
 
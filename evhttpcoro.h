@@ -0,0 +1,739 @@
+/***************************************************************
+* EVHTTPCORO
+* ----------
+* C++20 coroutine interface to EvHttpClient. Requests
+* are awaited rather than given callbacks:
+*
+*   EvTask<void> fetch(EvHttpCoClient client)
+*   {
+*       HttpResponse first = co_await client.get("/a");
+*       auto [b, c] = co_await when_all(client.get("/b"),
+*           client.get("/c"));
+*       ...
+*   }
+*
+*   spawn(fetch(EvHttpCoClient(&evClient)));
+*
+* A coroutine awaiting a request is resumed on the loop
+* thread, from the request's callback. Its state lives
+* in the coroutine frame, so no context object is
+* allocated per request; frames themselves come from a
+* per-thread pool of size classes.
+*
+* Header-only, and only available to code compiled as
+* C++20 or later; the library itself needs neither.
+* Like EvHttpClient, not thread-safe.
+*
+*/
+
+#ifndef EVHTTPCORO_H_
+#define EVHTTPCORO_H_
+
+#if defined(__cpp_impl_coroutine)
+
+/*
+ * Frames up to CORO_FRAME_CLASSES * CORO_FRAME_CLASS_SIZE
+ * bytes are pooled, in classes CORO_FRAME_CLASS_SIZE
+ * apart. Larger frames use operator new.
+ */
+#define CORO_FRAME_CLASS_SIZE (64)
+#define CORO_FRAME_CLASSES (32)
+
+#include <coroutine>
+#include <array>
+#include <vector>
+#include <utility>
+#include <exception>
+#include "evhttpclient.h"
+
+/*
+ * Per-thread free lists of coroutine frames. Frames are
+ * kept for reuse rather than returned to the heap.
+ */
+class CoroFramePool
+{
+	public:
+		static void *allocate(size_t size)
+		{
+			size_t sizeClass = (size + CORO_FRAME_CLASS_SIZE - 1) / CORO_FRAME_CLASS_SIZE;
+			if(sizeClass > CORO_FRAME_CLASSES)
+			{
+				return ::operator new(size);
+			}
+
+			FreeFrame *& head = freeLists()[sizeClass - 1];
+			if(head == NULL)
+			{
+				return ::operator new(sizeClass * CORO_FRAME_CLASS_SIZE);
+			}
+			FreeFrame *frame = head;
+			head = frame->next;
+			return frame;
+		}
+
+		static void deallocate(void *frame, size_t size)
+		{
+			size_t sizeClass = (size + CORO_FRAME_CLASS_SIZE - 1) / CORO_FRAME_CLASS_SIZE;
+			if(sizeClass > CORO_FRAME_CLASSES)
+			{
+				::operator delete(frame);
+				return;
+			}
+
+			FreeFrame *& head = freeLists()[sizeClass - 1];
+			FreeFrame *freed = (FreeFrame *) frame;
+			freed->next = head;
+			head = freed;
+		}
+
+	private:
+		struct FreeFrame
+		{
+			FreeFrame *next;
+		};
+
+		static FreeFrame **freeLists()
+		{
+			static thread_local FreeFrame *lists[CORO_FRAME_CLASSES];
+			return lists;
+		}
+};
+
+/*
+ * Promise parts shared by every EvTask. A task starts
+ * when awaited (or spawned), and resumes its awaiter
+ * when it finishes.
+ */
+class EvPromiseBase
+{
+	public:
+		std::coroutine_handle<> continuation;
+		bool detached = false;
+
+		void *operator new(size_t size)
+		{
+			return CoroFramePool::allocate(size);
+		}
+
+		void operator delete(void *frame, size_t size)
+		{
+			CoroFramePool::deallocate(frame, size);
+		}
+
+		std::suspend_always initial_suspend() noexcept
+		{
+			return {};
+		}
+
+		struct FinalAwaiter
+		{
+			bool await_ready() noexcept
+			{
+				return false;
+			}
+
+			template <class Promise>
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+			{
+				EvPromiseBase & promise = handle.promise();
+				if(promise.detached)
+				{
+					handle.destroy();
+					return std::noop_coroutine();
+				}
+				if(promise.continuation)
+				{
+					return promise.continuation;
+				}
+				return std::noop_coroutine();
+			}
+
+			void await_resume() noexcept
+			{
+			}
+		};
+
+		FinalAwaiter final_suspend() noexcept
+		{
+			return {};
+		}
+
+		void unhandled_exception()
+		{
+			std::terminate();
+		}
+};
+
+/*
+ * A coroutine producing a T (default-constructible).
+ * Await it from another coroutine, or spawn it.
+ */
+template <class T>
+class EvTask
+{
+	public:
+		class promise_type : public EvPromiseBase
+		{
+			public:
+				T value;
+
+				EvTask get_return_object()
+				{
+					return EvTask(std::coroutine_handle<promise_type>::from_promise(*this));
+				}
+
+				void return_value(T value)
+				{
+					this->value = std::move(value);
+				}
+		};
+
+		EvTask(EvTask && other) : handle(other.handle)
+		{
+			other.handle = nullptr;
+		}
+
+		~EvTask()
+		{
+			if(handle)
+			{
+				handle.destroy();
+			}
+		}
+
+		bool await_ready()
+		{
+			return false;
+		}
+
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter)
+		{
+			handle.promise().continuation = awaiter;
+			return handle;
+		}
+
+		T await_resume()
+		{
+			return std::move(handle.promise().value);
+		}
+
+		/*
+		 * Gives up the coroutine, for spawn.
+		 */
+		std::coroutine_handle<promise_type> release()
+		{
+			std::coroutine_handle<promise_type> released = handle;
+			handle = nullptr;
+			return released;
+		}
+
+	private:
+		std::coroutine_handle<promise_type> handle;
+
+		EvTask(std::coroutine_handle<promise_type> handle) : handle(handle)
+		{
+		}
+};
+
+template <>
+class EvTask<void>
+{
+	public:
+		class promise_type : public EvPromiseBase
+		{
+			public:
+				EvTask get_return_object()
+				{
+					return EvTask(std::coroutine_handle<promise_type>::from_promise(*this));
+				}
+
+				void return_void()
+				{
+				}
+		};
+
+		EvTask(EvTask && other) : handle(other.handle)
+		{
+			other.handle = nullptr;
+		}
+
+		~EvTask()
+		{
+			if(handle)
+			{
+				handle.destroy();
+			}
+		}
+
+		bool await_ready()
+		{
+			return false;
+		}
+
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter)
+		{
+			handle.promise().continuation = awaiter;
+			return handle;
+		}
+
+		void await_resume()
+		{
+		}
+
+		std::coroutine_handle<promise_type> release()
+		{
+			std::coroutine_handle<promise_type> released = handle;
+			handle = nullptr;
+			return released;
+		}
+
+	private:
+		std::coroutine_handle<promise_type> handle;
+
+		EvTask(std::coroutine_handle<promise_type> handle) : handle(handle)
+		{
+		}
+};
+
+/*
+ * Starts a task with nobody awaiting it. It runs until
+ * its first suspension before spawn returns, and its
+ * frame is freed when it finishes.
+ */
+template <class T>
+void spawn(EvTask<T> && task)
+{
+	auto handle = task.release();
+	handle.promise().detached = true;
+	handle.resume();
+}
+
+/*
+ * The outcome of an awaited request. Holds the
+ * ResponseInfo (see EvHttpClient::keepResponse) until
+ * destroyed, which must happen on the loop thread.
+ *
+ * Empty if the request failed; error is then the
+ * request function's return value if the request could
+ * not be made, or 0 if it failed later.
+ */
+class HttpResponse
+{
+	public:
+		int error;
+
+		HttpResponse() : error(0), client(NULL), response(NULL)
+		{
+		}
+
+		HttpResponse(EvHttpClient *client, ResponseInfo *response, int error)
+			: error(error), client(client), response(response)
+		{
+		}
+
+		HttpResponse(HttpResponse && other)
+			: error(other.error), client(other.client), response(other.response)
+		{
+			other.response = NULL;
+		}
+
+		HttpResponse & operator=(HttpResponse && other)
+		{
+			if(this != &other)
+			{
+				reset();
+				error = other.error;
+				client = other.client;
+				response = other.response;
+				other.response = NULL;
+			}
+			return *this;
+		}
+
+		~HttpResponse()
+		{
+			reset();
+		}
+
+		ResponseInfo *get() const
+		{
+			return response;
+		}
+
+		ResponseInfo *operator->() const
+		{
+			return response;
+		}
+
+		explicit operator bool() const
+		{
+			return response != NULL;
+		}
+
+		void reset()
+		{
+			if(response != NULL)
+			{
+				client->releaseResponse(response);
+				response = NULL;
+			}
+		}
+
+	private:
+		EvHttpClient *client;
+		ResponseInfo *response;
+};
+
+class RequestAwaitable;
+
+/*
+ * Shared by the requests of a when_all or when_any:
+ * resumes the awaiting coroutine once all of them, or
+ * the first, have finished.
+ */
+class RequestJoin
+{
+	public:
+		std::coroutine_handle<> awaiter;
+		size_t remaining;
+		bool any;
+		bool starting;
+		RequestAwaitable *first;
+
+		void arrived(RequestAwaitable *request)
+		{
+			remaining--;
+			if(any)
+			{
+				if(first == NULL)
+				{
+					first = request;
+					if(!starting)
+					{
+						awaiter.resume();
+					}
+				}
+			}
+			else if(remaining == 0 && !starting)
+			{
+				awaiter.resume();
+			}
+		}
+};
+
+/*
+ * One request, serialized when created and made when
+ * awaited. Its address is the request's data pointer.
+ */
+class RequestAwaitable
+{
+	public:
+		RequestAwaitable(EvHttpClient *client, std::string_view path,
+			std::string_view method, std::initializer_list<HeaderPair> headers,
+			std::string_view body)
+			: client(client), response(NULL), error(0), done(false), join(NULL)
+		{
+			client->buildRequest(requestString, path, method, headers.begin(),
+				headers.size(), body);
+		}
+
+		RequestAwaitable(RequestAwaitable && other) = default;
+
+		bool await_ready()
+		{
+			return false;
+		}
+
+		bool await_suspend(std::coroutine_handle<> awaiter)
+		{
+			this->awaiter = awaiter;
+			return start();
+		}
+
+		HttpResponse await_resume()
+		{
+			return take();
+		}
+
+		/*
+		 * Makes the request. Returns false if it could not
+		 * be made, which counts as finishing.
+		 */
+		bool start()
+		{
+			error = client->makeRequest(responseCb, std::string_view(requestString),
+				(void *) this);
+			if(error != 0)
+			{
+				done = true;
+				return false;
+			}
+			return true;
+		}
+
+		/*
+		 * Cancels the request if it hasn't finished.
+		 */
+		void cancel()
+		{
+			if(!done)
+			{
+				client->cancelRequests((void *) this);
+				done = true;
+			}
+		}
+
+		HttpResponse take()
+		{
+			HttpResponse taken(client, response, error);
+			response = NULL;
+			return taken;
+		}
+
+		void setJoin(RequestJoin *join)
+		{
+			this->join = join;
+		}
+
+	private:
+		EvHttpClient *client;
+		string requestString;
+		std::coroutine_handle<> awaiter;
+		ResponseInfo *response;
+		int error;
+		bool done;
+		RequestJoin *join;
+
+		static void responseCb(ResponseInfo *response, void *requestData, void *clientData)
+		{
+			RequestAwaitable *request = (RequestAwaitable *) requestData;
+			request->done = true;
+			request->response = response;
+			if(response != NULL)
+			{
+				request->client->keepResponse(response);
+			}
+
+			if(request->join != NULL)
+			{
+				request->join->arrived(request);
+			}
+			else
+			{
+				request->awaiter.resume();
+			}
+		}
+};
+
+/*
+ * Starts every request of a join. Returns whether the
+ * awaiter must suspend.
+ */
+template <class Iter>
+bool startJoin(RequestJoin & join, Iter begin, Iter end)
+{
+	join.starting = true;
+	join.first = NULL;
+	join.remaining = end - begin;
+	for(Iter iter = begin; iter != end && !(join.any && join.first != NULL); ++iter)
+	{
+		iter->setJoin(&join);
+		if(!iter->start())
+		{
+			join.arrived(&*iter);
+		}
+	}
+	join.starting = false;
+
+	if(join.any)
+	{
+		return join.first == NULL;
+	}
+	return join.remaining > 0;
+}
+
+/*
+ * Awaitable for when_all over a fixed number of
+ * requests. Resumes with their responses, in order.
+ */
+template <size_t N>
+class WhenAll
+{
+	public:
+		std::array<RequestAwaitable, N> requests;
+		RequestJoin join;
+
+		bool await_ready()
+		{
+			return N == 0;
+		}
+
+		bool await_suspend(std::coroutine_handle<> awaiter)
+		{
+			join.awaiter = awaiter;
+			join.any = false;
+			return startJoin(join, requests.begin(), requests.end());
+		}
+
+		std::array<HttpResponse, N> await_resume()
+		{
+			std::array<HttpResponse, N> responses;
+			for(size_t i = 0; i < N; ++i)
+			{
+				responses[i] = requests[i].take();
+			}
+			return responses;
+		}
+
+};
+
+/*
+ * Awaitable for when_all over a vector of requests.
+ */
+class WhenAllVector
+{
+	public:
+		std::vector<RequestAwaitable> requests;
+		RequestJoin join;
+
+		bool await_ready()
+		{
+			return requests.empty();
+		}
+
+		bool await_suspend(std::coroutine_handle<> awaiter)
+		{
+			join.awaiter = awaiter;
+			join.any = false;
+			return startJoin(join, requests.begin(), requests.end());
+		}
+
+		std::vector<HttpResponse> await_resume()
+		{
+			std::vector<HttpResponse> responses(requests.size());
+			for(size_t i = 0; i < requests.size(); ++i)
+			{
+				responses[i] = requests[i].take();
+			}
+			return responses;
+		}
+
+};
+
+/*
+ * Awaitable for when_any. Resumes with the index and
+ * response of the first request to finish; the others
+ * are cancelled. With no requests it resumes at once,
+ * with index 0 and an empty response whose error is -1.
+ */
+class WhenAny
+{
+	public:
+		std::vector<RequestAwaitable> requests;
+		RequestJoin join;
+
+		bool await_ready()
+		{
+			return requests.empty();
+		}
+
+		bool await_suspend(std::coroutine_handle<> awaiter)
+		{
+			join.awaiter = awaiter;
+			join.any = true;
+			return startJoin(join, requests.begin(), requests.end());
+		}
+
+		std::pair<size_t, HttpResponse> await_resume()
+		{
+			if(requests.empty())
+			{
+				return std::make_pair((size_t) 0, HttpResponse(NULL, NULL, -1));
+			}
+			for(size_t i = 0; i < requests.size(); ++i)
+			{
+				if(&requests[i] != join.first)
+				{
+					requests[i].cancel();
+				}
+			}
+			size_t index = join.first - &requests[0];
+			return std::make_pair(index, join.first->take());
+		}
+
+};
+
+template <class... Requests>
+WhenAll<sizeof...(Requests)> when_all(Requests &&... requests)
+{
+	return WhenAll<sizeof...(Requests)>{ { std::move(requests)... } };
+}
+
+inline WhenAllVector when_all(std::vector<RequestAwaitable> && requests)
+{
+	return WhenAllVector{ std::move(requests) };
+}
+
+template <class... Requests>
+WhenAny when_any(Requests &&... requests)
+{
+	static_assert(sizeof...(Requests) > 0,
+		"when_any needs at least one request");
+	WhenAny any;
+	any.requests.reserve(sizeof...(Requests));
+	(any.requests.push_back(std::move(requests)), ...);
+	return any;
+}
+
+inline WhenAny when_any(std::vector<RequestAwaitable> && requests)
+{
+	return WhenAny{ std::move(requests) };
+}
+
+/*
+ * Coroutine view of an EvHttpClient: request functions
+ * returning awaitables. Cheap to copy.
+ */
+class EvHttpCoClient
+{
+	public:
+		EvHttpCoClient(EvHttpClient *client) : client(client)
+		{
+		}
+
+		RequestAwaitable request(std::string_view path, std::string_view method,
+			std::initializer_list<HeaderPair> headers = {}, std::string_view body = "")
+		{
+			return RequestAwaitable(client, path, method, headers, body);
+		}
+
+		RequestAwaitable get(std::string_view path,
+			std::initializer_list<HeaderPair> headers = {})
+		{
+			return request(path, "GET", headers);
+		}
+
+		RequestAwaitable post(std::string_view path, std::string_view body,
+			std::initializer_list<HeaderPair> headers = {})
+		{
+			return request(path, "POST", headers, body);
+		}
+
+		RequestAwaitable put(std::string_view path, std::string_view body,
+			std::initializer_list<HeaderPair> headers = {})
+		{
+			return request(path, "PUT", headers, body);
+		}
+
+		EvHttpClient *getClient()
+		{
+			return client;
+		}
+
+	private:
+		EvHttpClient *client;
+};
+
+#endif /* __cpp_impl_coroutine */
+
+#endif /* EVHTTPCORO_H_ */
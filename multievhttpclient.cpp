@@ -0,0 +1,491 @@
+#include <algorithm>
+#include <math.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include "multievhttpclient.h"
+
+/*
+ * How often removed endpoints are checked for requests
+ * still in flight.
+ */
+#define SWEEP_INTERVAL (1.0)
+
+
+/**********
+* Helpers *
+**********/
+
+/*
+ * 64-bit hash of a string under a seed: FNV-1a, then a
+ * finalizer so that nearby seeds give unrelated values.
+ */
+static uint64_t hashString(std::string_view value, uint64_t seed)
+{
+	uint64_t hash = 14695981039346656037ULL ^ seed;
+	for(size_t i = 0; i < value.size(); ++i)
+	{
+		hash ^= (unsigned char) value[i];
+		hash *= 1099511628211ULL;
+	}
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ULL;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+
+/*****************************
+* MultiEvHttpClient (public) *
+*****************************/
+
+MultiEvHttpClient::MultiEvHttpClient(struct ev_loop *loop,
+	const vector<string> & urls, double timeout, void *data, int init_num_conns)
+{
+	this->loop = loop;
+	this->timeout = timeout;
+	this->data = data;
+	initNumConns = init_num_conns;
+	eject = true;
+	loadFactor = DEFAULT_HASH_LOAD_FACTOR;
+	random.seed(time(NULL) ^ getpid());
+	ev_timer_init(&sweepTimer, sweepCbWrapper, SWEEP_INTERVAL, SWEEP_INTERVAL);
+	sweepTimer.data = (void *) this;
+
+	for(size_t i = 0; i < urls.size(); ++i)
+	{
+		addEndpoint(urls[i]);
+	}
+}
+
+MultiEvHttpClient::~MultiEvHttpClient()
+{
+	ev_timer_stop(loop, &sweepTimer);
+	for(size_t i = 0; i < endpoints.size(); ++i)
+	{
+		delete endpoints[i].client;
+	}
+	for(size_t i = 0; i < retired.size(); ++i)
+	{
+		delete retired[i];
+	}
+}
+
+int MultiEvHttpClient::addEndpoint(const string & url)
+{
+	for(size_t i = 0; i < endpoints.size(); ++i)
+	{
+		if(endpoints[i].url == url)
+		{
+			return -1;
+		}
+	}
+
+	Endpoint endpoint;
+	endpoint.url = url;
+	endpoint.client = new EvHttpClient(loop, url, timeout, data, initNumConns,
+		DEFAULT_BLOCK_SIZE);
+	endpoint.requests = 0;
+	configure(endpoint.client);
+	endpoints.push_back(endpoint);
+	buildLookup();
+	return 0;
+}
+
+int MultiEvHttpClient::removeEndpoint(const string & url)
+{
+	for(size_t i = 0; i < endpoints.size(); ++i)
+	{
+		if(endpoints[i].url == url)
+		{
+			retired.push_back(endpoints[i].client);
+			endpoints.erase(endpoints.begin() + i);
+			buildLookup();
+			ev_timer_start(loop, &sweepTimer);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+void MultiEvHttpClient::setTimeout(double seconds)
+{
+	timeout = seconds;
+	for(size_t i = 0; i < endpoints.size(); ++i)
+	{
+		endpoints[i].client->setTimeout(seconds);
+	}
+}
+
+void MultiEvHttpClient::setDefaultHeaders(const map<string, string> & headers)
+{
+	defaultHeaders = headers;
+	for(size_t i = 0; i < endpoints.size(); ++i)
+	{
+		endpoints[i].client->setDefaultHeaders(headers);
+	}
+}
+
+void MultiEvHttpClient::setEjection(bool enabled, const BreakerPolicy & policy)
+{
+	eject = enabled;
+	ejectionPolicy = policy;
+	for(size_t i = 0; i < endpoints.size(); ++i)
+	{
+		endpoints[i].client->setCircuitBreaker(enabled, policy);
+	}
+}
+
+void MultiEvHttpClient::setHashLoadFactor(double factor)
+{
+	loadFactor = factor;
+}
+
+size_t MultiEvHttpClient::numEndpoints()
+{
+	return endpoints.size();
+}
+
+EvHttpClient *MultiEvHttpClient::getEndpoint(size_t i)
+{
+	return endpoints[i].client;
+}
+
+vector<EndpointReport> MultiEvHttpClient::getEndpointReport()
+{
+	vector<EndpointReport> report(endpoints.size());
+	for(size_t i = 0; i < endpoints.size(); ++i)
+	{
+		report[i].url = endpoints[i].url;
+		report[i].outstanding = endpoints[i].client->getOutstanding();
+		report[i].latency = endpoints[i].client->getLatencyEwma();
+		report[i].ejected = !available(endpoints[i]);
+		report[i].requests = endpoints[i].requests;
+	}
+	return report;
+}
+
+int MultiEvHttpClient::makeRequest(EvHttpClientCallback cb, std::string_view path,
+	std::string_view method, const HeaderPair *headers, size_t numHeaders,
+	std::string_view body, void *data)
+{
+	pick(candidates);
+	return dispatch([&](EvHttpClient *client)
+	{
+		return client->makeRequest(cb, path, method, headers, numHeaders, body, data);
+	});
+}
+
+int MultiEvHttpClient::makeRequest(EvHttpClientCallback cb, const string & path,
+	const string & method, const map<string, string> & headers,
+	const string & body, void *data)
+{
+	pick(candidates);
+	return dispatch([&](EvHttpClient *client)
+	{
+		return client->makeRequest(cb, path, method, headers, body, data);
+	});
+}
+
+int MultiEvHttpClient::makeKeyedRequest(std::string_view key, EvHttpClientCallback cb,
+	std::string_view path, std::string_view method,
+	const HeaderPair *headers, size_t numHeaders,
+	std::string_view body, void *data)
+{
+	pickKeyed(key, candidates);
+	return dispatch([&](EvHttpClient *client)
+	{
+		return client->makeRequest(cb, path, method, headers, numHeaders, body, data);
+	});
+}
+
+int MultiEvHttpClient::makeKeyedRequest(std::string_view key, EvHttpClientCallback cb,
+	const string & path, const string & method,
+	const map<string, string> & headers, const string & body, void *data)
+{
+	pickKeyed(key, candidates);
+	return dispatch([&](EvHttpClient *client)
+	{
+		return client->makeRequest(cb, path, method, headers, body, data);
+	});
+}
+
+int MultiEvHttpClient::makeKeyedGet(std::string_view key, EvHttpClientCallback cb,
+	const string & path, const map<string, string> & headers, void *data)
+{
+	return makeKeyedRequest(key, cb, path, "GET", headers, "", data);
+}
+
+int MultiEvHttpClient::makeGet(EvHttpClientCallback cb, const string & path,
+	const map<string, string> & headers, void *data)
+{
+	return makeRequest(cb, path, "GET", headers, "", data);
+}
+
+int MultiEvHttpClient::makePost(EvHttpClientCallback cb, const string & path,
+	const map<string, string> & headers, const string & body, void *data)
+{
+	return makeRequest(cb, path, "POST", headers, body, data);
+}
+
+int MultiEvHttpClient::makePut(EvHttpClientCallback cb, const string & path,
+	const map<string, string> & headers, const string & body, void *data)
+{
+	return makeRequest(cb, path, "PUT", headers, body, data);
+}
+
+int MultiEvHttpClient::makeDelete(EvHttpClientCallback cb, const string & path,
+	const map<string, string> & headers, const string & body, void *data)
+{
+	return makeRequest(cb, path, "DELETE", headers, body, data);
+}
+
+
+/******************************
+* MultiEvHttpClient (private) *
+******************************/
+
+/*
+ * Applies the client-wide settings to a new endpoint.
+ */
+void MultiEvHttpClient::configure(EvHttpClient *client)
+{
+	if(defaultHeaders.size() > 0)
+	{
+		client->setDefaultHeaders(defaultHeaders);
+	}
+	client->setCircuitBreaker(eject, ejectionPolicy);
+}
+
+/*
+ * An endpoint whose breaker is open is ejected. One
+ * that is half-open may take a probe.
+ */
+bool MultiEvHttpClient::available(const Endpoint & endpoint)
+{
+	return !eject || endpoint.client->getBreakerState() != BREAKER_OPEN;
+}
+
+/*
+ * Whether a new request would expect a shorter wait at
+ * endpoint a than at b: the requests ahead of it, plus
+ * itself, at the endpoint's recent latency. An endpoint
+ * that hasn't completed a request yet has no latency to
+ * go by (and would otherwise look free), so if either
+ * has none, only the requests outstanding are compared.
+ */
+bool MultiEvHttpClient::cheaper(const Endpoint & a, const Endpoint & b)
+{
+	double latencyA = a.client->getLatencyEwma();
+	double latencyB = b.client->getLatencyEwma();
+	int outstandingA = a.client->getOutstanding();
+	int outstandingB = b.client->getOutstanding();
+	if(latencyA <= 0 || latencyB <= 0)
+	{
+		return outstandingA < outstandingB;
+	}
+	return (outstandingA + 1) * latencyA < (outstandingB + 1) * latencyB;
+}
+
+/*
+ * Fills order with the endpoints to try: the cheaper
+ * of two available endpoints picked at random, then the
+ * other, then the rest, in case the first choices turn
+ * the request away.
+ */
+void MultiEvHttpClient::pick(vector<size_t> & order)
+{
+	order.clear();
+	for(size_t i = 0; i < endpoints.size(); ++i)
+	{
+		if(available(endpoints[i]))
+		{
+			order.push_back(i);
+		}
+	}
+	if(order.size() < 2)
+	{
+		return;
+	}
+
+	std::uniform_int_distribution<size_t> first(0, order.size() - 1);
+	std::uniform_int_distribution<size_t> second(1, order.size() - 1);
+	size_t a = first(random);
+	size_t b = (a + second(random)) % order.size();
+	if(cheaper(endpoints[order[b]], endpoints[order[a]]))
+	{
+		swap(a, b);
+	}
+
+	swap(order[0], order[a]);
+	if(b == 0)
+	{
+		b = a;
+	}
+	swap(order[1], order[b]);
+}
+
+/*
+ * Fills order with the endpoints to try for key: those
+ * met walking the lookup table from the key's slot, in
+ * order, skipping ejected ones. Endpoints at or over the
+ * load bound go to the back, so the key only moves while
+ * its own endpoint is overloaded.
+ */
+void MultiEvHttpClient::pickKeyed(std::string_view key, vector<size_t> & order)
+{
+	order.clear();
+	if(endpoints.empty())
+	{
+		return;
+	}
+
+	long total = 0;
+	for(size_t i = 0; i < endpoints.size(); ++i)
+	{
+		total += endpoints[i].client->getOutstanding();
+	}
+	double bound = ceil(loadFactor * (total + 1) / endpoints.size());
+
+	size_t ejected = 0;
+	seen.assign(endpoints.size(), false);
+	size_t slot = hashString(key, 0) % lookup.size();
+	for(size_t n = 0; n < lookup.size() && order.size() + ejected < endpoints.size(); ++n)
+	{
+		size_t i = lookup[(slot + n) % lookup.size()];
+		if(seen[i])
+		{
+			continue;
+		}
+		seen[i] = true;
+		if(!available(endpoints[i]))
+		{
+			ejected++;
+			continue;
+		}
+		order.push_back(i);
+	}
+
+	stable_partition(order.begin(), order.end(), [&](size_t i)
+	{
+		return endpoints[i].client->getOutstanding() < bound;
+	});
+}
+
+/*
+ * Rebuilds the Maglev lookup table. Each endpoint has its
+ * own permutation of the slots, from its URL, and the
+ * endpoints take turns claiming their next free slot.
+ * Endpoints are taken in URL order, so the table only
+ * depends on which endpoints there are.
+ */
+void MultiEvHttpClient::buildLookup()
+{
+	lookup.assign(MAGLEV_TABLE_SIZE, -1);
+	size_t n = endpoints.size();
+	if(n == 0)
+	{
+		return;
+	}
+
+	vector<size_t> byUrl(n);
+	for(size_t i = 0; i < n; ++i)
+	{
+		byUrl[i] = i;
+	}
+	sort(byUrl.begin(), byUrl.end(), [&](size_t a, size_t b)
+	{
+		return endpoints[a].url < endpoints[b].url;
+	});
+
+	vector<uint64_t> offset(n);
+	vector<uint64_t> skip(n);
+	vector<uint64_t> next(n, 0);
+	for(size_t i = 0; i < n; ++i)
+	{
+		offset[i] = hashString(endpoints[i].url, 1) % MAGLEV_TABLE_SIZE;
+		skip[i] = hashString(endpoints[i].url, 2) % (MAGLEV_TABLE_SIZE - 1) + 1;
+	}
+
+	size_t filled = 0;
+	while(true)
+	{
+		for(size_t k = 0; k < n; ++k)
+		{
+			size_t i = byUrl[k];
+			uint64_t slot = (offset[i] + next[i] * skip[i]) % MAGLEV_TABLE_SIZE;
+			while(lookup[slot] >= 0)
+			{
+				next[i]++;
+				slot = (offset[i] + next[i] * skip[i]) % MAGLEV_TABLE_SIZE;
+			}
+			lookup[slot] = i;
+			next[i]++;
+			if(++filled == MAGLEV_TABLE_SIZE)
+			{
+				return;
+			}
+		}
+	}
+}
+
+/*
+ * Makes a request on the first of the candidates,
+ * falling back to the next if its breaker refuses it (a
+ * half-open endpoint only takes so many probes).
+ */
+template<class Submit>
+int MultiEvHttpClient::dispatch(Submit submit)
+{
+	for(size_t i = 0; i < candidates.size(); ++i)
+	{
+		Endpoint & endpoint = endpoints[candidates[i]];
+		int result = submit(endpoint.client);
+		if(result != EVHTTPCLIENT_BREAKER_OPEN)
+		{
+			if(result == 0)
+			{
+				endpoint.requests++;
+			}
+			return result;
+		}
+	}
+	return EVHTTPCLIENT_BREAKER_OPEN;
+}
+
+/*
+ * Deletes removed endpoints' clients once nothing is in
+ * flight on them. Done from a timer, since a request
+ * callback may be what removed the endpoint.
+ */
+void MultiEvHttpClient::sweepCb(struct ev_loop *loop, struct ev_timer *timer, int revents)
+{
+	for(size_t i = 0; i < retired.size(); )
+	{
+		if(retired[i]->getOutstanding() == 0)
+		{
+			delete retired[i];
+			retired.erase(retired.begin() + i);
+		}
+		else
+		{
+			++i;
+		}
+	}
+	if(retired.empty())
+	{
+		ev_timer_stop(loop, &sweepTimer);
+	}
+}
+
+
+/*************
+* Callbacks  *
+*************/
+void MultiEvHttpClient::sweepCbWrapper(struct ev_loop *loop, struct ev_timer *timer, int revents)
+{
+	MultiEvHttpClient *client = (MultiEvHttpClient *) timer->data;
+	client->sweepCb(loop, timer, revents);
+}
@@ -0,0 +1,234 @@
+/***************************************************************
+* MULTIEVHTTPCLIENT
+* -----------------
+* Http client that spreads requests over a set of
+* endpoints (backend servers), each served by its own
+* EvHttpClient and so its own connection pool.
+*
+* Each request goes to the better of two endpoints
+* picked at random ("power of two choices"), judged by
+* requests outstanding and recent latency, so load
+* follows backend speed. Endpoints that keep failing are
+* ejected for a while by their circuit breakers (see
+* EvHttpClient::setCircuitBreaker).
+*
+* Requests made with a routing key instead go to the
+* endpoint the key hashes to (Maglev consistent hashing),
+* so the same key keeps reaching the same backend and its
+* caches, and adding or removing an endpoint moves few
+* keys. An endpoint already carrying more than its share
+* of the load passes keys on to the next in the table
+* (consistent hashing with bounded loads).
+*
+* Currently not thread-safe.
+*
+*/
+
+#ifndef MULTIEVHTTPCLIENT_H_
+#define MULTIEVHTTPCLIENT_H_
+
+/*
+ * Size of the Maglev lookup table; a prime, and best
+ * kept at least 100 times the number of endpoints.
+ */
+#define MAGLEV_TABLE_SIZE (65537)
+
+#define DEFAULT_HASH_LOAD_FACTOR (1.25)
+
+#include <vector>
+#include <map>
+#include <string>
+#include <string_view>
+#include <random>
+#include "evhttpclient.h"
+
+/*
+ * One endpoint's share of the load, as returned by
+ * MultiEvHttpClient::getEndpointReport. requests counts
+ * the requests sent to it.
+ */
+class EndpointReport
+{
+	public:
+		string url;
+		int outstanding;
+		double latency;
+		bool ejected;
+		long requests;
+};
+
+class MultiEvHttpClient
+{
+	public:
+		/*
+		 * Takes the URLs of the endpoints; the other
+		 * parameters are as for EvHttpClient, and apply to
+		 * each endpoint's client. The clients share their
+		 * loop's AsyncResolver. Endpoints are ejected under
+		 * the default BreakerPolicy.
+		 */
+		MultiEvHttpClient(struct ev_loop *loop, const vector<string> & urls,
+			double timeout, void *data = NULL,
+			int init_num_conns = DEFAULT_INIT_NUM_CONNS);
+		~MultiEvHttpClient();
+
+		/*
+		 * Adds an endpoint, or removes one. A removed
+		 * endpoint gets no new requests, and its client is
+		 * deleted once those in flight have finished.
+		 * Each return 0 on success, -1 if the endpoint is
+		 * already present (or absent).
+		 */
+		int addEndpoint(const string & url);
+		int removeEndpoint(const string & url);
+
+		/*
+		 * Applied to every endpoint's client, including
+		 * those added later.
+		 */
+		void setTimeout(double seconds);
+		void setDefaultHeaders(const map<string, string> & headers);
+
+		/*
+		 * Set when endpoints are ejected (see
+		 * BreakerPolicy), or disable ejection.
+		 */
+		void setEjection(bool enabled,
+			const BreakerPolicy & policy = BreakerPolicy());
+
+		/*
+		 * The endpoints, for settings not forwarded
+		 * above. Valid until the endpoint is removed.
+		 */
+		size_t numEndpoints();
+		EvHttpClient *getEndpoint(size_t i);
+
+		vector<EndpointReport> getEndpointReport();
+
+		/*
+		 * Load bound for keyed requests: an endpoint takes a
+		 * key only while its outstanding requests are below
+		 * factor times the mean (rounded up). Must be above
+		 * 1; higher values keep keys in place more strictly.
+		 */
+		void setHashLoadFactor(double factor);
+
+		/*
+		 * Request functions, as for EvHttpClient. The
+		 * request is made on the chosen endpoint's client,
+		 * with its Host header. Return
+		 * EVHTTPCLIENT_BREAKER_OPEN if every endpoint is
+		 * ejected.
+		 */
+		int makeRequest(EvHttpClientCallback cb, std::string_view path,
+			std::string_view method, const HeaderPair *headers, size_t numHeaders,
+			std::string_view body, void *data);
+		template <class Path, class Method, class Body,
+			class = EnableIfStringArgs<Path, Method, Body>>
+		int makeRequest(EvHttpClientCallback cb, const Path & path,
+			const Method & method, std::initializer_list<HeaderPair> headers,
+			const Body & body, void *data);
+		int makeRequest(EvHttpClientCallback cb, const string & path,
+			const string & method, const map<string, string> & headers,
+			const string & body, void *data);
+
+		/*
+		 * Keyed versions of the request functions, routed by
+		 * consistent hashing on key (see above).
+		 */
+		int makeKeyedRequest(std::string_view key, EvHttpClientCallback cb,
+			std::string_view path, std::string_view method,
+			const HeaderPair *headers, size_t numHeaders,
+			std::string_view body, void *data);
+		template <class Path, class Method, class Body,
+			class = EnableIfStringArgs<Path, Method, Body>>
+		int makeKeyedRequest(std::string_view key, EvHttpClientCallback cb,
+			const Path & path, const Method & method,
+			std::initializer_list<HeaderPair> headers,
+			const Body & body, void *data);
+		int makeKeyedRequest(std::string_view key, EvHttpClientCallback cb,
+			const string & path, const string & method,
+			const map<string, string> & headers, const string & body, void *data);
+		int makeKeyedGet(std::string_view key, EvHttpClientCallback cb,
+			const string & path, const map<string, string> & headers, void *data);
+
+		int makeGet(EvHttpClientCallback cb, const string & path,
+			const map<string, string> & headers, void *data);
+		int makePost(EvHttpClientCallback cb, const string & path,
+			const map<string, string> & headers,
+			const string & body, void *data);
+		int makePut(EvHttpClientCallback cb, const string & path,
+			const map<string, string> & headers,
+			const string & body, void *data);
+		int makeDelete(EvHttpClientCallback cb, const string & path,
+			const map<string, string> & headers,
+			const string & body, void *data);
+
+	private:
+		class Endpoint
+		{
+			public:
+				string url;
+				EvHttpClient *client;
+				long requests;
+		};
+
+		struct ev_loop *loop;
+		void *data;
+		int initNumConns;
+		double timeout;
+		map<string, string> defaultHeaders;
+		bool eject;
+		BreakerPolicy ejectionPolicy;
+
+		vector<Endpoint> endpoints;
+		vector<EvHttpClient *> retired;
+		struct ev_timer sweepTimer;
+		std::minstd_rand random;
+		vector<size_t> candidates;
+
+		/*
+		 * Maglev lookup table: endpoint index for each
+		 * slot, rebuilt when endpoints change.
+		 */
+		vector<int> lookup;
+		vector<bool> seen;
+		double loadFactor;
+
+		void configure(EvHttpClient *client);
+		bool available(const Endpoint & endpoint);
+		bool cheaper(const Endpoint & a, const Endpoint & b);
+		void pick(vector<size_t> & order);
+		void pickKeyed(std::string_view key, vector<size_t> & order);
+		void buildLookup();
+		void sweepCb(struct ev_loop *loop, struct ev_timer *timer, int revents);
+		static void sweepCbWrapper(struct ev_loop *loop, struct ev_timer *timer, int revents);
+
+		template<class Submit>
+		int dispatch(Submit submit);
+};
+
+/*
+ * Braced-list request functions, templates for the
+ * same reason as EvHttpClient's.
+ */
+template <class Path, class Method, class Body, class>
+int MultiEvHttpClient::makeRequest(EvHttpClientCallback cb, const Path & path,
+	const Method & method, std::initializer_list<HeaderPair> headers,
+	const Body & body, void *data)
+{
+	return makeRequest(cb, std::string_view(path), std::string_view(method),
+		headers.begin(), headers.size(), std::string_view(body), data);
+}
+
+template <class Path, class Method, class Body, class>
+int MultiEvHttpClient::makeKeyedRequest(std::string_view key, EvHttpClientCallback cb,
+	const Path & path, const Method & method,
+	std::initializer_list<HeaderPair> headers,
+	const Body & body, void *data)
+{
+	return makeKeyedRequest(key, cb, std::string_view(path), std::string_view(method),
+		headers.begin(), headers.size(), std::string_view(body), data);
+}
+
+#endif /* MULTIEVHTTPCLIENT_H_ */
@@ -0,0 +1,242 @@
+#include <algorithm>
+#include "requestgroup.h"
+
+
+/************************
+* RequestGroup (public) *
+************************/
+
+RequestGroup::RequestGroup(struct ev_loop *loop, size_t capacity, double deadline)
+	: results(capacity)
+{
+	this->loop = loop;
+	this->deadline = deadline;
+	count = 0;
+	outstanding = 0;
+	waiting = false;
+	finished = false;
+	deadlinePassed = false;
+	cb = NULL;
+	data = NULL;
+	clients.reserve(capacity);
+
+	ev_timer_init(&deadlineTimer, deadlineCbWrapper, 0., 0.);
+	deadlineTimer.data = (void *) this;
+}
+
+RequestGroup::~RequestGroup()
+{
+	ev_timer_stop(loop, &deadlineTimer);
+	cancelOutstanding();
+	reset();
+}
+
+void RequestGroup::setDeadline(double deadline)
+{
+	this->deadline = deadline;
+}
+
+/*
+ * Makes a request for the group. Its callback, which
+ * is small enough to be stored in the request, fills
+ * in its result.
+ */
+int RequestGroup::add(EvHttpClient *client, std::string_view path,
+	std::string_view method, const HeaderPair *headers, size_t numHeaders,
+	std::string_view body)
+{
+	if(finished)
+	{
+		reset();
+	}
+	if(waiting || count == results.size())
+	{
+		return -1;
+	}
+
+	// Set up first, in case the request finishes at once
+	// (e.g. from the cache).
+	size_t index = count;
+	GroupResult & result = results[index];
+	result.response = NULL;
+	result.done = false;
+	result.client = client;
+	count++;
+	outstanding++;
+
+	RequestCallback requestCb([this, index](ResponseInfo *response)
+	{
+		requestDone(index, response);
+	});
+	if(client->makeCallableRequest(std::move(requestCb), path, method, headers,
+		numHeaders, body, (void *) this, deadline <= 0) != 0)
+	{
+		count--;
+		outstanding--;
+		return -1;
+	}
+
+	if(find(clients.begin(), clients.end(), client) == clients.end())
+	{
+		clients.push_back(client);
+	}
+	return index;
+}
+
+int RequestGroup::add(EvHttpClient *client, std::string_view path,
+	std::string_view method, std::initializer_list<HeaderPair> headers,
+	std::string_view body)
+{
+	return add(client, path, method, headers.begin(), headers.size(), body);
+}
+
+int RequestGroup::addGet(EvHttpClient *client, std::string_view path,
+	std::initializer_list<HeaderPair> headers)
+{
+	return add(client, path, "GET", headers, "");
+}
+
+int RequestGroup::wait(RequestGroupCallback cb, void *data)
+{
+	if(waiting)
+	{
+		return -1;
+	}
+	if(finished)
+	{
+		reset();
+	}
+
+	this->cb = cb;
+	this->data = data;
+	waiting = true;
+	if(outstanding == 0)
+	{
+		finish();
+		return 0;
+	}
+
+	if(deadline > 0)
+	{
+		ev_timer_set(&deadlineTimer, deadline, 0.);
+		ev_timer_start(loop, &deadlineTimer);
+	}
+	return 0;
+}
+
+size_t RequestGroup::size()
+{
+	return count;
+}
+
+const GroupResult *RequestGroup::getResults()
+{
+	return results.data();
+}
+
+const GroupResult & RequestGroup::getResult(size_t index)
+{
+	return results[index];
+}
+
+size_t RequestGroup::numDone()
+{
+	return count - outstanding;
+}
+
+bool RequestGroup::expired()
+{
+	return deadlinePassed;
+}
+
+
+/*************************
+* RequestGroup (private) *
+*************************/
+
+/*
+ * Releases the last round's responses and empties the
+ * group, keeping its storage.
+ */
+void RequestGroup::reset()
+{
+	for(size_t i = 0; i < count; ++i)
+	{
+		if(results[i].response != NULL)
+		{
+			results[i].client->releaseResponse(results[i].response);
+			results[i].response = NULL;
+		}
+	}
+	count = 0;
+	outstanding = 0;
+	waiting = false;
+	finished = false;
+	deadlinePassed = false;
+	clients.clear();
+}
+
+/*
+ * Cancels the requests not yet done. All of a round's
+ * requests carry the group as their data pointer, so
+ * one pass per client finds them.
+ */
+void RequestGroup::cancelOutstanding()
+{
+	if(outstanding == 0)
+	{
+		return;
+	}
+	for(size_t i = 0; i < clients.size(); ++i)
+	{
+		clients[i]->cancelRequests((void *) this);
+	}
+	outstanding = 0;
+}
+
+void RequestGroup::requestDone(size_t index, ResponseInfo *response)
+{
+	GroupResult & result = results[index];
+	result.done = true;
+	if(response != NULL)
+	{
+		result.client->keepResponse(response);
+		result.response = response;
+	}
+
+	outstanding--;
+	if(waiting && outstanding == 0)
+	{
+		finish();
+	}
+}
+
+/*
+ * Ends the round and calls the group's callback, which
+ * may reuse or delete the group, so nothing touches it
+ * afterwards.
+ */
+void RequestGroup::finish()
+{
+	ev_timer_stop(loop, &deadlineTimer);
+	waiting = false;
+	finished = true;
+	if(cb != NULL)
+	{
+		cb(this, data);
+	}
+}
+
+void RequestGroup::deadlineCb()
+{
+	deadlinePassed = true;
+	cancelOutstanding();
+	finish();
+}
+
+void RequestGroup::deadlineCbWrapper(struct ev_loop *loop, struct ev_timer *timer,
+	int revents)
+{
+	RequestGroup *group = (RequestGroup *) timer->data;
+	group->deadlineCb();
+}
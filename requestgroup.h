@@ -0,0 +1,153 @@
+/***************************************************************
+* REQUESTGROUP
+* ------------
+* Scatter-gather over EvHttpClients: a group of requests
+* (to one client or several, on one loop) whose results
+* are delivered together, in one callback, once every
+* request has finished or the group's deadline has
+* passed, whichever comes first.
+*
+* With a deadline, the group's requests have no timeouts
+* of their own; one timer serves the whole group, and
+* requests still outstanding when it fires are
+* cancelled. Results are kept in one array, allocated
+* with the group, so a group that is reused allocates
+* nothing for its bookkeeping.
+*
+* Not thread-safe.
+*
+*/
+
+#ifndef REQUESTGROUP_H_
+#define REQUESTGROUP_H_
+
+#include <vector>
+#include <string_view>
+#include <initializer_list>
+#include <ev.h>
+#include "evhttpclient.h"
+
+class RequestGroup;
+
+/*
+ * Signature for the callback of a RequestGroup.
+ *
+ * The first argument is the group, whose results may be
+ * read (see getResult). The second is the data pointer
+ * passed to wait.
+ */
+typedef void (*RequestGroupCallback) (RequestGroup *, void *);
+
+/*
+ * Outcome of one request of a RequestGroup. done is
+ * false if the request was still outstanding at the
+ * deadline. response is NULL if the request failed or
+ * was not done; otherwise it is as for an
+ * EvHttpClientCallback (and timeout may be set if the
+ * client's own timeout applied).
+ */
+class GroupResult
+{
+	friend class RequestGroup;
+
+	public:
+		ResponseInfo *response;
+		bool done;
+
+	private:
+		EvHttpClient *client;
+};
+
+class RequestGroup
+{
+	public:
+		/*
+		 * A group of up to capacity requests, on clients
+		 * running on loop. The deadline is in seconds from
+		 * wait; if it is 0, there is no group deadline and
+		 * each request has its client's timeout instead.
+		 */
+		RequestGroup(struct ev_loop *loop, size_t capacity, double deadline);
+
+		/*
+		 * Cancels any requests outstanding. Their callbacks
+		 * and the group's are not called.
+		 */
+		~RequestGroup();
+
+		void setDeadline(double deadline);
+
+		/*
+		 * Request functions, as for EvHttpClient. Each
+		 * request is made at once, and gets the next result
+		 * slot. Adding to a group whose callback has run
+		 * starts a new round, releasing the old results.
+		 *
+		 * Each returns the request's index among the
+		 * results, or -1 if it could not be made (or the
+		 * group is full or waiting).
+		 */
+		int add(EvHttpClient *client, std::string_view path,
+			std::string_view method, const HeaderPair *headers, size_t numHeaders,
+			std::string_view body);
+		int add(EvHttpClient *client, std::string_view path,
+			std::string_view method, std::initializer_list<HeaderPair> headers,
+			std::string_view body);
+		int addGet(EvHttpClient *client, std::string_view path,
+			std::initializer_list<HeaderPair> headers = {});
+
+		/*
+		 * Starts the deadline and arranges for cb to be
+		 * called once all the requests added have finished,
+		 * or at the deadline. If none are outstanding, cb is
+		 * called at once.
+		 *
+		 * The results stay valid until the group is reused
+		 * or destroyed, which cb may do.
+		 *
+		 * Returns 0 on success, -1 if already waiting.
+		 */
+		int wait(RequestGroupCallback cb, void *data);
+
+		/*
+		 * The results, in the order the requests were added.
+		 * getResults returns them as one array of size()
+		 * results.
+		 */
+		size_t size();
+		const GroupResult *getResults();
+		const GroupResult & getResult(size_t index);
+
+		/*
+		 * The number of requests that have finished, and
+		 * whether the deadline cut the last round short.
+		 */
+		size_t numDone();
+		bool expired();
+
+	private:
+		struct ev_loop *loop;
+		double deadline;
+		vector<GroupResult> results;
+		size_t count;
+		size_t outstanding;
+		bool waiting;
+		bool finished;
+		bool deadlinePassed;
+		RequestGroupCallback cb;
+		void *data;
+		struct ev_timer deadlineTimer;
+
+		// Distinct clients of the round, for cancelling.
+		vector<EvHttpClient *> clients;
+
+		void reset();
+		void cancelOutstanding();
+		void requestDone(size_t index, ResponseInfo *response);
+		void finish();
+		void deadlineCb();
+		static void deadlineCbWrapper(struct ev_loop *loop, struct ev_timer *timer,
+			int revents);
+};
+
+#endif /* REQUESTGROUP_H_ */
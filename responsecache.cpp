@@ -0,0 +1,574 @@
+#include <algorithm>
+#include <charconv>
+#include <time.h>
+#include <string.h>
+#include <strings.h>
+#include "responsecache.h"
+#include "cachefile.h"
+
+/*
+ * Without explicit freshness, a response with
+ * Last-Modified is considered fresh for this fraction
+ * of its age when received, up to a day.
+ */
+#define CACHE_HEURISTIC_FRACTION (0.1)
+#define CACHE_HEURISTIC_MAX (86400.)
+
+/*
+ * Approximate bookkeeping cost of an entry on top of
+ * its strings, counted against the memory bound.
+ */
+#define CACHE_ENTRY_OVERHEAD (sizeof(CacheEntry) + 64)
+
+
+/**********
+* Helpers *
+**********/
+
+/*
+ * Returns the next comma-separated token in value
+ * starting at *pos, trimmed, and advances *pos past it.
+ */
+static std::string_view nextToken(std::string_view value, size_t *pos)
+{
+	size_t end = value.find(',', *pos);
+	if(end == std::string_view::npos)
+	{
+		end = value.size();
+	}
+
+	size_t first = *pos;
+	size_t last = end;
+	while(first < last && (value[first] == ' ' || value[first] == '\t'))
+	{
+		first++;
+	}
+	while(last > first && (value[last - 1] == ' ' || value[last - 1] == '\t'))
+	{
+		last--;
+	}
+
+	*pos = end + 1;
+	return value.substr(first, last - first);
+}
+
+static bool equalsIgnoreCase(std::string_view a, std::string_view b)
+{
+	return a.size() == b.size() && strncasecmp(a.data(), b.data(), a.size()) == 0;
+}
+
+/*
+ * Finds a directive in a Cache-Control value, e.g.
+ * "max-age" in "public, max-age=60". If arg is given,
+ * sets it to the directive's argument without quotes.
+ */
+static bool cacheDirective(std::string_view value, std::string_view name,
+	std::string_view *arg)
+{
+	size_t pos = 0;
+	while(pos < value.size())
+	{
+		std::string_view token = nextToken(value, &pos);
+		size_t eq = token.find('=');
+		if(!equalsIgnoreCase(token.substr(0, eq), name))
+		{
+			continue;
+		}
+
+		if(arg != NULL)
+		{
+			*arg = eq == std::string_view::npos ? std::string_view() : token.substr(eq + 1);
+			if(arg->size() >= 2 && arg->front() == '"' && arg->back() == '"')
+			{
+				*arg = arg->substr(1, arg->size() - 2);
+			}
+		}
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Parses a non-negative number of seconds (as used by
+ * max-age and Age). Returns -1 if there is none.
+ */
+static double parseSeconds(std::string_view value)
+{
+	long seconds = 0;
+	std::from_chars_result result =
+		std::from_chars(value.data(), value.data() + value.size(), seconds);
+	if(result.ec != std::errc() || seconds < 0)
+	{
+		return -1;
+	}
+	return seconds;
+}
+
+/*
+ * Parses an HTTP date (RFC 1123 format) into seconds
+ * since the epoch. Returns -1 if it can't be parsed.
+ */
+double ResponseCache::parseHttpDate(std::string_view value)
+{
+	char buffer[64];
+	if(value.size() == 0 || value.size() >= sizeof(buffer))
+	{
+		return -1;
+	}
+	memcpy(buffer, value.data(), value.size());
+	buffer[value.size()] = 0;
+
+	struct tm tm;
+	bzero(&tm, sizeof(tm));
+	if(strptime(buffer, "%a, %d %b %Y %H:%M:%S", &tm) == NULL)
+	{
+		return -1;
+	}
+	return timegm(&tm);
+}
+
+/*
+ * Status codes that may be cached by default.
+ */
+static bool cacheableStatus(short code)
+{
+	switch(code)
+	{
+		case 200: case 203: case 204: case 300: case 301:
+		case 404: case 405: case 410: case 414: case 501:
+			return true;
+		default:
+			return false;
+	}
+}
+
+/*
+ * Works out how much longer a response may be served
+ * without revalidation: its freshness lifetime (from
+ * max-age, else Expires - Date, else the Last-Modified
+ * heuristic) less its current age. no-cache makes it
+ * stale at once. Returns false if the response must not
+ * be stored at all.
+ */
+static bool freshness(const ResponseInfo *response, double now,
+	double *lifetime, double *ttl)
+{
+	std::string_view cacheControl = response->getHeader(HEADER_CACHE_CONTROL);
+	if(cacheDirective(cacheControl, "no-store", NULL))
+	{
+		return false;
+	}
+
+	double date = ResponseCache::parseHttpDate(response->getHeader(HEADER_DATE));
+	if(date < 0)
+	{
+		date = now;
+	}
+	double age = max(now - date, parseSeconds(response->getHeader(HEADER_AGE)));
+	age = max(age, 0.);
+
+	std::string_view arg;
+	if(cacheDirective(cacheControl, "no-cache", NULL))
+	{
+		*lifetime = 0;
+	}
+	else if(cacheDirective(cacheControl, "max-age", &arg))
+	{
+		*lifetime = max(parseSeconds(arg), 0.);
+	}
+	else if(response->hasHeader(HEADER_EXPIRES))
+	{
+		double expires = ResponseCache::parseHttpDate(response->getHeader(HEADER_EXPIRES));
+		*lifetime = max(expires - date, 0.);
+	}
+	else
+	{
+		double modified = ResponseCache::parseHttpDate(response->getHeader(HEADER_LAST_MODIFIED));
+		*lifetime = 0;
+		if(modified >= 0 && modified < date)
+		{
+			*lifetime = min((date - modified) * CACHE_HEURISTIC_FRACTION,
+				CACHE_HEURISTIC_MAX);
+		}
+	}
+
+	*ttl = *lifetime - age;
+	return true;
+}
+
+
+
+/*************************
+* ResponseCache (public) *
+*************************/
+
+ResponseCache::ResponseCache(size_t maxBytes)
+{
+	this->maxBytes = maxBytes;
+	bytes = 0;
+	file = NULL;
+	hits = 0;
+	fileHits = 0;
+	misses = 0;
+	revalidated = 0;
+	stores = 0;
+	evictions = 0;
+}
+
+ResponseCache::~ResponseCache()
+{
+	delete file;
+}
+
+/*
+ * Opens the persistent tier. Entries already in memory
+ * are not written to it.
+ */
+int ResponseCache::openFile(const string & path, size_t capacity)
+{
+	CacheFile *newFile = new CacheFile();
+	if(newFile->open(path, capacity) < 0)
+	{
+		delete newFile;
+		return -1;
+	}
+
+	delete file;
+	file = newFile;
+	return 0;
+}
+
+void ResponseCache::setMaxBytes(size_t maxBytes)
+{
+	this->maxBytes = maxBytes;
+	evict();
+}
+
+CacheLookup ResponseCache::lookup(std::string_view key,
+	std::string_view request, double now, const CacheEntry **entry)
+{
+	EntryIndex::iterator iter = index.find(key);
+	if(iter == index.end())
+	{
+		iter = load(key);
+	}
+	if(iter == index.end())
+	{
+		misses++;
+		return CACHE_MISS;
+	}
+
+	CacheEntry & found = *iter->second;
+	for(size_t i = 0; i < found.varyNames.size(); ++i)
+	{
+		if(requestHeader(request, found.varyNames[i]) != found.varyValues[i])
+		{
+			misses++;
+			return CACHE_MISS;
+		}
+	}
+
+	entries.splice(entries.begin(), entries, iter->second);
+	*entry = &found;
+	if(now < found.expires)
+	{
+		hits++;
+		return CACHE_HIT;
+	}
+
+	misses++;
+	return CACHE_STALE;
+}
+
+void ResponseCache::store(std::string_view key, std::string_view request,
+	const ResponseInfo *response, double now)
+{
+	remove(key);
+
+	double lifetime;
+	double ttl;
+	std::string_view etag = response->getHeader(HEADER_ETAG);
+	std::string_view lastModified = response->getHeader(HEADER_LAST_MODIFIED);
+	if(!cacheableStatus(response->code) ||
+		!freshness(response, now, &lifetime, &ttl) ||
+		(ttl <= 0 && etag.size() == 0 && lastModified.size() == 0))
+	{
+		return;
+	}
+
+	// Vary: * means no request can be matched to this
+	// response.
+	std::string_view vary = response->getHeader(HEADER_VARY);
+	vector<string> varyNames;
+	vector<string> varyValues;
+	size_t pos = 0;
+	while(pos < vary.size())
+	{
+		std::string_view name = nextToken(vary, &pos);
+		if(name == "*")
+		{
+			return;
+		}
+		if(name.size() > 0)
+		{
+			varyNames.push_back(string(name));
+			varyValues.push_back(string(requestHeader(request, name)));
+		}
+	}
+
+	CacheEntry probe;
+	probe.key.assign(key);
+	probe.etag.assign(etag);
+	probe.lastModified.assign(lastModified);
+	probe.varyNames.swap(varyNames);
+	probe.varyValues.swap(varyValues);
+	size_t size = entrySize(probe, response->headerBlock.size(),
+		response->headerSpans.size() * sizeof(ResponseInfo::HeaderSpan),
+		response->response.size());
+	if(size > maxBytes)
+	{
+		return;
+	}
+
+	entries.push_front(CacheEntry());
+	CacheEntry & entry = entries.front();
+	entry.key.swap(probe.key);
+	entry.code = response->code;
+	entry.etag.swap(probe.etag);
+	entry.lastModified.swap(probe.lastModified);
+	entry.expires = now + ttl;
+	entry.lifetime = lifetime;
+	entry.size = size;
+	entry.headerBlock.assign(response->headerBlock);
+	entry.headerSpans.assign(response->headerSpans.begin(), response->headerSpans.end());
+	memcpy(entry.wellKnown, response->wellKnown, sizeof(entry.wellKnown));
+	entry.body.assign(response->response);
+	entry.varyNames.swap(probe.varyNames);
+	entry.varyValues.swap(probe.varyValues);
+
+	index.insert(EntryIndex::value_type(entry.key, entries.begin()));
+	bytes += size;
+	stores++;
+	if(file != NULL)
+	{
+		file->store(entry, now);
+	}
+	evict();
+}
+
+/*
+ * A 304 carrying its own Cache-Control or Expires
+ * resets the entry's freshness from those; otherwise
+ * the entry is fresh again for its original lifetime.
+ * A new ETag replaces the stored one.
+ */
+const CacheEntry *ResponseCache::refresh(std::string_view key,
+	const ResponseInfo *notModified, double now)
+{
+	EntryIndex::iterator iter = index.find(key);
+	if(iter == index.end())
+	{
+		return NULL;
+	}
+
+	CacheEntry & entry = *iter->second;
+	double lifetime = entry.lifetime;
+	double ttl = lifetime;
+	if(notModified->hasHeader(HEADER_CACHE_CONTROL) ||
+		notModified->hasHeader(HEADER_EXPIRES))
+	{
+		if(!freshness(notModified, now, &lifetime, &ttl))
+		{
+			remove(key);
+			return NULL;
+		}
+	}
+	entry.lifetime = lifetime;
+	entry.expires = now + ttl;
+	if(notModified->hasHeader(HEADER_ETAG))
+	{
+		entry.etag.assign(notModified->getHeader(HEADER_ETAG));
+	}
+
+	entries.splice(entries.begin(), entries, iter->second);
+	revalidated++;
+	if(file != NULL)
+	{
+		file->store(entry, now);
+	}
+	return &entry;
+}
+
+void ResponseCache::fill(const CacheEntry *entry, ResponseInfo *response) const
+{
+	response->code = entry->code;
+	response->headerBlock.assign(entry->headerBlock);
+	response->headerSpans.assign(entry->headerSpans.begin(), entry->headerSpans.end());
+	memcpy(response->wellKnown, entry->wellKnown, sizeof(response->wellKnown));
+	response->compatHeaders.clear();
+	response->compatBuilt = false;
+	response->response.assign(entry->body);
+}
+
+void ResponseCache::invalidate(std::string_view prefix)
+{
+	EntryIndex::iterator iter = index.lower_bound(prefix);
+	while(iter != index.end() && iter->first.compare(0, prefix.size(), prefix) == 0)
+	{
+		EntryIndex::iterator next = iter;
+		++next;
+		erase(iter);
+		iter = next;
+	}
+
+	if(file != NULL)
+	{
+		file->invalidate(prefix);
+	}
+}
+
+CacheStats ResponseCache::stats() const
+{
+	CacheStats stats;
+	stats.hits = hits;
+	stats.misses = misses;
+	stats.revalidated = revalidated;
+	stats.stores = stores;
+	stats.evictions = evictions;
+	stats.entries = index.size();
+	stats.bytes = bytes;
+	stats.maxBytes = maxBytes;
+	stats.fileHits = fileHits;
+	stats.fileEntries = file != NULL ? file->entries() : 0;
+	stats.fileBytes = file != NULL ? file->bytes() : 0;
+	return stats;
+}
+
+/*
+ * Scans the header lines between the request line and
+ * the blank line that ends the headers.
+ */
+std::string_view ResponseCache::requestHeader(std::string_view request,
+	std::string_view name)
+{
+	size_t pos = request.find("\r\n");
+	while(pos != std::string_view::npos)
+	{
+		pos += 2;
+		size_t end = request.find("\r\n", pos);
+		if(end == std::string_view::npos || end == pos)
+		{
+			break;
+		}
+
+		std::string_view line = request.substr(pos, end - pos);
+		size_t colon = line.find(':');
+		if(colon != std::string_view::npos &&
+			equalsIgnoreCase(line.substr(0, colon), name))
+		{
+			std::string_view value = line.substr(colon + 1);
+			size_t first = 0;
+			while(first < value.size() && (value[first] == ' ' || value[first] == '\t'))
+			{
+				first++;
+			}
+			return value.substr(first);
+		}
+		pos = end;
+	}
+	return std::string_view();
+}
+
+
+/**************************
+* ResponseCache (private) *
+**************************/
+
+void ResponseCache::erase(EntryIndex::iterator iter)
+{
+	bytes -= iter->second->size;
+	entries.erase(iter->second);
+	index.erase(iter);
+}
+
+/*
+ * Memory an entry is charged against the cache's bound,
+ * given the sizes of its headers and body.
+ */
+size_t ResponseCache::entrySize(const CacheEntry & entry, size_t headerBlockSize,
+	size_t spansSize, size_t bodySize)
+{
+	size_t size = CACHE_ENTRY_OVERHEAD + 2 * entry.key.size() + entry.etag.size() +
+		entry.lastModified.size() + headerBlockSize + spansSize + bodySize;
+	for(size_t i = 0; i < entry.varyNames.size(); ++i)
+	{
+		size += entry.varyNames[i].size() + entry.varyValues[i].size();
+	}
+	return size;
+}
+
+/*
+ * Removes the entry for key from memory and from the
+ * file, if any.
+ */
+void ResponseCache::remove(std::string_view key)
+{
+	EntryIndex::iterator iter = index.find(key);
+	if(iter != index.end())
+	{
+		erase(iter);
+	}
+	if(file != NULL)
+	{
+		file->erase(key);
+	}
+}
+
+/*
+ * Brings the file's entry for key, if any, into memory.
+ * Returns its index position, or index.end().
+ */
+ResponseCache::EntryIndex::iterator ResponseCache::load(std::string_view key)
+{
+	if(file == NULL)
+	{
+		return index.end();
+	}
+
+	CacheEntry loaded;
+	if(!file->load(key, &loaded))
+	{
+		return index.end();
+	}
+
+	loaded.size = entrySize(loaded, loaded.headerBlock.size(),
+		loaded.headerSpans.size() * sizeof(ResponseInfo::HeaderSpan),
+		loaded.body.size());
+	if(loaded.size > maxBytes)
+	{
+		return index.end();
+	}
+
+	entries.push_front(CacheEntry());
+	CacheEntry & entry = entries.front();
+	swap(entry, loaded);
+	EntryIndex::iterator iter =
+		index.insert(EntryIndex::value_type(entry.key, entries.begin())).first;
+	bytes += entry.size;
+	fileHits++;
+	evict();
+	return iter;
+}
+
+/*
+ * Drops least recently used entries until the cache
+ * is within its memory bound. They stay in the file.
+ */
+void ResponseCache::evict()
+{
+	while(bytes > maxBytes && !entries.empty())
+	{
+		erase(index.find(entries.back().key));
+		evictions++;
+	}
+}
@@ -0,0 +1,171 @@
+/***************************************************************
+* RESPONSECACHE
+* -------------
+* In-memory LRU cache of HTTP responses, bounded by the
+* bytes it holds. Used by EvHttpClient to answer GETs
+* without going to the network; see EvHttpClient::setCache.
+*
+* Freshness follows HTTP caching: Cache-Control max-age,
+* no-store and no-cache, Expires, Date and Age, with a
+* heuristic based on Last-Modified when none is given.
+* Responses with Vary are only reused for requests that
+* match on the named headers.
+*
+* Optionally backed by a CacheFile, which keeps entries
+* across restarts and holds more than fits in memory.
+*
+* Currently not thread-safe.
+*
+*/
+
+#ifndef RESPONSECACHE_H_
+#define RESPONSECACHE_H_
+
+#include <list>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <functional>
+#include "evhttpclient.h"
+
+class CacheFile;
+
+/*
+ * Outcome of ResponseCache::lookup. A stale entry can
+ * still be revalidated with the server.
+ */
+enum CacheLookup
+{
+	CACHE_MISS,
+	CACHE_HIT,
+	CACHE_STALE
+};
+
+/*
+ * A stored response. etag and lastModified are the
+ * validators used to revalidate it once stale.
+ */
+class CacheEntry
+{
+	friend class ResponseCache;
+	friend class CacheFile;
+
+	public:
+		string key;
+		short code;
+		string etag;
+		string lastModified;
+		double expires;
+
+	private:
+		double lifetime;
+		size_t size;
+		string headerBlock;
+		vector<ResponseInfo::HeaderSpan> headerSpans;
+		short wellKnown[NUM_WELL_KNOWN_HEADERS];
+		string body;
+		vector<string> varyNames;
+		vector<string> varyValues;
+};
+
+class ResponseCache
+{
+	public:
+		ResponseCache(size_t maxBytes);
+		~ResponseCache();
+
+		/*
+		 * Adds a persistent tier in the file at path, sized
+		 * to capacity bytes (see CacheFile). Entries it holds
+		 * from earlier runs are served as if stored in memory.
+		 * Returns 0 on success, -1 on failure.
+		 */
+		int openFile(const string & path, size_t capacity);
+
+		/*
+		 * Changes the memory bound, evicting least recently
+		 * used entries as needed.
+		 */
+		void setMaxBytes(size_t maxBytes);
+
+		/*
+		 * Finds the entry stored under key whose Vary
+		 * headers match the (serialized) request. On a hit
+		 * or a stale entry, sets entry and marks it most
+		 * recently used. Entries only in the file are
+		 * loaded into memory first.
+		 */
+		CacheLookup lookup(std::string_view key, std::string_view request,
+			double now, const CacheEntry **entry);
+
+		/*
+		 * Stores a response received for request under key,
+		 * replacing any previous entry. Responses that may
+		 * not be cached (or have neither freshness nor
+		 * validators) just remove the previous entry.
+		 */
+		void store(std::string_view key, std::string_view request,
+			const ResponseInfo *response, double now);
+
+		/*
+		 * Freshens the entry under key after the server
+		 * answered a conditional request with 304 Not
+		 * Modified. Returns the entry, or NULL if it has
+		 * been evicted in the meantime.
+		 */
+		const CacheEntry *refresh(std::string_view key,
+			const ResponseInfo *notModified, double now);
+
+		/*
+		 * Copies a stored status, headers and body into
+		 * response (into its arena).
+		 */
+		void fill(const CacheEntry *entry, ResponseInfo *response) const;
+
+		/*
+		 * Removes every entry whose key starts with prefix.
+		 */
+		void invalidate(std::string_view prefix);
+
+		CacheStats stats() const;
+
+		/*
+		 * Value of the first header called name (any case)
+		 * in a serialized request, or an empty view.
+		 */
+		static std::string_view requestHeader(std::string_view request,
+			std::string_view name);
+
+		/*
+		 * Seconds since the epoch for an HTTP date, or -1
+		 * if it can't be parsed.
+		 */
+		static double parseHttpDate(std::string_view value);
+
+	private:
+		typedef list<CacheEntry> EntryList;
+		typedef map<string, EntryList::iterator, std::less<> > EntryIndex;
+
+		EntryList entries;
+		EntryIndex index;
+		size_t maxBytes;
+		size_t bytes;
+		CacheFile *file;
+
+		long hits;
+		long fileHits;
+		long misses;
+		long revalidated;
+		long stores;
+		long evictions;
+
+		void erase(EntryIndex::iterator iter);
+		void remove(std::string_view key);
+		EntryIndex::iterator load(std::string_view key);
+		void evict();
+		static size_t entrySize(const CacheEntry & entry, size_t headerBlockSize,
+			size_t spansSize, size_t bodySize);
+};
+
+#endif /* RESPONSECACHE_H_ */
@@ -0,0 +1,418 @@
+#include <functional>
+#include <pthread.h>
+#include <sched.h>
+#include "shardedevhttpclient.h"
+
+
+/*******************
+* Helper functions *
+*******************/
+
+/*
+ * Stands in for a NULL callback, so that the shards
+ * need not check for one.
+ */
+static void noOpCb(ResponseInfo *response, void *requestData,
+	void *clientData)
+{
+	// Do nothing.
+}
+
+
+/*******************************
+* ShardedEvHttpClient (public) *
+*******************************/
+
+ShardedEvHttpClient::ShardedEvHttpClient(const string & url, double timeout,
+	void *data, int num_shards, int init_num_conns, bool pin)
+{
+	this->data = data;
+	dispatch = SHARD_ROUND_ROBIN;
+	stealing = true;
+	nextShard = 0;
+
+	int cores = std::thread::hardware_concurrency();
+	if(cores < 1)
+	{
+		cores = 1;
+	}
+	if(num_shards < 1)
+	{
+		num_shards = cores;
+	}
+
+	for(int i = 0; i < num_shards; ++i)
+	{
+		Shard *shard = new Shard();
+		shard->owner = this;
+		shard->loop = ev_loop_new(EVFLAG_AUTO);
+		shard->client = new EvHttpClient(shard->loop, url, timeout, (void *) shard,
+			init_num_conns);
+		shard->stopping = false;
+		shard->queued = 0;
+		shard->outstanding = 0;
+		shard->requests = 0;
+		shard->stolen = 0;
+
+		// Unlike the client's own watchers, this one keeps
+		// the shard's loop running while it waits for work.
+		ev_async_init(&shard->wake, wakeCbWrapper);
+		shard->wake.data = (void *) shard;
+		ev_async_start(shard->loop, &shard->wake);
+
+		shards.push_back(shard);
+	}
+
+	// Shards look at each other, so none starts until
+	// all are there.
+	for(int i = 0; i < num_shards; ++i)
+	{
+		shards[i]->thread = std::thread(&ShardedEvHttpClient::run, this, shards[i]);
+#ifdef __linux__
+		if(pin)
+		{
+			cpu_set_t cpus;
+			CPU_ZERO(&cpus);
+			CPU_SET(i % cores, &cpus);
+			pthread_setaffinity_np(shards[i]->thread.native_handle(), sizeof(cpus), &cpus);
+		}
+#endif
+	}
+}
+
+ShardedEvHttpClient::~ShardedEvHttpClient()
+{
+	for(size_t i = 0; i < shards.size(); ++i)
+	{
+		shards[i]->stopping = true;
+		ev_async_send(shards[i]->loop, &shards[i]->wake);
+	}
+	for(size_t i = 0; i < shards.size(); ++i)
+	{
+		shards[i]->thread.join();
+	}
+
+	for(size_t i = 0; i < shards.size(); ++i)
+	{
+		Shard *shard = shards[i];
+		deque<QueuedRequest> *queues[] = { &shard->queue, &shard->keyed };
+		for(size_t j = 0; j < 2; ++j)
+		{
+			for(size_t k = 0; k < queues[j]->size(); ++k)
+			{
+				QueuedRequest & request = (*queues[j])[k];
+				request.cb(NULL, request.data, data);
+			}
+		}
+
+		delete shard->client;
+		ev_async_stop(shard->loop, &shard->wake);
+		ev_loop_destroy(shard->loop);
+		for(size_t j = 0; j < shard->freeSlots.size(); ++j)
+		{
+			delete shard->freeSlots[j];
+		}
+		delete shard;
+	}
+}
+
+void ShardedEvHttpClient::setDispatch(ShardDispatch dispatch)
+{
+	this->dispatch = dispatch;
+}
+
+void ShardedEvHttpClient::setWorkStealing(bool enabled)
+{
+	stealing = enabled;
+}
+
+int ShardedEvHttpClient::numShards()
+{
+	return shards.size();
+}
+
+vector<ShardReport> ShardedEvHttpClient::getShardReport()
+{
+	vector<ShardReport> report(shards.size());
+	for(size_t i = 0; i < shards.size(); ++i)
+	{
+		report[i].queued = shards[i]->queued;
+		report[i].outstanding = shards[i]->outstanding;
+		report[i].requests = shards[i]->requests;
+		report[i].stolen = shards[i]->stolen;
+	}
+	return report;
+}
+
+/*
+ * Request functions. Requests are serialized on the
+ * calling thread by the first shard's client while that
+ * shard's thread uses it. This is safe only because
+ * buildRequest reads nothing but the client's default
+ * headers, Host and path, which are set when the client
+ * is constructed and never changed after: the shard
+ * clients are private, and nothing here calls
+ * setDefaultHeaders on them. Keep it that way.
+ */
+int ShardedEvHttpClient::makeRequest(EvHttpClientCallback cb,
+	std::string_view path, std::string_view method,
+	const HeaderPair *headers, size_t numHeaders,
+	std::string_view body, void *data)
+{
+	QueuedRequest request;
+	request.cb = cb != NULL ? cb : noOpCb;
+	request.data = data;
+	shards[0]->client->buildRequest(request.requestString, path, method,
+		headers, numHeaders, body);
+	enqueue(pick(), request, false);
+	return 0;
+}
+
+int ShardedEvHttpClient::makeRequest(EvHttpClientCallback cb,
+	std::string_view path, std::string_view method,
+	std::initializer_list<HeaderPair> headers,
+	std::string_view body, void *data)
+{
+	return makeRequest(cb, path, method, headers.begin(), headers.size(),
+		body, data);
+}
+
+int ShardedEvHttpClient::makeGet(EvHttpClientCallback cb, std::string_view path,
+	std::initializer_list<HeaderPair> headers, void *data)
+{
+	return makeRequest(cb, path, "GET", headers, "", data);
+}
+
+int ShardedEvHttpClient::makeKeyedRequest(std::string_view key,
+	EvHttpClientCallback cb, std::string_view path, std::string_view method,
+	const HeaderPair *headers, size_t numHeaders,
+	std::string_view body, void *data)
+{
+	QueuedRequest request;
+	request.cb = cb != NULL ? cb : noOpCb;
+	request.data = data;
+	shards[0]->client->buildRequest(request.requestString, path, method,
+		headers, numHeaders, body);
+	enqueue(shards[std::hash<std::string_view>()(key) % shards.size()], request, true);
+	return 0;
+}
+
+int ShardedEvHttpClient::makeKeyedGet(std::string_view key,
+	EvHttpClientCallback cb, std::string_view path,
+	std::initializer_list<HeaderPair> headers, void *data)
+{
+	return makeKeyedRequest(key, cb, path, "GET", headers.begin(), headers.size(),
+		"", data);
+}
+
+
+/********************************
+* ShardedEvHttpClient (private) *
+********************************/
+
+/*
+ * Chooses the shard for an unkeyed request.
+ */
+ShardedEvHttpClient::Shard *ShardedEvHttpClient::pick()
+{
+	if(dispatch == SHARD_LEAST_LOADED)
+	{
+		return leastLoaded();
+	}
+	return shards[nextShard++ % shards.size()];
+}
+
+/*
+ * The shard with the fewest requests queued and
+ * outstanding.
+ */
+ShardedEvHttpClient::Shard *ShardedEvHttpClient::leastLoaded()
+{
+	Shard *best = shards[0];
+	int bestLoad = best->queued + best->outstanding;
+	for(size_t i = 1; i < shards.size(); ++i)
+	{
+		int load = shards[i]->queued + shards[i]->outstanding;
+		if(load < bestLoad)
+		{
+			best = shards[i];
+			bestLoad = load;
+		}
+	}
+	return best;
+}
+
+/*
+ * Queues a request for shard. Only the request that
+ * finds the queue empty wakes the shard; later ones are
+ * picked up by the same drain. If the queue is getting
+ * long, the least loaded shard is woken to help.
+ */
+void ShardedEvHttpClient::enqueue(Shard *shard, QueuedRequest & request, bool keyed)
+{
+	bool wake;
+	size_t length;
+	{
+		std::lock_guard<std::mutex> guard(shard->lock);
+		wake = shard->queue.empty() && shard->keyed.empty();
+		(keyed ? shard->keyed : shard->queue).push_back(std::move(request));
+		length = shard->queue.size();
+		shard->queued++;
+	}
+
+	if(wake)
+	{
+		ev_async_send(shard->loop, &shard->wake);
+	}
+	else if(stealing && length >= SHARD_STEAL_THRESHOLD)
+	{
+		Shard *helper = leastLoaded();
+		if(helper != shard && helper->outstanding < SHARD_STEAL_THRESHOLD)
+		{
+			ev_async_send(helper->loop, &helper->wake);
+		}
+	}
+}
+
+/*
+ * Body of a shard's thread.
+ */
+void ShardedEvHttpClient::run(Shard *shard)
+{
+	ev_loop(shard->loop, 0);
+}
+
+/*
+ * On a shard's thread: starts everything queued for it,
+ * then helps other shards if it has little to do.
+ */
+void ShardedEvHttpClient::wakeCb(Shard *shard)
+{
+	if(shard->stopping)
+	{
+		ev_unloop(shard->loop, EVUNLOOP_ALL);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(shard->lock);
+		shard->batch.swap(shard->queue);
+		for(size_t i = 0; i < shard->keyed.size(); ++i)
+		{
+			shard->batch.push_back(std::move(shard->keyed[i]));
+		}
+		shard->keyed.clear();
+		shard->queued -= shard->batch.size();
+	}
+
+	for(size_t i = 0; i < shard->batch.size(); ++i)
+	{
+		start(shard, shard->batch[i]);
+	}
+	shard->batch.clear();
+
+	if(stealing && shard->outstanding < SHARD_STEAL_THRESHOLD)
+	{
+		steal(shard);
+	}
+}
+
+/*
+ * On a shard's thread: makes a request on its client.
+ */
+void ShardedEvHttpClient::start(Shard *shard, QueuedRequest & request)
+{
+	Slot *slot;
+	if(shard->freeSlots.empty())
+	{
+		slot = new Slot();
+	}
+	else
+	{
+		slot = shard->freeSlots.back();
+		shard->freeSlots.pop_back();
+	}
+	slot->cb = request.cb;
+	slot->data = request.data;
+
+	shard->outstanding++;
+	shard->requests++;
+	if(shard->client->makeRequest(responseCbWrapper, std::move(request.requestString),
+		(void *) slot) != 0)
+	{
+		shard->outstanding--;
+		shard->freeSlots.push_back(slot);
+		request.cb(NULL, request.data, data);
+	}
+}
+
+/*
+ * On a shard's thread: takes half of the unkeyed
+ * requests queued for the busiest other shard (the
+ * oldest half), and starts them.
+ */
+void ShardedEvHttpClient::steal(Shard *shard)
+{
+	Shard *victim = NULL;
+	int most = 0;
+	for(size_t i = 0; i < shards.size(); ++i)
+	{
+		if(shards[i] != shard && shards[i]->queued > most)
+		{
+			victim = shards[i];
+			most = victim->queued;
+		}
+	}
+	if(victim == NULL)
+	{
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(victim->lock);
+		size_t count = (victim->queue.size() + 1) / 2;
+		for(size_t i = 0; i < count; ++i)
+		{
+			shard->loot.push_back(std::move(victim->queue.front()));
+			victim->queue.pop_front();
+		}
+		victim->queued -= count;
+	}
+
+	shard->stolen += shard->loot.size();
+	for(size_t i = 0; i < shard->loot.size(); ++i)
+	{
+		start(shard, shard->loot[i]);
+	}
+	shard->loot.clear();
+}
+
+void ShardedEvHttpClient::wakeCbWrapper(struct ev_loop *loop, struct ev_async *watcher,
+	int revents)
+{
+	Shard *shard = (Shard *) watcher->data;
+	shard->owner->wakeCb(shard);
+}
+
+/*
+ * Every request's callback: recycles its slot, calls
+ * the caller's callback, and lets a shard that has run
+ * out of work look for more.
+ */
+void ShardedEvHttpClient::responseCbWrapper(ResponseInfo *response, void *requestData,
+	void *clientData)
+{
+	Shard *shard = (Shard *) clientData;
+	Slot *slot = (Slot *) requestData;
+	EvHttpClientCallback cb = slot->cb;
+	void *data = slot->data;
+	shard->freeSlots.push_back(slot);
+	shard->outstanding--;
+
+	ShardedEvHttpClient *owner = shard->owner;
+	cb(response, data, owner->data);
+	if(owner->stealing && shard->outstanding == 0 && !shard->stopping)
+	{
+		owner->steal(shard);
+	}
+}
@@ -0,0 +1,194 @@
+/***************************************************************
+* SHARDEDEVHTTPCLIENT
+* -------------------
+* Http client for one server that spreads its work over
+* several cores. It owns N shards, each an event loop on
+* its own thread (pinned to a core where supported) with
+* its own EvHttpClient, and so its own connection pool,
+* request and response pools and resolver. Shards share
+* nothing but their request queues and the first shard's
+* request serialization (see makeRequest).
+*
+* Requests may be made from any thread. Each is
+* serialized on the calling thread and queued for a
+* shard chosen round-robin, by least load, or by a key
+* (so the same key always reaches the same shard). The
+* shard is woken once for however many requests arrive
+* before it drains its queue. A shard that is idle while
+* another falls behind takes (steals) half of the other's
+* unkeyed queued requests.
+*
+* Callbacks run on the thread of the shard that made the
+* request; as with EvHttpClient, the ResponseInfo is only
+* valid during the callback.
+*
+*/
+
+#ifndef SHARDEDEVHTTPCLIENT_H_
+#define SHARDEDEVHTTPCLIENT_H_
+
+/*
+ * A shard whose queue reaches this many requests gets
+ * help from the least loaded shard, and a shard with
+ * fewer requests outstanding than this may help others.
+ */
+#define SHARD_STEAL_THRESHOLD (64)
+
+#include <deque>
+#include <vector>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include "evhttpclient.h"
+
+/*
+ * How unkeyed requests are spread over the shards.
+ */
+enum ShardDispatch
+{
+	SHARD_ROUND_ROBIN,
+	SHARD_LEAST_LOADED
+};
+
+/*
+ * One shard's load, as returned by
+ * ShardedEvHttpClient::getShardReport. requests counts
+ * the requests the shard made, stolen those of them it
+ * took from other shards' queues.
+ */
+class ShardReport
+{
+	public:
+		int queued;
+		int outstanding;
+		long requests;
+		long stolen;
+};
+
+class ShardedEvHttpClient
+{
+	public:
+		/*
+		 * Starts num_shards shards (one per core if 0) for
+		 * url. The other parameters are as for EvHttpClient,
+		 * and apply to each shard's client; the data pointer
+		 * is passed to every callback. With pin set, shard i
+		 * runs on core i (modulo the number of cores).
+		 */
+		ShardedEvHttpClient(const string & url, double timeout,
+			void *data = NULL, int num_shards = 0,
+			int init_num_conns = DEFAULT_INIT_NUM_CONNS, bool pin = true);
+
+		/*
+		 * Stops the shards. Requests still queued get their
+		 * callbacks with a NULL response, on the calling
+		 * thread.
+		 */
+		~ShardedEvHttpClient();
+
+		/*
+		 * Dispatch settings. May be changed at any time.
+		 */
+		void setDispatch(ShardDispatch dispatch);
+		void setWorkStealing(bool enabled);
+
+		int numShards();
+		vector<ShardReport> getShardReport();
+
+		/*
+		 * Request functions, as for EvHttpClient, but
+		 * callable from any thread. A request the shard
+		 * can't start gets its callback with a NULL
+		 * response. Each returns 0.
+		 */
+		int makeRequest(EvHttpClientCallback cb, std::string_view path,
+			std::string_view method, const HeaderPair *headers, size_t numHeaders,
+			std::string_view body, void *data);
+		int makeRequest(EvHttpClientCallback cb, std::string_view path,
+			std::string_view method, std::initializer_list<HeaderPair> headers,
+			std::string_view body, void *data);
+		int makeGet(EvHttpClientCallback cb, std::string_view path,
+			std::initializer_list<HeaderPair> headers, void *data);
+
+		/*
+		 * Keyed versions of the request functions: the
+		 * shard is chosen by hashing key, and the request is
+		 * never stolen.
+		 */
+		int makeKeyedRequest(std::string_view key, EvHttpClientCallback cb,
+			std::string_view path, std::string_view method,
+			const HeaderPair *headers, size_t numHeaders,
+			std::string_view body, void *data);
+		int makeKeyedGet(std::string_view key, EvHttpClientCallback cb,
+			std::string_view path, std::initializer_list<HeaderPair> headers,
+			void *data);
+
+	private:
+		class QueuedRequest
+		{
+			public:
+				EvHttpClientCallback cb;
+				void *data;
+				string requestString;
+		};
+
+		/*
+		 * What a shard's client gets as the request data
+		 * pointer, to find the caller's callback. Recycled
+		 * by the shard.
+		 */
+		class Slot
+		{
+			public:
+				EvHttpClientCallback cb;
+				void *data;
+		};
+
+		class Shard
+		{
+			public:
+				ShardedEvHttpClient *owner;
+				struct ev_loop *loop;
+				EvHttpClient *client;
+				std::thread thread;
+				struct ev_async wake;
+				std::atomic<bool> stopping;
+
+				// Guarded by lock
+				std::mutex lock;
+				deque<QueuedRequest> queue;
+				deque<QueuedRequest> keyed;
+
+				std::atomic<int> queued;
+				std::atomic<int> outstanding;
+				std::atomic<long> requests;
+				std::atomic<long> stolen;
+
+				// Shard thread only
+				deque<QueuedRequest> batch;
+				deque<QueuedRequest> loot;
+				vector<Slot *> freeSlots;
+		};
+
+		void *data;
+		vector<Shard *> shards;
+		std::atomic<int> dispatch;
+		std::atomic<bool> stealing;
+		std::atomic<unsigned> nextShard;
+
+		Shard *pick();
+		Shard *leastLoaded();
+		void enqueue(Shard *shard, QueuedRequest & request, bool keyed);
+		void run(Shard *shard);
+		void wakeCb(Shard *shard);
+		void start(Shard *shard, QueuedRequest & request);
+		void steal(Shard *shard);
+		static void wakeCbWrapper(struct ev_loop *loop, struct ev_async *watcher,
+			int revents);
+		static void responseCbWrapper(ResponseInfo *response, void *requestData,
+			void *clientData);
+};
+
+#endif /* SHARDEDEVHTTPCLIENT_H_ */
@@ -0,0 +1,119 @@
+/*
+ * autoscale.cpp
+ *
+ * Drives a steady load against a local server with a
+ * fixed response delay, and checks that an autoscaling
+ * client grows its pool to roughly rate * latency, then
+ * shrinks it again once the load stops.
+ */
+
+#include <iostream>
+#include <sstream>
+#include <map>
+#include <ev.h>
+#include <evhttpclient.h>
+#include "local_server.h"
+
+using namespace std;
+
+#define SERVER_DELAY (0.02)
+#define REQUEST_INTERVAL (0.002)
+#define LOAD_DURATION (3.0)
+#define IDLE_DURATION (6.0)
+#define MIN_GROWN_CONNS (10)
+#define MAX_GROWN_CONNS (40)
+#define MAX_SHRUNK_CONNS (3)
+
+static int num_responses = 0;
+
+static struct ev_timer load_timer;
+static struct ev_timer phase_timer;
+static bool loaded = false;
+
+void response_cb(ResponseInfo *response, void *requestData, void *clientData)
+{
+	if(response == NULL || response->timeout || response->code != 200)
+	{
+		cout << "Bad response." << endl;
+		exit(1);
+	}
+	num_responses++;
+}
+
+void print_report(PoolReport report)
+{
+	cout << "target " << report.target << ", total " << report.total
+		<< ", idle " << report.idle << ", outstanding " << report.outstanding
+		<< endl << "  " << report.reason << endl;
+}
+
+void load_cb(struct ev_loop *loop, struct ev_timer *timer, int revents)
+{
+	EvHttpClient *client = (EvHttpClient *) timer->data;
+	if(client->makeGet(response_cb, "", map<string, string>(), NULL) < 0)
+	{
+		cout << "Error making request." << endl;
+		exit(1);
+	}
+}
+
+void phase_cb(struct ev_loop *loop, struct ev_timer *timer, int revents)
+{
+	EvHttpClient *client = (EvHttpClient *) timer->data;
+	PoolReport report = client->getPoolReport();
+	print_report(report);
+
+	if(!loaded)
+	{
+		// End of load phase: the pool should have grown.
+		loaded = true;
+		ev_timer_stop(loop, &load_timer);
+		if(report.total < MIN_GROWN_CONNS || report.total > MAX_GROWN_CONNS)
+		{
+			cout << "Pool did not grow to the expected size." << endl;
+			exit(1);
+		}
+		ev_timer_set(&phase_timer, IDLE_DURATION, 0.);
+		ev_timer_start(loop, &phase_timer);
+		return;
+	}
+
+	// End of idle phase: the surplus should have been closed.
+	if(report.total > MAX_SHRUNK_CONNS)
+	{
+		cout << "Pool did not shrink." << endl;
+		exit(1);
+	}
+
+	cout << "Done (" << num_responses << " responses)." << endl;
+	exit(0);
+}
+
+/* Main */
+int main()
+{
+	struct ev_loop *loop = ev_default_loop(0);
+
+	local_server_delay = SERVER_DELAY;
+	unsigned short port = local_server_start(loop);
+	stringstream url;
+	url << "http://127.0.0.1:" << port << "/";
+
+	EvHttpClient client(loop, url.str(), 0, NULL, 2);
+	client.setAutoscale(true, 2, 64, 1.5, 0.5);
+
+	load_timer.data = (void *) &client;
+	ev_timer_init(&load_timer, load_cb, REQUEST_INTERVAL, REQUEST_INTERVAL);
+	ev_timer_start(loop, &load_timer);
+
+	phase_timer.data = (void *) &client;
+	ev_timer_init(&phase_timer, phase_cb, LOAD_DURATION, 0.);
+	ev_timer_start(loop, &phase_timer);
+
+	while (1)
+	{
+		ev_loop(loop, 0);
+	}
+
+	return 0;
+}
@@ -32,10 +32,9 @@ void response_cb(ResponseInfo *response, void *requestData, void *clientData)
 	cout << "Code" << endl << "-----" << endl << response->code << endl << endl;
 	cout << "Latency" << endl << "-----" << endl << response->latency << endl << endl;
 	cout << "Headers" << endl << "-----" << endl;
-	for(map<string, string>::const_iterator iter = response->headers.begin();
-		iter != response->headers.end(); ++iter)
+	for(size_t i = 0; i < response->headerCount(); ++i)
 	{
-		cout << iter->first << ": " << iter->second << endl;
+		cout << response->headerName(i) << ": " << response->headerValue(i) << endl;
 	}
 	cout << endl;
 	cout << "Response" << endl << "-----" << endl;
@@ -0,0 +1,181 @@
+/*
+ * breaker.cpp
+ *
+ * Checks the circuit breaker against a local server
+ * that stops answering in time:
+ *
+ * 1. Enough timeouts open the breaker.
+ * 2. While open, requests are refused at once with
+ *    EVHTTPCLIENT_BREAKER_OPEN and no callback.
+ * 3. After the open time, a single probe is let
+ *    through; when it times out the breaker opens again.
+ * 4. Once the server recovers, a successful probe
+ *    closes the breaker and requests flow again.
+ */
+
+#include <iostream>
+#include <sstream>
+#include <map>
+#include <ev.h>
+#include <evhttpclient.h>
+#include "local_server.h"
+
+using namespace std;
+
+#define NUM_FAILURES (5)
+#define OPEN_TIME (0.3)
+
+static EvHttpClient *client = NULL;
+static struct ev_timer phase_timer;
+static int phase = 0;
+
+static int responses = 0;
+static int timeouts = 0;
+
+static const char *state_names[] = { "closed", "open", "half-open" };
+
+void response_cb(ResponseInfo *response, void *requestData, void *clientData)
+{
+	if(response == NULL)
+	{
+		cout << "Request failed." << endl;
+		exit(1);
+	}
+	if(response->timeout)
+	{
+		timeouts++;
+	}
+	else
+	{
+		responses++;
+	}
+}
+
+int make()
+{
+	int result = client->makeGet(response_cb, "/", map<string, string>(), NULL);
+	if(result == -1)
+	{
+		cout << "Error making request." << endl;
+		exit(1);
+	}
+	return result;
+}
+
+void next_phase(double after)
+{
+	ev_timer_set(&phase_timer, after, 0.);
+	ev_timer_start(ev_default_loop(0), &phase_timer);
+}
+
+void check(bool ok, const string & what)
+{
+	BreakerReport report = client->getBreakerReport();
+	cout << what << ": " << state_names[report.state] << ", " << report.transitions
+		<< " transitions, " << report.rejected << " rejected, " << responses
+		<< " responses, " << timeouts << " timeouts" << endl;
+	if(!ok)
+	{
+		cout << "Unexpected breaker state after " << what << "." << endl;
+		exit(1);
+	}
+}
+
+void phase_cb(struct ev_loop *loop, struct ev_timer *timer, int revents)
+{
+	BreakerReport report = client->getBreakerReport();
+	switch(phase++)
+	{
+		case 0:
+			local_server_delay = 0.5;
+			for(int i = 0; i < NUM_FAILURES; ++i)
+			{
+				make();
+			}
+			next_phase(0.15);
+			break;
+
+		case 1:
+			check(report.state == BREAKER_OPEN && report.transitions == 1 &&
+				timeouts == NUM_FAILURES, "timeouts");
+			if(make() != EVHTTPCLIENT_BREAKER_OPEN)
+			{
+				cout << "Open breaker let a request through." << endl;
+				exit(1);
+			}
+			next_phase(OPEN_TIME);
+			break;
+
+		case 2:
+			check(report.state == BREAKER_HALF_OPEN && report.rejected == 1, "open time");
+			if(make() != 0 || make() != EVHTTPCLIENT_BREAKER_OPEN)
+			{
+				cout << "Half-open breaker did not let exactly one probe through." << endl;
+				exit(1);
+			}
+			next_phase(0.15);
+			break;
+
+		case 3:
+			check(report.state == BREAKER_OPEN && report.transitions == 3 &&
+				timeouts == NUM_FAILURES + 1, "failed probe");
+			local_server_delay = 0;
+			next_phase(OPEN_TIME);
+			break;
+
+		case 4:
+			if(make() != 0)
+			{
+				cout << "Probe was refused." << endl;
+				exit(1);
+			}
+			next_phase(0.1);
+			break;
+
+		case 5:
+			check(report.state == BREAKER_CLOSED && report.transitions == 5 &&
+				responses == 1, "successful probe");
+			for(int i = 0; i < NUM_FAILURES; ++i)
+			{
+				if(make() != 0)
+				{
+					cout << "Closed breaker refused a request." << endl;
+					exit(1);
+				}
+			}
+			next_phase(0.1);
+			break;
+
+		default:
+			check(report.state == BREAKER_CLOSED && responses == NUM_FAILURES + 1,
+				"recovered");
+			cout << "Done." << endl;
+			exit(0);
+	}
+}
+
+/* Main */
+int main()
+{
+	struct ev_loop *loop = ev_default_loop(0);
+
+	unsigned short port = local_server_start(loop);
+	stringstream url;
+	url << "http://127.0.0.1:" << port << "/";
+
+	client = new EvHttpClient(loop, url.str(), 0.1, NULL, 0);
+	BreakerPolicy policy;
+	policy.minRequests = NUM_FAILURES;
+	policy.openTime = OPEN_TIME;
+	client->setCircuitBreaker(true, policy);
+
+	ev_timer_init(&phase_timer, phase_cb, 0., 0.);
+	ev_timer_start(loop, &phase_timer);
+
+	while (1)
+	{
+		ev_loop(loop, 0);
+	}
+
+	return 0;
+}
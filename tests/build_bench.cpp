@@ -0,0 +1,122 @@
+/*
+ * build_bench.cpp
+ *
+ * Microbenchmark for request serialization. Reports
+ * nanoseconds per request built by buildRequest, by a
+ * RequestTemplate, and by the stringstream approach
+ * buildRequest used to take, for several header counts.
+ *
+ * No connections are made.
+ */
+
+#include <iostream>
+#include <sstream>
+#include <map>
+#include <time.h>
+#include <ev.h>
+#include <evhttpclient.h>
+
+using namespace std;
+
+#define ITERATIONS (200000)
+
+/* Keeps the compiler from discarding the work. */
+static volatile size_t sink;
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* The stringstream serializer, for comparison. */
+static string legacy_build(const string & path, const string & method,
+	const map<string, string> & headers, const string & body)
+{
+	stringstream request;
+	string realMethod(method);
+	transform(realMethod.begin(), realMethod.end(), realMethod.begin(), ::toupper);
+	request << realMethod << " " << path << " HTTP/1.1\r\n";
+	for(map<string, string>::const_iterator iter = headers.begin(); iter != headers.end(); ++iter)
+	{
+		request << iter->first << ": " << iter->second << "\r\n";
+	}
+	request << "Host: 127.0.0.1:8080\r\n";
+	if(body.size() > 0)
+	{
+		request << "Content-Length: " << body.size() << "\r\n";
+	}
+	request << "\r\n" << body;
+	return request.str();
+}
+
+static map<string, string> make_headers(int count)
+{
+	map<string, string> headers;
+	for(int i = 0; i < count; ++i)
+	{
+		stringstream name;
+		name << "X-Header-" << i;
+		headers[name.str()] = "some-typical-header-value";
+	}
+	return headers;
+}
+
+static void run(EvHttpClient & client, int num_headers, const string & body)
+{
+	map<string, string> headers = make_headers(num_headers);
+	string out;
+	size_t total = 0;
+
+	double start = now();
+	for(int i = 0; i < ITERATIONS; ++i)
+	{
+		client.buildRequest(out, "/api/v1/items/12345", "POST", headers, body);
+		total += out.size();
+	}
+	double built = (now() - start) * 1e9 / ITERATIONS;
+
+	start = now();
+	for(int i = 0; i < ITERATIONS; ++i)
+	{
+		string legacy = legacy_build("/api/v1/items/12345", "post", headers, body);
+		total += legacy.size();
+	}
+	double legacy = (now() - start) * 1e9 / ITERATIONS;
+
+	cout << num_headers << " headers, " << body.size() << " byte body: "
+		<< "buildRequest " << built << " ns, "
+		<< "stringstream " << legacy << " ns" << endl;
+	sink = total;
+}
+
+/* Main */
+int main()
+{
+	struct ev_loop *loop = ev_default_loop(0);
+	EvHttpClient client(loop, "http://127.0.0.1:8080/", 0, NULL, 0);
+
+	run(client, 0, "");
+	run(client, 4, "");
+	run(client, 4, string(256, 'x'));
+	run(client, 16, string(256, 'x'));
+
+	// RequestTemplate with the same four headers fixed and
+	// one slot header filled in per request.
+	RequestTemplate tmpl(&client, "POST", "/api/v1/items/", make_headers(4),
+		vector<string>(1, "X-Request-Id"));
+	string body(256, 'x');
+	string out;
+	std::string_view slot = "0123456789abcdef";
+	double start = now();
+	for(int i = 0; i < ITERATIONS; ++i)
+	{
+		client.buildRequest(out, tmpl, "12345", &slot, body);
+	}
+	sink = out.size();
+	cout << "template, 4+1 headers, 256 byte body: "
+		<< (now() - start) * 1e9 / ITERATIONS << " ns" << endl;
+
+	return 0;
+}
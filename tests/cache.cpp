@@ -0,0 +1,214 @@
+/*
+ * cache.cpp
+ *
+ * Runs a sequence of requests against a local server
+ * through a caching client, checking after each which
+ * ones reached the server: fresh hits must not, no-store
+ * responses are never reused, stale entries are
+ * revalidated with If-None-Match, Vary separates
+ * variants, and a POST invalidates the path. An entry
+ * evicted while being revalidated is fetched again in
+ * full rather than answered with the bare 304. Finally
+ * shrinks the cache to check eviction.
+ */
+
+#include <iostream>
+#include <sstream>
+#include <map>
+#include <ev.h>
+#include <evhttpclient.h>
+#include "local_server.h"
+
+using namespace std;
+
+typedef struct Step_
+{
+	const char *method;
+	const char *path;
+	const char *accept;
+	const char *body;
+	int serverRequests;
+	bool evict;
+} Step;
+
+/*
+ * The expected body, and the number of requests the
+ * server should have seen, once each step completes.
+ * evict empties the cache once the request is sent.
+ */
+static Step steps[] =
+{
+	{ "GET", "/fresh", "", "fresh", 1, false },
+	{ "GET", "/fresh", "", "fresh", 1, false },
+	{ "GET", "/nostore", "", "nostore", 2, false },
+	{ "GET", "/nostore", "", "nostore", 3, false },
+	{ "GET", "/etag", "", "etag body", 4, false },
+	{ "GET", "/etag", "", "etag body", 5, false },
+	{ "GET", "/etag", "", "etag body", 7, true },
+	{ "GET", "/vary", "text/a", "text/a", 8, false },
+	{ "GET", "/vary", "text/a", "text/a", 8, false },
+	{ "GET", "/vary", "text/b", "text/b", 9, false },
+	{ "POST", "/fresh", "", "ok", 10, false },
+	{ "GET", "/fresh", "", "fresh", 11, false },
+	{ "GET", "/fresh", "", "fresh", 11, false }
+};
+
+#define NUM_STEPS ((int) (sizeof(steps) / sizeof(steps[0])))
+
+static int step = 0;
+static bool requesting = false;
+static int not_modified = 0;
+
+static string http_response(const string & status, const string & headers,
+	const string & body)
+{
+	stringstream response;
+	response << "HTTP/1.1 " << status << "\r\n" << headers
+		<< "Content-Length: " << body.size() << "\r\n\r\n" << body;
+	return response.str();
+}
+
+static string request_header(const string & request, const string & name)
+{
+	size_t pos = request.find("\r\n" + name + ": ");
+	if(pos == string::npos)
+	{
+		return "";
+	}
+	pos += name.size() + 4;
+	return request.substr(pos, request.find("\r\n", pos) - pos);
+}
+
+static string handler(const string & request)
+{
+	if(request.compare(0, 5, "POST ") == 0)
+	{
+		return http_response("200 OK", "", "ok");
+	}
+	if(request.compare(0, 11, "GET /fresh ") == 0)
+	{
+		return http_response("200 OK", "Cache-Control: max-age=60\r\n", "fresh");
+	}
+	if(request.compare(0, 13, "GET /nostore ") == 0)
+	{
+		return http_response("200 OK", "Cache-Control: no-store\r\n", "nostore");
+	}
+	if(request.compare(0, 10, "GET /etag ") == 0)
+	{
+		if(request_header(request, "If-None-Match") == "\"v1\"")
+		{
+			not_modified++;
+			return http_response("304 Not Modified", "ETag: \"v1\"\r\n", "");
+		}
+		return http_response("200 OK",
+			"Cache-Control: no-cache\r\nETag: \"v1\"\r\n", "etag body");
+	}
+	if(request.compare(0, 10, "GET /vary ") == 0)
+	{
+		return http_response("200 OK", "Cache-Control: max-age=60\r\nVary: Accept\r\n",
+			request_header(request, "Accept"));
+	}
+	return http_response("404 Not Found", "", "");
+}
+
+void make_step(EvHttpClient *client);
+
+void response_cb(ResponseInfo *response, void *requestData, void *clientData)
+{
+	EvHttpClient *client = (EvHttpClient *) clientData;
+	Step & current = steps[step];
+
+	if(response == NULL || response->timeout || response->code != 200)
+	{
+		cout << "Bad response at step " << step << "." << endl;
+		exit(1);
+	}
+	if(requesting)
+	{
+		cout << "Callback ran inside the request function." << endl;
+		exit(1);
+	}
+	if(response->response != current.body ||
+		local_server_requests != current.serverRequests)
+	{
+		cout << "Step " << step << " (" << current.method << " " << current.path
+			<< "): got \"" << response->response << "\" after "
+			<< local_server_requests << " server requests, expected \""
+			<< current.body << "\" after " << current.serverRequests << "." << endl;
+		exit(1);
+	}
+
+	if(current.evict)
+	{
+		client->setCache(1024 * 1024);
+	}
+	if(++step < NUM_STEPS)
+	{
+		make_step(client);
+		return;
+	}
+
+	CacheStats stats = client->getCacheStats();
+	cout << "hits " << stats.hits << ", misses " << stats.misses
+		<< ", revalidated " << stats.revalidated << ", entries " << stats.entries
+		<< ", bytes " << stats.bytes << endl;
+	if(not_modified != 2 || stats.revalidated != 1 || stats.hits != 3)
+	{
+		cout << "Unexpected cache counters." << endl;
+		exit(1);
+	}
+
+	client->setCache(stats.bytes / 2);
+	stats = client->getCacheStats();
+	if(stats.evictions == 0 || stats.bytes > stats.maxBytes)
+	{
+		cout << "Cache did not evict down to its bound." << endl;
+		exit(1);
+	}
+
+	cout << "Done." << endl;
+	exit(0);
+}
+
+void make_step(EvHttpClient *client)
+{
+	Step & current = steps[step];
+	HeaderPair accept("Accept", current.accept);
+
+	requesting = true;
+	int result = client->makeRequest(response_cb, current.path, current.method,
+		&accept, strlen(current.accept) > 0 ? 1 : 0, "", NULL);
+	requesting = false;
+	if(current.evict)
+	{
+		client->setCache(1);
+	}
+
+	if(result < 0)
+	{
+		cout << "Error making request." << endl;
+		exit(1);
+	}
+}
+
+/* Main */
+int main()
+{
+	struct ev_loop *loop = ev_default_loop(0);
+
+	local_server_handler = handler;
+	unsigned short port = local_server_start(loop);
+	stringstream url;
+	url << "http://127.0.0.1:" << port << "/";
+
+	EvHttpClient client(loop, url.str(), 5, (void *) &client, 1);
+	client.setCache(1024 * 1024);
+	make_step(&client);
+
+	while (1)
+	{
+		ev_loop(loop, 0);
+	}
+
+	return 0;
+}
@@ -0,0 +1,263 @@
+/*
+ * cache_file.cpp
+ *
+ * Checks that a response cache backed by a file
+ * survives its client: a second client opening the same
+ * file serves fresh entries without contacting the
+ * server, revalidates stale ones, and does not bring
+ * back entries that were invalidated. Then rewrites one
+ * entry until a small file has to compact, and checks
+ * that a third client sees the latest version.
+ *
+ * Finally fills another small file with fresh entries
+ * under distinct keys: storing keeps evicting the least
+ * recently used, so a later client still finds the
+ * newest, and a second client can't open the file while
+ * one has it.
+ */
+
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <map>
+#include <unistd.h>
+#include <ev.h>
+#include <evhttpclient.h>
+#include "local_server.h"
+
+using namespace std;
+
+#define CACHE_BYTES (1024 * 1024)
+#define SMALL_FILE_BYTES (4096)
+#define NUM_VERSIONS (30)
+#define NUM_FILLS (20)
+
+typedef struct Step_
+{
+	int client;
+	string method;
+	string path;
+	string body;
+	int serverRequests;
+} Step;
+
+static vector<Step> steps;
+static size_t step = 0;
+static int current_client = -1;
+static EvHttpClient *client = NULL;
+static string url;
+static string cache_path;
+static int version = 0;
+static string last_if_none_match;
+static string rot_if_none_match;
+static struct ev_timer step_timer;
+
+static string http_response(const string & status, const string & headers,
+	const string & body)
+{
+	stringstream response;
+	response << "HTTP/1.1 " << status << "\r\n" << headers
+		<< "Content-Length: " << body.size() << "\r\n\r\n" << body;
+	return response.str();
+}
+
+static string request_header(const string & request, const string & name)
+{
+	size_t pos = request.find("\r\n" + name + ": ");
+	if(pos == string::npos)
+	{
+		return "";
+	}
+	pos += name.size() + 4;
+	return request.substr(pos, request.find("\r\n", pos) - pos);
+}
+
+static string handler(const string & request)
+{
+	last_if_none_match = request_header(request, "If-None-Match");
+	if(request.compare(0, 5, "POST ") == 0)
+	{
+		return http_response("200 OK", "", "ok");
+	}
+	if(request.compare(0, 7, "GET /a ") == 0)
+	{
+		return http_response("200 OK", "Cache-Control: max-age=60\r\n", "alpha");
+	}
+	if(request.compare(0, 7, "GET /b ") == 0)
+	{
+		return http_response("200 OK", "Cache-Control: max-age=60\r\n", "beta");
+	}
+	if(request.compare(0, 7, "GET /c ") == 0)
+	{
+		if(last_if_none_match == "\"c1\"")
+		{
+			return http_response("304 Not Modified", "", "");
+		}
+		return http_response("200 OK", "Cache-Control: no-cache\r\nETag: \"c1\"\r\n", "gamma");
+	}
+	if(request.compare(0, 9, "GET /rot ") == 0)
+	{
+		rot_if_none_match = last_if_none_match;
+		stringstream etag;
+		stringstream body;
+		etag << "ETag: \"v" << ++version << "\"\r\n";
+		body << "version " << version << " " << string(400, 'x');
+		return http_response("200 OK", "Cache-Control: no-cache\r\n" + etag.str(), body.str());
+	}
+	if(request.compare(0, 10, "GET /fill/") == 0)
+	{
+		string path = request.substr(4, request.find(' ', 4) - 4);
+		return http_response("200 OK", "Cache-Control: max-age=60\r\n",
+			path + " " + string(400, 'x'));
+	}
+	return http_response("404 Not Found", "", "");
+}
+
+static void add_step(int client, const string & method, const string & path,
+	const string & body, int serverRequests)
+{
+	Step s = { client, method, path, body, serverRequests };
+	steps.push_back(s);
+}
+
+/*
+ * Clients 0 and 1 share a roomy file; clients 2 and 3,
+ * and 4 and 5, share small ones.
+ */
+static void open_client(int index)
+{
+	delete client;
+	if(index == 2 || index == 4)
+	{
+		unlink(cache_path.c_str());
+	}
+
+	client = new EvHttpClient(ev_default_loop(0), url, 5, NULL, 1);
+	client->setCache(CACHE_BYTES);
+	if(client->setCacheFile(cache_path, index < 2 ? CACHE_BYTES : SMALL_FILE_BYTES) < 0)
+	{
+		cout << "Could not open cache file." << endl;
+		exit(1);
+	}
+	current_client = index;
+
+	if(index == 5)
+	{
+		EvHttpClient other(ev_default_loop(0), url, 5, NULL, 1);
+		other.setCache(CACHE_BYTES);
+		if(other.setCacheFile(cache_path, SMALL_FILE_BYTES) == 0)
+		{
+			cout << "Opened a cache file already in use." << endl;
+			exit(1);
+		}
+	}
+}
+
+void response_cb(ResponseInfo *response, void *requestData, void *clientData)
+{
+	Step & current = steps[step];
+	if(response == NULL || response->timeout || response->code != 200)
+	{
+		cout << "Bad response at step " << step << "." << endl;
+		exit(1);
+	}
+	if(response->response.compare(0, current.body.size(), current.body) != 0 ||
+		local_server_requests != current.serverRequests)
+	{
+		cout << "Step " << step << " (client " << current.client << ", "
+			<< current.method << " " << current.path << "): got \""
+			<< response->response.substr(0, 16) << "\" after "
+			<< local_server_requests << " server requests, expected \""
+			<< current.body << "\" after " << current.serverRequests << "." << endl;
+		exit(1);
+	}
+
+	// Move on from a timer, since the next step may
+	// replace the client this callback belongs to.
+	step++;
+	ev_timer_set(&step_timer, 0., 0.);
+	ev_timer_start(ev_default_loop(0), &step_timer);
+}
+
+void step_cb(struct ev_loop *loop, struct ev_timer *timer, int revents)
+{
+	if(step == steps.size())
+	{
+		CacheStats stats = client->getCacheStats();
+		cout << "file entries " << stats.fileEntries << ", file bytes "
+			<< stats.fileBytes << endl;
+		if(rot_if_none_match != "\"v30\"")
+		{
+			cout << "Reopened file did not hold the latest version." << endl;
+			exit(1);
+		}
+		delete client;
+		unlink(cache_path.c_str());
+		cout << "Done." << endl;
+		exit(0);
+	}
+
+	Step & current = steps[step];
+	if(current.client != current_client)
+	{
+		open_client(current.client);
+	}
+	if(client->makeRequest(response_cb, current.path, current.method,
+		map<string, string>(), "", NULL) < 0)
+	{
+		cout << "Error making request." << endl;
+		exit(1);
+	}
+}
+
+/* Main */
+int main()
+{
+	struct ev_loop *loop = ev_default_loop(0);
+
+	local_server_handler = handler;
+	unsigned short port = local_server_start(loop);
+	stringstream ss;
+	ss << "http://127.0.0.1:" << port << "/";
+	url = ss.str();
+	ss.str("");
+	ss << "/tmp/evhttpclient_cache_file_test." << getpid();
+	cache_path = ss.str();
+	unlink(cache_path.c_str());
+
+	add_step(0, "GET", "/a", "alpha", 1);
+	add_step(0, "GET", "/b", "beta", 2);
+	add_step(0, "GET", "/c", "gamma", 3);
+	add_step(0, "POST", "/b", "ok", 4);
+	add_step(1, "GET", "/a", "alpha", 4);
+	add_step(1, "GET", "/b", "beta", 5);
+	add_step(1, "GET", "/c", "gamma", 6);
+	for(int i = 1; i <= NUM_VERSIONS; ++i)
+	{
+		stringstream body;
+		body << "version " << i;
+		add_step(2, "GET", "/rot", body.str(), 6 + i);
+	}
+	add_step(3, "GET", "/rot", "version 31", 7 + NUM_VERSIONS);
+	int served = 7 + NUM_VERSIONS;
+	for(int i = 1; i <= NUM_FILLS; ++i)
+	{
+		stringstream path;
+		path << "/fill/" << i;
+		add_step(4, "GET", path.str(), path.str(), ++served);
+	}
+	stringstream newest;
+	newest << "/fill/" << NUM_FILLS;
+	add_step(5, "GET", newest.str(), newest.str(), served);
+	add_step(5, "GET", "/fill/1", "/fill/1", ++served);
+
+	ev_timer_init(&step_timer, step_cb, 0., 0.);
+	ev_timer_start(loop, &step_timer);
+
+	while (1)
+	{
+		ev_loop(loop, 0);
+	}
+
+	return 0;
+}
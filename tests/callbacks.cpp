@@ -0,0 +1,305 @@
+/*
+ * callbacks.cpp
+ *
+ * Checks callable request callbacks against a local
+ * server:
+ *
+ * 1. Lambdas with small captures (including move-only
+ *    ones) get their responses, and once the client's
+ *    pools are warm, making such a request allocates
+ *    nothing.
+ * 2. A lambda with captures larger than
+ *    CALLBACK_INLINE_SIZE works, allocating only its
+ *    heap copy.
+ * 3. Captures are destroyed once the request is done,
+ *    including when it is cancelled.
+ * 4. The function-pointer API is unchanged.
+ * 5. Destroying a client calls back each request still
+ *    in flight once, with a NULL response, and destroys
+ *    its captures.
+ */
+
+#include <iostream>
+#include <sstream>
+#include <memory>
+#include <new>
+#include <stdlib.h>
+#include <ev.h>
+#include <evhttpclient.h>
+#include "local_server.h"
+
+using namespace std;
+
+#define NUM_REQUESTS (200)
+#define WARMUP (20)
+
+/*
+ * Allocations made while counting is set. The
+ * replacement operators pair malloc with free, which
+ * g++ can't see through.
+ */
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+static bool counting = false;
+static long allocations = 0;
+
+void *operator new(size_t size)
+{
+	if(counting)
+	{
+		allocations++;
+	}
+	void *p = malloc(size);
+	if(p == NULL)
+	{
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+void operator delete(void *p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void *p, size_t size) noexcept
+{
+	free(p);
+}
+
+static struct ev_loop *loop;
+static EvHttpClient *client = NULL;
+static int responses = 0;
+static int alive = 0;
+
+/* Counts live copies, to check captures are destroyed. */
+class Tracker
+{
+	public:
+		Tracker()
+		{
+			alive++;
+		}
+
+		Tracker(const Tracker & other)
+		{
+			alive++;
+		}
+
+		Tracker(Tracker && other) noexcept
+		{
+			alive++;
+		}
+
+		~Tracker()
+		{
+			alive--;
+		}
+};
+
+static void fail(const string & message)
+{
+	cout << message << endl;
+	exit(1);
+}
+
+static void check(ResponseInfo *response)
+{
+	if(response == NULL || response->timeout || response->code != 200 ||
+		response->response != "hello world\n")
+	{
+		fail("Bad response.");
+	}
+	responses++;
+}
+
+void fn_cb(ResponseInfo *response, void *requestData, void *clientData)
+{
+	if(requestData != (void *) client)
+	{
+		fail("Wrong data pointer.");
+	}
+	check(response);
+}
+
+static void wait_for(int count)
+{
+	while(responses < count)
+	{
+		ev_loop(loop, EVLOOP_ONESHOT);
+	}
+	responses = 0;
+}
+
+/*
+ * Makes NUM_REQUESTS requests with make, one at a time,
+ * and returns the allocations made by the request
+ * function itself after warm-up, per request.
+ */
+template <class Make>
+double per_request(Make make)
+{
+	long made = 0;
+	for(int i = 0; i < NUM_REQUESTS; ++i)
+	{
+		allocations = 0;
+		counting = i >= WARMUP;
+		if(make() != 0)
+		{
+			fail("Request failed.");
+		}
+		counting = false;
+		made += allocations;
+		wait_for(1);
+	}
+	return made / (double) (NUM_REQUESTS - WARMUP);
+}
+
+/* Main */
+int main()
+{
+	loop = ev_default_loop(0);
+	unsigned short port = local_server_start(loop);
+	stringstream url;
+	url << "http://127.0.0.1:" << port << "/";
+	client = new EvHttpClient(loop, url.str(), 5, NULL, 4);
+
+	// 1. Small captures
+	int seen = 0;
+	double small = per_request([&]()
+	{
+		return client->makeGet([&seen, id = 7](ResponseInfo *response)
+		{
+			if(id != 7)
+			{
+				fail("Capture corrupted.");
+			}
+			seen++;
+			check(response);
+		}, "/small", {{"Accept", "text/plain"}});
+	});
+	if(seen != NUM_REQUESTS)
+	{
+		fail("Small lambda not called.");
+	}
+	cout << "small capture: " << small << " allocations/request" << endl;
+	if(small != 0)
+	{
+		fail("Small capture allocated.");
+	}
+
+	double moveOnly = per_request([&]()
+	{
+		unique_ptr<int> owned(new int(42));
+		return client->makePost([owned = std::move(owned)](ResponseInfo *response)
+		{
+			if(*owned != 42)
+			{
+				fail("Move-only capture corrupted.");
+			}
+			check(response);
+		}, "/owned", {}, "body");
+	});
+	// The unique_ptr's own allocation is counted too.
+	cout << "move-only capture: " << moveOnly << " allocations/request" << endl;
+	if(moveOnly != 1)
+	{
+		fail("Move-only capture allocated more than its own int.");
+	}
+
+	// 2. Large captures
+	char padding[CALLBACK_INLINE_SIZE * 2] = { 1 };
+	double large = per_request([&]()
+	{
+		return client->makeGet([padding](ResponseInfo *response)
+		{
+			if(padding[0] != 1)
+			{
+				fail("Large capture corrupted.");
+			}
+			check(response);
+		}, "/large");
+	});
+	cout << "large capture: " << large << " allocations/request" << endl;
+	if(large != 1)
+	{
+		fail("Large capture should allocate once.");
+	}
+
+	// 3. Captures are destroyed
+	{
+		Tracker tracker;
+		client->makeGet([tracker](ResponseInfo *response)
+		{
+			check(response);
+		}, "/tracked");
+		wait_for(1);
+
+		// Callable requests have a NULL data pointer, which
+		// is what cancels them.
+		client->makeGet([tracker](ResponseInfo *response)
+		{
+			fail("Cancelled callback called.");
+		}, "/cancelled");
+		if(client->cancelRequests(NULL) != 1)
+		{
+			fail("Couldn't cancel.");
+		}
+		if(alive != 1)
+		{
+			fail("Captures leaked.");
+		}
+	}
+	cout << "captures destroyed: ok" << endl;
+
+	// 4. Function pointers
+	double pointer = per_request([&]()
+	{
+		return client->makeGet(fn_cb, "/fn", {}, (void *) client);
+	});
+	cout << "function pointer: " << pointer << " allocations/request" << endl;
+	if(pointer != 0)
+	{
+		fail("Function pointer request allocated.");
+	}
+
+	delete client;
+
+	// 5. Destruction. The server accepts connections but
+	// never answers.
+	unsigned short hole_port = 0;
+	if(local_server_listen(AF_INET, 16, &hole_port) < 0)
+	{
+		fail("Couldn't listen.");
+	}
+	stringstream hole_url;
+	hole_url << "http://127.0.0.1:" << hole_port << "/";
+	client = new EvHttpClient(loop, hole_url.str(), 5, NULL, 4);
+	int failed = 0;
+	{
+		Tracker tracker;
+		for(int i = 0; i < 4; ++i)
+		{
+			client->makeGet([&failed, tracker](ResponseInfo *response)
+			{
+				if(response != NULL)
+				{
+					fail("Destroyed client gave a response.");
+				}
+				failed++;
+			}, "/hole");
+		}
+	}
+	for(int i = 0; i < 10; ++i)
+	{
+		ev_loop(loop, EVLOOP_NONBLOCK);
+	}
+	delete client;
+	if(failed != 4 || alive != 0)
+	{
+		fail("Requests in flight not failed on destruction.");
+	}
+	cout << "destruction: ok" << endl;
+
+	cout << "Done." << endl;
+	return 0;
+}
@@ -0,0 +1,212 @@
+/*
+ * coalesce.cpp
+ *
+ * Checks request coalescing against a local server
+ * that answers after a delay:
+ *
+ * 1. A burst of identical GETs reaches the server once,
+ *    and every callback gets the same ResponseInfo.
+ * 2. When the first GET times out, a GET waiting on it
+ *    still gets the response.
+ * 3. Cancelling the first GET, or a waiter, leaves the
+ *    other waiters' callbacks intact.
+ */
+
+#include <iostream>
+#include <sstream>
+#include <map>
+#include <ev.h>
+#include <evhttpclient.h>
+#include "local_server.h"
+
+using namespace std;
+
+#define BURST_SIZE (20)
+
+static EvHttpClient *client = NULL;
+static struct ev_timer phase_timer;
+static int phase = 0;
+
+static int responses = 0;
+static int timeouts = 0;
+static ResponseInfo *first_response = NULL;
+static bool all_same = true;
+
+/* Data pointers identifying requests in phase 3. */
+static int first_request;
+static int second_request;
+static int third_request;
+static bool called[3];
+
+void burst_cb(ResponseInfo *response, void *requestData, void *clientData)
+{
+	if(response == NULL || response->timeout || response->code != 200)
+	{
+		cout << "Bad response in burst." << endl;
+		exit(1);
+	}
+	if(requestData == NULL)
+	{
+		if(first_response == NULL)
+		{
+			first_response = response;
+		}
+		all_same = all_same && response == first_response;
+	}
+	responses++;
+}
+
+void handover_cb(ResponseInfo *response, void *requestData, void *clientData)
+{
+	if(response == NULL)
+	{
+		cout << "Error in handover." << endl;
+		exit(1);
+	}
+	if(response->timeout)
+	{
+		timeouts++;
+	}
+	else if(response->code == 200)
+	{
+		responses++;
+	}
+}
+
+void cancel_cb(ResponseInfo *response, void *requestData, void *clientData)
+{
+	if(response == NULL || response->timeout || response->code != 200)
+	{
+		cout << "Bad response after cancel." << endl;
+		exit(1);
+	}
+	if(requestData == &first_request)
+	{
+		called[0] = true;
+	}
+	else if(requestData == &second_request)
+	{
+		called[1] = true;
+	}
+	else
+	{
+		called[2] = true;
+	}
+	responses++;
+}
+
+void make(EvHttpClientCallback cb, const string & path, void *data)
+{
+	if(client->makeGet(cb, path, map<string, string>(), data) < 0)
+	{
+		cout << "Error making request." << endl;
+		exit(1);
+	}
+}
+
+void next_phase(double after)
+{
+	ev_timer_set(&phase_timer, after, 0.);
+	ev_timer_start(ev_default_loop(0), &phase_timer);
+}
+
+void phase_cb(struct ev_loop *loop, struct ev_timer *timer, int revents)
+{
+	switch(phase++)
+	{
+		case 0:
+			// Burst of identical GETs plus one other.
+			local_server_delay = 0.1;
+			for(int i = 0; i < BURST_SIZE; ++i)
+			{
+				make(burst_cb, "/same", NULL);
+			}
+			make(burst_cb, "/other", (void *) &phase);
+			next_phase(0.5);
+			break;
+
+		case 1:
+			cout << "burst: " << responses << " responses, "
+				<< local_server_requests << " server requests" << endl;
+			if(responses != BURST_SIZE + 1 || local_server_requests != 2 || !all_same)
+			{
+				cout << "Burst was not coalesced." << endl;
+				exit(1);
+			}
+
+			// The first GET times out at 0.2s; the one made
+			// 0.15s later must still get the 0.3s response.
+			responses = 0;
+			local_server_delay = 0.3;
+			client->setTimeout(0.2);
+			make(handover_cb, "/slow", NULL);
+			next_phase(0.15);
+			break;
+
+		case 2:
+			make(handover_cb, "/slow", NULL);
+			next_phase(0.5);
+			break;
+
+		case 3:
+			cout << "handover: " << responses << " responses, " << timeouts
+				<< " timeouts, " << local_server_requests << " server requests" << endl;
+			if(responses != 1 || timeouts != 1 || local_server_requests != 3)
+			{
+				cout << "Timed out leader did not hand over." << endl;
+				exit(1);
+			}
+
+			// Cancel the first of three identical GETs, then
+			// the third.
+			responses = 0;
+			local_server_delay = 0.1;
+			client->setTimeout(5);
+			make(cancel_cb, "/cancel", &first_request);
+			make(cancel_cb, "/cancel", &second_request);
+			make(cancel_cb, "/cancel", &third_request);
+			if(client->cancelRequests(&first_request) != 1 ||
+				client->cancelRequests(&third_request) != 1)
+			{
+				cout << "Requests were not cancelled." << endl;
+				exit(1);
+			}
+			next_phase(0.5);
+			break;
+
+		default:
+			cout << "cancel: " << responses << " responses, "
+				<< local_server_requests << " server requests" << endl;
+			if(responses != 1 || called[0] || !called[1] || called[2] ||
+				local_server_requests != 4)
+			{
+				cout << "Cancellation affected the wrong requests." << endl;
+				exit(1);
+			}
+			cout << "Done." << endl;
+			exit(0);
+	}
+}
+
+/* Main */
+int main()
+{
+	struct ev_loop *loop = ev_default_loop(0);
+
+	unsigned short port = local_server_start(loop);
+	stringstream url;
+	url << "http://127.0.0.1:" << port << "/";
+
+	client = new EvHttpClient(loop, url.str(), 5, NULL, 0);
+	client->setCoalescing(true);
+
+	ev_timer_init(&phase_timer, phase_cb, 0., 0.);
+	ev_timer_start(loop, &phase_timer);
+
+	while (1)
+	{
+		ev_loop(loop, 0);
+	}
+
+	return 0;
+}
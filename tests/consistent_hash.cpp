@@ -0,0 +1,221 @@
+/*
+ * consistent_hash.cpp
+ *
+ * Checks keyed routing in MultiEvHttpClient against
+ * local servers:
+ *
+ * 1. Each key keeps reaching the same endpoint.
+ * 2. Adding an endpoint moves about a quarter of the
+ *    keys (of four), all of them to the new endpoint.
+ * 3. A hot key's requests, sent all at once, spill over
+ *    to other endpoints instead of piling onto one.
+ */
+
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <map>
+#include <stdlib.h>
+#include <ev.h>
+#include <evhttpclient.h>
+#include <multievhttpclient.h>
+#include "local_server.h"
+
+using namespace std;
+
+#define NUM_KEYS (400)
+#define HOT_REQUESTS (20)
+
+static MultiEvHttpClient *client = NULL;
+static int phase = 0;
+static int key_index = 0;
+static int completed = 0;
+static unsigned short new_port = 0;
+
+/* Endpoint port each key reached, per round. */
+static map<string, unsigned short> routes[3];
+static map<unsigned short, int> hot_served;
+
+static string handler(const string & request)
+{
+	size_t pos = request.find("Host: 127.0.0.1:");
+	unsigned short port = atoi(request.c_str() + pos + 16);
+	string key = request.substr(5, request.find(' ', 5) - 5);
+	if(phase < 3)
+	{
+		routes[phase][key] = port;
+	}
+	else
+	{
+		hot_served[port]++;
+	}
+	return "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok";
+}
+
+static string local_url(unsigned short port)
+{
+	stringstream url;
+	url << "http://127.0.0.1:" << port << "/";
+	return url.str();
+}
+
+static string key_name(int i)
+{
+	stringstream key;
+	key << "key" << i;
+	return key.str();
+}
+
+void finish_phase();
+
+void send_key();
+
+void response_cb(ResponseInfo *response, void *requestData, void *clientData)
+{
+	if(response == NULL || response->timeout || response->code != 200)
+	{
+		cout << "Request failed." << endl;
+		exit(1);
+	}
+	completed++;
+	if(phase == 3)
+	{
+		if(completed == HOT_REQUESTS)
+		{
+			finish_phase();
+		}
+		return;
+	}
+	send_key();
+}
+
+/*
+ * Keys go one at a time, so load never moves them.
+ */
+void send_key()
+{
+	if(key_index == NUM_KEYS)
+	{
+		finish_phase();
+		return;
+	}
+	string key = key_name(key_index++);
+	if(client->makeKeyedGet(key, response_cb, "/" + key, map<string, string>(), NULL) != 0)
+	{
+		cout << "Error making request." << endl;
+		exit(1);
+	}
+}
+
+void finish_phase()
+{
+	key_index = 0;
+	completed = 0;
+	switch(phase++)
+	{
+		case 0:
+			send_key();
+			break;
+
+		case 1:
+		{
+			int moved = 0;
+			for(map<string, unsigned short>::iterator iter = routes[0].begin();
+				iter != routes[0].end(); ++iter)
+			{
+				if(routes[1][iter->first] != iter->second)
+				{
+					moved++;
+				}
+			}
+			cout << "stable: " << routes[0].size() << " keys, " << moved << " moved" << endl;
+			if(routes[0].size() != NUM_KEYS || moved != 0)
+			{
+				cout << "Keys moved between identical rounds." << endl;
+				exit(1);
+			}
+
+			new_port = local_server_start(ev_default_loop(0));
+			client->addEndpoint(local_url(new_port));
+			send_key();
+			break;
+		}
+
+		case 2:
+		{
+			int moved = 0;
+			int misplaced = 0;
+			for(map<string, unsigned short>::iterator iter = routes[1].begin();
+				iter != routes[1].end(); ++iter)
+			{
+				unsigned short port = routes[2][iter->first];
+				if(port != iter->second)
+				{
+					moved++;
+					misplaced += port != new_port;
+				}
+			}
+			cout << "added endpoint: " << moved << " of " << NUM_KEYS << " keys moved, "
+				<< misplaced << " not to the new endpoint" << endl;
+			if(moved < NUM_KEYS / 8 || moved > NUM_KEYS * 3 / 8 || misplaced != 0)
+			{
+				cout << "Adding an endpoint did not rebalance minimally." << endl;
+				exit(1);
+			}
+
+			local_server_delay = 0.1;
+			for(int i = 0; i < HOT_REQUESTS; ++i)
+			{
+				if(client->makeKeyedGet("hot", response_cb, "/hot", map<string, string>(),
+					NULL) != 0)
+				{
+					cout << "Error making request." << endl;
+					exit(1);
+				}
+			}
+			break;
+		}
+
+		default:
+		{
+			int most = 0;
+			for(map<unsigned short, int>::iterator iter = hot_served.begin();
+				iter != hot_served.end(); ++iter)
+			{
+				most = max(most, iter->second);
+			}
+			cout << "hot key: " << hot_served.size() << " endpoints, at most " << most
+				<< " requests on one" << endl;
+			if(most >= HOT_REQUESTS || hot_served.size() < 2)
+			{
+				cout << "Hot key was not spread under the load bound." << endl;
+				exit(1);
+			}
+			cout << "Done." << endl;
+			exit(0);
+		}
+	}
+}
+
+/* Main */
+int main()
+{
+	struct ev_loop *loop = ev_default_loop(0);
+
+	local_server_handler = handler;
+	vector<string> urls;
+	for(int i = 0; i < 3; ++i)
+	{
+		urls.push_back(local_url(local_server_start(loop)));
+	}
+
+	client = new MultiEvHttpClient(loop, urls, 5, NULL, 1);
+	send_key();
+
+	while (1)
+	{
+		ev_loop(loop, 0);
+	}
+
+	return 0;
+}
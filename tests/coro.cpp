@@ -0,0 +1,186 @@
+/*
+ * coro.cpp
+ *
+ * Checks the coroutine interface against local servers:
+ *
+ * 1. Sequential awaits, including of a nested task,
+ *    resume on the loop thread with the responses.
+ * 2. A held response stays intact while the coroutine
+ *    awaits other requests.
+ * 3. when_all (fixed and vector forms) returns every
+ *    response, in order.
+ * 4. when_any returns the first response, from a server
+ *    that answers rather than one that never does, and
+ *    cancels the other request; over no requests it
+ *    returns at once with an error.
+ * 5. Many short-lived tasks reuse pooled frames.
+ *
+ * Built as C++20.
+ */
+
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <ev.h>
+#include <evhttpcoro.h>
+#include "local_server.h"
+
+using namespace std;
+
+#define NUM_FANOUT (8)
+#define NUM_TASKS (1000)
+
+static thread::id loop_thread;
+static bool finished = false;
+static int tasks_done = 0;
+
+static void fail(const string & message)
+{
+	cout << message << endl;
+	exit(1);
+}
+
+static void check(const HttpResponse & response, const string & what)
+{
+	if(!response || response->timeout || response->code != 200 ||
+		response->response != "hello world\n" ||
+		this_thread::get_id() != loop_thread)
+	{
+		fail("Bad response: " + what);
+	}
+}
+
+EvTask<int> fetch_code(EvHttpCoClient client)
+{
+	HttpResponse response = co_await client.get("/nested");
+	co_return response ? response->code : -1;
+}
+
+EvTask<void> short_task(EvHttpCoClient client)
+{
+	HttpResponse response = co_await client.get("/short");
+	check(response, "short task");
+	tasks_done++;
+}
+
+EvTask<void> run(EvHttpCoClient client, EvHttpCoClient hole)
+{
+	// 1. Sequential awaits
+	for(int i = 0; i < 3; ++i)
+	{
+		HttpResponse response = co_await client.get("/seq");
+		check(response, "sequential");
+	}
+	if(co_await fetch_code(client) != 200)
+	{
+		fail("Nested task failed.");
+	}
+	cout << "sequential: ok" << endl;
+
+	// 2. Held response
+	HttpResponse held = co_await client.get("/held");
+	for(int i = 0; i < 3; ++i)
+	{
+		HttpResponse response = co_await client.get("/other");
+		check(response, "other");
+	}
+	check(held, "held");
+	held.reset();
+	cout << "held: ok" << endl;
+
+	// 3. when_all
+	auto [a, b, c] = co_await when_all(client.get("/a"), client.get("/b"),
+		client.post("/c", "body"));
+	check(a, "when_all a");
+	check(b, "when_all b");
+	check(c, "when_all c");
+
+	vector<RequestAwaitable> fanout;
+	for(int i = 0; i < NUM_FANOUT; ++i)
+	{
+		fanout.push_back(client.get("/fanout"));
+	}
+	vector<HttpResponse> responses = co_await when_all(std::move(fanout));
+	if(responses.size() != NUM_FANOUT)
+	{
+		fail("when_all lost responses.");
+	}
+	for(size_t i = 0; i < responses.size(); ++i)
+	{
+		check(responses[i], "when_all vector");
+	}
+	cout << "when_all: ok" << endl;
+
+	// 4. when_any
+	auto [index, first] = co_await when_any(hole.get("/slow"), client.get("/fast"));
+	if(index != 1)
+	{
+		fail("when_any picked the wrong request.");
+	}
+	check(first, "when_any");
+	if(hole.getClient()->getOutstanding() != 0)
+	{
+		fail("when_any left its loser outstanding.");
+	}
+	auto [none, empty] = co_await when_any(vector<RequestAwaitable>());
+	if(none != 0 || empty.get() != NULL || empty.error != -1)
+	{
+		fail("when_any over no requests did not fail at once.");
+	}
+	cout << "when_any: ok" << endl;
+
+	// 5. Pooled frames
+	for(int i = 0; i < NUM_TASKS; ++i)
+	{
+		spawn(short_task(client));
+		if(i % 16 == 15)
+		{
+			// Let some finish, so their frames are reused.
+			co_await client.get("/pace");
+		}
+	}
+
+	finished = true;
+}
+
+void timeout_cb(struct ev_loop *loop, struct ev_timer *timer, int revents)
+{
+	fail("Timed out.");
+}
+
+/* Main */
+int main()
+{
+	struct ev_loop *loop = ev_default_loop(0);
+	loop_thread = this_thread::get_id();
+
+	unsigned short port = local_server_start(loop);
+	stringstream url;
+	url << "http://127.0.0.1:" << port << "/";
+	EvHttpClient client(loop, url.str(), 5, NULL, 4);
+
+	// Accepts connections (through its backlog) but never
+	// reads them.
+	unsigned short hole_port = 0;
+	if(local_server_listen(AF_INET, 16, &hole_port) < 0)
+	{
+		fail("Couldn't listen.");
+	}
+	stringstream hole_url;
+	hole_url << "http://127.0.0.1:" << hole_port << "/";
+	EvHttpClient hole(loop, hole_url.str(), 5, NULL, 1);
+
+	struct ev_timer timer;
+	ev_timer_init(&timer, timeout_cb, 10, 0);
+	ev_timer_start(loop, &timer);
+
+	spawn(run(EvHttpCoClient(&client), EvHttpCoClient(&hole)));
+	while(!finished || tasks_done < NUM_TASKS)
+	{
+		ev_loop(loop, EVLOOP_ONESHOT);
+	}
+	ev_timer_stop(loop, &timer);
+
+	cout << "Done." << endl;
+	return 0;
+}
@@ -0,0 +1,240 @@
+/*
+ * dns.cpp
+ *
+ * Checks host name resolution against a stub Resolver
+ * that takes a while to answer and can be repointed
+ * from one local server to another:
+ *
+ * 1. Creating a client doesn't wait for the lookup, and
+ *    requests made before it finishes are sent once it
+ *    does.
+ * 2. When the name moves to another server, the client
+ *    follows after the TTL, and its connections to the
+ *    old server are closed.
+ * 3. Clients sharing an AsyncResolver share its cache.
+ * 4. A name that can't be resolved fails the requests
+ *    waiting for it, and later requests at once.
+ */
+
+#include <iostream>
+#include <sstream>
+#include <map>
+#include <atomic>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/time.h>
+#include <ev.h>
+#include <evhttpclient.h>
+#include "local_server.h"
+
+using namespace std;
+
+#define LOOKUP_TIME (50000)
+#define TTL (0.2)
+#define NUM_REQUESTS (5)
+
+static atomic<int> stub_port(0);
+static atomic<int> lookups(0);
+
+/*
+ * Resolves backend.test to the local server at
+ * stub_port, slowly. Any other name is unknown.
+ */
+class StubResolver : public Resolver
+{
+	public:
+		int resolve(const string & host, const string & service,
+			vector<ResolvedAddress> & addresses, double *ttl)
+		{
+			usleep(LOOKUP_TIME);
+			lookups++;
+			if(host != "backend.test")
+			{
+				return EAI_NONAME;
+			}
+
+			stringstream port;
+			port << stub_port;
+			Resolver::resolve("127.0.0.1", port.str(), addresses, NULL);
+			*ttl = TTL;
+			return 0;
+		}
+};
+
+static StubResolver stub;
+static AsyncResolver *resolver = NULL;
+static EvHttpClient *client = NULL;
+static struct ev_timer phase_timer;
+static int phase = 0;
+
+static unsigned short first_port;
+static unsigned short second_port;
+static map<unsigned short, int> served;
+static int responses = 0;
+static int errors = 0;
+
+static string handler(const string & request)
+{
+	served[local_server_port]++;
+	return "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok";
+}
+
+void response_cb(ResponseInfo *response, void *requestData, void *clientData)
+{
+	if(response == NULL)
+	{
+		errors++;
+		return;
+	}
+	if(response->timeout || response->code != 200)
+	{
+		cout << "Bad response." << endl;
+		exit(1);
+	}
+	responses++;
+}
+
+int make(EvHttpClient *client)
+{
+	return client->makeGet(response_cb, "/", map<string, string>(), NULL);
+}
+
+void make_all(EvHttpClient *client)
+{
+	for(int i = 0; i < NUM_REQUESTS; ++i)
+	{
+		if(make(client) != 0)
+		{
+			cout << "Error making request." << endl;
+			exit(1);
+		}
+	}
+}
+
+double now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.;
+}
+
+void next_phase(double after)
+{
+	ev_timer_set(&phase_timer, after, 0.);
+	ev_timer_start(ev_default_loop(0), &phase_timer);
+}
+
+void phase_cb(struct ev_loop *loop, struct ev_timer *timer, int revents)
+{
+	static EvHttpClient *second = NULL;
+	switch(phase++)
+	{
+		case 0:
+		{
+			double start = now();
+			client = new EvHttpClient(loop, "http://backend.test/", 5, NULL, 2, DEFAULT_BLOCK_SIZE,
+				resolver);
+			make_all(client);
+			double elapsed = now() - start;
+			cout << "constructed and requested in " << elapsed << "s" << endl;
+			if(elapsed > LOOKUP_TIME / 2000000.)
+			{
+				cout << "Client waited for the lookup." << endl;
+				exit(1);
+			}
+			next_phase(0.15);
+			break;
+		}
+
+		case 1:
+			cout << "first lookup: " << responses << " responses, " << served[first_port]
+				<< " on the first server" << endl;
+			if(responses != NUM_REQUESTS || served[first_port] != NUM_REQUESTS)
+			{
+				cout << "Waiting requests were not sent." << endl;
+				exit(1);
+			}
+			stub_port = second_port;
+			next_phase(TTL + 0.15);
+			break;
+
+		case 2:
+			responses = 0;
+			make_all(client);
+			next_phase(0.1);
+			break;
+
+		case 3:
+			cout << "moved: " << responses << " responses, " << served[second_port]
+				<< " on the second server, " << client->getPoolReport().total
+				<< " connections" << endl;
+			if(responses != NUM_REQUESTS || served[second_port] != NUM_REQUESTS ||
+				served[first_port] != NUM_REQUESTS)
+			{
+				cout << "Client did not follow the name to the new server." << endl;
+				exit(1);
+			}
+
+			// Within the TTL, a second client is answered from
+			// the shared cache.
+			lookups = 0;
+			responses = 0;
+			second = new EvHttpClient(loop, "http://backend.test/", 5, NULL, 0,
+				DEFAULT_BLOCK_SIZE, resolver);
+			make_all(second);
+			next_phase(0.02);
+			break;
+
+		case 4:
+			cout << "shared: " << responses << " responses, " << lookups << " lookups" << endl;
+			if(responses != NUM_REQUESTS || lookups != 0)
+			{
+				cout << "Shared resolver did not use its cache." << endl;
+				exit(1);
+			}
+			delete second;
+
+			responses = 0;
+			second = new EvHttpClient(loop, "http://missing.test/", 5, NULL, 0,
+				DEFAULT_BLOCK_SIZE, resolver);
+			make_all(second);
+			next_phase(0.15);
+			break;
+
+		default:
+			cout << "unknown name: " << errors << " errors, next request returns "
+				<< make(second) << endl;
+			if(errors != NUM_REQUESTS || responses != 0 || make(second) != -1)
+			{
+				cout << "Unresolvable name did not fail requests." << endl;
+				exit(1);
+			}
+			delete second;
+			delete client;
+			delete resolver;
+			cout << "Done." << endl;
+			exit(0);
+	}
+}
+
+/* Main */
+int main()
+{
+	struct ev_loop *loop = ev_default_loop(0);
+
+	local_server_handler = handler;
+	first_port = local_server_start(loop);
+	second_port = local_server_start(loop);
+	stub_port = first_port;
+	resolver = new AsyncResolver(loop, &stub);
+
+	ev_timer_init(&phase_timer, phase_cb, 0., 0.);
+	ev_timer_start(loop, &phase_timer);
+
+	while (1)
+	{
+		ev_loop(loop, 0);
+	}
+
+	return 0;
+}
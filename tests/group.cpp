@@ -0,0 +1,205 @@
+/*
+ * group.cpp
+ *
+ * Checks RequestGroup against local servers:
+ *
+ * 1. A group of requests over two clients calls back
+ *    once, when all have finished, with every result.
+ * 2. At the deadline, requests to a server that never
+ *    answers are cancelled and reported not done, while
+ *    the others keep their responses. Their client's
+ *    own (shorter) timeout does not apply: the group's
+ *    timer is the only one.
+ * 3. A group can be reused, or deleted, from its
+ *    callback.
+ */
+
+#include <iostream>
+#include <sstream>
+#include <time.h>
+#include <ev.h>
+#include <evhttpclient.h>
+#include <requestgroup.h>
+#include "local_server.h"
+
+using namespace std;
+
+#define GROUP_SIZE (8)
+#define DEADLINE (0.3)
+#define ROUNDS (5)
+
+static struct ev_loop *loop;
+static EvHttpClient *first = NULL;
+static EvHttpClient *second = NULL;
+static EvHttpClient *hole = NULL;
+static int phase = 0;
+static int callbacks = 0;
+static int rounds = 0;
+static double started;
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fail(const string & message)
+{
+	cout << message << endl;
+	exit(1);
+}
+
+static void check(const GroupResult & result)
+{
+	if(!result.done || result.response == NULL || result.response->timeout ||
+		result.response->code != 200 || result.response->response != "hello world\n")
+	{
+		fail("Bad result.");
+	}
+}
+
+void all_done_cb(RequestGroup *group, void *data)
+{
+	callbacks++;
+	if(group->size() != GROUP_SIZE || group->numDone() != GROUP_SIZE ||
+		group->expired())
+	{
+		fail("Group finished early.");
+	}
+	const GroupResult *results = group->getResults();
+	for(size_t i = 0; i < group->size(); ++i)
+	{
+		check(results[i]);
+	}
+	phase++;
+}
+
+void deadline_cb(RequestGroup *group, void *data)
+{
+	callbacks++;
+	double elapsed = now() - started;
+	if(!group->expired() || elapsed < DEADLINE * 0.9)
+	{
+		fail("Deadline came early.");
+	}
+	for(size_t i = 0; i < group->size(); ++i)
+	{
+		const GroupResult & result = group->getResult(i);
+		if(i % 2 == 0)
+		{
+			check(result);
+		}
+		else if(result.done || result.response != NULL)
+		{
+			fail("Unanswered request reported done.");
+		}
+	}
+	if(hole->getOutstanding() != 0)
+	{
+		fail("Unanswered requests left outstanding.");
+	}
+	phase++;
+}
+
+/* Reuses the group for ROUNDS rounds, then deletes it. */
+void reuse_cb(RequestGroup *group, void *data)
+{
+	callbacks++;
+	if(group->size() != 2)
+	{
+		fail("Reused group kept old results.");
+	}
+	check(group->getResult(0));
+	check(group->getResult(1));
+
+	if(++rounds < ROUNDS)
+	{
+		group->addGet(first, "/again");
+		group->addGet(second, "/again");
+		group->wait(reuse_cb, NULL);
+		return;
+	}
+	delete group;
+	phase++;
+}
+
+static void run_until(int target)
+{
+	while(phase < target)
+	{
+		ev_loop(loop, EVLOOP_ONESHOT);
+	}
+}
+
+/* Main */
+int main()
+{
+	loop = ev_default_loop(0);
+	unsigned short port = local_server_start(loop);
+	stringstream url;
+	url << "http://127.0.0.1:" << port << "/";
+	first = new EvHttpClient(loop, url.str(), 5, NULL, 4);
+	second = new EvHttpClient(loop, url.str(), 5, NULL, 4);
+
+	// Accepts connections (through its backlog) but never
+	// reads them. Its client's timeout is shorter than the
+	// group deadline.
+	unsigned short hole_port = 0;
+	if(local_server_listen(AF_INET, 16, &hole_port) < 0)
+	{
+		fail("Couldn't listen.");
+	}
+	stringstream hole_url;
+	hole_url << "http://127.0.0.1:" << hole_port << "/";
+	hole = new EvHttpClient(loop, hole_url.str(), DEADLINE / 3, NULL, GROUP_SIZE);
+
+	// The group holds responses, so goes before the clients.
+	{
+		// 1. All finish
+		RequestGroup group(loop, GROUP_SIZE, DEADLINE);
+		for(int i = 0; i < GROUP_SIZE; ++i)
+		{
+			if(group.addGet(i % 2 ? second : first, "/all") != i)
+			{
+				fail("Couldn't add.");
+			}
+		}
+		if(group.addGet(first, "/full") != -1)
+		{
+			fail("Group overfilled.");
+		}
+		group.wait(all_done_cb, NULL);
+		run_until(1);
+		cout << "all done: ok" << endl;
+
+		// 2. Deadline
+		started = now();
+		for(int i = 0; i < GROUP_SIZE; ++i)
+		{
+			group.addGet(i % 2 ? hole : first, "/deadline");
+		}
+		group.wait(deadline_cb, NULL);
+		run_until(2);
+		cout << "deadline: ok" << endl;
+	}
+
+	// 3. Reuse and delete from the callback
+	RequestGroup *reused = new RequestGroup(loop, 2, DEADLINE);
+	reused->addGet(first, "/again");
+	reused->addGet(second, "/again");
+	reused->wait(reuse_cb, NULL);
+	run_until(3);
+	cout << "reuse: ok" << endl;
+
+	if(callbacks != 2 + ROUNDS)
+	{
+		fail("Wrong number of group callbacks.");
+	}
+
+	delete first;
+	delete second;
+	delete hole;
+	cout << "Done." << endl;
+	return 0;
+}
@@ -0,0 +1,192 @@
+/*
+ * hedge.cpp
+ *
+ * Checks request hedging against a local server:
+ *
+ * 1. A GET whose server answers slowly is hedged after
+ *    the hedge delay, and the hedge's quick response is
+ *    the one passed to the callback.
+ * 2. A burst of slow GETs is hedged only as far as the
+ *    rate cap allows, and each callback runs once.
+ * 3. POSTs are never hedged.
+ * 4. With a percentile set, the delay follows observed
+ *    latencies once enough requests have completed.
+ */
+
+#include <iostream>
+#include <sstream>
+#include <map>
+#include <ev.h>
+#include <evhttpclient.h>
+#include "local_server.h"
+
+using namespace std;
+
+#define BURST_SIZE (20)
+#define NUM_SAMPLES (128)
+
+static EvHttpClient *client = NULL;
+static struct ev_timer phase_timer;
+static int phase = 0;
+
+static int responses = 0;
+static int slow_requests = 0;
+
+static string http_response(const string & body)
+{
+	stringstream response;
+	response << "HTTP/1.1 200 OK\r\nContent-Length: " << body.size() << "\r\n\r\n" << body;
+	return response.str();
+}
+
+/*
+ * The first slow_requests requests are answered after a
+ * delay, the rest straight away.
+ */
+static string handler(const string & request)
+{
+	if(local_server_requests < slow_requests)
+	{
+		local_server_delay = 0.3;
+		return http_response("slow");
+	}
+	local_server_delay = 0;
+	return http_response("fast");
+}
+
+void response_cb(ResponseInfo *response, void *requestData, void *clientData)
+{
+	if(response == NULL || response->timeout || response->code != 200)
+	{
+		cout << "Bad response." << endl;
+		exit(1);
+	}
+	if(requestData != NULL && response->response != (const char *) requestData)
+	{
+		cout << "Expected \"" << (const char *) requestData << "\", got \""
+			<< response->response << "\"." << endl;
+		exit(1);
+	}
+	responses++;
+}
+
+void make(const string & method, void *data)
+{
+	if(client->makeRequest(response_cb, "/", method, map<string, string>(), "", data) < 0)
+	{
+		cout << "Error making request." << endl;
+		exit(1);
+	}
+}
+
+void next_phase(double after)
+{
+	ev_timer_set(&phase_timer, after, 0.);
+	ev_timer_start(ev_default_loop(0), &phase_timer);
+}
+
+void phase_cb(struct ev_loop *loop, struct ev_timer *timer, int revents)
+{
+	HedgeReport report = client->getHedgeReport();
+	switch(phase++)
+	{
+		case 0:
+			slow_requests = 1;
+			client->setHedging(true, 0.05);
+			make("GET", (void *) "fast");
+			next_phase(0.2);
+			break;
+
+		case 1:
+			cout << "hedged: " << responses << " responses, " << local_server_requests
+				<< " server requests, " << report.sent << " sent, " << report.won
+				<< " won" << endl;
+			if(responses != 1 || local_server_requests != 2 || report.sent != 1 ||
+				report.won != 1)
+			{
+				cout << "Slow request was not hedged." << endl;
+				exit(1);
+			}
+
+			// Every request is slow and hedges cost more than
+			// the burst allowance.
+			responses = 0;
+			slow_requests = 1000;
+			client->setHedging(true, 0.05, 0, 0);
+			for(int i = 0; i < BURST_SIZE; ++i)
+			{
+				make("GET", (void *) "slow");
+			}
+			next_phase(0.6);
+			break;
+
+		case 2:
+			cout << "capped: " << responses << " responses, " << report.sent
+				<< " sent, " << report.suppressed << " suppressed" << endl;
+			if(responses != BURST_SIZE || report.suppressed == 0 ||
+				report.sent - 1 + report.suppressed != BURST_SIZE)
+			{
+				cout << "Hedges were not capped." << endl;
+				exit(1);
+			}
+
+			responses = 0;
+			slow_requests = local_server_requests + 1;
+			client->setHedging(true, 0.05);
+			make("POST", (void *) "slow");
+			next_phase(0.5);
+			break;
+
+		case 3:
+			cout << "post: " << responses << " responses, " << report.sent << " sent" << endl;
+			if(responses != 1 || client->getHedgeReport().sent != report.sent)
+			{
+				cout << "POST was hedged." << endl;
+				exit(1);
+			}
+
+			responses = 0;
+			slow_requests = 0;
+			client->setHedging(true, 1.0, 0.9);
+			for(int i = 0; i < NUM_SAMPLES; ++i)
+			{
+				make("GET", (void *) "fast");
+			}
+			next_phase(0.5);
+			break;
+
+		default:
+			cout << "percentile: " << responses << " responses, delay "
+				<< report.delay << endl;
+			if(responses != NUM_SAMPLES || report.delay >= 1.0)
+			{
+				cout << "Delay did not follow latencies." << endl;
+				exit(1);
+			}
+			cout << "Done." << endl;
+			exit(0);
+	}
+}
+
+/* Main */
+int main()
+{
+	struct ev_loop *loop = ev_default_loop(0);
+
+	local_server_handler = handler;
+	unsigned short port = local_server_start(loop);
+	stringstream url;
+	url << "http://127.0.0.1:" << port << "/";
+
+	client = new EvHttpClient(loop, url.str(), 5, NULL, 0);
+
+	ev_timer_init(&phase_timer, phase_cb, 0., 0.);
+	ev_timer_start(loop, &phase_timer);
+
+	while (1)
+	{
+		ev_loop(loop, 0);
+	}
+
+	return 0;
+}
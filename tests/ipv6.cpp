@@ -0,0 +1,232 @@
+/*
+ * ipv6.cpp
+ *
+ * Checks IPv6 support and connection racing against
+ * local servers:
+ *
+ * 1. A URL with a bracketed IPv6 literal reaches a
+ *    server on ::1, with a bracketed Host header.
+ * 2. A name whose first address never answers (a
+ *    listener with a full backlog) connects through its
+ *    other address after HAPPY_EYEBALLS_DELAY rather
+ *    than timing out.
+ * 3. Once IPv4 has won, new connections try it first.
+ *
+ * The unreachable address is on ::1 when the host has
+ * IPv6, and the IPv6 checks are skipped otherwise.
+ */
+
+#include <iostream>
+#include <sstream>
+#include <map>
+#include <netdb.h>
+#include <ev.h>
+#include <evhttpclient.h>
+#include "local_server.h"
+
+using namespace std;
+
+#define NUM_REQUESTS (4)
+
+static bool have_ipv6 = false;
+static unsigned short hole_port;
+static unsigned short working_port;
+
+/*
+ * Resolves dual.test to the unreachable address first,
+ * then the working server.
+ */
+class StubResolver : public Resolver
+{
+	public:
+		int resolve(const string & host, const string & service,
+			vector<ResolvedAddress> & addresses, double *ttl)
+		{
+			stringstream hole;
+			stringstream working;
+			hole << hole_port;
+			working << working_port;
+			Resolver::resolve(have_ipv6 ? "::1" : "127.0.0.1", hole.str(), addresses, NULL);
+			Resolver::resolve("127.0.0.1", working.str(), addresses, NULL);
+			return 0;
+		}
+};
+
+static StubResolver stub;
+static AsyncResolver *resolver = NULL;
+static EvHttpClient *client = NULL;
+static struct ev_timer phase_timer;
+static int phase = 0;
+
+static string host_header;
+static int responses = 0;
+static double max_latency = 0;
+
+static string handler(const string & request)
+{
+	size_t pos = request.find("\r\nHost: ");
+	if(pos != string::npos)
+	{
+		pos += 8;
+		host_header = request.substr(pos, request.find("\r\n", pos) - pos);
+	}
+	return "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok";
+}
+
+void response_cb(ResponseInfo *response, void *requestData, void *clientData)
+{
+	if(response == NULL || response->timeout || response->code != 200)
+	{
+		cout << "Bad response." << endl;
+		exit(1);
+	}
+	max_latency = max(max_latency, response->latency);
+	responses++;
+}
+
+void make(int count)
+{
+	responses = 0;
+	max_latency = 0;
+	for(int i = 0; i < count; ++i)
+	{
+		if(client->makeGet(response_cb, "/", map<string, string>(), NULL) != 0)
+		{
+			cout << "Error making request." << endl;
+			exit(1);
+		}
+	}
+}
+
+/*
+ * A listener that accepts nothing, with its backlog
+ * already taken, so further connects get no answer.
+ */
+static unsigned short black_hole(int family)
+{
+	unsigned short port = 0;
+	int sd = local_server_listen(family, 0, &port);
+	int filler = socket(family, SOCK_STREAM, 0);
+	struct addrinfo hints;
+	struct addrinfo *info = NULL;
+	bzero(&hints, sizeof(hints));
+	hints.ai_family = family;
+	hints.ai_flags = AI_NUMERICHOST;
+	stringstream service;
+	service << port;
+	if(sd < 0 || filler < 0 ||
+		getaddrinfo(family == AF_INET6 ? "::1" : "127.0.0.1", service.str().c_str(),
+			&hints, &info) != 0 ||
+		connect(filler, info->ai_addr, info->ai_addrlen) != 0)
+	{
+		perror("black hole error");
+		exit(1);
+	}
+	freeaddrinfo(info);
+	return port;
+}
+
+void next_phase(double after)
+{
+	ev_timer_set(&phase_timer, after, 0.);
+	ev_timer_start(ev_default_loop(0), &phase_timer);
+}
+
+void phase_cb(struct ev_loop *loop, struct ev_timer *timer, int revents)
+{
+	switch(phase++)
+	{
+		case 0:
+		{
+			if(!have_ipv6)
+			{
+				cout << "no IPv6 on this host, skipping literal" << endl;
+				next_phase(0);
+				break;
+			}
+			unsigned short port = local_server_start(loop, AF_INET6);
+			stringstream url;
+			url << "http://[::1]:" << port << "/";
+			client = new EvHttpClient(loop, url.str(), 5, NULL, 0);
+			make(1);
+			next_phase(0.1);
+			break;
+		}
+
+		case 1:
+			if(have_ipv6)
+			{
+				stringstream expected;
+				expected << "[::1]:" << local_server_port;
+				cout << "literal: " << responses << " responses, Host " << host_header << endl;
+				if(responses != 1 || host_header != expected.str())
+				{
+					cout << "IPv6 literal was not reached." << endl;
+					exit(1);
+				}
+				delete client;
+			}
+
+			client = new EvHttpClient(loop, "http://dual.test/", 5, NULL, 0,
+				DEFAULT_BLOCK_SIZE, resolver);
+			make(1);
+			next_phase(1);
+			break;
+
+		case 2:
+			cout << "race: " << responses << " responses in " << max_latency << "s" << endl;
+			if(responses != 1 || max_latency < HAPPY_EYEBALLS_DELAY || max_latency > 1)
+			{
+				cout << "Unreachable address was not raced." << endl;
+				exit(1);
+			}
+
+			// Only one connection is pooled, so all but one
+			// of these make their own.
+			make(NUM_REQUESTS);
+			next_phase(1);
+			break;
+
+		default:
+			cout << "after race: " << responses << " responses, slowest in "
+				<< max_latency << "s" << endl;
+			if(responses != NUM_REQUESTS || (have_ipv6 && max_latency >= HAPPY_EYEBALLS_DELAY))
+			{
+				cout << "Winning family was not preferred." << endl;
+				exit(1);
+			}
+			delete client;
+			delete resolver;
+			cout << "Done." << endl;
+			exit(0);
+	}
+}
+
+/* Main */
+int main()
+{
+	struct ev_loop *loop = ev_default_loop(0);
+
+	unsigned short port = 0;
+	int probe = local_server_listen(AF_INET6, 1, &port);
+	if(probe >= 0)
+	{
+		have_ipv6 = true;
+		close(probe);
+	}
+
+	local_server_handler = handler;
+	working_port = local_server_start(loop);
+	hole_port = black_hole(have_ipv6 ? AF_INET6 : AF_INET);
+	resolver = new AsyncResolver(loop, &stub);
+
+	ev_timer_init(&phase_timer, phase_cb, 0., 0.);
+	ev_timer_start(loop, &phase_timer);
+
+	while (1)
+	{
+		ev_loop(loop, 0);
+	}
+
+	return 0;
+}
@@ -0,0 +1,201 @@
+/*
+ * local_server.h
+ *
+ * A tiny keep-alive HTTP server that runs on the same
+ * event loop as the client under test, so tests do not
+ * depend on a remote host. Every request receives the
+ * same canned response, optionally after a delay,
+ * unless local_server_handler is set, in which case it
+ * builds the response to each request.
+ *
+ * Requests are assumed to have no body; a request is
+ * considered complete at the first blank line.
+ *
+ * Several servers, on loops in different threads, may
+ * share a port, which spreads connections over them.
+ */
+
+#ifndef LOCAL_SERVER_H_
+#define LOCAL_SERVER_H_
+
+#include <strings.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <string>
+#include <atomic>
+#include <ev.h>
+
+using namespace std;
+
+#define LOCAL_SERVER_RESPONSE ("HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: 12\r\n\r\nhello world\n")
+
+static double local_server_delay = 0;
+static atomic<int> local_server_requests(0);
+static string (*local_server_handler)(const string & request) = NULL;
+
+/* Port of the server the handler is answering for. */
+static thread_local unsigned short local_server_port = 0;
+
+/* Per-connection state. */
+typedef struct LocalConn_
+{
+	struct ev_io reader;
+	struct ev_timer delay;
+	string buffer;
+	string output;
+} LocalConn;
+
+/* Send the responses to all complete requests. */
+static void local_server_respond(LocalConn *conn)
+{
+	send(conn->reader.fd, conn->output.data(), conn->output.size(), MSG_NOSIGNAL);
+	conn->output.clear();
+}
+
+static void local_server_delay_cb(struct ev_loop *loop, struct ev_timer *timer, int revents)
+{
+	local_server_respond((LocalConn *) timer->data);
+}
+
+static void local_server_read_cb(struct ev_loop *loop, struct ev_io *watcher, int revents)
+{
+	LocalConn *conn = (LocalConn *) watcher->data;
+	char buffer[4096];
+
+	int received = recv(watcher->fd, buffer, sizeof(buffer), 0);
+	if(received <= 0)
+	{
+		ev_io_stop(loop, &conn->reader);
+		ev_timer_stop(loop, &conn->delay);
+		close(watcher->fd);
+		delete conn;
+		return;
+	}
+
+	conn->buffer.append(buffer, received);
+
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+	getsockname(watcher->fd, (struct sockaddr *) &addr, &len);
+	local_server_port = ntohs(((struct sockaddr_in *) &addr)->sin_port);
+	size_t end;
+	while((end = conn->buffer.find("\r\n\r\n")) != string::npos)
+	{
+		if(local_server_handler != NULL)
+		{
+			conn->output += local_server_handler(conn->buffer.substr(0, end + 4));
+		}
+		else
+		{
+			conn->output += LOCAL_SERVER_RESPONSE;
+		}
+		conn->buffer.erase(0, end + 4);
+		local_server_requests++;
+	}
+
+	if(local_server_delay > 0)
+	{
+		if(!ev_is_active(&conn->delay))
+		{
+			ev_timer_set(&conn->delay, local_server_delay, 0.);
+			ev_timer_start(loop, &conn->delay);
+		}
+	}
+	else
+	{
+		local_server_respond(conn);
+	}
+}
+
+static void local_server_accept_cb(struct ev_loop *loop, struct ev_io *watcher, int revents)
+{
+	int sd = accept(watcher->fd, NULL, NULL);
+	if(sd < 0)
+	{
+		perror("accept error");
+		return;
+	}
+
+	LocalConn *conn = new LocalConn();
+	ev_io_init(&conn->reader, local_server_read_cb, sd, EV_READ);
+	conn->reader.data = (void *) conn;
+	ev_timer_init(&conn->delay, local_server_delay_cb, 0., 0.);
+	conn->delay.data = (void *) conn;
+	ev_io_start(loop, &conn->reader);
+}
+
+/*
+ * Binds a listening socket to a loopback port
+ * (127.0.0.1, or ::1 for AF_INET6): port, which other
+ * listeners may share, or an ephemeral one if it is 0.
+ * Sets port and returns the socket, or -1 on failure.
+ */
+static int local_server_listen(int family, int backlog, unsigned short *port)
+{
+	int sd = socket(family, SOCK_STREAM, 0);
+	if(sd < 0)
+	{
+		return -1;
+	}
+	int on = 1;
+	setsockopt(sd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+
+	struct sockaddr_storage addr;
+	bzero(&addr, sizeof(addr));
+	socklen_t len;
+	if(family == AF_INET6)
+	{
+		struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *) &addr;
+		addr6->sin6_family = AF_INET6;
+		addr6->sin6_addr = in6addr_loopback;
+		addr6->sin6_port = htons(*port);
+		len = sizeof(*addr6);
+	}
+	else
+	{
+		struct sockaddr_in *addr4 = (struct sockaddr_in *) &addr;
+		addr4->sin_family = AF_INET;
+		addr4->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		addr4->sin_port = htons(*port);
+		len = sizeof(*addr4);
+	}
+
+	if(bind(sd, (struct sockaddr *) &addr, len) != 0 ||
+		getsockname(sd, (struct sockaddr *) &addr, &len) != 0 ||
+		listen(sd, backlog) < 0)
+	{
+		close(sd);
+		return -1;
+	}
+	*port = ntohs(((struct sockaddr_in *) &addr)->sin_port);
+	return sd;
+}
+
+/*
+ * Starts listening on a loopback port (ephemeral unless
+ * given). May be called more than once for several
+ * servers, which share the settings above. Returns the
+ * port, or exits on failure.
+ */
+static unsigned short local_server_start(struct ev_loop *loop, int family = AF_INET,
+	unsigned short port = 0)
+{
+	int sd = local_server_listen(family, 128, &port);
+	if(sd < 0)
+	{
+		perror("server bind/listen error");
+		exit(1);
+	}
+
+	struct ev_io *accepter = new struct ev_io;
+	ev_io_init(accepter, local_server_accept_cb, sd, EV_READ);
+	ev_io_start(loop, accepter);
+
+	return port;
+}
+
+#endif /* LOCAL_SERVER_H_ */
@@ -0,0 +1,205 @@
+/*
+ * multi.cpp
+ *
+ * Checks MultiEvHttpClient against local servers:
+ *
+ * 1. With two fast endpoints and a slow one, most
+ *    requests go to the fast ones.
+ * 2. An endpoint that refuses connections is ejected
+ *    after a few failures, and later requests succeed.
+ * 3. A removed endpoint gets no more requests.
+ */
+
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <map>
+#include <stdlib.h>
+#include <ev.h>
+#include <evhttpclient.h>
+#include <multievhttpclient.h>
+#include "local_server.h"
+
+using namespace std;
+
+#define NUM_REQUESTS (300)
+#define CONCURRENCY (10)
+#define SLOW_DELAY (0.05)
+
+static MultiEvHttpClient *client = NULL;
+static unsigned short slow_port = 0;
+static vector<string> urls;
+static int phase = 0;
+
+static int sent = 0;
+static int completed = 0;
+static int failed = 0;
+static map<unsigned short, int> served;
+
+/*
+ * Answers straight away, except on the slow server,
+ * which it tells apart by the Host header.
+ */
+static string handler(const string & request)
+{
+	size_t pos = request.find("Host: 127.0.0.1:");
+	unsigned short port = atoi(request.c_str() + pos + 16);
+	served[port]++;
+	local_server_delay = port == slow_port ? SLOW_DELAY : 0;
+	return "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok";
+}
+
+static string local_url(unsigned short port)
+{
+	stringstream url;
+	url << "http://127.0.0.1:" << port << "/";
+	return url.str();
+}
+
+/*
+ * A loopback port with nothing listening on it.
+ */
+static unsigned short closed_port()
+{
+	int sd = socket(PF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr;
+	bzero(&addr, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t len = sizeof(addr);
+	bind(sd, (struct sockaddr *) &addr, sizeof(addr));
+	getsockname(sd, (struct sockaddr *) &addr, &len);
+	close(sd);
+	return ntohs(addr.sin_port);
+}
+
+void next_phase();
+
+void send_one();
+
+void response_cb(ResponseInfo *response, void *requestData, void *clientData)
+{
+	if(response == NULL || response->timeout || response->code != 200)
+	{
+		failed++;
+	}
+	completed++;
+	if(completed == NUM_REQUESTS)
+	{
+		next_phase();
+	}
+	else
+	{
+		send_one();
+	}
+}
+
+void send_one()
+{
+	if(sent == NUM_REQUESTS)
+	{
+		return;
+	}
+	sent++;
+	if(client->makeGet(response_cb, "/", map<string, string>(), NULL) != 0)
+	{
+		failed++;
+		completed++;
+		send_one();
+	}
+}
+
+void start_phase()
+{
+	sent = 0;
+	completed = 0;
+	failed = 0;
+	served.clear();
+	for(int i = 0; i < CONCURRENCY; ++i)
+	{
+		send_one();
+	}
+}
+
+void print_report()
+{
+	vector<EndpointReport> report = client->getEndpointReport();
+	for(size_t i = 0; i < report.size(); ++i)
+	{
+		cout << "  " << report[i].url << ": " << report[i].requests << " requests, latency "
+			<< report[i].latency << (report[i].ejected ? ", ejected" : "") << endl;
+	}
+}
+
+void next_phase()
+{
+	unsigned short fast1 = atoi(urls[0].c_str() + 17);
+	unsigned short fast2 = atoi(urls[1].c_str() + 17);
+	switch(phase++)
+	{
+		case 0:
+			cout << "speed: " << served[fast1] << ", " << served[fast2] << " fast, "
+				<< served[slow_port] << " slow, " << failed << " failed" << endl;
+			print_report();
+			if(failed > 0 || served[slow_port] * 5 > NUM_REQUESTS ||
+				served[fast1] < NUM_REQUESTS / 4 || served[fast2] < NUM_REQUESTS / 4)
+			{
+				cout << "Load did not follow endpoint speed." << endl;
+				exit(1);
+			}
+
+			local_server_delay = 0;
+			client->addEndpoint(local_url(closed_port()));
+			start_phase();
+			break;
+
+		case 1:
+			cout << "ejection: " << failed << " failed" << endl;
+			print_report();
+			if(failed == 0 || failed > 10 || !client->getEndpointReport()[3].ejected)
+			{
+				cout << "Failing endpoint was not ejected." << endl;
+				exit(1);
+			}
+
+			client->removeEndpoint(local_url(slow_port));
+			start_phase();
+			break;
+
+		default:
+			cout << "removal: " << served[slow_port] << " slow, " << failed << " failed, "
+				<< client->numEndpoints() << " endpoints" << endl;
+			if(served[slow_port] != 0 || failed != 0 || client->numEndpoints() != 3)
+			{
+				cout << "Removed endpoint still got requests." << endl;
+				exit(1);
+			}
+			cout << "Done." << endl;
+			exit(0);
+	}
+}
+
+/* Main */
+int main()
+{
+	struct ev_loop *loop = ev_default_loop(0);
+
+	local_server_handler = handler;
+	urls.push_back(local_url(local_server_start(loop)));
+	urls.push_back(local_url(local_server_start(loop)));
+	slow_port = local_server_start(loop);
+	urls.push_back(local_url(slow_port));
+
+	client = new MultiEvHttpClient(loop, urls, 5, NULL, 1);
+	BreakerPolicy policy;
+	policy.minRequests = 3;
+	client->setEjection(true, policy);
+	start_phase();
+
+	while (1)
+	{
+		ev_loop(loop, 0);
+	}
+
+	return 0;
+}
@@ -48,24 +48,23 @@ void response_cb(ResponseInfo *response, void *requestData, void *clientData)
 		exit(1);
 	}
 	
-	if(response->headers.size() < MIN_NUM_HEADERS ||
-		response->headers.size() > MAX_NUM_HEADERS)
+	if(response->headerCount() < MIN_NUM_HEADERS ||
+		response->headerCount() > MAX_NUM_HEADERS)
 	{
-		cout << "Incorrect number of headers (was " << response->headers.size()
+		cout << "Incorrect number of headers (was " << response->headerCount()
 			<< ", should be between " << MIN_NUM_HEADERS << " and " 
 			<< MAX_NUM_HEADERS << ")." << endl;
 		cout << "Headers" << endl << "-----" << endl;
-		for(map<string, string>::const_iterator iter = response->headers.begin();
-			iter != response->headers.end(); ++iter)
+		for(size_t i = 0; i < response->headerCount(); ++i)
 		{
-			cout << iter->first << ": " << iter->second << endl;
+			cout << response->headerName(i) << ": " << response->headerValue(i) << endl;
 		}
 		exit(1);
 	}
 	
 	size_t contentLength = 0;
 	stringstream ss;
-	ss << response->headers["Content-Length"];
+	ss << response->getHeader("Content-Length");
 	ss >> contentLength;
 	if(response->response.size() != contentLength)
 	{
@@ -0,0 +1,161 @@
+/*
+ * request_template.cpp
+ *
+ * Checks that requests built from a RequestTemplate are
+ * byte for byte those buildRequest makes from the same
+ * method and path, with the fixed headers followed by
+ * the slot headers: with and without a path prefix,
+ * with slot values, with default headers (including one
+ * a slot overrides), with and without an explicit Host,
+ * and with Content-Length added for a body or given as
+ * a fixed header. Then sends a template request to a
+ * local server, which must receive those bytes too.
+ */
+
+#include <iostream>
+#include <sstream>
+#include <map>
+#include <vector>
+#include <ev.h>
+#include <evhttpclient.h>
+#include "local_server.h"
+
+using namespace std;
+
+static struct ev_loop *loop;
+static string received;
+static bool answered = false;
+
+static string handler(const string & request)
+{
+	received = request;
+	return LOCAL_SERVER_RESPONSE;
+}
+
+void response_cb(ResponseInfo *response, void *requestData, void *clientData)
+{
+	if(response == NULL || response->timeout || response->code != 200)
+	{
+		cout << "Bad response." << endl;
+		exit(1);
+	}
+	answered = true;
+}
+
+static void check(const char *what, const string & built, const string & expected)
+{
+	if(built != expected)
+	{
+		cout << what << ": template built" << endl << built << "expected" << endl
+			<< expected;
+		exit(1);
+	}
+	cout << what << ": ok" << endl;
+}
+
+/*
+ * Builds a request from tmpl, and the same request from
+ * path, method, the fixed headers and the slot headers,
+ * and compares them.
+ */
+static void compare(const char *what, EvHttpClient & client, const RequestTemplate & tmpl,
+	const string & path, const string & method, const map<string, string> & fixed,
+	const vector<string> & slotHeaders, const vector<std::string_view> & slotValues,
+	const string & pathSuffix, const string & body)
+{
+	vector<HeaderPair> headers;
+	for(map<string, string>::const_iterator iter = fixed.begin();
+		iter != fixed.end(); ++iter)
+	{
+		headers.push_back(HeaderPair(iter->first, iter->second));
+	}
+	for(size_t i = 0; i < slotHeaders.size(); ++i)
+	{
+		headers.push_back(HeaderPair(slotHeaders[i], slotValues[i]));
+	}
+
+	string built;
+	string expected;
+	client.buildRequest(built, tmpl, pathSuffix, slotValues.data(), body);
+	client.buildRequest(expected, path, method, headers.data(), headers.size(), body);
+	check(what, built, expected);
+}
+
+/* Main */
+int main()
+{
+	loop = ev_default_loop(0);
+	unsigned short port = local_server_start(loop);
+	local_server_handler = handler;
+	stringstream url;
+	url << "http://127.0.0.1:" << port << "/base";
+	EvHttpClient client(loop, url.str(), 5, NULL, 1);
+
+	map<string, string> defaults;
+	defaults["User-Agent"] = "template-test";
+	defaults["X-Default"] = "on";
+	client.setDefaultHeaders(defaults);
+
+	map<string, string> none;
+	vector<string> noSlots;
+	vector<std::string_view> noValues;
+
+	// Path prefix and suffix, no headers of its own.
+	RequestTemplate plain(&client, "get", "/items/", none);
+	compare("prefix and suffix", client, plain, "/items/42", "GET", none,
+		noSlots, noValues, "42", "");
+
+	// No prefix: the client's default path.
+	RequestTemplate base(&client, "GET", "", none);
+	compare("default path", client, base, "/base", "GET", none,
+		noSlots, noValues, "", "");
+
+	// Fixed and slot headers, with a body: Content-Length
+	// is added.
+	map<string, string> fixed;
+	fixed["Accept"] = "text/plain";
+	fixed["X-Fixed"] = "1";
+	vector<string> slots;
+	slots.push_back("X-Request-Id");
+	slots.push_back("Authorization");
+	vector<std::string_view> values;
+	values.push_back("0123456789abcdef");
+	values.push_back("Bearer token");
+	RequestTemplate post(&client, "POST", "/api/v1/items/", fixed, slots);
+	compare("fixed and slot headers, body", client, post, "/api/v1/items/7", "POST",
+		fixed, slots, values, "7", "hello world");
+	compare("empty body", client, post, "/api/v1/items/", "POST",
+		fixed, slots, values, "", "");
+
+	// A slot overriding a default header.
+	vector<string> agent(1, "User-Agent");
+	vector<std::string_view> agentValue(1, "override");
+	RequestTemplate overriding(&client, "GET", "/agent", none, agent);
+	compare("slot overrides default", client, overriding, "/agent", "GET", none,
+		agent, agentValue, "", "");
+
+	// Explicit Host and Content-Length.
+	map<string, string> explicitHeaders;
+	explicitHeaders["Host"] = "example.com";
+	explicitHeaders["Content-Length"] = "5";
+	RequestTemplate put(&client, "PUT", "/raw", explicitHeaders);
+	compare("fixed Host and Content-Length", client, put, "/raw", "PUT",
+		explicitHeaders, noSlots, noValues, "", "hello");
+
+	// A template request on the wire.
+	string expected;
+	client.buildRequest(expected, overriding, "", agentValue.data(), "");
+	if(client.makeRequest(response_cb, overriding, "", { "override" }, "", NULL) != 0)
+	{
+		cout << "Template request failed." << endl;
+		exit(1);
+	}
+	while(!answered)
+	{
+		ev_loop(loop, EVLOOP_ONESHOT);
+	}
+	check("sent", received, expected);
+
+	cout << "Done." << endl;
+	return 0;
+}
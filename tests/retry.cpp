@@ -0,0 +1,171 @@
+/*
+ * retry.cpp
+ *
+ * Checks the retry policy against a local server that
+ * answers 503 Service Unavailable as told:
+ *
+ * 1. A GET is retried through two 503s, honouring
+ *    Retry-After, and its callback gets the 200.
+ * 2. A POST is not retried.
+ * 3. A GET stops after maxAttempts and gets the 503.
+ * 4. A GET whose Retry-After ends after its timeout is
+ *    not retried.
+ * 5. A burst of failing GETs is retried only as far as
+ *    the retry budget allows.
+ */
+
+#include <iostream>
+#include <sstream>
+#include <map>
+#include <ev.h>
+#include <evhttpclient.h>
+#include "local_server.h"
+
+using namespace std;
+
+#define BURST_SIZE (5)
+
+static EvHttpClient *client = NULL;
+static struct ev_timer phase_timer;
+static int phase = 0;
+
+static int unavailable = 0;
+static string retry_after = "0";
+static int responses = 0;
+static int last_code = 0;
+
+static string handler(const string & request)
+{
+	if(unavailable > 0)
+	{
+		unavailable--;
+		return "HTTP/1.1 503 Service Unavailable\r\nRetry-After: " + retry_after +
+			"\r\nContent-Length: 0\r\n\r\n";
+	}
+	return "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok";
+}
+
+void response_cb(ResponseInfo *response, void *requestData, void *clientData)
+{
+	if(response == NULL || response->timeout)
+	{
+		cout << "Request failed." << endl;
+		exit(1);
+	}
+	last_code = response->code;
+	responses++;
+}
+
+void make(const string & method)
+{
+	if(client->makeRequest(response_cb, "/", method, map<string, string>(), "", NULL) < 0)
+	{
+		cout << "Error making request." << endl;
+		exit(1);
+	}
+}
+
+void next_phase(double after)
+{
+	ev_timer_set(&phase_timer, after, 0.);
+	ev_timer_start(ev_default_loop(0), &phase_timer);
+}
+
+void check(bool ok, const string & what)
+{
+	RetryReport report = client->getRetryReport();
+	cout << what << ": " << responses << " responses, code " << last_code << ", "
+		<< local_server_requests << " server requests, " << report.retries
+		<< " retries, " << report.exhausted << " exhausted, " << report.overBudget
+		<< " over budget" << endl;
+	if(!ok)
+	{
+		cout << "Unexpected retries for " << what << "." << endl;
+		exit(1);
+	}
+	responses = 0;
+	local_server_requests = 0;
+}
+
+void phase_cb(struct ev_loop *loop, struct ev_timer *timer, int revents)
+{
+	RetryReport report = client->getRetryReport();
+	RetryPolicy policy;
+	switch(phase++)
+	{
+		case 0:
+			unavailable = 2;
+			make("GET");
+			next_phase(0.5);
+			break;
+
+		case 1:
+			check(responses == 1 && last_code == 200 && local_server_requests == 3 &&
+				report.retries == 2, "retried GET");
+			unavailable = 1;
+			make("POST");
+			next_phase(0.2);
+			break;
+
+		case 2:
+			check(responses == 1 && last_code == 503 && local_server_requests == 1 &&
+				report.retries == 2, "POST");
+			unavailable = 1000;
+			make("GET");
+			next_phase(0.5);
+			break;
+
+		case 3:
+			check(responses == 1 && last_code == 503 && local_server_requests == 3 &&
+				report.retries == 4 && report.exhausted == 1, "exhausted GET");
+			retry_after = "10";
+			client->setTimeout(1);
+			make("GET");
+			next_phase(0.2);
+			break;
+
+		case 4:
+			check(responses == 1 && last_code == 503 && local_server_requests == 1 &&
+				report.retries == 4 && report.exhausted == 2, "Retry-After past timeout");
+			retry_after = "0";
+			policy.maxAttempts = 2;
+			policy.budgetRatio = 0;
+			policy.budgetBurst = 2;
+			client->setRetryPolicy(policy);
+			for(int i = 0; i < BURST_SIZE; ++i)
+			{
+				make("GET");
+			}
+			next_phase(0.5);
+			break;
+
+		default:
+			check(responses == BURST_SIZE && local_server_requests == BURST_SIZE + 2 &&
+				report.retries == 6 && report.overBudget == BURST_SIZE - 2, "budget");
+			cout << "Done." << endl;
+			exit(0);
+	}
+}
+
+/* Main */
+int main()
+{
+	struct ev_loop *loop = ev_default_loop(0);
+
+	local_server_handler = handler;
+	unsigned short port = local_server_start(loop);
+	stringstream url;
+	url << "http://127.0.0.1:" << port << "/";
+
+	client = new EvHttpClient(loop, url.str(), 5, NULL, 0);
+
+	ev_timer_init(&phase_timer, phase_cb, 0., 0.);
+	ev_timer_start(loop, &phase_timer);
+
+	while (1)
+	{
+		ev_loop(loop, 0);
+	}
+
+	return 0;
+}
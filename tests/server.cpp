@@ -4,7 +4,7 @@
  * Implements an HTTP server that pings a number of 
  * remote hosts in response to a request, and responds
  * only when each request has received a response or
- * timed out.
+ * timed out. The pings of a request form a RequestGroup.
  *
  * To run from the top directory, type
  *
@@ -29,6 +29,7 @@
 #include <stdio.h>
 #include <ev.h>
 #include <evhttpclient.h>
+#include <requestgroup.h>
 
 using namespace std;
 
@@ -58,15 +59,6 @@ static int total_responses = 0;
 
 static vector<EvHttpClient *> clients;
 
-/* Struct to keep track of how many responses we have received. */
-typedef struct ReqInfo_
-{
-	int fd;
-	vector<string> responses;
-	int num_responses;
-	int expected_num_responses;
-} ReqInfo;
-
 /* Keep track of how many responses we have been receiving on
  * each request. */
 void update_stats(int num_responses)
@@ -92,32 +84,29 @@ void update_stats(int num_responses)
 	}
 }
 
-/* Callback when we get a response. */
-void response_callback(ResponseInfo *response, void *request_data,
-	void *client_data)
+/* Callback when every ping has a response, or the
+ * deadline has passed. */
+void group_callback(RequestGroup *group, void *data)
 {
-	ReqInfo *req_info = (ReqInfo *) request_data;
-
-	req_info->num_responses++;
-	if(response == NULL)
-	{
-		cout << "Error." << endl;
-		return;
+	int fd = (int) (long) data;
+	int num_responses = 0;
+	for(size_t i = 0; i < group->size(); ++i)
+	{
+		const GroupResult & result = group->getResult(i);
+		if(result.done && result.response == NULL)
+		{
+			cout << "Error." << endl;
+		}
+		else if(result.response != NULL && !result.response->timeout)
+		{
+			num_responses++;
+		}
 	}
 
-	if(!response->timeout)
-	{
-		req_info->responses.push_back(response->response);
-	}
-
-	if(req_info->num_responses == req_info->expected_num_responses)
-	{
-		int num_responses = req_info->responses.size();
-		update_stats(num_responses);
-		send(req_info->fd, MSG, sizeof MSG, 0);
-		close(req_info->fd);
-		delete req_info;
-	}
+	update_stats(num_responses);
+	send(fd, MSG, sizeof MSG, 0);
+	close(fd);
+	delete group;
 }
 
 /* Callback for when the socket corresponsding to our new
@@ -125,14 +114,12 @@ void response_callback(ResponseInfo *response, void *request_data,
  * request happening. */
 static void read_cb(struct ev_loop *loop, struct ev_io *watcher, int revents)
 {
-	ReqInfo *req_info = new ReqInfo();
-	req_info->num_responses = 0;
-	req_info->expected_num_responses = num_urls;
-	req_info->fd = watcher->fd;
+	RequestGroup *group = new RequestGroup(loop, num_urls, TIMEOUT);
 	for(int i = 0; i < num_urls; ++i)
 	{
-		clients[i]->makeGet(response_callback, "", map<string, string>(), req_info);
+		group->addGet(clients[i], "");
 	}
+	group->wait(group_callback, (void *) (long) watcher->fd);
 }
 
 /* Callback for when someone tries to connect to our server. */
@@ -0,0 +1,177 @@
+/*
+ * shard_bench.cpp
+ *
+ * Throughput benchmark for ShardedEvHttpClient. A local
+ * server runs one loop per core, all on one port, and
+ * the main thread keeps WINDOW requests per shard in
+ * flight. Reports requests per second for several shard
+ * counts, under round-robin and least-loaded dispatch,
+ * with the requests each shard made and stole.
+ *
+ * Also checks that requests with the same key all go to
+ * one shard, that requests with a NULL callback are
+ * sent and ignored, and fails if any request is lost or
+ * answered badly.
+ */
+
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <time.h>
+#include <ev.h>
+#include <shardedevhttpclient.h>
+#include "local_server.h"
+
+using namespace std;
+
+#define REQUESTS_PER_ROUND (100000)
+#define WINDOW (64)
+#define MAX_SHARDS (4)
+
+static atomic<int> outstanding(0);
+static atomic<int> responses(0);
+static atomic<int> failures(0);
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void response_cb(ResponseInfo *response, void *requestData, void *clientData)
+{
+	if(response == NULL || response->timeout || response->code != 200)
+	{
+		failures++;
+	}
+	outstanding--;
+	responses++;
+}
+
+void serve(struct ev_loop *loop)
+{
+	ev_loop(loop, 0);
+}
+
+/*
+ * Makes count requests, keeping window in flight, and
+ * waits for them all. With a key, every request uses it.
+ */
+double run(ShardedEvHttpClient & client, int count, int window, const char *key)
+{
+	responses = 0;
+	double start = now();
+	for(int i = 0; i < count; ++i)
+	{
+		while(outstanding >= window)
+		{
+			this_thread::yield();
+		}
+		outstanding++;
+		if(key != NULL)
+		{
+			client.makeKeyedGet(key, response_cb, "/", {}, NULL);
+		}
+		else
+		{
+			client.makeGet(response_cb, "/", {}, NULL);
+		}
+	}
+	while(responses < count)
+	{
+		this_thread::yield();
+	}
+	if(failures > 0)
+	{
+		cout << failures << " bad responses." << endl;
+		exit(1);
+	}
+	return now() - start;
+}
+
+/* Main */
+int main()
+{
+	int cores = thread::hardware_concurrency();
+	if(cores < 1)
+	{
+		cores = 1;
+	}
+	cout << cores << " cores" << endl;
+
+	unsigned short port = 0;
+	for(int i = 0; i < cores; ++i)
+	{
+		struct ev_loop *loop = ev_loop_new(EVFLAG_AUTO);
+		port = local_server_start(loop, AF_INET, port);
+		thread(serve, loop).detach();
+	}
+	stringstream url;
+	url << "http://127.0.0.1:" << port << "/";
+
+	for(int shards = 1; shards <= MAX_SHARDS; shards *= 2)
+	{
+		for(int dispatch = SHARD_ROUND_ROBIN; dispatch <= SHARD_LEAST_LOADED; ++dispatch)
+		{
+			ShardedEvHttpClient client(url.str(), 5, NULL, shards, WINDOW);
+			client.setDispatch((ShardDispatch) dispatch);
+			double elapsed = run(client, REQUESTS_PER_ROUND, WINDOW * shards, NULL);
+
+			cout << shards << " shards, "
+				<< (dispatch == SHARD_ROUND_ROBIN ? "round-robin" : "least-loaded") << ": "
+				<< (long) (REQUESTS_PER_ROUND / elapsed) << " requests/s (requests/stolen:";
+			vector<ShardReport> report = client.getShardReport();
+			for(size_t i = 0; i < report.size(); ++i)
+			{
+				cout << " " << report[i].requests << "/" << report[i].stolen;
+			}
+			cout << ")" << endl;
+		}
+	}
+
+	// Keyed requests stay on their shard.
+	ShardedEvHttpClient client(url.str(), 5, NULL, MAX_SHARDS, WINDOW);
+	run(client, REQUESTS_PER_ROUND / 10, WINDOW * MAX_SHARDS, "some key");
+	vector<ShardReport> report = client.getShardReport();
+	int used = 0;
+	for(size_t i = 0; i < report.size(); ++i)
+	{
+		if(report[i].requests > 0)
+		{
+			used++;
+		}
+	}
+	cout << "keyed: " << used << " shard used" << endl;
+	if(used != 1)
+	{
+		cout << "Keyed requests were spread over shards." << endl;
+		exit(1);
+	}
+
+	// NULL callbacks are sent and ignored, also when the
+	// client is destroyed with them still queued.
+	{
+		ShardedEvHttpClient nullClient(url.str(), 5, NULL, MAX_SHARDS, WINDOW);
+		int target = local_server_requests + 100;
+		for(int i = 0; i < 50; ++i)
+		{
+			nullClient.makeGet(NULL, "/", {}, NULL);
+			nullClient.makeKeyedGet("some key", NULL, "/", {}, NULL);
+		}
+		while(local_server_requests < target)
+		{
+			this_thread::yield();
+		}
+		for(int i = 0; i < 1000; ++i)
+		{
+			nullClient.makeGet(NULL, "/", {}, NULL);
+		}
+	}
+	cout << "NULL callbacks: ok" << endl;
+
+	cout << "Done." << endl;
+	return 0;
+}
@@ -0,0 +1,132 @@
+/*
+ * string_args.cpp
+ *
+ * Checks that the request functions taking a braced
+ * header list accept std::string (and string_view)
+ * paths, methods and bodies alongside the map-based
+ * functions, which take const string &, without the
+ * calls being ambiguous, and that each sends what
+ * buildRequest serializes for the same arguments.
+ *
+ * Bodies are empty, as the local server does not read
+ * them.
+ */
+
+#include <iostream>
+#include <sstream>
+#include <map>
+#include <ev.h>
+#include <evhttpclient.h>
+#include <multievhttpclient.h>
+#include "local_server.h"
+
+using namespace std;
+
+static struct ev_loop *loop;
+static string received;
+static int responses = 0;
+
+static string handler(const string & request)
+{
+	received = request;
+	return LOCAL_SERVER_RESPONSE;
+}
+
+void response_cb(ResponseInfo *response, void *requestData, void *clientData)
+{
+	if(response == NULL || response->timeout || response->code != 200)
+	{
+		cout << "Bad response." << endl;
+		exit(1);
+	}
+	responses++;
+}
+
+/*
+ * Waits for the response to a request made with result
+ * and checks the server received expected.
+ */
+static void expect(const char *what, int result, const string & expected)
+{
+	if(result != 0)
+	{
+		cout << what << ": request failed." << endl;
+		exit(1);
+	}
+	int target = responses + 1;
+	while(responses < target)
+	{
+		ev_loop(loop, EVLOOP_ONESHOT);
+	}
+	if(received != expected)
+	{
+		cout << what << ": sent" << endl << received << "expected" << endl
+			<< expected;
+		exit(1);
+	}
+	cout << what << ": ok" << endl;
+}
+
+/* Main */
+int main()
+{
+	loop = ev_default_loop(0);
+	unsigned short port = local_server_start(loop);
+	local_server_handler = handler;
+	stringstream url;
+	url << "http://127.0.0.1:" << port << "/";
+	EvHttpClient client(loop, url.str(), 5, NULL, 2);
+	MultiEvHttpClient multi(loop, vector<string>(1, url.str()), 5, NULL, 2);
+
+	string path = "/string/path";
+	const string constPath = "/const/path";
+	std::string_view viewPath = "/view/path";
+	string method = "GET";
+	string body;
+	HeaderPair accept[] = { {"Accept", "text/plain"} };
+	map<string, string> headers;
+	headers["Accept"] = "text/plain";
+	string expected;
+
+	client.buildRequest(expected, path, "GET", accept, 1, "");
+	expect("makeGet, string path", client.makeGet(response_cb, path,
+		{{"Accept", "text/plain"}}, NULL), expected);
+	expect("makeGet, map headers", client.makeGet(response_cb, path, headers, NULL),
+		expected);
+
+	client.buildRequest(expected, constPath, "GET", NULL, 0, "");
+	expect("makeGet, const string path, empty list", client.makeGet(response_cb,
+		constPath, {}, NULL), expected);
+
+	client.buildRequest(expected, viewPath, "GET", accept, 1, "");
+	expect("makeGet, string_view path", client.makeGet(response_cb, viewPath,
+		{{"Accept", "text/plain"}}, NULL), expected);
+
+	client.buildRequest(expected, path, "POST", accept, 1, body);
+	expect("makePost, string path and body", client.makePost(response_cb, path,
+		{{"Accept", "text/plain"}}, body, NULL), expected);
+
+	client.buildRequest(expected, path, "PUT", accept, 1, body);
+	expect("makePut, string path and body", client.makePut(response_cb, path,
+		{{"Accept", "text/plain"}}, body, NULL), expected);
+
+	client.buildRequest(expected, path, "DELETE", accept, 1, body);
+	expect("makeDelete, string path and body", client.makeDelete(response_cb, path,
+		{{"Accept", "text/plain"}}, body, NULL), expected);
+
+	client.buildRequest(expected, path, method, accept, 1, body);
+	expect("makeRequest, string path, method and body", client.makeRequest(response_cb,
+		path, method, {{"Accept", "text/plain"}}, body, NULL), expected);
+	expect("makeRequest, map headers", client.makeRequest(response_cb, path, method,
+		headers, body, NULL), expected);
+
+	// MultiEvHttpClient sends the same bytes through its
+	// endpoint's client.
+	expect("multi makeRequest, string arguments", multi.makeRequest(response_cb,
+		path, method, {{"Accept", "text/plain"}}, body, NULL), expected);
+	expect("multi makeKeyedRequest, string arguments", multi.makeKeyedRequest(path,
+		response_cb, path, method, {{"Accept", "text/plain"}}, body, NULL), expected);
+
+	cout << "Done." << endl;
+	return 0;
+}
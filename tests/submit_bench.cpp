@@ -0,0 +1,184 @@
+/*
+ * submit_bench.cpp
+ *
+ * Throughput benchmark for thread-safe submission.
+ * Producer threads submit GETs to a local server on the
+ * client's loop, each keeping at most WINDOW of its
+ * requests in flight, and the loop thread reports
+ * requests per second for several producer counts.
+ *
+ * Fails if any request is lost, answered badly, or has
+ * its callback run off the loop thread.
+ *
+ * Checks that submissions with a NULL callback are sent
+ * and ignored, also when still queued at destruction.
+ *
+ * Then checks that with setSubmitKeepAlive, an idle
+ * loop on its own thread waits in ev_loop for a request
+ * submitted later, instead of returning at once.
+ */
+
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <time.h>
+#include <ev.h>
+#include <evhttpclient.h>
+#include "local_server.h"
+
+using namespace std;
+
+#define REQUESTS_PER_PRODUCER (20000)
+#define WINDOW (32)
+#define MAX_PRODUCERS (8)
+
+static EvHttpClient *client = NULL;
+static thread::id loop_thread;
+static int responses = 0;
+
+/* Requests in flight, per producer. */
+static atomic<int> outstanding[MAX_PRODUCERS];
+
+static struct ev_loop *idle_loop = NULL;
+static atomic<bool> idle_running(false);
+static atomic<bool> idle_answered(false);
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void response_cb(ResponseInfo *response, void *requestData, void *clientData)
+{
+	if(response == NULL || response->timeout || response->code != 200 ||
+		this_thread::get_id() != loop_thread)
+	{
+		cout << "Bad response." << endl;
+		exit(1);
+	}
+	outstanding[(long) requestData]--;
+	responses++;
+}
+
+void idle_cb(ResponseInfo *response, void *requestData, void *clientData)
+{
+	if(response == NULL || response->timeout || response->code != 200)
+	{
+		cout << "Bad response on the idle loop." << endl;
+		exit(1);
+	}
+	idle_answered = true;
+	ev_unloop(idle_loop, EVUNLOOP_ALL);
+}
+
+void serve_idle()
+{
+	idle_running = true;
+	ev_loop(idle_loop, 0);
+	idle_running = false;
+}
+
+void produce(long producer)
+{
+	for(int i = 0; i < REQUESTS_PER_PRODUCER; ++i)
+	{
+		while(outstanding[producer] >= WINDOW)
+		{
+			this_thread::yield();
+		}
+		outstanding[producer]++;
+		client->submitGet(response_cb, "/", {}, (void *) producer);
+	}
+}
+
+/* Main */
+int main()
+{
+	struct ev_loop *loop = ev_default_loop(0);
+	loop_thread = this_thread::get_id();
+
+	unsigned short port = local_server_start(loop);
+	stringstream url;
+	url << "http://127.0.0.1:" << port << "/";
+	client = new EvHttpClient(loop, url.str(), 5, NULL, MAX_PRODUCERS * WINDOW);
+
+	for(int producers = 1; producers <= MAX_PRODUCERS; producers *= 2)
+	{
+		responses = 0;
+		int total = producers * REQUESTS_PER_PRODUCER;
+		double start = now();
+
+		vector<thread> threads;
+		for(long i = 0; i < producers; ++i)
+		{
+			threads.push_back(thread(produce, i));
+		}
+		while(responses < total)
+		{
+			ev_loop(loop, EVLOOP_ONESHOT);
+		}
+		for(size_t i = 0; i < threads.size(); ++i)
+		{
+			threads[i].join();
+		}
+
+		double elapsed = now() - start;
+		cout << producers << " producers: " << (long) (total / elapsed)
+			<< " requests/s" << endl;
+		if(local_server_requests != responses)
+		{
+			cout << "Server saw " << local_server_requests << " requests, expected "
+				<< responses << "." << endl;
+			exit(1);
+		}
+		local_server_requests = 0;
+	}
+
+	// NULL callbacks are sent and ignored, also when the
+	// client is destroyed with one still queued.
+	thread([] {
+		for(int i = 0; i < 10; ++i)
+		{
+			client->submitGet(NULL, "/", {}, NULL);
+		}
+	}).join();
+	while(local_server_requests < 10)
+	{
+		ev_loop(loop, EVLOOP_ONESHOT);
+	}
+	thread([] { client->submitGet(NULL, "/", {}, NULL); }).join();
+	delete client;
+	cout << "NULL callbacks: ok" << endl;
+
+	idle_loop = ev_loop_new(EVFLAG_AUTO);
+	EvHttpClient *idle = new EvHttpClient(idle_loop, url.str(), 5, NULL, 1);
+
+	// Without keep-alive, the loop returns once the
+	// client's start-up work is done.
+	ev_loop(idle_loop, 0);
+	idle->setSubmitKeepAlive(true);
+	thread server(serve_idle);
+	struct timespec pause = { 0, 100 * 1000 * 1000 };
+	nanosleep(&pause, NULL);
+	if(!idle_running)
+	{
+		cout << "Idle loop returned before anything was submitted." << endl;
+		exit(1);
+	}
+	idle->submitGet(idle_cb, "/idle", {}, NULL);
+	while(!idle_answered)
+	{
+		ev_loop(loop, EVLOOP_ONESHOT);
+	}
+	server.join();
+	delete idle;
+	ev_loop_destroy(idle_loop);
+	cout << "keep-alive: ok" << endl;
+
+	cout << "Done." << endl;
+	return 0;
+}
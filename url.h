@@ -56,9 +56,23 @@ typedef struct Url_
 			return;
 		
 		advance(prot_i, prot_end.length());
+		// An IPv6 literal is bracketed, as in http://[::1]:8080/;
+		// the host is stored without the brackets.
+		string::const_iterator host_i = prot_i;
+		string::const_iterator host_end_i = url_s.end();
+		if(host_i != url_s.end() && *host_i == '[')
+		{
+			++host_i;
+			host_end_i = find(host_i, url_s.end(), ']');
+			prot_i = host_end_i;
+		}
 		string::const_iterator port_i = find(prot_i, url_s.end(), ':');
 		string::const_iterator path_i = min(find(prot_i, url_s.end(), '/'), find(prot_i, url_s.end(), '?'));
 		string::const_iterator next_i = (port_i == url_s.end() ? path_i : port_i);
+		if(host_end_i != url_s.end())
+		{
+			next_i = host_end_i;
+		}
 		if(port_i != url_s.end())
 		{
 			++port_i;
@@ -75,8 +89,8 @@ typedef struct Url_
 			port_ = 80;
 		}
 	
-		host_.reserve(distance(prot_i, next_i));
-		transform(prot_i, next_i,
+		host_.reserve(distance(host_i, next_i));
+		transform(host_i, next_i,
 					back_inserter(host_),
 					ptr_fun<int,int>(tolower)); // host is icase
 		string::const_iterator query_i = find(path_i, url_s.end(), '?');
@@ -104,7 +118,7 @@ typedef struct Url_
 	
 private:
     string protocol_, host_, path_, query_;
-    short port_;
+    int port_;
 } Url;
 
 #endif /* URL_H_ */